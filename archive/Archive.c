@@ -1,5 +1,14 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for asprintf
+#endif
+
 #include "Archive.h"
+#include "ArchiveManifest.h"
+#include "FileIO.h"
 #include <uuid/uuid.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 
 void        Archive_init(Archive*                 self,
@@ -8,7 +17,44 @@ void        Archive_init(Archive*                 self,
     size_t capacity = 10;
     self->n_pages = 0;
     self->capacity = capacity;
+    self->wal_batch_size = 0;
+    self->manifest_filename = NULL;
+    self->verify_mode = ArchiveVerifyAlways;
+    self->verify_sample_rate = 0;
+    self->digest = NULL;
+    self->verify_digest_reads = false;
+    self->access = ArchiveAccessNormal;
+    self->compaction_drops_cache = false;
+    self->direct_io_threshold = 0;
+    self->blob_threshold = 0;
+    ArchiveExecutor_init(&self->executor, 0);
     self->pages = (ArchivePage*)malloc(sizeof(ArchivePage) * capacity);
+    self->retired_pages = NULL;
+    self->n_retired_pages = 0;
+    self->runs = NULL;
+    self->n_runs = 0;
+    self->miss_cache = NULL;
+    self->cache = NULL;
+    self->hot_keys_filename = NULL;
+    self->max_hot_keys = 0;
+    self->hot_keys_interval_ms = 0;
+    self->hot_keys_saved_at = 0;
+    self->compaction_throttle = NULL;
+    self->compaction_throttle_context = NULL;
+    self->n_bytes_set = 0;
+    pthread_mutex_init(&self->open_lock, NULL);
+    pthread_mutex_init(&self->write_lock, NULL);
+
+    // a swap of compacted pages waits for the lookups in progress, but the
+    // ones starting meanwhile wait for it
+    pthread_rwlockattr_t swap_lock_attr;
+    pthread_rwlockattr_init(&swap_lock_attr);
+#if defined(__GLIBC__)
+    pthread_rwlockattr_setkind_np(&swap_lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&self->swap_lock, &swap_lock_attr);
+    pthread_rwlockattr_destroy(&swap_lock_attr);
+    self->n_swaps = 0;
 
     // copy base file path
     size_t base_file_path_size = strlen(base_file_path) + 1;
@@ -26,26 +72,537 @@ void        Archive_free(Archive*                 self)
         ArchivePage_free(&(self->pages[i]));
     }
     free(self->pages);
+    for (i = 0; i < self->n_retired_pages; i++) {
+        free(self->retired_pages[i]);
+    }
+    free(self->retired_pages);
+    self->retired_pages = NULL;
+    self->n_retired_pages = 0;
+    free(self->runs);
+    self->runs = NULL;
+    self->n_runs = 0;
+    Archive_set_miss_cache(self, 0);
+    Archive_set_cache_budget(self, NULL);
+    Archive_use_hot_keys(self, NULL, 0, 0);
+    pthread_mutex_destroy(&self->open_lock);
+    pthread_mutex_destroy(&self->write_lock);
+    pthread_rwlock_destroy(&self->swap_lock);
+    ArchiveExecutor_free(&self->executor);
     
-    // free file path string
+    // free file path strings
     free(self->base_file_path);
+    free(self->manifest_filename);
     
     // set null pointers
     self->base_file_path = NULL;
+    self->manifest_filename = NULL;
     self->pages = NULL;
     self->n_pages = 0;
     self->capacity = 0;
 }
 
 
+/**
+ Copies a page to a larger list of pages, while lookups may be touching its
+ priority in the cache (see _Archive_touch_page).
+
+ @param page The copy.
+ @param source The page.
+ */
+static inline void      _Archive_copy_page(ArchivePage*         page,
+                                           const ArchivePage*   source)
+{
+    size_t start = offsetof(ArchivePage, cache_cost);
+    memcpy(page, source, offsetof(ArchivePage, cache_priority));
+    page->cache_priority = __atomic_load_n(&source->cache_priority, __ATOMIC_RELAXED);
+    memcpy((char*)page + start, (const char*)source + start, sizeof(ArchivePage) - start);
+}
+
+
+/**
+ Makes room for one more page at the end of the archive.
+
+ @param self The archive.
+ @return The page struct, to initialize before incrementing the number of
+         pages.
+ */
+static ArchivePage*     _Archive_reserve_page(Archive*  self)
+{
+    // make sure we have enough space, or we move the pages to a larger list;
+    // lookups on other threads may still walk the previous one, which is kept
+    // until the archive is freed, and pages can't be opened while it's copied
+    if (self->n_pages >= self->capacity) {
+        size_t new_capacity = self->capacity * 2;
+        ArchivePage* pages = (ArchivePage*)malloc(sizeof(ArchivePage) * new_capacity);
+        pthread_mutex_lock(&self->open_lock);
+        size_t i;
+        for (i = 0; i < self->n_pages; i++) {
+            _Archive_copy_page(pages + i, self->pages + i);
+        }
+        self->retired_pages = (ArchivePage**)realloc(self->retired_pages,
+                                                     sizeof(ArchivePage*) * (self->n_retired_pages + 1));
+        self->retired_pages[self->n_retired_pages++] = self->pages;
+        __atomic_store_n(&self->pages, pages, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&self->open_lock);
+        self->capacity = new_capacity;
+    }
+    return &(self->pages[self->n_pages]);
+}
+
+
+/**
+ Gets the list of pages of the archive as published to the lookups, which
+ may run on other threads than the writer's.
+
+ @param self The archive.
+ @return The pages.
+ */
+static inline ArchivePage*  _Archive_pages(const Archive*   self)
+{
+    return __atomic_load_n(&self->pages, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ Locks the pages of the archive for a lookup, so the pages it finds aren't
+ swapped by a compaction until it's done with them.
+
+ @param self The archive.
+ */
+static inline void  _Archive_lock_pages(const Archive*      self)
+{
+    pthread_rwlock_rdlock((pthread_rwlock_t*)&self->swap_lock);
+}
+
+
+static inline void  _Archive_unlock_pages(const Archive*    self)
+{
+    pthread_rwlock_unlock((pthread_rwlock_t*)&self->swap_lock);
+}
+
+
+#pragma mark Levels
+
+
+/**
+ Finds the sorted runs of the pages, once they're loaded or swapped, while
+ the writer and the lookups are locked out.
+
+ @param self The archive.
+ */
+static void             _Archive_index_runs(Archive*    self)
+{
+    ArchiveSortedRun* runs = NULL;
+    size_t n_runs = 0;
+    const ArchivePage* page;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        page = self->pages + i;
+        if (page->level == 0) {
+            continue;
+        }
+        if (n_runs > 0 && runs[n_runs - 1].first_page + runs[n_runs - 1].n_pages == i &&
+            page[-1].level == page->level && memcmp(page[-1].max_key, page->min_key, 20) < 0) {
+            runs[n_runs - 1].n_pages++;
+            continue;
+        }
+        runs = (ArchiveSortedRun*)realloc(runs, sizeof(ArchiveSortedRun) * (n_runs + 1));
+        runs[n_runs].first_page = i;
+        runs[n_runs].n_pages = 1;
+        n_runs++;
+    }
+    free(self->runs);
+    self->runs = runs;
+    self->n_runs = n_runs;
+}
+
+
+/**
+ * A walk through the pages that may have a key, from the newest to the
+ * oldest: the pages out of sorted runs one by one, and in each run only the
+ * pages whose key range covers the key (`next` down to `run_first`).
+ */
+typedef struct ArchivePageWalk
+{
+    const char*                 partial_key;
+    size_t                      partial_key_len;
+    size_t                      next;
+    size_t                      run;
+    size_t                      run_first;
+    bool                        in_run;
+} ArchivePageWalk;
+
+
+static inline void  _ArchivePageWalk_init(ArchivePageWalk*      walk,
+                                          const Archive*        archive,
+                                          const char*           partial_key,
+                                          size_t                partial_key_len)
+{
+    walk->partial_key = partial_key;
+    walk->partial_key_len = partial_key_len;
+    walk->next = __atomic_load_n(&archive->n_pages, __ATOMIC_ACQUIRE);
+    walk->run = archive->n_runs;
+    walk->run_first = 0;
+    walk->in_run = false;
+}
+
+
+/**
+ Gets the next (older) page of a walk.
+
+ @param walk The walk.
+ @param archive The archive.
+ @param _page A pointer in which the index of the page is written.
+ @return false if there are no pages left.
+ */
+static bool         _ArchivePageWalk_next(ArchivePageWalk*      walk,
+                                          const Archive*        archive,
+                                          size_t*               _page)
+{
+    const ArchivePage* pages = _Archive_pages(archive);
+    const ArchiveSortedRun* run;
+    size_t low, high, middle;
+    while (walk->next > 0) {
+        if (walk->in_run) {
+            if (walk->next > walk->run_first) {
+                *_page = --walk->next;
+                return true;
+            }
+            walk->next = archive->runs[walk->run].first_page;
+            walk->in_run = false;
+            continue;
+        }
+        if (walk->run == 0 || archive->runs[walk->run - 1].first_page +
+                              archive->runs[walk->run - 1].n_pages < walk->next) {
+            *_page = --walk->next;
+            return true;
+        }
+
+        // the pages of the run covering the key, by binary search
+        run = archive->runs + --walk->run;
+        low = run->first_page;
+        high = run->first_page + run->n_pages;
+        while (low < high) {
+            middle = low + (high - low) / 2;
+            if (ArchivePage_compare_range(pages + middle, walk->partial_key, walk->partial_key_len) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        walk->run_first = low;
+        high = run->first_page + run->n_pages;
+        while (low < high) {
+            middle = low + (high - low) / 2;
+            if (ArchivePage_compare_range(pages + middle, walk->partial_key, walk->partial_key_len) <= 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        walk->next = low;
+        walk->in_run = true;
+    }
+    return false;
+}
+
+
+#pragma mark Manifest
+
+
+/**
+ Builds the path of the archive's manifest.
+
+ @param self The archive.
+ @return The path, which should be free'ed by the caller.
+ */
+static inline char*     _Archive_manifest_path(const Archive*   self)
+{
+    char* manifest_path;
+    asprintf(&manifest_path, "%s%s", self->base_file_path, self->manifest_filename);
+    return manifest_path;
+}
+
+
+/**
+ Writes the manifest listing the current pages of the archive.
+
+ @param self The archive.
+ @return An error code.
+ */
+static Errors           _Archive_write_manifest(const Archive*  self)
+{
+    ArchiveManifest manifest;
+    ArchiveManifest_init(&manifest);
+    size_t i;
+    ArchiveManifestPage entry;
+    for (i = 0; i < self->n_pages; i++) {
+        ArchivePage_summarize(self->pages + i, &entry);
+        ArchiveManifest_add_page(&manifest, &entry);
+    }
+    char* manifest_path = _Archive_manifest_path(self);
+    Errors error = ArchiveManifest_write(&manifest, manifest_path);
+    free(manifest_path);
+    ArchiveManifest_free(&manifest);
+    return error;
+}
+
+
+void        Archive_use_manifest(Archive*         self,
+                                 const char*      manifest_filename)
+{
+    free(self->manifest_filename);
+    self->manifest_filename = strdup(manifest_filename);
+}
+
+
+Errors      Archive_load_manifest(Archive*        self)
+{
+    ArchiveManifest manifest;
+    ArchiveManifest_init(&manifest);
+    char* manifest_path = _Archive_manifest_path(self);
+    Errors error = ArchiveManifest_read(&manifest, manifest_path);
+    free(manifest_path);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // pages are opened on first use, the fences of their entries let
+    // lookups skip them
+    size_t i;
+    for (i = 0; i < manifest.n_pages; i++) {
+        ArchivePage_init_unopened(_Archive_reserve_page(self), manifest.pages + i, self->base_file_path);
+        self->n_pages += 1;
+    }
+    ArchiveManifest_free(&manifest);
+    _Archive_index_runs(self);
+    if (self->miss_cache != NULL) {
+        ArchiveMissCache_clear(self->miss_cache);
+    }
+    if (self->cache != NULL) {
+        ArchiveCache_clear(self->cache);
+    }
+
+    // except the last one, which is written to, and may have items logged
+    // since its entry
+    if (self->n_pages > 0) {
+        error = Archive_open_page(self, self->n_pages - 1);
+    }
+    if (error == E_SUCCESS && self->n_pages > 0) {
+        ArchivePage_refresh_fence(self->pages + self->n_pages - 1);
+    }
+
+    // the keys hot before the archive was closed are prefetched, if they
+    // were saved
+    if (error == E_SUCCESS && self->hot_keys_filename != NULL) {
+        char* hot_keys_path;
+        asprintf(&hot_keys_path, "%s%s", self->base_file_path, self->hot_keys_filename);
+        Archive_warm_cache(self, hot_keys_path);
+        free(hot_keys_path);
+    }
+    return error;
+}
+
+
+Errors      Archive_open(Archive*                 self,
+                         const char*              base_file_path,
+                         const char*              manifest_filename)
+{
+    Archive_init(self, base_file_path);
+    Archive_use_manifest(self, manifest_filename);
+    return Archive_load_manifest(self);
+}
+
+
+/**
+ Reads the monotonic clock, to time what the cache keeps.
+
+ @return The time, in ns.
+ */
+static inline __uint64_t    _Archive_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (__uint64_t)now.tv_sec * 1000000000ull + (__uint64_t)now.tv_nsec;
+}
+
+
+/**
+ Counts the index of a page just opened in the cache, and sets its cost and
+ priority.
+
+ @param self The archive.
+ @param page The page.
+ @param ns The time it took to open.
+ */
+static inline void      _Archive_count_index(const Archive*     self,
+                                             ArchivePage*       page,
+                                             __uint64_t         ns)
+{
+    ArchiveCache* cache = self->cache;
+    size_t index_size = ArchivePage_index_size(page);
+    __uint64_t cost = ArchiveCache_cost(ns, index_size);
+    __atomic_store_n(&page->cache_cost, cost, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->cache_priority, ArchiveCache_priority(cache, cost), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->stats.index_bytes, index_size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->stats.n_indexes, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cache->stats.n_index_loads, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ Raises the priority of the index of a page used by a lookup, so it's
+ trimmed after the indexes used less since.
+
+ @param self The archive.
+ @param page The page.
+ */
+static inline void      _Archive_touch_page(const Archive*      self,
+                                            ArchivePage*        page)
+{
+    __uint64_t cost = __atomic_load_n(&page->cache_cost, __ATOMIC_RELAXED);
+    __uint64_t priority = ArchiveCache_priority(self->cache, cost);
+    if (__atomic_load_n(&page->cache_priority, __ATOMIC_RELAXED) < priority) {
+        __atomic_store_n(&page->cache_priority, priority, __ATOMIC_RELAXED);
+    }
+}
+
+
+Errors      Archive_open_page(const Archive*      self,
+                              size_t              page)
+{
+    if (ArchivePage_is_open(_Archive_pages(self) + page)) {
+        return E_SUCCESS;
+    }
+
+    // lookups on other threads may be opening the page too
+    pthread_mutex_t* open_lock = (pthread_mutex_t*)&self->open_lock;
+    pthread_mutex_lock(open_lock);
+    ArchivePage* archive_page = self->pages + page;
+    if (ArchivePage_is_open(archive_page)) {
+        pthread_mutex_unlock(open_lock);
+        return E_SUCCESS;
+    }
+
+    // the settings are kept by the open
+    ArchivePage_set_verify(archive_page, self->verify_mode, self->verify_sample_rate);
+    ArchivePage_set_direct_io(archive_page, self->direct_io_threshold);
+    ArchivePage_set_blob_threshold(archive_page, self->blob_threshold);
+    __uint64_t start = _Archive_now();
+    Errors error = ArchivePage_open(archive_page);
+    if (error == E_SUCCESS) {
+        if (self->cache != NULL) {
+            _Archive_count_index(self, archive_page, _Archive_now() - start);
+        }
+        if (self->access != ArchiveAccessNormal) {
+            ArchivePage_advise(archive_page, self->access);
+        }
+        if (self->wal_batch_size > 0) {
+            ArchivePage_enable_wal(archive_page, self->wal_batch_size);
+        }
+    }
+    pthread_mutex_unlock(open_lock);
+    return error;
+}
+
+
+void        Archive_lock_pages(const Archive*     self)
+{
+    _Archive_lock_pages(self);
+}
+
+
+void        Archive_unlock_pages(const Archive*   self)
+{
+    _Archive_unlock_pages(self);
+}
+
+
+/**
+ Checks if a page may have a key, using its fence, or its index if it's the
+ page being written, and opens it if so.
+
+ @param self The archive.
+ @param page The index of the page.
+ @param key The key, or a partial key.
+ @param key_len The length of the key, only its first byte is checked if 1.
+ @return false if the page doesn't have the key or can't be opened.
+ */
+static inline bool      _Archive_page_may_have(const Archive*   self,
+                                               size_t           page,
+                                               const char*      key,
+                                               size_t           key_len)
+{
+    // the writer only updates the fence of the last page, which is done with
+    // once the next one is published
+    size_t n_pages = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    ArchivePage* pages = _Archive_pages(self);
+    bool may_have;
+    if (page + 1 < n_pages) {
+        may_have = ArchivePage_fence_may_have(pages + page, key, key_len);
+    } else {
+        may_have = ArchivePage_may_have(pages + page, _HashIndex_key(key));
+    }
+    if (!may_have || Archive_open_page(self, page) != E_SUCCESS) {
+        return false;
+    }
+    if (self->cache != NULL) {
+        _Archive_touch_page(self, pages + page);
+    }
+    return true;
+}
+
+
+#pragma mark Save
+
+
+/**
+ * The state shared by the tasks of Archive_save.
+ */
+typedef struct ArchiveSaveJob
+{
+    const Archive*              archive;
+    ArchiveSaveResult*          result;
+} ArchiveSaveJob;
+
+
+/**
+ Saves a page of the archive, and lists it in the result of the save.
+
+ @param context The save job.
+ @param index The index of the page.
+ @return An error code.
+ */
+static Errors       _Archive_save_page(void*            context,
+                                       size_t           index)
+{
+    ArchiveSaveJob* job = (ArchiveSaveJob*)context;
+    ArchivePage* page = job->archive->pages + index;
+    ArchiveSaveFile* file = job->result->files + index;
+    bool has_changes = page->has_changes;
+
+    // save page, under its current name in manifest mode
+    Errors error = job->archive->manifest_filename != NULL ?
+        ArchivePage_commit(page) :
+        ArchivePage_save(page);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // copy the filename
+    size_t filename_size = strlen(page->filename) + 1;
+    file->filename = (char*)malloc(filename_size);
+    memcpy(file->filename, page->filename, filename_size);
+
+    // set has changes flag
+    file->has_changes = has_changes;
+    return E_SUCCESS;
+}
+
+
 Errors      Archive_save(const Archive*           self,
                          ArchiveSaveResult*       result)
 {
-    Errors error;
-    ArchivePage* page;
-    ArchiveSaveFile* file;
-    size_t filename_size;
-    bool has_changes;
     size_t n_pages = self->n_pages;
     result->count = 0;
     result->files = NULL;
@@ -55,37 +612,26 @@ Errors      Archive_save(const Archive*           self,
         return E_SUCCESS;
     }
     
-    // alloc a number of ArchiveSaveFile
-    result->files = (ArchiveSaveFile*)malloc(sizeof(ArchiveSaveFile) * n_pages);
-    size_t i;
-    // save all pages
-    for (i = 0; i < n_pages; i++) {
-        page = self->pages + i;
-        file = result->files + i;
-        has_changes = page->has_changes;
-        
-        // save page
-        error = ArchivePage_save(page);
-        if (error != E_SUCCESS) {
-            printf("Failed to save!!! %d\n", error);
-            printf("File not saved ERROR: %s\n", strerror(errno));
-            ArchiveSaveResult_free(result);
-            return error;
-        }
-        
-        // copy the filename
-        filename_size = strlen(page->filename) + 1;
-        file->filename = (char*)malloc(filename_size);
-        memcpy(file->filename, page->filename, filename_size);
-        
-        // set has changes flag
-        file->has_changes = has_changes;
-        
-        // increment the result count
-        result->count++;
-    }
+    // save all pages, in parallel; the pages not saved have no filename
+    // (and no page is added or swapped meanwhile)
+    pthread_mutex_t* write_lock = (pthread_mutex_t*)&self->write_lock;
+    pthread_mutex_lock(write_lock);
+    n_pages = self->n_pages;
+    ArchiveSaveJob job = {self, result};
+    result->files = (ArchiveSaveFile*)calloc(n_pages, sizeof(ArchiveSaveFile));
+    result->count = n_pages;
+    Errors error = ArchiveExecutor_run((ArchiveExecutor*)&self->executor, n_pages, 0,
+                                       _Archive_save_page, &job);
     
-    return E_SUCCESS;
+    // list the saved pages
+    if (error == E_SUCCESS && self->manifest_filename != NULL) {
+        error = _Archive_write_manifest(self);
+    }
+    pthread_mutex_unlock(write_lock);
+    if (error != E_SUCCESS) {
+        ArchiveSaveResult_free(result);
+    }
+    return error;
 }
 
 
@@ -93,109 +639,2291 @@ static inline Errors    Archive_add_page(Archive*       self,
                                          const char*    filename,
                                          bool           new_file)
 {
-    // make sure we have enough space, or we realloc
-    if (self->n_pages >= self->capacity) {
-        size_t new_capacity = self->capacity * 2;
-        self->pages = (ArchivePage*)realloc(self->pages, sizeof(ArchivePage) * new_capacity);
-        self->capacity = new_capacity;
-    }
-
     // create the page struct
-    ArchivePage* page = &(self->pages[self->n_pages]);
+    ArchivePage* page = _Archive_reserve_page(self);
     Errors error = ArchivePage_init(page, filename, self->base_file_path, new_file);
     if (error != E_SUCCESS) {
         return error;
     }
     
-    // increment number of pages
-    self->n_pages += 1;
+    ArchivePage_set_verify(page, self->verify_mode, self->verify_sample_rate);
+    ArchivePage_set_direct_io(page, self->direct_io_threshold);
+    ArchivePage_set_blob_threshold(page, self->blob_threshold);
+    if (self->access != ArchiveAccessNormal) {
+        ArchivePage_advise(page, self->access);
+    }
+    
+    // log the page's items if enabled
+    if (self->wal_batch_size > 0) {
+        ArchivePage_enable_wal(page, self->wal_batch_size);
+    }
     
-    // free filepath
+    // increment number of pages, publishing the page to lookups
+    __atomic_store_n(&self->n_pages, self->n_pages + 1, __ATOMIC_RELEASE);
+
+    // its keys may have been missed until now
+    if (!new_file && self->miss_cache != NULL) {
+        ArchiveMissCache_clear(self->miss_cache);
+    }
+    if (!new_file && self->cache != NULL) {
+        ArchiveCache_clear(self->cache);
+    }
 
     return E_SUCCESS;
 }
 
 
-Errors      Archive_add_page_by_name(Archive*     self,
-                                     const char*  filename)
+void        Archive_enable_wal(Archive*           self,
+                               size_t             batch_size)
 {
-    return Archive_add_page(self, filename, false);
+    self->wal_batch_size = batch_size > 0 ? batch_size : 1;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        // unopened pages enable it when they're opened
+        if (ArchivePage_is_open(self->pages + i)) {
+            ArchivePage_enable_wal(self->pages + i, self->wal_batch_size);
+        }
+    }
 }
 
 
-Errors      Archive_add_empty_page(Archive*       self)
+void        Archive_set_verify(Archive*           self,
+                               ArchiveVerifyMode  mode,
+                               __uint32_t         sample_rate)
 {
-    // generate filename uuid
-    uuid_t uuid;
-    uuid_generate_random(uuid);
-    char filename[37]; // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
-    uuid_unparse_lower(uuid, filename);
-    
-    return Archive_add_page(self, filename, true);
+    self->verify_mode = mode;
+    self->verify_sample_rate = sample_rate;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        ArchivePage_set_verify(self->pages + i, mode, sample_rate);
+    }
 }
 
 
-bool                Archive_has_partial(const Archive*      self,
-                                        const char*         partial_key,
-                                        size_t              partial_key_len,
-                                        char*               key)
+void        Archive_use_digest(Archive*           self,
+                               ArchiveDigest      digest,
+                               bool               verify_reads)
 {
-    long long i;
-    for (i = self->n_pages - 1; i >= 0; i--) {
-        if (ArchivePage_has(self->pages + i, partial_key, partial_key_len, key)) {
-            return true;
-        }
+    self->digest = digest;
+    self->verify_digest_reads = digest != NULL && verify_reads;
+}
+
+
+void        Archive_set_access(Archive*           self,
+                               ArchiveAccess      access)
+{
+    self->access = access;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        // unopened pages get it when they're opened
+        ArchivePage_advise(self->pages + i, access);
     }
-    return false;
 }
 
 
-Errors              Archive_get_partial(const Archive*      self,
-                                        const char*         partial_key,
-                                        size_t              partial_key_len,
-                                        char*               key,
-                                        size_t              data_max_size,
-                                        char**              _data,
-                                        size_t*             _data_size)
+void        Archive_set_direct_io(Archive*        self,
+                                  size_t          threshold)
 {
-    Errors error;
-    long long i;
-    for (i = self->n_pages - 1; i >= 0; i--) {
-        // lookup in an archive
-        error = ArchivePage_get(self->pages + i, partial_key, partial_key_len, key, data_max_size, _data, _data_size);
-        // if success or an error that isn't "not found" stop
-        if (error != E_NOT_FOUND) {
-            return error;
-        }
+    self->direct_io_threshold = threshold;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        ArchivePage_set_direct_io(self->pages + i, threshold);
     }
+}
+
 
-    return E_NOT_FOUND;
+void        Archive_set_blob_threshold(Archive*   self,
+                                       size_t     threshold)
+{
+    self->blob_threshold = threshold;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        ArchivePage_set_blob_threshold(self->pages + i, threshold);
+    }
 }
 
 
-Errors      Archive_set(Archive*                  self,
-                        const char*               key,
-                        const char*               data,
-                        size_t                    size)
+void        Archive_set_miss_cache(Archive*       self,
+                                   size_t         n_keys)
 {
-    Errors error;
-    
-    // if file is already in the archive, consider it a success
-    if (Archive_has(self, key)) {
-        return E_SUCCESS;
+    if (self->miss_cache != NULL) {
+        ArchiveMissCache_free(self->miss_cache);
+        free(self->miss_cache);
+        self->miss_cache = NULL;
     }
-    
-    // write to the last page
-    error = ArchivePage_set(&(self->pages[self->n_pages - 1]), key, data, size);
-    
-    // if page is full, add a new page and try again
-    if (error == E_INDEX_MAX_SIZE_EXCEEDED) {
-        error = Archive_add_empty_page(self);
-        if (error != E_SUCCESS) {
-            return error;
-        }
-        error =  ArchivePage_set(&(self->pages[self->n_pages - 1]), key, data, size);
+    if (n_keys > 0) {
+        self->miss_cache = (ArchiveMissCache*)malloc(sizeof(ArchiveMissCache));
+        ArchiveMissCache_init(self->miss_cache, n_keys);
     }
+}
 
-    return error;
+
+void        Archive_miss_cache_stats(const Archive*           self,
+                                     ArchiveMissCacheStats*   stats)
+{
+    if (self->miss_cache != NULL) {
+        ArchiveMissCache_stats(self->miss_cache, stats);
+    } else {
+        memset(stats, 0, sizeof(ArchiveMissCacheStats));
+    }
+}
+
+
+void        Archive_set_compaction_drops_cache(Archive*   self,
+                                               bool       drop_cache)
+{
+    self->compaction_drops_cache = drop_cache;
+}
+
+
+void        Archive_set_compaction_throttle(Archive*          self,
+                                            ArchiveThrottle   throttle,
+                                            void*             context)
+{
+    self->compaction_throttle = throttle;
+    self->compaction_throttle_context = context;
+}
+
+
+void        Archive_set_max_threads(Archive*      self,
+                                    size_t        max_threads)
+{
+    ArchiveExecutor_set_max_threads(&self->executor, max_threads);
+}
+
+
+void        Archive_set_dispatch(Archive*         self,
+                                 ArchiveDispatch  dispatch,
+                                 void*            context)
+{
+    ArchiveExecutor_set_dispatch(&self->executor, dispatch, context);
+}
+
+
+void        Archive_set_progress(Archive*         self,
+                                 ArchiveProgress  progress,
+                                 void*            context)
+{
+    ArchiveExecutor_set_progress(&self->executor, progress, context);
+}
+
+
+void        Archive_cancel(const Archive*         self)
+{
+    ArchiveExecutor_cancel((ArchiveExecutor*)&self->executor);
+}
+
+
+Errors      Archive_sync(const Archive*           self)
+{
+    Errors error = E_SUCCESS;
+    pthread_mutex_t* write_lock = (pthread_mutex_t*)&self->write_lock;
+    pthread_mutex_lock(write_lock);
+    size_t i;
+    for (i = 0; i < self->n_pages && error == E_SUCCESS; i++) {
+        error = ArchivePage_sync(self->pages + i);
+    }
+    pthread_mutex_unlock(write_lock);
+    return error;
+}
+
+
+Errors      Archive_add_page_by_name(Archive*     self,
+                                     const char*  filename)
+{
+    pthread_mutex_lock(&self->write_lock);
+    Errors error = Archive_add_page(self, filename, false);
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+/**
+ See Archive_add_empty_page, for a writer holding the write lock.
+ */
+static Errors       _Archive_add_empty_page(Archive*    self)
+{
+    // generate filename uuid
+    uuid_t uuid;
+    uuid_generate_random(uuid);
+    char filename[37]; // ex. "1b4e28ba-2fa1-11d2-883f-0016d3cca427" + "\0"
+    uuid_unparse_lower(uuid, filename);
+    
+    return Archive_add_page(self, filename, true);
+}
+
+
+Errors      Archive_add_empty_page(Archive*       self)
+{
+    pthread_mutex_lock(&self->write_lock);
+    Errors error = _Archive_add_empty_page(self);
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+#pragma mark Lookup
+
+
+/**
+ Checks that a key is the digest of some data, if the archive is
+ content-addressed.
+
+ @param self The archive.
+ @param key The key (20 bytes).
+ @param data The data.
+ @param size The size of the data.
+ @return E_DIGEST_MISMATCH if the key doesn't match, or E_SUCCESS.
+ */
+static inline Errors    _Archive_check_digest(const Archive*    self,
+                                              const char*       key,
+                                              const char*       data,
+                                              size_t            size)
+{
+    if (self->digest == NULL) {
+        return E_SUCCESS;
+    }
+    char digest[20];
+    self->digest(data, size, digest);
+    return memcmp(digest, key, 20) == 0 ? E_SUCCESS : E_DIGEST_MISMATCH;
+}
+
+
+/**
+ Checks if a key is in a list of deleted keys.
+
+ @param deleted The deleted keys (20 bytes each).
+ @param n_deleted The number of deleted keys.
+ @param key The key to look for.
+ @return A boolean representing wheather the key has been deleted.
+ */
+static inline bool  _Archive_is_deleted(const char*             deleted,
+                                        size_t                  n_deleted,
+                                        const char*             key)
+{
+    size_t i;
+    for (i = 0; i < n_deleted; i++) {
+        if (memcmp(deleted + (20 * i), key, 20) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ See _Archive_lookup, without the miss cache.
+ */
+static const HashItem*  _Archive_lookup_pages(const Archive*    self,
+                                              const char*       partial_key,
+                                              size_t            partial_key_len,
+                                              size_t*           _page)
+{
+    const HashItem* item;
+    const HashItem* found = NULL;
+    char* deleted = NULL;
+    size_t n_deleted = 0;
+    ArchivePageWalk walk;
+    size_t i;
+    _ArchivePageWalk_init(&walk, self, partial_key, partial_key_len);
+    while (found == NULL && _ArchivePageWalk_next(&walk, self, &i)) {
+        if (!_Archive_page_may_have(self, i, partial_key, partial_key_len)) {
+            continue;
+        }
+        item = NULL;
+        while ((item = HashIndex_get_next(_Archive_pages(self)[i].index, partial_key, partial_key_len, item)) != NULL) {
+            if (n_deleted > 0 && _Archive_is_deleted(deleted, n_deleted, item->key)) {
+                continue;
+            }
+            if (HashItem_is_tombstone(item)) {
+                // a full key has only one candidate
+                if (partial_key_len == 20) {
+                    return NULL;
+                }
+                deleted = (char*)realloc(deleted, 20 * (n_deleted + 1));
+                memcpy(deleted + (20 * n_deleted), item->key, 20);
+                n_deleted++;
+                continue;
+            }
+            found = item;
+            *_page = i;
+            break;
+        }
+    }
+    free(deleted);
+    return found;
+}
+
+
+/**
+ Finds the live item matching a partial key, walking the pages that may have
+ it from the newest to the oldest. A tombstone hides the older items of its
+ key, but not the other keys matching the same partial key. Full keys are
+ first looked up in the miss cache, and added to it if not found.
+
+ @param self The archive.
+ @param partial_key The partial key to lookup (between 3 and 20 bytes).
+ @param partial_key_len The length of the partial key.
+ @param _page A pointer in which the index of the item's page is written.
+ @return The item, or NULL if not found.
+ */
+static const HashItem*  _Archive_lookup(const Archive*          self,
+                                        const char*             partial_key,
+                                        size_t                  partial_key_len,
+                                        size_t*                 _page)
+{
+    if (self->miss_cache == NULL || partial_key_len != 20) {
+        return _Archive_lookup_pages(self, partial_key, partial_key_len, _page);
+    }
+    __uint64_t sequence;
+    if (ArchiveMissCache_has(self->miss_cache, partial_key, &sequence)) {
+        return NULL;
+    }
+    const HashItem* item = _Archive_lookup_pages(self, partial_key, partial_key_len, _page);
+    if (item == NULL) {
+        ArchiveMissCache_add(self->miss_cache, partial_key, sequence);
+    }
+    return item;
+}
+
+
+/**
+ Checks if the archive has a key about to be set, using the miss cache but
+ without adding the key to it.
+
+ @param self The archive, its writer holding the write lock.
+ @param key The key (20 bytes).
+ @return A boolean representing wheather the key has been found.
+ */
+static bool         _Archive_has_before_set(const Archive*  self,
+                                            const char*     key)
+{
+    __uint64_t sequence;
+    if (self->miss_cache != NULL && ArchiveMissCache_has(self->miss_cache, key, &sequence)) {
+        return false;
+    }
+    size_t page;
+    return _Archive_lookup_pages(self, key, 20, &page) != NULL;
+}
+
+
+/**
+ See Archive_has_partial, without locking the pages.
+ */
+static bool         _Archive_has_partial(const Archive*      self,
+                                         const char*         partial_key,
+                                         size_t              partial_key_len,
+                                         char*               key)
+{
+    if (partial_key_len < 3 || partial_key_len > 20) {
+        return false;
+    }
+    size_t page;
+    const HashItem* item = _Archive_lookup(self, partial_key, partial_key_len, &page);
+    if (item == NULL) {
+        return false;
+    }
+    if (key != NULL) {
+        memcpy(key, item->key, 20);
+    }
+    return true;
+}
+
+
+bool                Archive_has_partial(const Archive*      self,
+                                        const char*         partial_key,
+                                        size_t              partial_key_len,
+                                        char*               key)
+{
+    _Archive_lock_pages(self);
+    bool has = _Archive_has_partial(self, partial_key, partial_key_len, key);
+    _Archive_unlock_pages(self);
+    return has;
+}
+
+
+/**
+ Gets the value cache of the archive, if it has one.
+
+ @param self The archive.
+ @return The cache, or NULL.
+ */
+static inline ArchiveCache*     _Archive_value_cache(const Archive*     self)
+{
+    return self->cache != NULL && self->cache->budget.values > 0 ? self->cache : NULL;
+}
+
+
+/**
+ Reads the data of an item found by a lookup, and adds it to the value cache
+ if it's read whole.
+
+ @param self The archive.
+ @param page The index of the item's page.
+ @param item The item.
+ @param data_max_size The maximum size to read, or 0 for the whole value.
+ @param _data A pointer in which the data is returned.
+ @param _data_size A pointer in which the size of the value is returned.
+ @param generation The generation of the value cache when the lookup began.
+ @return An error code.
+ */
+static Errors       _Archive_read_item(const Archive*       self,
+                                       size_t               page,
+                                       const HashItem*      item,
+                                       size_t               data_max_size,
+                                       char**               _data,
+                                       size_t*              _data_size,
+                                       __uint64_t           generation)
+{
+    ArchiveCache* cache = _Archive_value_cache(self);
+    __uint64_t start = cache != NULL ? _Archive_now() : 0;
+    Errors error = ArchivePage_read(_Archive_pages(self) + page, item, data_max_size, _data, _data_size);
+    if (error != E_SUCCESS || data_max_size > 0) {
+        return error;
+    }
+    if (self->verify_digest_reads) {
+        error = _Archive_check_digest(self, item->key, *_data, *_data_size);
+        if (error != E_SUCCESS) {
+            free(*_data);
+            *_data = NULL;
+            return error;
+        }
+    }
+    if (cache != NULL) {
+        ArchiveCache_add(cache, item->key, *_data, *_data_size, _Archive_now() - start, generation);
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ See Archive_get_partial, without locking the pages.
+ */
+static Errors       _Archive_get_partial(const Archive*      self,
+                                         const char*         partial_key,
+                                         size_t              partial_key_len,
+                                         char*               key,
+                                         size_t              data_max_size,
+                                         char**              _data,
+                                         size_t*             _data_size)
+{
+    if (partial_key_len < 3 || partial_key_len > 20) {
+        return E_INVALID_PARTIAL_KEY_LENGTH;
+    }
+
+    // the value of a full key set or deleted leaves the cache, so a cached
+    // one is answered without walking the pages
+    ArchiveCache* cache = _Archive_value_cache(self);
+    if (cache != NULL && partial_key_len == 20 &&
+        ArchiveCache_get(cache, partial_key, data_max_size, _data, _data_size)) {
+        if (key != NULL) {
+            memcpy(key, partial_key, 20);
+        }
+        return E_SUCCESS;
+    }
+    __uint64_t generation = cache != NULL ? ArchiveCache_generation(cache) : 0;
+    size_t page;
+    const HashItem* item = _Archive_lookup(self, partial_key, partial_key_len, &page);
+    if (item == NULL) {
+        return E_NOT_FOUND;
+    }
+    if (key != NULL) {
+        memcpy(key, item->key, 20);
+    }
+    if (cache != NULL && partial_key_len < 20 &&
+        ArchiveCache_get(cache, item->key, data_max_size, _data, _data_size)) {
+        return E_SUCCESS;
+    }
+    return _Archive_read_item(self, page, item, data_max_size, _data, _data_size, generation);
+}
+
+
+Errors              Archive_get_partial(const Archive*      self,
+                                        const char*         partial_key,
+                                        size_t              partial_key_len,
+                                        char*               key,
+                                        size_t              data_max_size,
+                                        char**              _data,
+                                        size_t*             _data_size)
+{
+    _Archive_lock_pages(self);
+    Errors error = _Archive_get_partial(self, partial_key, partial_key_len, key, data_max_size, _data, _data_size);
+    _Archive_unlock_pages(self);
+    return error;
+}
+
+
+/**
+ See Archive_get_range, without locking the pages.
+ */
+static Errors       _Archive_get_range(const Archive*        self,
+                                       const char*           key,
+                                       size_t                offset,
+                                       size_t                length,
+                                       char**                _data,
+                                       size_t*               _data_size)
+{
+    size_t page;
+    const HashItem* item = _Archive_lookup(self, key, 20, &page);
+    if (item == NULL) {
+        return E_NOT_FOUND;
+    }
+    Errors error = ArchivePage_read_range(_Archive_pages(self) + page, item, offset, length, _data, _data_size);
+    if (error != E_SUCCESS || !self->verify_digest_reads || *_data_size != item->data_size) {
+        return error;
+    }
+    error = _Archive_check_digest(self, item->key, *_data, *_data_size);
+    if (error != E_SUCCESS) {
+        free(*_data);
+        *_data = NULL;
+    }
+    return error;
+}
+
+
+Errors              Archive_get_range(const Archive*        self,
+                                      const char*           key,
+                                      size_t                offset,
+                                      size_t                length,
+                                      char**                _data,
+                                      size_t*               _data_size)
+{
+    _Archive_lock_pages(self);
+    Errors error = _Archive_get_range(self, key, offset, length, _data, _data_size);
+    _Archive_unlock_pages(self);
+    return error;
+}
+
+
+/**
+ See Archive_get_range_to_fd, without locking the pages.
+ */
+static Errors       _Archive_get_range_to_fd(const Archive*  self,
+                                             const char*     key,
+                                             size_t          offset,
+                                             size_t          data_max_size,
+                                             file_descriptor out_fd,
+                                             size_t*         _data_size)
+{
+    size_t page;
+    const HashItem* item = _Archive_lookup(self, key, 20, &page);
+    if (item == NULL) {
+        return E_NOT_FOUND;
+    }
+    bool whole = offset == 0 && (data_max_size == 0 || data_max_size >= item->data_size);
+    if (!whole || !self->verify_digest_reads) {
+        return ArchivePage_send(_Archive_pages(self) + page, item, offset, data_max_size, out_fd, _data_size);
+    }
+
+    // the digest is checked before sending anything, so through memory
+    char* data;
+    size_t data_size;
+    Errors error = ArchivePage_read(_Archive_pages(self) + page, item, 0, &data, &data_size);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    error = _Archive_check_digest(self, item->key, data, data_size);
+    if (error == E_SUCCESS) {
+        error = write_to_stream(out_fd, data, data_size);
+    }
+    free(data);
+    if (error == E_SUCCESS) {
+        *_data_size = data_size;
+    }
+    return error;
+}
+
+
+Errors              Archive_get_range_to_fd(const Archive*  self,
+                                            const char*     key,
+                                            size_t          offset,
+                                            size_t          data_max_size,
+                                            file_descriptor out_fd,
+                                            size_t*         _data_size)
+{
+    _Archive_lock_pages(self);
+    Errors error = _Archive_get_range_to_fd(self, key, offset, data_max_size, out_fd, _data_size);
+    _Archive_unlock_pages(self);
+    return error;
+}
+
+
+/**
+ See Archive_prefetch, without locking the pages.
+ */
+static Errors       _Archive_prefetch(const Archive*         self,
+                                      const char*            keys,
+                                      size_t                 n_keys)
+{
+    size_t page;
+    const HashItem* item;
+    size_t i;
+    for (i = 0; i < n_keys; i++) {
+        item = _Archive_lookup(self, keys + (20 * i), 20, &page);
+        if (item != NULL) {
+            ArchivePage_prefetch(_Archive_pages(self) + page, item);
+        }
+    }
+    return E_SUCCESS;
+}
+
+
+Errors              Archive_prefetch(const Archive*         self,
+                                     const char*            keys,
+                                     size_t                 n_keys)
+{
+    _Archive_lock_pages(self);
+    Errors error = _Archive_prefetch(self, keys, n_keys);
+    _Archive_unlock_pages(self);
+    return error;
+}
+
+
+bool                Archive_is_newest(const Archive*        self,
+                                      size_t                page,
+                                      const HashItem*       item)
+{
+    // the newest item of the key in its page (items are compared by address,
+    // as two items of the same key may share an offset if they are empty)
+    if (HashIndex_get(_Archive_pages(self)[page].index, item->key, 20) != item) {
+        return false;
+    }
+    // and not set again in a newer page (the writer may be adding some)
+    ArchivePageWalk walk;
+    size_t i;
+    _ArchivePageWalk_init(&walk, self, item->key, 20);
+    while (_ArchivePageWalk_next(&walk, self, &i) && i > page) {
+        if (_Archive_page_may_have(self, i, item->key, 20) &&
+            HashIndex_get(_Archive_pages(self)[i].index, item->key, 20) != NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+Errors              Archive_resolve_partial(const Archive*  self,
+                                            const char*     partial_key,
+                                            size_t          partial_key_len,
+                                            char*           key,
+                                            size_t*         _n_candidates)
+{
+    if (partial_key_len < 3 || partial_key_len > 20) {
+        return E_INVALID_PARTIAL_KEY_LENGTH;
+    }
+
+    // count the distinct live keys matching the prefix, only the bucket of
+    // the first byte is walked, newest page first; the count stops at two
+    // keys when only the ambiguity is needed
+    _Archive_lock_pages(self);
+    const HashPage* bucket;
+    const HashItem* item;
+    size_t bucket_key = _HashIndex_key(partial_key);
+    size_t n_pages = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    size_t max_candidates = _n_candidates != NULL ? SIZE_MAX : 2;
+    size_t n_candidates = 0;
+    size_t i, j;
+    for (i = n_pages; i > 0 && n_candidates < max_candidates; i--) {
+        if (!_Archive_page_may_have(self, i - 1, partial_key, partial_key_len)) {
+            continue;
+        }
+        bucket = &(_Archive_pages(self)[i - 1].index->pages[bucket_key]);
+        for (j = 0; j < bucket->n_items && n_candidates < max_candidates; j++) {
+            item = bucket->items + j;
+            if (HashItem_is_tombstone(item) ||
+                memcmp(item->key, partial_key, partial_key_len) != 0 ||
+                !Archive_is_newest(self, i - 1, item)) {
+                continue;
+            }
+            if (n_candidates == 0 && key != NULL) {
+                memcpy(key, item->key, 20);
+            }
+            n_candidates++;
+        }
+    }
+    _Archive_unlock_pages(self);
+
+    if (_n_candidates != NULL) {
+        *_n_candidates = n_candidates;
+    }
+    if (n_candidates == 0) {
+        return E_NOT_FOUND;
+    }
+    if (n_candidates > 1) {
+        return E_AMBIGUOUS;
+    }
+    return E_SUCCESS;
+}
+
+
+Errors              Archive_get_partial_unique(const Archive*   self,
+                                               const char*      partial_key,
+                                               size_t           partial_key_len,
+                                               char*            key,
+                                               size_t           data_max_size,
+                                               char**           _data,
+                                               size_t*          _data_size,
+                                               size_t*          _n_candidates)
+{
+    char full_key[20];
+    Errors error = Archive_resolve_partial(self, partial_key, partial_key_len, full_key, _n_candidates);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    if (key != NULL) {
+        memcpy(key, full_key, 20);
+    }
+    return Archive_get_partial(self, full_key, 20, NULL, data_max_size, _data, _data_size);
+}
+
+
+Errors              Archive_unique_prefix_length(const Archive*     self,
+                                                 const char*        key,
+                                                 size_t*            _length)
+{
+    _Archive_lock_pages(self);
+    if (!_Archive_has_partial(self, key, 20, NULL)) {
+        _Archive_unlock_pages(self);
+        return E_NOT_FOUND;
+    }
+
+    // all keys sharing a prefix with `key` live in the same bucket of each
+    // page, so finding the longest common prefix with any other key only
+    // needs to compare against those buckets; like Archive_resolve_partial,
+    // only the live keys count
+    const HashPage* bucket;
+    const HashItem* item;
+    size_t bucket_key = _HashIndex_key(key);
+    size_t n_pages = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    size_t longest = 0;
+    size_t common;
+    size_t i, j;
+    for (i = 0; i < n_pages; i++) {
+        if (!_Archive_page_may_have(self, i, key, 1)) {
+            continue;
+        }
+        bucket = &(_Archive_pages(self)[i].index->pages[bucket_key]);
+        for (j = 0; j < bucket->n_items; j++) {
+            item = bucket->items + j;
+            if (HashItem_is_tombstone(item) || !Archive_is_newest(self, i, item)) {
+                continue;
+            }
+            for (common = 1; common < 20 && item->key[common] == key[common]; common++);
+            if (common < 20 && common > longest) {
+                longest = common;
+            }
+        }
+    }
+    _Archive_unlock_pages(self);
+
+    *_length = (longest + 1 < 3) ? 3 : longest + 1;
+    return E_SUCCESS;
+}
+
+
+/**
+ Writes an item to the last page of the archive, adding a page if it's full.
+
+ @param self The archive.
+ @param key The key of the item (a 20 bytes binary string).
+ @param data The data to write to the archive.
+ @param size The length of the data to write.
+ @return An error code.
+ */
+static Errors       _Archive_put(Archive*               self,
+                                 const char*            key,
+                                 const char*            data,
+                                 size_t                 size)
+{
+    Errors error;
+
+    // write to the last page, the new item shadows any older one as lookups
+    // walk pages (and items within a page) from the newest
+    error = Archive_open_page(self, self->n_pages - 1);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    error = ArchivePage_set(&(self->pages[self->n_pages - 1]), key, data, size);
+    
+    // if page is full, add a new page and try again
+    if (error == E_INDEX_MAX_SIZE_EXCEEDED) {
+        error = _Archive_add_empty_page(self);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+        error =  ArchivePage_set(&(self->pages[self->n_pages - 1]), key, data, size);
+    }
+    if (error == E_SUCCESS) {
+        __atomic_fetch_add(&self->n_bytes_set, size, __ATOMIC_RELAXED);
+    }
+
+    // lookups see the item from now on
+    if (error == E_SUCCESS && self->miss_cache != NULL) {
+        ArchiveMissCache_remove(self->miss_cache, key);
+    }
+    if (error == E_SUCCESS && self->cache != NULL) {
+        ArchiveCache_remove(self->cache, key);
+    }
+
+    return error;
+}
+
+
+Errors      Archive_set(Archive*                  self,
+                        const char*               key,
+                        const char*               data,
+                        size_t                    size)
+{
+    Errors error = _Archive_check_digest(self, key, data, size);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // if file is already in the archive, consider it a success
+    pthread_mutex_lock(&self->write_lock);
+    if (!_Archive_has_before_set(self, key)) {
+        error = _Archive_put(self, key, data, size);
+    }
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+Errors      Archive_set_content(Archive*          self,
+                                const char*       data,
+                                size_t            size,
+                                char*             key)
+{
+    if (self->digest == NULL) {
+        return E_NOT_CONTENT_ADDRESSED;
+    }
+    char digest[20];
+    self->digest(data, size, digest);
+    if (key != NULL) {
+        memcpy(key, digest, 20);
+    }
+    Errors error = E_SUCCESS;
+    pthread_mutex_lock(&self->write_lock);
+    if (!_Archive_has_before_set(self, digest)) {
+        error = _Archive_put(self, digest, data, size);
+    }
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+Errors      Archive_put(Archive*                  self,
+                        const char*               key,
+                        const char*               data,
+                        size_t                    size)
+{
+    Errors error = _Archive_check_digest(self, key, data, size);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    pthread_mutex_lock(&self->write_lock);
+    error = _Archive_put(self, key, data, size);
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+/**
+ See Archive_delete, for a writer holding the write lock.
+ */
+static Errors       _Archive_delete(Archive*            self,
+                                    const char*         key)
+{
+    Errors error;
+
+    // nothing to shadow if the key isn't in the archive
+    if (!Archive_has(self, key)) {
+        return E_NOT_FOUND;
+    }
+
+    // write the tombstone to the last page
+    error = Archive_open_page(self, self->n_pages - 1);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    error = ArchivePage_delete(&(self->pages[self->n_pages - 1]), key);
+
+    // if page is full, add a new page and try again
+    if (error == E_INDEX_MAX_SIZE_EXCEEDED) {
+        error = _Archive_add_empty_page(self);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+        error = ArchivePage_delete(&(self->pages[self->n_pages - 1]), key);
+    }
+
+    // lookups see the tombstone from now on
+    if (error == E_SUCCESS && self->cache != NULL) {
+        ArchiveCache_remove(self->cache, key);
+    }
+
+    return error;
+}
+
+
+Errors      Archive_delete(Archive*               self,
+                           const char*            key)
+{
+    pthread_mutex_lock(&self->write_lock);
+    Errors error = _Archive_delete(self, key);
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+#pragma mark Cache
+
+
+void        Archive_set_cache_budget(Archive*                   self,
+                                     const ArchiveCacheBudget*  budget)
+{
+    if (self->cache != NULL) {
+        ArchiveCache_free(self->cache);
+        free(self->cache);
+        self->cache = NULL;
+    }
+    if (budget != NULL) {
+        self->cache = (ArchiveCache*)malloc(sizeof(ArchiveCache));
+        ArchiveCache_init(self->cache, budget);
+    }
+}
+
+
+Errors      Archive_pin_page(Archive*             self,
+                             size_t               page,
+                             bool                 pinned)
+{
+    // a compactor may be swapping the pages
+    _Archive_lock_pages(self);
+    if (page >= __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE)) {
+        _Archive_unlock_pages(self);
+        return E_INDEX_OUT_OF_BOUNDS;
+    }
+    __atomic_store_n(&(_Archive_pages(self)[page].pinned), pinned, __ATOMIC_RELAXED);
+    _Archive_unlock_pages(self);
+    return E_SUCCESS;
+}
+
+
+static int          _Archive_priority_compare(const void*   a,
+                                              const void*   b)
+{
+    __uint64_t priority_a = (*(ArchivePage* const*)a)->cache_priority;
+    __uint64_t priority_b = (*(ArchivePage* const*)b)->cache_priority;
+    return priority_a < priority_b ? -1 : (priority_a > priority_b ? 1 : 0);
+}
+
+
+void        Archive_trim_cache(Archive*           self)
+{
+    ArchiveCache* cache = self->cache;
+    if (cache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&self->write_lock);
+    pthread_rwlock_wrlock(&self->swap_lock);
+
+    // the last page is written to, it stays opened
+    ArchivePage** candidates = (ArchivePage**)malloc(sizeof(ArchivePage*) * (self->n_pages + 1));
+    size_t n_candidates = 0;
+    size_t index_bytes = 0;
+    size_t n_indexes = 0;
+    size_t n_pinned_indexes = 0;
+    ArchivePage* page;
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        page = self->pages + i;
+        if (!ArchivePage_is_open(page)) {
+            continue;
+        }
+        index_bytes += ArchivePage_index_size(page);
+        n_indexes++;
+        if (page->pinned) {
+            n_pinned_indexes++;
+        } else if (i + 1 < self->n_pages) {
+            candidates[n_candidates++] = page;
+        }
+    }
+
+    // the indexes of lowest priority first, the clock moving to theirs
+    qsort(candidates, n_candidates, sizeof(ArchivePage*), _Archive_priority_compare);
+    size_t index_size;
+    for (i = 0; i < n_candidates && cache->budget.indexes > 0 && index_bytes > cache->budget.indexes; i++) {
+        page = candidates[i];
+        index_size = ArchivePage_index_size(page);
+        if (ArchivePage_close(page)) {
+            index_bytes -= index_size;
+            n_indexes--;
+            ArchiveCache_age(cache, page->cache_priority);
+            __atomic_fetch_add(&cache->stats.n_index_evictions, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(candidates);
+    __atomic_store_n(&cache->stats.index_bytes, index_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->stats.n_indexes, n_indexes, __ATOMIC_RELAXED);
+    __atomic_store_n(&cache->stats.n_pinned_indexes, n_pinned_indexes, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&self->swap_lock);
+    pthread_mutex_unlock(&self->write_lock);
+}
+
+
+void        Archive_cache_stats(const Archive*        self,
+                                ArchiveCacheStats*    stats)
+{
+    if (self->cache == NULL) {
+        memset(stats, 0, sizeof(ArchiveCacheStats));
+        return;
+    }
+    ArchiveCache_stats(self->cache, stats);
+
+    // the fences of the pages are always kept
+    const ArchivePage* page;
+    stats->filter_bytes = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE) *
+                          (sizeof(page->filter) + sizeof(page->min_key) + sizeof(page->max_key));
+}
+
+
+/**
+ Adds a key to a hot set, with the ranges of the page files it's read from:
+ the header and index of its page, and its data.
+
+ @param self The archive, its pages locked.
+ @param hot_set The hot set.
+ @param key The key (20 bytes).
+ */
+static void         _Archive_add_hot_key(const Archive*     self,
+                                         ArchiveHotSet*     hot_set,
+                                         const char*        key)
+{
+    size_t page;
+    const HashItem* item = _Archive_lookup_pages(self, key, 20, &page);
+    if (item == NULL) {
+        return;
+    }
+    const ArchivePage* archive_page = _Archive_pages(self) + page;
+    ArchiveHotSet_add_key(hot_set, key);
+    ArchiveHotSet_add_range(hot_set, archive_page->filename, 0, ArchivePage_index_end(archive_page));
+    size_t size;
+    bool in_blob;
+    off_t offset = ArchivePage_item_range(archive_page, item, &size, &in_blob);
+    if (in_blob) {
+        char* blob_filename;
+        asprintf(&blob_filename, "%s.blob", archive_page->filename);
+        ArchiveHotSet_add_range(hot_set, blob_filename, (__uint64_t)offset, size);
+        free(blob_filename);
+    } else {
+        ArchiveHotSet_add_range(hot_set, archive_page->filename, (__uint64_t)offset, size);
+    }
+}
+
+
+Errors      Archive_save_hot_keys(const Archive*      self,
+                                  const char*         path,
+                                  size_t              max_keys)
+{
+    char* keys = (char*)malloc(20 * max_keys + 1);
+    size_t n_keys = self->cache != NULL ? ArchiveCache_hot_keys(self->cache, keys, max_keys) : 0;
+    ArchiveHotSet hot_set;
+    ArchiveHotSet_init(&hot_set);
+    size_t i;
+    for (i = 0; i < n_keys; i++) {
+        _Archive_lock_pages(self);
+        _Archive_add_hot_key(self, &hot_set, keys + 20 * i);
+        _Archive_unlock_pages(self);
+    }
+    free(keys);
+    ArchiveHotSet_merge_ranges(&hot_set);
+    Errors error = ArchiveHotSet_write(&hot_set, path);
+    ArchiveHotSet_free(&hot_set);
+    return error;
+}
+
+
+/**
+ * The state shared by the tasks prefetching the ranges of a hot set, a task
+ * per file.
+ */
+typedef struct ArchiveWarmJob
+{
+    const Archive*              archive;
+    const ArchiveHotSet*        hot_set;
+    size_t*                     files;
+} ArchiveWarmJob;
+
+
+/**
+ Prefetches the ranges of a file of a hot set.
+
+ @param context The warm job.
+ @param index The index of the file.
+ @return E_SUCCESS, files removed since the set was saved are skipped.
+ */
+static Errors       _Archive_warm_file(void*            context,
+                                       size_t           index)
+{
+    ArchiveWarmJob* job = (ArchiveWarmJob*)context;
+    const ArchiveHotRange* ranges = job->hot_set->ranges;
+    char* path;
+    asprintf(&path, "%s%s", job->archive->base_file_path, ranges[job->files[index]].filename);
+    file_descriptor fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return E_SUCCESS;
+    }
+    size_t i;
+    for (i = job->files[index]; i < job->files[index + 1]; i++) {
+        advise_file(fd, (off_t)ranges[i].offset, ranges[i].size, ArchiveAccessWillNeed);
+    }
+    close(fd);
+    return E_SUCCESS;
+}
+
+
+/**
+ * The pages pinned by Archive_warm_cache take at most this fraction (one
+ * over it) of the budget of the indexes, so the others can still be opened.
+ */
+#define ArchivePinnedIndexesDivisor     2
+
+
+/**
+ Pins the page of a hot key, if its index fits in the share of the budget of
+ the indexes left to the pinned pages. The pages must be locked.
+
+ @param self The archive.
+ @param page The index of the page.
+ @param pinned_bytes A pointer to the bytes of the pinned indexes.
+ */
+static void         _Archive_pin_hot_page(Archive*      self,
+                                          size_t        page,
+                                          size_t*       pinned_bytes)
+{
+    ArchivePage* archive_page = _Archive_pages(self) + page;
+    if (archive_page->pinned) {
+        return;
+    }
+    size_t index_size = ArchivePage_index_size(archive_page);
+    size_t budget = self->cache != NULL ? self->cache->budget.indexes : 0;
+    if (budget > 0 && *pinned_bytes + index_size > budget / ArchivePinnedIndexesDivisor) {
+        return;
+    }
+    __atomic_store_n(&archive_page->pinned, true, __ATOMIC_RELAXED);
+    *pinned_bytes += index_size;
+}
+
+
+Errors      Archive_warm_cache(Archive*           self,
+                               const char*        path)
+{
+    ArchiveHotSet hot_set;
+    ArchiveHotSet_init(&hot_set);
+    Errors error = ArchiveHotSet_read(&hot_set, path);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // the ranges are prefetched in parallel, a file at a time, before the
+    // keys are looked up and read; they're sorted by file
+    size_t* files = (size_t*)malloc(sizeof(size_t) * (hot_set.n_ranges + 1));
+    size_t n_files = 0;
+    size_t i;
+    for (i = 0; i < hot_set.n_ranges; i++) {
+        if (i == 0 || strcmp(hot_set.ranges[i].filename, hot_set.ranges[i - 1].filename) != 0) {
+            files[n_files++] = i;
+        }
+    }
+    files[n_files] = hot_set.n_ranges;
+    ArchiveWarmJob job = {self, &hot_set, files};
+    error = ArchiveExecutor_run(&self->executor, n_files, 0, _Archive_warm_file, &job);
+    free(files);
+    if (error != E_SUCCESS) {
+        ArchiveHotSet_free(&hot_set);
+        return error;
+    }
+
+    // the pages already pinned count in the share of the pinned indexes
+    size_t pinned_bytes = 0;
+    _Archive_lock_pages(self);
+    size_t n_pages = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n_pages; i++) {
+        if (_Archive_pages(self)[i].pinned && ArchivePage_is_open(_Archive_pages(self) + i)) {
+            pinned_bytes += ArchivePage_index_size(_Archive_pages(self) + i);
+        }
+    }
+    _Archive_unlock_pages(self);
+
+    ArchiveCache* cache = _Archive_value_cache(self);
+    __uint64_t generation;
+    const HashItem* item;
+    size_t page;
+    char* data;
+    size_t data_size;
+    for (i = 0; error == E_SUCCESS && i < hot_set.n_keys; i++) {
+        _Archive_lock_pages(self);
+        generation = cache != NULL ? ArchiveCache_generation(cache) : 0;
+        item = _Archive_lookup(self, hot_set.keys + 20 * i, 20, &page);
+        if (item != NULL) {
+            _Archive_pin_hot_page(self, page, &pinned_bytes);
+        }
+        if (item != NULL && cache != NULL) {
+            error = _Archive_read_item(self, page, item, 0, &data, &data_size, generation);
+            if (error == E_SUCCESS) {
+                free(data);
+            }
+        }
+        _Archive_unlock_pages(self);
+    }
+    ArchiveHotSet_free(&hot_set);
+    return error;
+}
+
+
+void        Archive_use_hot_keys(Archive*         self,
+                                 const char*      filename,
+                                 size_t           max_keys,
+                                 unsigned int     interval_ms)
+{
+    free(self->hot_keys_filename);
+    self->hot_keys_filename = filename != NULL ? strdup(filename) : NULL;
+    self->max_hot_keys = max_keys;
+    self->hot_keys_interval_ms = interval_ms;
+}
+
+
+Errors      Archive_snapshot_hot_keys(Archive*    self)
+{
+    if (self->hot_keys_filename == NULL || _Archive_value_cache(self) == NULL) {
+        return E_SUCCESS;
+    }
+    __uint64_t now = _Archive_now();
+    if (self->hot_keys_saved_at > 0 &&
+        now - self->hot_keys_saved_at < (__uint64_t)self->hot_keys_interval_ms * 1000000ull) {
+        return E_SUCCESS;
+    }
+    char* path;
+    asprintf(&path, "%s%s", self->base_file_path, self->hot_keys_filename);
+    Errors error = Archive_save_hot_keys(self, path, self->max_hot_keys);
+    free(path);
+    if (error == E_SUCCESS) {
+        self->hot_keys_saved_at = now;
+    }
+    return error;
+}
+
+
+#pragma mark Compaction
+
+
+Errors      Archive_page_stats(const Archive*     self,
+                               size_t             page,
+                               ArchivePageStats*  stats)
+{
+    // the page must not be swapped nor closed while its index is walked
+    _Archive_lock_pages(self);
+    if (page >= __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE)) {
+        _Archive_unlock_pages(self);
+        return E_INDEX_OUT_OF_BOUNDS;
+    }
+    Errors error = Archive_open_page(self, page);
+    if (error != E_SUCCESS) {
+        _Archive_unlock_pages(self);
+        return error;
+    }
+
+    const ArchivePage* archive_page = _Archive_pages(self) + page;
+    const HashPage* bucket;
+    const HashItem* item;
+    size_t i, j;
+    memset(stats, 0, sizeof(ArchivePageStats));
+    for (i = 0; i < HashIndexPageCount; i++) {
+        bucket = &(archive_page->index->pages[i]);
+        for (j = 0; j < bucket->n_items; j++) {
+            item = bucket->items + j;
+            if (HashItem_is_tombstone(item)) {
+                stats->n_tombstones++;
+            } else if (Archive_is_newest(self, page, item)) {
+                stats->n_live_items++;
+                stats->live_size += ArchivePage_stored_size(archive_page, item);
+            } else {
+                stats->n_dead_items++;
+            }
+        }
+    }
+
+    // everything in the data section that isn't referenced by a live item
+    stats->dead_size = archive_page->data_size - stats->live_size;
+    _Archive_unlock_pages(self);
+
+    return E_SUCCESS;
+}
+
+
+/**
+ Opens a new page for the compaction output, growing the output list.
+
+ @param self The archive.
+ @param pages A pointer to the list of output pages.
+ @param n_pages A pointer to the number of output pages.
+ @return An error code.
+ */
+static Errors       _Archive_compact_add_page(const Archive*    self,
+                                              ArchivePage**     pages,
+                                              size_t*           n_pages)
+{
+    uuid_t uuid;
+    char filename[37];
+    uuid_generate_random(uuid);
+    uuid_unparse_lower(uuid, filename);
+
+    *pages = (ArchivePage*)realloc(*pages, sizeof(ArchivePage) * (*n_pages + 1));
+    Errors error = ArchivePage_init(*pages + *n_pages, filename, self->base_file_path, true);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    ArchivePage_set_verify(*pages + *n_pages, self->verify_mode, self->verify_sample_rate);
+    ArchivePage_set_direct_io(*pages + *n_pages, self->direct_io_threshold);
+    ArchivePage_set_blob_threshold(*pages + *n_pages, self->blob_threshold);
+    *n_pages += 1;
+    return E_SUCCESS;
+}
+
+
+/**
+ Closes pages and removes their files.
+
+ @param pages The pages.
+ @param n_pages The number of pages.
+ */
+static void         _Archive_compact_remove_pages(ArchivePage*  pages,
+                                                  size_t        n_pages)
+{
+    char* full_file_path;
+    char* wal_path;
+    char* blob_path;
+    size_t i;
+    for (i = 0; i < n_pages; i++) {
+        asprintf(&full_file_path, "%s%s", pages[i].base_file_path, pages[i].filename);
+        asprintf(&wal_path, "%s.wal", full_file_path);
+        asprintf(&blob_path, "%s.blob", full_file_path);
+        ArchivePage_free(pages + i);
+        unlink(full_file_path);
+        unlink(wal_path);
+        unlink(blob_path);
+        free(full_file_path);
+        free(wal_path);
+        free(blob_path);
+    }
+}
+
+
+static int          _Archive_offset_compare(const void*     a,
+                                            const void*     b)
+{
+    size_t offset_a = (*(const HashItem**)a)->data_offset;
+    size_t offset_b = (*(const HashItem**)b)->data_offset;
+    if (offset_a < offset_b) {
+        return -1;
+    }
+    return offset_a > offset_b;
+}
+
+
+/**
+ Collects the items of an opened page in data offset order (the order in
+ which they were written to the file), tombstones left out. They point into
+ the page's index, so the page must not be closed nor swapped while they're
+ used.
+
+ @param page The page.
+ @param _items A pointer in which the list of items will be written (to be
+               freed).
+ @return The number of items.
+ */
+static size_t       _Archive_page_items(const ArchivePage*  page,
+                                        const HashItem***   _items)
+{
+    const HashIndex* index = page->index;
+    const HashItem** items = (const HashItem**)malloc(
+        sizeof(HashItem*) * (index->n_items > 0 ? index->n_items : 1));
+    size_t n_items = 0;
+    const HashPage* bucket;
+    size_t i, j;
+    for (i = 0; i < HashIndexPageCount; i++) {
+        bucket = &(index->pages[i]);
+        for (j = 0; j < bucket->n_items; j++) {
+            if (!HashItem_is_tombstone(bucket->items + j)) {
+                items[n_items++] = bucket->items + j;
+            }
+        }
+    }
+    if (n_items > 0) {
+        qsort(items, n_items, sizeof(HashItem*), _Archive_offset_compare);
+    }
+    *_items = items;
+    return n_items;
+}
+
+
+/**
+ Copies the live items (and needed tombstones) of a page to the compaction
+ output, in data offset order.
+
+ @param self The archive.
+ @param page The index of the page to copy.
+ @param first_page The index of the first page of the compacted range.
+ @param pages A pointer to the list of output pages.
+ @param n_pages A pointer to the number of output pages.
+ @return An error code.
+ */
+static Errors       _Archive_compact_page(const Archive*    self,
+                                          size_t            page,
+                                          size_t            first_page,
+                                          ArchivePage**     pages,
+                                          size_t*           n_pages)
+{
+    Errors error = E_SUCCESS;
+    const HashItem** items;
+    size_t n_items;
+    const HashPage* bucket;
+    const HashItem* item;
+    size_t i, j, k;
+
+    // copy live items, reading the page sequentially (the page stays at its
+    // index and opened while it's compacted, as Archive_trim_cache doesn't
+    // run meanwhile, but the writer may move the list of pages)
+    error = Archive_open_page(self, page);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    n_items = _Archive_page_items(_Archive_pages(self) + page, &items);
+    ArchivePage_advise(_Archive_pages(self) + page, ArchiveAccessSequential);
+    for (k = 0; error == E_SUCCESS && k < n_items; k++) {
+        item = items[k];
+        if (!Archive_is_newest(self, page, item)) {
+            continue;
+        }
+        error = ArchivePage_copy_item(*pages + (*n_pages - 1), _Archive_pages(self) + page, item);
+        if (error == E_INDEX_MAX_SIZE_EXCEEDED) {
+            error = _Archive_compact_add_page(self, pages, n_pages);
+            if (error == E_SUCCESS) {
+                error = ArchivePage_copy_item(*pages + (*n_pages - 1), _Archive_pages(self) + page, item);
+            }
+        }
+        if (error == E_SUCCESS && self->compaction_throttle != NULL) {
+            error = self->compaction_throttle(self->compaction_throttle_context,
+                                              HashItem_is_tombstone(item) ? 0 : item->data_size);
+        }
+    }
+    free(items);
+    ArchivePage_advise(_Archive_pages(self) + page, self->compaction_drops_cache ?
+                       ArchiveAccessDontNeed : self->access);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // copy the tombstones still hiding a key of a page older than the range
+    bool shadows;
+    for (i = 0; i < HashIndexPageCount; i++) {
+        bucket = &(_Archive_pages(self)[page].index->pages[i]);
+        for (j = 0; j < bucket->n_items; j++) {
+            item = bucket->items + j;
+            if (!HashItem_is_tombstone(item) ||
+                !Archive_is_newest(self, page, item)) {
+                continue;
+            }
+            shadows = false;
+            for (k = 0; k < first_page && !shadows; k++) {
+                shadows = _Archive_page_may_have(self, k, item->key, 20) &&
+                          HashIndex_get(_Archive_pages(self)[k].index, item->key, 20) != NULL;
+            }
+            if (!shadows) {
+                continue;
+            }
+            error = ArchivePage_delete(*pages + (*n_pages - 1), item->key);
+            if (error == E_INDEX_MAX_SIZE_EXCEEDED) {
+                error = _Archive_compact_add_page(self, pages, n_pages);
+                if (error == E_SUCCESS) {
+                    error = ArchivePage_delete(*pages + (*n_pages - 1), item->key);
+                }
+            }
+            if (error != E_SUCCESS) {
+                return error;
+            }
+        }
+    }
+
+    return E_SUCCESS;
+}
+
+
+/**
+ * The state shared by the tasks saving the pages written by Archive_compact.
+ */
+typedef struct ArchiveCompactJob
+{
+    const Archive*              archive;
+    ArchivePage*                pages;
+} ArchiveCompactJob;
+
+
+/**
+ Saves a page written by a compaction.
+
+ @param context The compaction job.
+ @param index The index of the page in the new pages.
+ @return An error code.
+ */
+static Errors       _Archive_compact_save_page(void*        context,
+                                               size_t       index)
+{
+    ArchiveCompactJob* job = (ArchiveCompactJob*)context;
+    return job->archive->manifest_filename != NULL ?
+        ArchivePage_commit(job->pages + index) :
+        ArchivePage_save(job->pages + index);
+}
+
+
+Errors      Archive_compact(Archive*              self,
+                            size_t                first_page,
+                            size_t                n_pages)
+{
+    Errors error;
+    ArchivePage* pages = NULL;
+    size_t n_new_pages = 0;
+    size_t i;
+
+    // the last page is being written to
+    if (n_pages == 0 || first_page + n_pages >= __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE)) {
+        return E_INDEX_OUT_OF_BOUNDS;
+    }
+
+    // rewrite the live items of the range, oldest page first
+    error = _Archive_compact_add_page(self, &pages, &n_new_pages);
+    for (i = first_page; error == E_SUCCESS && i < first_page + n_pages; i++) {
+        error = _Archive_compact_page(self, i, first_page, &pages, &n_new_pages);
+    }
+
+    // make the new pages durable before dropping the old ones
+    if (error == E_SUCCESS) {
+        ArchiveCompactJob job = {self, pages};
+        error = ArchiveExecutor_run(&self->executor, n_new_pages, 0, _Archive_compact_save_page, &job);
+    }
+    if (error != E_SUCCESS) {
+        _Archive_compact_remove_pages(pages, n_new_pages);
+        free(pages);
+        return error;
+    }
+
+    // splice the new pages in place of the old ones, at once for the writer
+    // and the lookups, which may have been running until now
+    pthread_mutex_lock(&self->write_lock);
+    pthread_rwlock_wrlock(&self->swap_lock);
+    ArchivePage* old_pages = (ArchivePage*)malloc(sizeof(ArchivePage) * n_pages);
+    memcpy(old_pages, self->pages + first_page, sizeof(ArchivePage) * n_pages);
+    size_t new_count = self->n_pages - n_pages + n_new_pages;
+    if (new_count > self->capacity) {
+        self->pages = (ArchivePage*)realloc(self->pages, sizeof(ArchivePage) * new_count);
+        self->capacity = new_count;
+    }
+    memmove(self->pages + first_page + n_new_pages,
+            self->pages + first_page + n_pages,
+            sizeof(ArchivePage) * (self->n_pages - first_page - n_pages));
+    memcpy(self->pages + first_page, pages, sizeof(ArchivePage) * n_new_pages);
+    self->n_pages = new_count;
+    __atomic_fetch_add(&self->n_swaps, 1, __ATOMIC_RELEASE);
+    free(pages);
+    _Archive_index_runs(self);
+
+    // the manifest must stop listing the old pages before they're dropped,
+    // they're only closed if it can't be written
+    if (self->manifest_filename != NULL) {
+        error = _Archive_write_manifest(self);
+    }
+    pthread_rwlock_unlock(&self->swap_lock);
+    pthread_mutex_unlock(&self->write_lock);
+    if (error == E_SUCCESS) {
+        _Archive_compact_remove_pages(old_pages, n_pages);
+    } else {
+        for (i = 0; i < n_pages; i++) {
+            ArchivePage_free(old_pages + i);
+        }
+    }
+    free(old_pages);
+
+    return error;
+}
+
+
+/**
+ * A live item merged into a level, and the page it's from.
+ */
+typedef struct ArchiveLevelItem
+{
+    const HashItem*             item;
+    size_t                      page;
+} ArchiveLevelItem;
+
+
+static int          _Archive_level_compare(const void*  a,
+                                           const void*  b)
+{
+    return memcmp(((const ArchiveLevelItem*)a)->item->key, ((const ArchiveLevelItem*)b)->item->key, 20);
+}
+
+
+/**
+ Checks if a page deeper than a level still holds a key.
+
+ @param self The archive.
+ @param level The level.
+ @param key The key.
+ @return true if one does.
+ */
+static bool         _Archive_level_below_has(const Archive*     self,
+                                             __uint32_t         level,
+                                             const char*        key)
+{
+    ArchivePageWalk walk;
+    size_t i;
+    _ArchivePageWalk_init(&walk, self, key, 20);
+    while (_ArchivePageWalk_next(&walk, self, &i)) {
+        if (_Archive_pages(self)[i].level > level &&
+            _Archive_page_may_have(self, i, key, 20) &&
+            HashIndex_get(_Archive_pages(self)[i].index, key, 20) != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ Writes an item to the last page of a leveled compaction output, starting a
+ new page when it's full.
+
+ @param self The archive.
+ @param entry The item and its page.
+ @param pages A pointer to the list of output pages.
+ @param n_pages A pointer to the number of output pages.
+ @return An error code.
+ */
+static Errors       _Archive_level_copy(const Archive*          self,
+                                        const ArchiveLevelItem* entry,
+                                        ArchivePage**           pages,
+                                        size_t*                 n_pages)
+{
+    const ArchivePage* source = _Archive_pages(self) + entry->page;
+    const HashItem* item = entry->item;
+    Errors error = E_INDEX_MAX_SIZE_EXCEEDED;
+    if (*n_pages > 0) {
+        error = HashItem_is_tombstone(item) ?
+            ArchivePage_delete(*pages + (*n_pages - 1), item->key) :
+            ArchivePage_copy_item(*pages + (*n_pages - 1), source, item);
+    }
+    if (error == E_INDEX_MAX_SIZE_EXCEEDED) {
+        error = _Archive_compact_add_page(self, pages, n_pages);
+        if (error == E_SUCCESS) {
+            error = HashItem_is_tombstone(item) ?
+                ArchivePage_delete(*pages + (*n_pages - 1), item->key) :
+                ArchivePage_copy_item(*pages + (*n_pages - 1), source, item);
+        }
+    }
+    if (error == E_SUCCESS && self->compaction_throttle != NULL) {
+        error = self->compaction_throttle(self->compaction_throttle_context,
+                                          HashItem_is_tombstone(item) ? 0 : item->data_size);
+    }
+    return error;
+}
+
+
+/**
+ Checks that pages can be merged into the next level: they're of a single
+ level, after the pages of deeper levels and before those of lower ones.
+
+ @param self The archive.
+ @param first_page The index of the first page.
+ @param n_pages The number of pages.
+ @return false if they can't.
+ */
+static bool         _Archive_level_can_merge(const Archive*     self,
+                                             size_t             first_page,
+                                             size_t             n_pages)
+{
+    const ArchivePage* pages = _Archive_pages(self);
+    size_t count = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    __uint32_t level = pages[first_page].level;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (i < first_page ? pages[i].level < level || (pages[i].level == level && level == 0) :
+            i < first_page + n_pages ? pages[i].level != level :
+            pages[i].level > level) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+Errors      Archive_compact_level(Archive*        self,
+                                  size_t          first_page,
+                                  size_t          n_pages)
+{
+    // the last page is being written to
+    if (n_pages == 0 || first_page + n_pages >= __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE) ||
+        !_Archive_level_can_merge(self, first_page, n_pages)) {
+        return E_INDEX_OUT_OF_BOUNDS;
+    }
+    __uint32_t level = _Archive_pages(self)[first_page].level + 1;
+
+    // the key range of the pages to merge, from their fences
+    Errors error = E_SUCCESS;
+    char min_key[20], max_key[20];
+    bool empty = true;
+    const ArchivePage* input;
+    size_t i, j, k;
+    for (i = first_page; error == E_SUCCESS && i < first_page + n_pages; i++) {
+        error = Archive_open_page(self, i);
+        input = _Archive_pages(self) + i;
+        if (error != E_SUCCESS || input->index->n_items == 0) {
+            continue;
+        }
+        if (empty || memcmp(input->min_key, min_key, 20) < 0) {
+            memcpy(min_key, input->min_key, 20);
+        }
+        if (empty || memcmp(input->max_key, max_key, 20) > 0) {
+            memcpy(max_key, input->max_key, 20);
+        }
+        empty = false;
+    }
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // with the pages of the next level overlapping it, which are older
+    size_t* inputs = (size_t*)malloc(sizeof(size_t) * (first_page + n_pages));
+    size_t n_inputs = 0;
+    const ArchivePage* page;
+    for (i = 0; !empty && error == E_SUCCESS && i < first_page; i++) {
+        page = _Archive_pages(self) + i;
+        if (page->level == level && memcmp(page->max_key, min_key, 20) >= 0 &&
+            memcmp(page->min_key, max_key, 20) <= 0) {
+            inputs[n_inputs++] = i;
+            error = Archive_open_page(self, i);
+        }
+    }
+    for (i = first_page; i < first_page + n_pages; i++) {
+        inputs[n_inputs++] = i;
+    }
+
+    // rewrite their live items in key order, a bucket at a time; tombstones
+    // are only needed if a deeper level has their key
+    ArchivePage* pages = NULL;
+    size_t n_new_pages = 0;
+    ArchiveLevelItem* items = NULL;
+    ArchiveLevelItem* grown;
+    size_t n_items, capacity = 0;
+    const HashPage* bucket;
+    const HashItem* item;
+    for (i = 0; error == E_SUCCESS && i < HashIndexPageCount; i++) {
+        n_items = 0;
+        for (k = 0; error == E_SUCCESS && k < n_inputs; k++) {
+            bucket = &(_Archive_pages(self)[inputs[k]].index->pages[i]);
+            for (j = 0; error == E_SUCCESS && j < bucket->n_items; j++) {
+                item = bucket->items + j;
+                if (!Archive_is_newest(self, inputs[k], item) ||
+                    (HashItem_is_tombstone(item) && !_Archive_level_below_has(self, level, item->key))) {
+                    continue;
+                }
+                if (n_items >= capacity) {
+                    grown = (ArchiveLevelItem*)realloc(items, sizeof(ArchiveLevelItem) *
+                                                              (capacity > 0 ? capacity * 2 : 64));
+                    if (grown == NULL) {
+                        error = E_SYSTEM_ERROR_ERRNO;
+                        continue;
+                    }
+                    items = grown;
+                    capacity = capacity > 0 ? capacity * 2 : 64;
+                }
+                items[n_items].item = item;
+                items[n_items].page = inputs[k];
+                n_items++;
+            }
+        }
+        if (error == E_SUCCESS && n_items > 0) {
+            qsort(items, n_items, sizeof(ArchiveLevelItem), _Archive_level_compare);
+        }
+        for (j = 0; error == E_SUCCESS && j < n_items; j++) {
+            error = _Archive_level_copy(self, items + j, &pages, &n_new_pages);
+        }
+    }
+    free(items);
+
+    // each new page covers the keys from its first to its last, as its fence
+    for (i = 0; error == E_SUCCESS && i < n_new_pages; i++) {
+        pages[i].level = level;
+    }
+
+    // make the new pages durable before dropping the old ones
+    if (error == E_SUCCESS) {
+        ArchiveCompactJob job = {self, pages};
+        error = ArchiveExecutor_run(&self->executor, n_new_pages, 0, _Archive_compact_save_page, &job);
+    }
+    if (error != E_SUCCESS) {
+        _Archive_compact_remove_pages(pages, n_new_pages);
+        free(pages);
+        free(inputs);
+        return error;
+    }
+
+    // put the new pages in the next level, in key order, leaving the merged
+    // pages out; it's done at once for the writer and the lookups
+    pthread_mutex_lock(&self->write_lock);
+    pthread_rwlock_wrlock(&self->swap_lock);
+    ArchivePage* old_pages = (ArchivePage*)malloc(sizeof(ArchivePage) * n_inputs);
+    size_t new_count = self->n_pages - n_inputs + n_new_pages;
+    size_t new_capacity = new_count > self->capacity ? new_count : self->capacity;
+    ArchivePage* all_pages = (ArchivePage*)malloc(sizeof(ArchivePage) * new_capacity);
+    bool placed = n_new_pages == 0;
+    for (i = 0, j = 0, k = 0; i < self->n_pages; i++) {
+        page = self->pages + i;
+        if (k < n_inputs && inputs[k] == i) {
+            old_pages[k++] = *page;
+            continue;
+        }
+        if (!placed && (page->level < level ||
+                        (page->level == level && memcmp(page->min_key, pages[0].min_key, 20) > 0))) {
+            memcpy(all_pages + j, pages, sizeof(ArchivePage) * n_new_pages);
+            j += n_new_pages;
+            placed = true;
+        }
+        all_pages[j++] = *page;
+    }
+    if (!placed) {
+        memcpy(all_pages + j, pages, sizeof(ArchivePage) * n_new_pages);
+    }
+    free(self->pages);
+    self->pages = all_pages;
+    self->capacity = new_capacity;
+    self->n_pages = new_count;
+    __atomic_fetch_add(&self->n_swaps, 1, __ATOMIC_RELEASE);
+    free(pages);
+    _Archive_index_runs(self);
+
+    // the manifest must stop listing the old pages before they're dropped,
+    // they're only closed if it can't be written
+    if (self->manifest_filename != NULL) {
+        error = _Archive_write_manifest(self);
+    }
+    pthread_rwlock_unlock(&self->swap_lock);
+    pthread_mutex_unlock(&self->write_lock);
+    if (error == E_SUCCESS) {
+        _Archive_compact_remove_pages(old_pages, n_inputs);
+    } else {
+        for (i = 0; i < n_inputs; i++) {
+            ArchivePage_free(old_pages + i);
+        }
+    }
+    free(old_pages);
+    free(inputs);
+
+    return error;
+}
+
+
+#pragma mark Bulk Load
+
+
+// a batch is cut when its data reaches this size, so the batches being
+// staged and built take a bounded amount of memory
+#define ArchiveBulkBatchDataSize    (64 << 20)
+
+
+/**
+ * Items of a bulk load staged for a page, and the page built from them.
+ */
+typedef struct ArchiveBulkBatch
+{
+    HashItem*                   items;
+    size_t                      n_items;
+    char*                       data;
+    size_t                      data_size;
+    size_t                      data_capacity;
+    ArchivePage                 page;
+    bool                        has_page;
+    Errors                      error;
+} ArchiveBulkBatch;
+
+
+/**
+ * The state shared by the tasks of Archive_bulk_load: the staged batches to
+ * build.
+ */
+typedef struct ArchiveBulkJob
+{
+    const Archive*              archive;
+    ArchiveBulkBatch**          batches;
+} ArchiveBulkJob;
+
+
+static int          _Archive_bulk_compare(const void*   a,
+                                          const void*   b)
+{
+    const HashItem* item_a = (const HashItem*)a;
+    const HashItem* item_b = (const HashItem*)b;
+    int order = memcmp(item_a->key, item_b->key, 20);
+    if (order != 0) {
+        return order;
+    }
+    // staged later, set later
+    return item_a->data_offset < item_b->data_offset ? -1 : 1;
+}
+
+
+/**
+ Builds and saves the page of a batch, sorting its items by key and keeping
+ the last item staged of each key. The staged items are free'ed.
+
+ @param archive The archive.
+ @param batch The batch.
+ */
+static void         _Archive_bulk_build(const Archive*      archive,
+                                        ArchiveBulkBatch*   batch)
+{
+    qsort(batch->items, batch->n_items, sizeof(HashItem), _Archive_bulk_compare);
+    size_t n_items = 0;
+    size_t i;
+    for (i = 0; i < batch->n_items; i++) {
+        if (i + 1 < batch->n_items && memcmp(batch->items[i].key, batch->items[i + 1].key, 20) == 0) {
+            continue;
+        }
+        batch->items[n_items++] = batch->items[i];
+    }
+
+    Errors error = E_SUCCESS;
+    for (i = 0; i < n_items && error == E_SUCCESS; i++) {
+        error = _Archive_check_digest(archive, batch->items[i].key,
+                                      batch->data + batch->items[i].data_offset,
+                                      batch->items[i].data_size);
+    }
+
+    uuid_t uuid;
+    char filename[37];
+    uuid_generate_random(uuid);
+    uuid_unparse_lower(uuid, filename);
+    if (error == E_SUCCESS) {
+        error = ArchivePage_init(&batch->page, filename, archive->base_file_path, true);
+        batch->has_page = error == E_SUCCESS;
+    }
+    if (error == E_SUCCESS) {
+        ArchivePage_set_verify(&batch->page, archive->verify_mode, archive->verify_sample_rate);
+        ArchivePage_set_direct_io(&batch->page, archive->direct_io_threshold);
+        ArchivePage_set_blob_threshold(&batch->page, archive->blob_threshold);
+        error = ArchivePage_build(&batch->page, batch->items, n_items, batch->data);
+    }
+    if (error == E_SUCCESS) {
+        error = ArchivePage_save(&batch->page);
+    }
+    batch->error = error;
+
+    free(batch->items);
+    free(batch->data);
+    batch->items = NULL;
+    batch->data = NULL;
+}
+
+
+/**
+ Builds the page of a staged batch.
+
+ @param context The bulk load job.
+ @param index The index of the batch.
+ @return An error code.
+ */
+static Errors       _Archive_bulk_build_batch(void*         context,
+                                              size_t        index)
+{
+    ArchiveBulkJob* job = (ArchiveBulkJob*)context;
+    _Archive_bulk_build(job->archive, job->batches[index]);
+    return job->batches[index]->error;
+}
+
+
+/**
+ Stages an item in a batch.
+
+ @param batch The batch.
+ @param key The key of the item.
+ @param data The data of the item.
+ @param size The size of the data.
+ */
+static void         _Archive_bulk_stage(ArchiveBulkBatch*   batch,
+                                        const char*         key,
+                                        const char*         data,
+                                        size_t              size)
+{
+    if (batch->data_size + size > batch->data_capacity) {
+        size_t capacity = batch->data_capacity > 0 ? batch->data_capacity : 4096;
+        while (capacity < batch->data_size + size) {
+            capacity *= 2;
+        }
+        batch->data = (char*)realloc(batch->data, capacity);
+        batch->data_capacity = capacity;
+    }
+    memcpy(batch->data + batch->data_size, data, size);
+    HashItem* item = batch->items + batch->n_items;
+    memcpy(item->key, key, 20);
+    item->data_offset = batch->data_size;
+    item->data_size = size;
+    batch->data_size += size;
+    batch->n_items += 1;
+}
+
+
+Errors      Archive_bulk_load(Archive*              self,
+                              ArchiveBulkSource     source,
+                              void*                 context,
+                              size_t                n_threads)
+{
+    // the batches are staged by rounds of one per thread, so the batches
+    // being staged and built take a bounded amount of memory
+    size_t round_size = n_threads > 0 && n_threads < self->executor.max_threads ?
+        n_threads : self->executor.max_threads;
+    ArchiveBulkJob job = {self, NULL};
+    size_t n_built = 0;
+
+    // stage the items in batches of a page, in the calling thread
+    ArchiveBulkBatch** batches = NULL;
+    size_t n_batches = 0;
+    ArchiveBulkBatch* batch = NULL;
+    char key[20];
+    const char* data;
+    size_t size;
+    Errors error;
+    while ((error = source(context, key, &data, &size)) == E_SUCCESS) {
+        if (batch != NULL && (batch->n_items == MAX_ITEMS_PER_INDEX ||
+                              batch->data_size + size > ArchiveBulkBatchDataSize)) {
+            batch = NULL;
+            if (n_batches - n_built == round_size) {
+                job.batches = batches + n_built;
+                error = ArchiveExecutor_run(&self->executor, n_batches - n_built, n_threads,
+                                            _Archive_bulk_build_batch, &job);
+                n_built = n_batches;
+                if (error != E_SUCCESS) {
+                    break;
+                }
+            }
+        }
+        if (batch == NULL) {
+            batch = (ArchiveBulkBatch*)calloc(1, sizeof(ArchiveBulkBatch));
+            batch->items = (HashItem*)malloc(sizeof(HashItem) * MAX_ITEMS_PER_INDEX);
+            batches = (ArchiveBulkBatch**)realloc(batches, sizeof(ArchiveBulkBatch*) * (n_batches + 1));
+            batches[n_batches++] = batch;
+        }
+        _Archive_bulk_stage(batch, key, data, size);
+    }
+    if (error == E_NOT_FOUND) {
+        error = E_SUCCESS;
+    }
+    if (error == E_SUCCESS && n_batches > n_built) {
+        job.batches = batches + n_built;
+        error = ArchiveExecutor_run(&self->executor, n_batches - n_built, n_threads,
+                                    _Archive_bulk_build_batch, &job);
+    }
+
+    size_t i;
+    for (i = 0; i < n_batches && error == E_SUCCESS; i++) {
+        error = batches[i]->error;
+    }
+
+    // attach the pages in the order of their items, or drop them all
+    ArchivePage* page;
+    pthread_mutex_lock(&self->write_lock);
+    for (i = 0; i < n_batches; i++) {
+        batch = batches[i];
+        if (error != E_SUCCESS) {
+            if (batch->has_page) {
+                _Archive_compact_remove_pages(&batch->page, 1);
+            }
+            free(batch->items);
+            free(batch->data);
+        } else {
+            page = _Archive_reserve_page(self);
+            *page = batch->page;
+            if (self->access != ArchiveAccessNormal) {
+                ArchivePage_advise(page, self->access);
+            }
+            if (self->wal_batch_size > 0) {
+                ArchivePage_enable_wal(page, self->wal_batch_size);
+            }
+            __atomic_store_n(&self->n_pages, self->n_pages + 1, __ATOMIC_RELEASE);
+        }
+        free(batch);
+    }
+    free(batches);
+
+    if (error == E_SUCCESS && n_batches > 0 && self->miss_cache != NULL) {
+        ArchiveMissCache_clear(self->miss_cache);
+    }
+    if (error == E_SUCCESS && n_batches > 0 && self->cache != NULL) {
+        ArchiveCache_clear(self->cache);
+    }
+    if (error == E_SUCCESS && n_batches > 0 && self->manifest_filename != NULL) {
+        error = _Archive_write_manifest(self);
+    }
+    pthread_mutex_unlock(&self->write_lock);
+    return error;
+}
+
+
+#pragma mark Verification
+
+
+/**
+ * The state shared by the tasks of Archive_verify.
+ */
+typedef struct ArchiveVerifyJob
+{
+    const Archive*              archive;
+    char**                      filenames;
+    size_t                      n_pages;
+    atomic_size_t               n_corrupted;
+} ArchiveVerifyJob;
+
+
+/**
+ Finds a page of the archive by its file name, from the index it had. The
+ pages must be locked.
+
+ @param self The archive.
+ @param filename The file name of the page.
+ @param hint The index the page had.
+ @param _page A pointer in which the index of the page will be written.
+ @return false if the page isn't in the archive anymore.
+ */
+static bool         _Archive_find_page(const Archive*   self,
+                                       const char*      filename,
+                                       size_t           hint,
+                                       size_t*          _page)
+{
+    const ArchivePage* pages = _Archive_pages(self);
+    size_t n_pages = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    size_t i;
+    if (hint < n_pages && strcmp(pages[hint].filename, filename) == 0) {
+        *_page = hint;
+        return true;
+    }
+    for (i = 0; i < n_pages; i++) {
+        if (strcmp(pages[i].filename, filename) == 0) {
+            *_page = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ Checks a page of the archive, opening it first (a page whose header is
+ corrupted can't be opened). The pages are locked while it's read, and it's
+ skipped if a compaction merged it into others meanwhile.
+
+ @param context The verification job.
+ @param index The index the page had when the verification started.
+ @return An error code, other than for corruption.
+ */
+static Errors       _Archive_verify_page(void*          context,
+                                         size_t         index)
+{
+    ArchiveVerifyJob* job = (ArchiveVerifyJob*)context;
+    const Archive* self = job->archive;
+    size_t page;
+    _Archive_lock_pages(self);
+    if (!_Archive_find_page(self, job->filenames[index], index, &page)) {
+        _Archive_unlock_pages(self);
+        return E_SUCCESS;
+    }
+    Errors error = Archive_open_page(self, page);
+    if (error == E_CHECKSUM_MISMATCH) {
+        _Archive_unlock_pages(self);
+        atomic_fetch_add(&job->n_corrupted, 1);
+        return E_SUCCESS;
+    } else if (error != E_SUCCESS) {
+        _Archive_unlock_pages(self);
+        return error;
+    }
+    const ArchivePage* archive_page = _Archive_pages(self) + page;
+    error = ArchivePage_verify_header(archive_page);
+    if (error == E_CHECKSUM_MISMATCH) {
+        atomic_fetch_add(&job->n_corrupted, 1);
+    } else if (error != E_SUCCESS) {
+        _Archive_unlock_pages(self);
+        return error;
+    }
+
+    // in data offset order, so the page is read sequentially
+    const HashItem** items;
+    size_t n_items = _Archive_page_items(archive_page, &items);
+    ArchivePage_advise(archive_page, ArchiveAccessSequential);
+    char* data;
+    size_t data_size;
+    size_t i;
+    for (i = 0; i < n_items; i++) {
+        error = ArchivePage_verify_item(archive_page, items[i]);
+        if (error == E_SUCCESS && self->digest != NULL) {
+            // the key of a content-addressed item is the digest of its data
+            error = ArchivePage_read(archive_page, items[i], 0, &data, &data_size);
+            if (error == E_SUCCESS) {
+                error = _Archive_check_digest(self, items[i]->key, data, data_size);
+                free(data);
+            }
+        }
+        if (error == E_CHECKSUM_MISMATCH || error == E_DIGEST_MISMATCH) {
+            atomic_fetch_add(&job->n_corrupted, 1);
+        } else if (error != E_SUCCESS) {
+            break;
+        }
+    }
+    free(items);
+    ArchivePage_advise(archive_page, self->access);
+    _Archive_unlock_pages(self);
+    return error == E_CHECKSUM_MISMATCH || error == E_DIGEST_MISMATCH ? E_SUCCESS : error;
+}
+
+
+Errors      Archive_verify(const Archive*         self,
+                           size_t                 n_threads,
+                           size_t*                _n_corrupted)
+{
+    // the pages are found by name, as a compactor may move them meanwhile
+    ArchiveVerifyJob job;
+    size_t i;
+    job.archive = self;
+    _Archive_lock_pages(self);
+    job.n_pages = __atomic_load_n(&self->n_pages, __ATOMIC_ACQUIRE);
+    job.filenames = (char**)malloc(sizeof(char*) * (job.n_pages > 0 ? job.n_pages : 1));
+    for (i = 0; i < job.n_pages; i++) {
+        job.filenames[i] = strdup(_Archive_pages(self)[i].filename);
+    }
+    _Archive_unlock_pages(self);
+    atomic_init(&job.n_corrupted, 0);
+    Errors error = ArchiveExecutor_run((ArchiveExecutor*)&self->executor, job.n_pages, n_threads,
+                                       _Archive_verify_page, &job);
+    for (i = 0; i < job.n_pages; i++) {
+        free(job.filenames[i]);
+    }
+    free(job.filenames);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    size_t n_corrupted = atomic_load(&job.n_corrupted);
+    if (_n_corrupted != NULL) {
+        *_n_corrupted = n_corrupted;
+    }
+    return n_corrupted > 0 ? E_CHECKSUM_MISMATCH : E_SUCCESS;
 }
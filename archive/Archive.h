@@ -11,19 +11,114 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "Errors.h"
 #include "ArchivePage.h"
 #include "HashIndex.h"
 #include "ArchiveSaveResult.h"
+#include "ArchiveExecutor.h"
+#include "ArchiveMissCache.h"
+#include "ArchiveCache.h"
+#include "ArchiveHotSet.h"
+#include "Sha1.h"
 
 
 #pragma mark - Archive
 
 
+/**
+ * Statistics about the items of a page, to drive compaction. Sizes are the
+ * space taken in the page file, checksums included.
+ */
+typedef struct ArchivePageStats
+{
+    size_t                      n_live_items;
+    size_t                      n_dead_items;
+    size_t                      n_tombstones;
+    size_t                      live_size;
+    size_t                      dead_size;
+} ArchivePageStats;
+
+
+/**
+ * A digest function for content-addressed archives, computing the key
+ * (20 bytes) of some data. Sha1_digest is one.
+ */
+typedef void (*ArchiveDigest)(const void*               data,
+                              size_t                    size,
+                              char*                     digest);
+
+
+/**
+ * The source of the items of a bulk load (see Archive_bulk_load). It's called
+ * from a single thread, until it returns something else than E_SUCCESS.
+ *
+ * @param context The context given to Archive_bulk_load.
+ * @param key A pointer in which the key of the next item (20 bytes) is
+ *            written.
+ * @param _data A pointer in which the data of the next item is returned. It
+ *              only needs to be valid until the next call.
+ * @param _size A pointer in which the size of the data is returned.
+ * @return E_SUCCESS if there's an item, E_NOT_FOUND if there are no items
+ *         left, or an error code stopping the load.
+ */
+typedef Errors (*ArchiveBulkSource)(void*               context,
+                                    char*               key,
+                                    const char**        _data,
+                                    size_t*             _size);
+
+
+/**
+ * Called by compaction for each item it copies, to keep its IO under a
+ * budget. It may wait before returning.
+ *
+ * @param context The context given with the function.
+ * @param n_bytes The number of bytes copied.
+ * @return E_SUCCESS to go on, or an error code stopping the compaction.
+ */
+typedef Errors (*ArchiveThrottle)(void*                 context,
+                                  size_t                n_bytes);
+
+
+/**
+ * Consecutive pages of the same level above 0, sorted by key with ranges
+ * that don't overlap, so a key is looked up in one of them at most, found by
+ * binary search.
+ */
+typedef struct ArchiveSortedRun
+{
+    size_t                      first_page;
+    size_t                      n_pages;
+} ArchiveSortedRun;
+
+
 /**
  * Archive object latest pages on the end of the list
  *
+ * A writer (set, delete, add_page) and any number of readers (get, has,
+ * get_range, ...) may use the archive at the same time, the readers without
+ * waiting for the writer: items and pages are published once complete, and
+ * what's moved while growing is kept until the archive is freed. Writers
+ * take `write_lock`, so a compaction running on another thread (see
+ * ArchiveCompactor) can swap its pages in between two writes, and lookups
+ * share `swap_lock`, which the swap takes for itself and counts in `n_swaps`
+ * (so the scans see their pages moved). The configuration and the other
+ * operations need the archive for themselves.
+ *
+ * Pages can be organized in levels by leveled compaction (see
+ * Archive_compact_level): deeper levels first, each a sorted run, then the
+ * pages of level 0 as they were written. Lookups probe the pages of level 0
+ * and a single page of each level, found in `runs` (set along with pages).
+ *
+ * Keys not found by lookups can be kept in a miss cache (see
+ * Archive_set_miss_cache), so looking them up again doesn't walk the pages.
+ *
+ * The memory of the indexes of the opened pages and of a cache of values can
+ * be bounded (see Archive_set_cache_budget): the indexes of the pages used
+ * the least are closed again by Archive_trim_cache, unless they're pinned.
+ * The hottest keys can be saved to a side file (see Archive_use_hot_keys),
+ * and prefetched once the archive is opened again.
  */
 typedef struct Archive
 {
@@ -31,6 +126,34 @@ typedef struct Archive
     ArchivePage*                pages;
     size_t                      n_pages;
     size_t                      capacity;
+    size_t                      wal_batch_size;
+    char*                       manifest_filename;
+    ArchiveVerifyMode           verify_mode;
+    __uint32_t                  verify_sample_rate;
+    ArchiveDigest               digest;
+    bool                        verify_digest_reads;
+    ArchiveAccess               access;
+    bool                        compaction_drops_cache;
+    size_t                      direct_io_threshold;
+    size_t                      blob_threshold;
+    ArchiveExecutor             executor;
+    ArchiveThrottle             compaction_throttle;
+    void*                       compaction_throttle_context;
+    size_t                      n_bytes_set;
+    pthread_mutex_t             open_lock;
+    pthread_mutex_t             write_lock;
+    pthread_rwlock_t            swap_lock;
+    size_t                      n_swaps;
+    ArchivePage**               retired_pages;
+    size_t                      n_retired_pages;
+    ArchiveSortedRun*           runs;
+    size_t                      n_runs;
+    ArchiveMissCache*           miss_cache;
+    ArchiveCache*               cache;
+    char*                       hot_keys_filename;
+    size_t                      max_hot_keys;
+    unsigned int                hot_keys_interval_ms;
+    __uint64_t                  hot_keys_saved_at;
 } Archive;
 
 
@@ -97,7 +220,8 @@ static inline bool  Archive_has(const Archive*          self,
               Data is not null-terminated, may be binary. The caller should
               rely on the `_data_size` value to know how many bytes to read.
  @param _data_size A pointer to the size of the read data.
- @return An error code.
+ @return An error code. E_DIGEST_MISMATCH if the archive verifies the digest
+         of full reads and the data doesn't match its key.
  */
 Errors          Archive_get_partial(const Archive*      self,
                                     const char*         partial_key,
@@ -108,6 +232,21 @@ Errors          Archive_get_partial(const Archive*      self,
                                     size_t*             _data_size);
 
 
+/**
+ Checks if an item of a page is the newest item of its key in the archive,
+ that is, it is not shadowed by an item set later in the same page or in a
+ newer page.
+
+ @param self The archive.
+ @param page The index of the item's page.
+ @param item The item, as found in the page's index.
+ @return A boolean representing wheather the item is the newest.
+ */
+bool            Archive_is_newest(const Archive*        self,
+                                  size_t                page,
+                                  const HashItem*       item);
+
+
 /**
  Retrieve an item from the archive.
 
@@ -130,19 +269,288 @@ static inline Errors Archive_get(const Archive*         self,
 
 
 /**
- Sets a new item to the archive.
+ Reads a range of the data of an item of the archive, without reading the
+ rest of it, e.g. to serve a range request or to parse the end of a large
+ item.
+
+ @param self The archive.
+ @param key The key to lookup (a 20 bytes binary string).
+ @param offset The offset in the data of the first byte to read. The range is
+               empty if it's past the end of the data.
+ @param length The maximum number of bytes to read.
+               Pass 0 to read up to the end of the data.
+ @param _data A pointer to the char* that will be returned.
+              The returned char* should be free'ed by the caller.
+ @param _data_size A pointer to the number of bytes read.
+ @return An error code. E_DIGEST_MISMATCH if the archive verifies the digest
+         of full reads, the range covers the whole data and it doesn't match
+         its key.
+ */
+Errors          Archive_get_range(const Archive*        self,
+                                  const char*           key,
+                                  size_t                offset,
+                                  size_t                length,
+                                  char**                _data,
+                                  size_t*               _data_size);
+/**
+ Sends a range of the data of an item of the archive to a file descriptor (a
+ file, a pipe or a socket), at its current position. The data goes from the
+ page file to the descriptor in the kernel where it can (see
+ ArchivePage_send), so serving an item doesn't copy it through a buffer.
+
+ @param self The archive.
+ @param key The key to lookup (a 20 bytes binary string).
+ @param offset The offset in the data of the first byte to send.
+ @param data_max_size The maximum number of bytes to send.
+                      Pass 0 to send up to the end of the data.
+ @param out_fd The file descriptor to write the data to.
+ @param _data_size A pointer to the number of bytes sent.
+ @return An error code. E_DIGEST_MISMATCH if the archive verifies the digest
+         of full reads and the data doesn't match its key, in which case
+         nothing is sent.
+ */
+Errors          Archive_get_range_to_fd(const Archive*  self,
+                                        const char*     key,
+                                        size_t          offset,
+                                        size_t          data_max_size,
+                                        file_descriptor out_fd,
+                                        size_t*         _data_size);
+
+
+/**
+ Sends the data of an item of the archive to a file descriptor (a file, a
+ pipe or a socket), at its current position.
+
+ @param self The archive.
+ @param key The key to lookup (a 20 bytes binary string).
+ @param out_fd The file descriptor to write the data to.
+ @param _data_size A pointer to the number of bytes sent.
+ @return An error code.
+ */
+static inline Errors Archive_get_to_fd(const Archive*   self,
+                                       const char*      key,
+                                       file_descriptor  out_fd,
+                                       size_t*          _data_size)
+{
+    return Archive_get_range_to_fd(self, key, 0, 0, out_fd, _data_size);
+}
+
+
+/**
+ Resolves a partial key to a full key, making sure that only one live key
+ of the archive matches it.
+
+ @param self The archive.
+ @param partial_key The partial key to lookup (between 3 and 20 bytes).
+ @param partial_key_len The length of the partial key.
+ @param key A pointer in which the full key (20 bytes) will be written.
+            Or NULL, if the user doesn't need to know the full key.
+ @param _n_candidates A pointer in which the number of matching keys will be
+                      written. Or NULL, the keys are then only counted up
+                      to the second one, which is enough to tell whether
+                      the partial key is ambiguous.
+ @return E_SUCCESS, E_NOT_FOUND or E_AMBIGUOUS if more than one key matches.
+ */
+Errors          Archive_resolve_partial(const Archive*  self,
+                                        const char*     partial_key,
+                                        size_t          partial_key_len,
+                                        char*           key,
+                                        size_t*         _n_candidates);
+
+
+/**
+ Retrieve an item from the archive given a partial key, failing with
+ E_AMBIGUOUS instead of picking one if more than one key matches.
+
+ @param self The archive.
+ @param partial_key The partial key to lookup (between 3 and 20 bytes).
+ @param partial_key_len The length of the partial key.
+ @param key A pointer in which the full key (20 bytes) will be written.
+            Or NULL, if the user doesn't need to know the full key.
+ @param data_max_size The maximum number of bytes to read from the file.
+                      Pass 0 to read the full file.
+ @param _data A pointer to the char* that will be returned.
+              The returned char* should be free'ed by the caller.
+ @param _data_size A pointer to the size of the read data.
+ @param _n_candidates A pointer in which the number of matching keys will be
+                      written. Or NULL, to only count them up to the second
+                      one (see Archive_resolve_partial).
+ @return An error code.
+ */
+Errors          Archive_get_partial_unique(const Archive*   self,
+                                           const char*      partial_key,
+                                           size_t           partial_key_len,
+                                           char*            key,
+                                           size_t           data_max_size,
+                                           char**           _data,
+                                           size_t*          _data_size,
+                                           size_t*          _n_candidates);
+
+
+/**
+ Computes the length of the shortest prefix of a key that is not shared
+ with any other key of the archive (never shorter than 3 bytes, which is the
+ minimum partial key length).
+
+ @param self The archive.
+ @param key The key (a 20 bytes binary string).
+ @param _length A pointer in which the prefix length will be written.
+ @return E_NOT_FOUND if the key isn't in the archive, or E_SUCCESS.
+ */
+Errors          Archive_unique_prefix_length(const Archive*     self,
+                                             const char*        key,
+                                             size_t*            _length);
+
+
+/**
+ Sets a new item to the archive. If the key is already in the archive,
+ nothing is written.
 
  @param self The archive.
  @param key The key to set for the new item (a 20 bytes binary string).
  @param data The data to write to the archive.
  @param size The length of the data to write.
- @return An error code.
+ @return An error code. E_DIGEST_MISMATCH if the archive is content-addressed
+         and the key isn't the digest of the data.
  */
 Errors          Archive_set(Archive*                    self,
                             const char*                 key,
                             const char*                 data,
                             size_t                      size);
 
+
+/**
+ Sets an item to a content-addressed archive, under the digest of its data.
+ If the key is already in the archive, nothing is written: the item it
+ holds has the same data.
+
+ @param self The archive, content-addressed (see Archive_use_digest).
+ @param data The data to write to the archive.
+ @param size The length of the data to write.
+ @param key A pointer in which the key (20 bytes) will be written. Or NULL.
+ @return An error code. E_NOT_CONTENT_ADDRESSED if the archive has no digest.
+ */
+Errors          Archive_set_content(Archive*            self,
+                                    const char*         data,
+                                    size_t              size,
+                                    char*               key);
+
+/**
+ Puts an item to the archive, shadowing the older items with the same key.
+ Unlike Archive_set, this doesn't look the key up in the archive first, and
+ always writes the data to the last page. In a content-addressed archive,
+ an item shadowed this way has the same data, so an ingest which trusts its
+ digests can skip the lookup.
+
+ @param self The archive.
+ @param key The key to set for the item (a 20 bytes binary string).
+ @param data The data to write to the archive.
+ @param size The length of the data to write.
+ @return An error code. E_DIGEST_MISMATCH if the archive is content-addressed
+         and the key isn't the digest of the data.
+ */
+Errors          Archive_put(Archive*                    self,
+                            const char*                 key,
+                            const char*                 data,
+                            size_t                      size);
+
+
+/**
+ Deletes an item from the archive, by adding a tombstone to the last page.
+ The data of the deleted item is only reclaimed by compaction.
+
+ @param self The archive.
+ @param key The key of the item to delete (a 20 bytes binary string).
+ @return E_NOT_FOUND if the key isn't in the archive, or an error code.
+ */
+Errors          Archive_delete(Archive*                 self,
+                               const char*              key);
+
+
+/**
+ Computes the live and dead items and bytes of a page.
+
+ @param self The archive.
+ @param page The index of the page.
+ @param stats A pointer to the stats to populate.
+ @return An error code.
+ */
+Errors          Archive_page_stats(const Archive*       self,
+                                   size_t               page,
+                                   ArchivePageStats*    stats);
+
+
+/**
+ Rewrites a range of pages into new pages holding only their live items,
+ dropping shadowed and deleted data. Tombstones are dropped unless a page
+ older than the range still holds their key. The new pages are saved in
+ parallel, then the old page files are removed, so the caller must save the
+ archive to learn about the new file names.
+
+ The range can't have the last page, which is being written to. The writer
+ and lookups may go on meanwhile: the new pages replace the old ones at
+ once, in between two writes and once the lookups in progress are done.
+
+ @param self The archive.
+ @param first_page The index of the first page to compact.
+ @param n_pages The number of pages to compact.
+ @return An error code. E_INDEX_OUT_OF_BOUNDS if the range has the last
+         page.
+ */
+Errors          Archive_compact(Archive*                self,
+                                size_t                  first_page,
+                                size_t                  n_pages);
+
+
+/**
+ Merges consecutive pages of a level into the next level: their live items
+ and those of the pages of the next level whose key range overlaps theirs are
+ rewritten in key order, into new pages with key ranges that don't overlap,
+ which take the place of the merged pages of the next level. Tombstones are
+ dropped unless a deeper page still holds their key. The manifest keeps the
+ levels, pages being of level 0 until merged.
+
+ The pages before the range must be of deeper levels (or of the same level,
+ above 0), and those after it of the same level or above, so for level 0,
+ the range is the oldest pages of the level. As with Archive_compact, the
+ range can't have the last page, and the writer and lookups may go on
+ meanwhile.
+
+ @param self The archive.
+ @param first_page The index of the first page to merge.
+ @param n_pages The number of pages to merge.
+ @return An error code. E_INDEX_OUT_OF_BOUNDS if the pages can't be merged
+         into the next level, or the range has the last page.
+ */
+Errors          Archive_compact_level(Archive*          self,
+                                      size_t            first_page,
+                                      size_t            n_pages);
+
+
+/**
+ Loads many items at once into new pages, which are built and saved in
+ parallel and then added to the archive in the order of their items. The
+ items are staged by pages, sorted by key in their page and written with
+ large sequential writes, when Archive_set would write them one by one.
+
+ The items are put, as with Archive_put: they aren't looked up first, and
+ shadow the items of their keys already in the archive. Of the items of a
+ key in the load, the last one wins.
+
+ @param self The archive.
+ @param source The source of the items.
+ @param context The context passed to the source.
+ @param n_threads The number of threads building the pages, 0 for as many
+                  as allowed (see Archive_set_max_threads).
+ @return An error code, from the source or from building the pages. On
+         error, no page is added.
+ */
+Errors          Archive_bulk_load(Archive*              self,
+                                  ArchiveBulkSource     source,
+                                  void*                 context,
+                                  size_t                n_threads);
+
+
 /**
  Adds a new empty page to the archive.
 
@@ -163,7 +571,423 @@ Errors          Archive_add_page_by_name(Archive*       self,
                                          const char*    filename);
 
 /**
- Saves all pages of the archive to the file system.
+ Enables the write-ahead log of the archive's pages, so that the items set
+ since the last save survive a crash once they're synced.
+
+ @param self The archive.
+ @param batch_size The number of items grouped in a single sync. Items are
+                   synced when a batch is full, or on Archive_sync.
+ */
+void            Archive_enable_wal(Archive*             self,
+                                   size_t               batch_size);
+
+
+/**
+ Syncs the items set on the archive that are not yet durable. Does nothing
+ if the write-ahead log isn't enabled.
+
+ @param self The archive.
+ @return An error code.
+ */
+Errors          Archive_sync(const Archive*             self);
+
+
+/**
+ Keeps the page files of the archive under stable names, and lists them in a
+ manifest file which is written atomically on each save (instead of renaming
+ each changed page to a new unique name).
+
+ @param self The archive.
+ @param manifest_filename The file name of the manifest, relative to the
+                          archive's base path (a null-terminated string).
+ */
+void            Archive_use_manifest(Archive*           self,
+                                     const char*        manifest_filename);
+
+
+/**
+ Adds the pages listed in the archive's manifest (see Archive_use_manifest),
+ in order. Only the last page is opened, the others are opened on first use,
+ and lookups skip them (without opening) when the filter of their manifest
+ entry excludes the key.
+
+ @param self The archive.
+ @return An error code. E_STALE_PAGE if the last page file is older than the
+         generation recorded in the manifest.
+ */
+Errors          Archive_load_manifest(Archive*          self);
+
+
+/**
+ Initializes an archive and restores its pages from its manifest.
+
+ @param self The archive struct to initialize. It must be free'ed with
+             Archive_free, even if an error is returned.
+ @param base_file_path The base path for archive files (a null-terminated
+                       string).
+ @param manifest_filename The file name of the manifest, relative to the
+                          base path (a null-terminated string).
+ @return An error code.
+ */
+Errors          Archive_open(Archive*                   self,
+                             const char*                base_file_path,
+                             const char*                manifest_filename);
+
+
+/**
+ Opens a page restored from the manifest, if it isn't opened yet. Pages are
+ opened on first use by the archive functions, this is only needed to access
+ the `pages` directly.
+
+ @param self The archive.
+ @param page The index of the page.
+ @return An error code. E_STALE_PAGE if the page file is older than the
+         generation recorded in the manifest.
+ */
+Errors          Archive_open_page(const Archive*        self,
+                                  size_t                page);
+
+
+/**
+ Locks the pages of the archive as a lookup does, so they aren't swapped by a
+ compaction nor closed by Archive_trim_cache until they're unlocked. This is
+ only needed to access the `pages` directly while a compactor is running.
+ The other archive functions must not be called meanwhile (but
+ Archive_open_page and Archive_is_newest), as they may lock the pages too.
+
+ @param self The archive.
+ */
+void            Archive_lock_pages(const Archive*       self);
+
+
+/**
+ Unlocks the pages locked by Archive_lock_pages.
+
+ @param self The archive.
+ */
+void            Archive_unlock_pages(const Archive*     self);
+
+
+/**
+ Sets how reads from the archive's pages are verified against the checksums
+ of the items (always, by default).
+
+ @param self The archive.
+ @param mode The verification mode.
+ @param sample_rate With ArchiveVerifySampled, one read out of `sample_rate`
+                    is verified (on average).
+ */
+void            Archive_set_verify(Archive*             self,
+                                   ArchiveVerifyMode    mode,
+                                   __uint32_t           sample_rate);
+
+
+/**
+ Makes the archive content-addressed: the key of each item is the digest of
+ its data. Items set or put with another key are rejected, and
+ Archive_verify checks the digests.
+
+ @param self The archive.
+ @param digest The digest function, or NULL to stop checking the keys.
+ @param verify_reads Whether full reads (Archive_get_partial without a
+                     maximum size) check the digest of the data too.
+ */
+void            Archive_use_digest(Archive*             self,
+                                   ArchiveDigest        digest,
+                                   bool                 verify_reads);
+
+
+/**
+ Checks the headers and the data of all the items of the archive against
+ their checksums, regardless of the verification mode, and the keys of the
+ items against the digest of their data if the archive is content-addressed.
+ The pages are checked in parallel, and those merged by a compactor running
+ meanwhile are skipped.
+
+ @param self The archive.
+ @param n_threads The number of threads to use, or 0 to use as many as
+                  allowed (see Archive_set_max_threads).
+ @param _n_corrupted A pointer to the number of corrupted items and page
+                     headers found. Or NULL.
+ @return An error code. E_CHECKSUM_MISMATCH if anything is corrupted.
+ */
+Errors          Archive_verify(const Archive*           self,
+                               size_t                   n_threads,
+                               size_t*                  _n_corrupted);
+
+
+/**
+ Hints the kernel about how the data of the archive's pages will be
+ accessed: ArchiveAccessRandom for point lookups, ArchiveAccessSequential
+ for full scans, or back to ArchiveAccessNormal. Scans done by the archive
+ itself (Archive_verify, Archive_compact) read their pages sequentially
+ regardless.
+
+ @param self The archive.
+ @param access The access pattern.
+ */
+void            Archive_set_access(Archive*             self,
+                                   ArchiveAccess        access);
+
+
+/**
+ Starts reading the data of some items in the background, for a batch of
+ lookups or to warm up the page cache. Keys not in the archive are ignored.
+
+ @param self The archive.
+ @param keys The keys of the items (20 bytes each, one after the other).
+ @param n_keys The number of keys.
+ @return An error code.
+ */
+Errors          Archive_prefetch(const Archive*         self,
+                                 const char*            keys,
+                                 size_t                 n_keys);
+
+
+/**
+ Reads the items of at least `threshold` bytes with direct I/O, so large
+ items don't evict the small ones from the page cache, and aligns the items
+ of that size set from now on so they can be read this way (see
+ ArchivePage_set_direct_io).
+
+ @param self The archive.
+ @param threshold The size of the items to read directly, or 0 to read all
+                  the items through the page cache.
+ */
+void            Archive_set_direct_io(Archive*          self,
+                                      size_t            threshold);
+
+
+/**
+ Stores the items of at least `threshold` bytes set from now on in the blob
+ files of the pages, next to the page files, so the page files only hold the
+ small items and compaction copies the large ones from file to file (see
+ ArchivePage_set_blob_threshold).
+
+ @param self The archive.
+ @param threshold The size of the items to store in blob files, or 0 to
+                  store all the items in the page files.
+ */
+void            Archive_set_blob_threshold(Archive*     self,
+                                           size_t       threshold);
+
+
+/**
+ Keeps the last keys looked up with their full 20 bytes and not found, so
+ looking them up again doesn't walk the pages (see ArchiveMissCache). A key
+ leaves the cache when it's set, and the cache is emptied when pages with
+ existing keys are added.
+
+ @param self The archive.
+ @param n_keys The number of keys the cache can hold, or 0 for no cache.
+ */
+void            Archive_set_miss_cache(Archive*         self,
+                                       size_t           n_keys);
+
+
+/**
+ Gets the metrics of the miss cache of the archive, all 0 if it has none.
+
+ @param self The archive.
+ @param stats A pointer in which the metrics are written.
+ */
+void            Archive_miss_cache_stats(const Archive*         self,
+                                         ArchiveMissCacheStats* stats);
+
+
+/**
+ Bounds the memory taken by the indexes of the opened pages, and keeps the
+ values read by lookups of full keys in a cache (see ArchiveCache) within
+ its budget. A value leaves the cache when its key is set or deleted, and
+ the cache is emptied when pages with existing keys are added.
+
+ @param self The archive.
+ @param budget The budget, or NULL for no cache.
+ */
+void            Archive_set_cache_budget(Archive*                   self,
+                                         const ArchiveCacheBudget*  budget);
+
+
+/**
+ Pins the index of a page, so Archive_trim_cache keeps it. The pin isn't
+ carried over by compaction: the pages written by a compaction aren't
+ pinned, whether the pages they replace were or not.
+
+ @param self The archive.
+ @param page The index of the page.
+ @param pinned Whether the page is pinned.
+ @return An error code. E_INDEX_OUT_OF_BOUNDS if there's no such page.
+ */
+Errors          Archive_pin_page(Archive*       self,
+                                 size_t         page,
+                                 bool           pinned);
+
+
+/**
+ Closes the indexes of the opened pages used the least, until they fit in
+ the budget of the cache, except the pinned pages and the last page. They're
+ opened again on next use. Lookups, scans (see Archive_lock_pages) and the
+ writer wait meanwhile, but a compaction must not be running (see
+ ArchiveCompactor, which trims the cache between compactions).
+
+ @param self The archive.
+ */
+void            Archive_trim_cache(Archive*     self);
+
+
+/**
+ Gets the metrics of the cache of the archive, all 0 if it has none.
+
+ @param self The archive.
+ @param stats A pointer in which the metrics are written.
+ */
+void            Archive_cache_stats(const Archive*      self,
+                                    ArchiveCacheStats*  stats);
+
+
+/**
+ Saves the keys of the hottest values of the cache to a file, with the
+ ranges of the page files they're read from, to warm the archive once
+ opened again (see Archive_warm_cache).
+
+ @param self The archive.
+ @param path The path of the file.
+ @param max_keys The maximum number of keys to save.
+ @return An error code.
+ */
+Errors          Archive_save_hot_keys(const Archive*    self,
+                                      const char*       path,
+                                      size_t            max_keys);
+
+
+/**
+ Prefetches the ranges saved by Archive_save_hot_keys in parallel, then
+ opens and pins the pages of the keys, and reads their values if the
+ archive has a value cache, which fills it. Keys not in the archive anymore
+ and files removed since are skipped. The pinned indexes are kept within
+ half the budget of the indexes (if it's bounded), the pages of the keys
+ that don't fit aren't pinned.
+
+ @param self The archive.
+ @param path The path of the file.
+ @return An error code. E_INVALID_HOT_KEYS if the file is corrupted,
+         E_CANCELLED if the prefetch was cancelled (see Archive_cancel), the
+         keys aren't read then.
+ */
+Errors          Archive_warm_cache(Archive*         self,
+                                   const char*      path);
+
+
+/**
+ Saves the hot keys of the archive to a file next to its pages, at most every
+ interval (see Archive_snapshot_hot_keys), and warms the archive from it as
+ the manifest is loaded (see Archive_warm_cache), so a restarted archive
+ doesn't wait for the disk for its hottest keys. It's set before loading the
+ manifest, along with the budget of the cache.
+
+ @param self The archive.
+ @param filename The name of the file, or NULL to stop using one.
+ @param max_keys The maximum number of keys to save.
+ @param interval_ms The minimum time between two saves.
+ */
+void            Archive_use_hot_keys(Archive*           self,
+                                     const char*        filename,
+                                     size_t             max_keys,
+                                     unsigned int       interval_ms);
+
+
+/**
+ Saves the hot keys to the file set by Archive_use_hot_keys, unless they
+ were saved less than its interval ago. Nothing is saved if the archive
+ doesn't use such a file or has no value cache, in which case no key is
+ known to be hot. It's called by the compactor between compactions (see
+ ArchiveCompactor).
+
+ @param self The archive.
+ @return An error code.
+ */
+Errors          Archive_snapshot_hot_keys(Archive*      self);
+
+
+/**
+ Sets whether compaction drops the pages it reads from the page cache once
+ it's done with them, so rewriting cold pages doesn't evict hot data.
+
+ @param self The archive.
+ @param drop_cache Whether the compacted pages leave the cache.
+ */
+void            Archive_set_compaction_drops_cache(Archive*     self,
+                                                   bool         drop_cache);
+
+
+/**
+ Keeps the IO of compaction under a budget: the throttle function is called
+ for each item copied, and can wait or stop the compaction.
+
+ @param self The archive.
+ @param throttle The throttle function, or NULL.
+ @param context The context given to the function.
+ */
+void            Archive_set_compaction_throttle(Archive*        self,
+                                                ArchiveThrottle throttle,
+                                                void*           context);
+
+
+/**
+ Sets the maximum number of threads of the long operations of the archive
+ (save, compaction, verification, bulk load), so they don't take more CPUs
+ than the application can spare. It's the number of CPUs by default.
+
+ @param self The archive.
+ @param max_threads The maximum number of threads, 0 for the number of CPUs.
+ */
+void            Archive_set_max_threads(Archive*        self,
+                                        size_t          max_threads);
+
+
+/**
+ Runs the long operations of the archive on the application's threads
+ rather than on threads created for them (see ArchiveDispatch).
+
+ @param self The archive.
+ @param dispatch The dispatch function, or NULL to create threads.
+ @param context The context given to the dispatch function.
+ */
+void            Archive_set_dispatch(Archive*           self,
+                                     ArchiveDispatch    dispatch,
+                                     void*              context);
+
+
+/**
+ Reports the progress of the long operations of the archive: pages saved,
+ compacted pages saved, pages checked, or pages built by a bulk load (by
+ rounds of as many pages as threads).
+
+ @param self The archive.
+ @param progress The progress callback, or NULL. It can cancel the
+                 operation by returning false.
+ @param context The context given to the callback.
+ */
+void            Archive_set_progress(Archive*           self,
+                                     ArchiveProgress    progress,
+                                     void*              context);
+
+
+/**
+ Cancels the running long operations of the archive, those of a compactor
+ included. They return E_CANCELLED once the tasks already started are done.
+ It does nothing if none is running, and can be called from any thread. To
+ cancel a single operation, its progress callback returns false.
+
+ @param self The archive.
+ */
+void            Archive_cancel(const Archive*           self);
+
+
+/**
+ Saves all pages of the archive to the file system, in parallel. In manifest
+ mode, the pages keep their file name and the manifest is written once
+ they're all saved.
 
  @param self The archive.
  @param result A pointer to the result of the save. The caller must
@@ -0,0 +1,342 @@
+//
+//  ArchiveCache.c
+//  ArchiveLib
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Checksum.h"
+#include "ArchiveCache.h"
+
+
+#pragma mark - ArchiveCache (Private)
+
+
+/**
+ Gets the bucket of a key.
+
+ @param self The cache.
+ @param key The key (20 bytes).
+ @return The bucket.
+ */
+static inline ArchiveCacheValue**   _ArchiveCache_bucket(const ArchiveCache*    self,
+                                                         const char*            key)
+{
+    return self->buckets + (Checksum_fnv1a(Checksum_fnv1a_init, key, 20) & (self->n_buckets - 1));
+}
+
+
+/**
+ Finds the value of a key.
+
+ @param self The cache.
+ @param key The key (20 bytes).
+ @return A pointer to the link to the value in its bucket, pointing to NULL
+         if it's not in the cache.
+ */
+static ArchiveCacheValue**  _ArchiveCache_find(const ArchiveCache*  self,
+                                               const char*          key)
+{
+    ArchiveCacheValue** link = _ArchiveCache_bucket(self, key);
+    while (*link != NULL && memcmp((*link)->key, key, 20) != 0) {
+        link = &((*link)->next);
+    }
+    return link;
+}
+
+
+/**
+ Swaps two values of the heap.
+
+ @param self The cache.
+ @param i The index of a value.
+ @param j The index of the other.
+ */
+static inline void      _ArchiveCache_swap(ArchiveCache*    self,
+                                           size_t           i,
+                                           size_t           j)
+{
+    ArchiveCacheValue* value = self->heap[i];
+    self->heap[i] = self->heap[j];
+    self->heap[j] = value;
+    self->heap[i]->heap_index = i;
+    self->heap[j]->heap_index = j;
+}
+
+
+/**
+ Moves a value of the heap to its place, after its priority changed.
+
+ @param self The cache.
+ @param i The index of the value.
+ */
+static void             _ArchiveCache_sift(ArchiveCache*    self,
+                                           size_t           i)
+{
+    size_t parent, child;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (self->heap[parent]->priority <= self->heap[i]->priority) {
+            break;
+        }
+        _ArchiveCache_swap(self, i, parent);
+        i = parent;
+    }
+    while ((child = 2 * i + 1) < self->n_values) {
+        if (child + 1 < self->n_values && self->heap[child + 1]->priority < self->heap[child]->priority) {
+            child++;
+        }
+        if (self->heap[i]->priority <= self->heap[child]->priority) {
+            break;
+        }
+        _ArchiveCache_swap(self, i, child);
+        i = child;
+    }
+}
+
+
+/**
+ Removes a value from its bucket and the heap, and frees it.
+
+ @param self The cache.
+ @param link The link to the value in its bucket.
+ */
+static void             _ArchiveCache_unlink(ArchiveCache*          self,
+                                             ArchiveCacheValue**    link)
+{
+    ArchiveCacheValue* value = *link;
+    *link = value->next;
+    size_t i = value->heap_index;
+    self->n_values--;
+    if (i < self->n_values) {
+        self->heap[i] = self->heap[self->n_values];
+        self->heap[i]->heap_index = i;
+        _ArchiveCache_sift(self, i);
+    }
+    self->value_bytes -= value->size;
+    free(value->data);
+    free(value);
+}
+
+
+/**
+ Doubles the number of buckets.
+
+ @param self The cache.
+ */
+static void             _ArchiveCache_grow(ArchiveCache*    self)
+{
+    ArchiveCacheValue** buckets = self->buckets;
+    size_t n_buckets = self->n_buckets;
+    self->n_buckets *= 2;
+    self->buckets = (ArchiveCacheValue**)calloc(self->n_buckets, sizeof(ArchiveCacheValue*));
+    ArchiveCacheValue* value;
+    ArchiveCacheValue** bucket;
+    size_t i;
+    for (i = 0; i < n_buckets; i++) {
+        while ((value = buckets[i]) != NULL) {
+            buckets[i] = value->next;
+            bucket = _ArchiveCache_bucket(self, value->key);
+            value->next = *bucket;
+            *bucket = value;
+        }
+    }
+    free(buckets);
+}
+
+
+/**
+ Compares values by decreasing priority.
+ */
+static int              _ArchiveCache_compare(const void*   a,
+                                              const void*   b)
+{
+    __uint64_t priority_a = (*(ArchiveCacheValue* const*)a)->priority;
+    __uint64_t priority_b = (*(ArchiveCacheValue* const*)b)->priority;
+    return priority_a < priority_b ? 1 : (priority_a > priority_b ? -1 : 0);
+}
+
+
+#pragma mark - ArchiveCache
+
+
+void        ArchiveCache_init(ArchiveCache*             self,
+                              const ArchiveCacheBudget* budget)
+{
+    self->budget = *budget;
+    self->n_buckets = 64;
+    self->buckets = (ArchiveCacheValue**)calloc(self->n_buckets, sizeof(ArchiveCacheValue*));
+    self->heap = NULL;
+    self->n_values = 0;
+    self->heap_capacity = 0;
+    self->value_bytes = 0;
+    self->clock = 0;
+    self->generation = 0;
+    memset(&self->stats, 0, sizeof(ArchiveCacheStats));
+    pthread_mutex_init(&self->lock, NULL);
+}
+
+
+void        ArchiveCache_free(ArchiveCache*             self)
+{
+    ArchiveCache_clear(self);
+    free(self->buckets);
+    free(self->heap);
+    self->buckets = NULL;
+    self->heap = NULL;
+    self->n_buckets = 0;
+    self->heap_capacity = 0;
+    pthread_mutex_destroy(&self->lock);
+}
+
+
+void        ArchiveCache_age(ArchiveCache*              self,
+                             __uint64_t                 priority)
+{
+    pthread_mutex_lock(&self->lock);
+    if (priority > self->clock) {
+        __atomic_store_n(&self->clock, priority, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+bool        ArchiveCache_get(ArchiveCache*              self,
+                             const char*                key,
+                             size_t                     data_max_size,
+                             char**                     _data,
+                             size_t*                    _data_size)
+{
+    pthread_mutex_lock(&self->lock);
+    ArchiveCacheValue* value = *_ArchiveCache_find(self, key);
+    if (value == NULL) {
+        self->stats.n_value_misses++;
+        pthread_mutex_unlock(&self->lock);
+        return false;
+    }
+    self->stats.n_value_hits++;
+    value->priority = ArchiveCache_priority(self, value->cost);
+    _ArchiveCache_sift(self, value->heap_index);
+
+    // the size is the value's, like for reads from the pages
+    size_t size = data_max_size > 0 && data_max_size < value->size ? data_max_size : value->size;
+    *_data = (char*)malloc(size > 0 ? size : 1);
+    memcpy(*_data, value->data, size);
+    *_data_size = value->size;
+    pthread_mutex_unlock(&self->lock);
+    return true;
+}
+
+
+void        ArchiveCache_add(ArchiveCache*              self,
+                             const char*                key,
+                             const char*                data,
+                             size_t                     size,
+                             __uint64_t                 ns,
+                             __uint64_t                 generation)
+{
+    if (size > self->budget.values) {
+        return;
+    }
+    pthread_mutex_lock(&self->lock);
+    ArchiveCacheValue** link = _ArchiveCache_find(self, key);
+    if (*link != NULL || generation != self->generation) {
+        pthread_mutex_unlock(&self->lock);
+        return;
+    }
+
+    // make room, the clock moving to the evicted priorities
+    while (self->value_bytes + size > self->budget.values) {
+        __atomic_store_n(&self->clock, self->heap[0]->priority, __ATOMIC_RELAXED);
+        _ArchiveCache_unlink(self, _ArchiveCache_find(self, self->heap[0]->key));
+        self->stats.n_value_evictions++;
+    }
+
+    ArchiveCacheValue* value = (ArchiveCacheValue*)malloc(sizeof(ArchiveCacheValue));
+    memcpy(value->key, key, 20);
+    value->data = (char*)malloc(size > 0 ? size : 1);
+    memcpy(value->data, data, size);
+    value->size = size;
+    value->cost = ArchiveCache_cost(ns, size);
+    value->priority = ArchiveCache_priority(self, value->cost);
+    if (self->n_values >= self->heap_capacity) {
+        self->heap_capacity = self->heap_capacity > 0 ? self->heap_capacity * 2 : 64;
+        self->heap = (ArchiveCacheValue**)realloc(self->heap, sizeof(ArchiveCacheValue*) * self->heap_capacity);
+    }
+    value->heap_index = self->n_values;
+    self->heap[self->n_values++] = value;
+    _ArchiveCache_sift(self, value->heap_index);
+    if (self->n_values > self->n_buckets) {
+        _ArchiveCache_grow(self);
+    }
+    link = _ArchiveCache_bucket(self, key);
+    value->next = *link;
+    *link = value;
+    self->value_bytes += size;
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+void        ArchiveCache_remove(ArchiveCache*           self,
+                                const char*             key)
+{
+    pthread_mutex_lock(&self->lock);
+    __atomic_store_n(&self->generation, self->generation + 1, __ATOMIC_RELEASE);
+    ArchiveCacheValue** link = _ArchiveCache_find(self, key);
+    if (*link != NULL) {
+        _ArchiveCache_unlink(self, link);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+void        ArchiveCache_clear(ArchiveCache*            self)
+{
+    pthread_mutex_lock(&self->lock);
+    __atomic_store_n(&self->generation, self->generation + 1, __ATOMIC_RELEASE);
+    while (self->n_values > 0) {
+        _ArchiveCache_unlink(self, _ArchiveCache_find(self, self->heap[self->n_values - 1]->key));
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+size_t      ArchiveCache_hot_keys(ArchiveCache*         self,
+                                  char*                 keys,
+                                  size_t                max_keys)
+{
+    pthread_mutex_lock(&self->lock);
+    ArchiveCacheValue** values = (ArchiveCacheValue**)malloc(sizeof(ArchiveCacheValue*) * (self->n_values + 1));
+    memcpy(values, self->heap, sizeof(ArchiveCacheValue*) * self->n_values);
+    qsort(values, self->n_values, sizeof(ArchiveCacheValue*), _ArchiveCache_compare);
+    size_t n_keys = self->n_values < max_keys ? self->n_values : max_keys;
+    size_t i;
+    for (i = 0; i < n_keys; i++) {
+        memcpy(keys + 20 * i, values[i]->key, 20);
+    }
+    free(values);
+    pthread_mutex_unlock(&self->lock);
+    return n_keys;
+}
+
+
+void        ArchiveCache_stats(ArchiveCache*            self,
+                               ArchiveCacheStats*       stats)
+{
+    pthread_mutex_lock(&self->lock);
+    stats->value_bytes          = self->value_bytes;
+    stats->n_values             = self->n_values;
+    stats->n_value_hits         = self->stats.n_value_hits;
+    stats->n_value_misses       = self->stats.n_value_misses;
+    stats->n_value_evictions    = self->stats.n_value_evictions;
+    pthread_mutex_unlock(&self->lock);
+
+    // the archive counts the indexes on its own
+    stats->index_bytes          = __atomic_load_n(&self->stats.index_bytes, __ATOMIC_RELAXED);
+    stats->n_indexes            = __atomic_load_n(&self->stats.n_indexes, __ATOMIC_RELAXED);
+    stats->n_pinned_indexes     = __atomic_load_n(&self->stats.n_pinned_indexes, __ATOMIC_RELAXED);
+    stats->n_index_loads        = __atomic_load_n(&self->stats.n_index_loads, __ATOMIC_RELAXED);
+    stats->n_index_evictions    = __atomic_load_n(&self->stats.n_index_evictions, __ATOMIC_RELAXED);
+    stats->filter_bytes         = 0;
+}
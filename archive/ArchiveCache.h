@@ -0,0 +1,250 @@
+#ifndef ARCHIVECACHE_H
+#define ARCHIVECACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+
+#pragma mark - ArchiveCacheBudget
+
+
+/**
+ * The memory an archive can spend on the indexes of the pages it opens, and
+ * on the values it keeps, in bytes. 0 for indexes means no limit, and for
+ * values means no value cache.
+ */
+typedef struct ArchiveCacheBudget
+{
+    size_t                      indexes;
+    size_t                      values;
+} ArchiveCacheBudget;
+
+
+#pragma mark - ArchiveCacheStats
+
+
+/**
+ * Metrics of a cache. The bytes of the indexes are counted when they're
+ * trimmed (see Archive_trim_cache) and as pages are opened. The filters of
+ * the pages (their fences, see ArchivePage) are always kept, so they're only
+ * counted.
+ */
+typedef struct ArchiveCacheStats
+{
+    size_t                      index_bytes;
+    size_t                      n_indexes;
+    size_t                      n_pinned_indexes;
+    size_t                      n_index_loads;
+    size_t                      n_index_evictions;
+    size_t                      filter_bytes;
+    size_t                      value_bytes;
+    size_t                      n_values;
+    size_t                      n_value_hits;
+    size_t                      n_value_misses;
+    size_t                      n_value_evictions;
+} ArchiveCacheStats;
+
+
+#pragma mark - ArchiveCache
+
+
+/**
+ * A value in the cache, in the chain of its bucket and in the eviction
+ * heap.
+ */
+typedef struct ArchiveCacheValue
+{
+    char                        key[20];
+    char*                       data;
+    size_t                      size;
+    __uint64_t                  cost;
+    __uint64_t                  priority;
+    size_t                      heap_index;
+    struct ArchiveCacheValue*   next;
+} ArchiveCacheValue;
+
+
+/**
+ * Bounds the memory of the page indexes and values of an archive.
+ *
+ * Eviction is cost-aware (GreedyDual-Size): an entry's cost is the time it
+ * took to load, per KB, and its priority is the cost added to the cache's
+ * `clock` when it was last used. The entry of lowest priority is evicted
+ * first, and the clock moves to its priority, so entries not used since age
+ * out whatever their cost. Large entries quick to reload go first, small
+ * ones slow to reload stay.
+ *
+ * Values are kept here, under `lock`. Page indexes stay in their pages,
+ * which keep their own priority (see Archive_trim_cache), on the same clock.
+ *
+ * A value is only added if no key was removed since the lookup that read it
+ * began (see ArchiveCache_generation), so a value set meanwhile isn't
+ * shadowed by the one read before.
+ */
+typedef struct ArchiveCache
+{
+    ArchiveCacheBudget          budget;
+    ArchiveCacheValue**         buckets;
+    size_t                      n_buckets;
+    ArchiveCacheValue**         heap;
+    size_t                      n_values;
+    size_t                      heap_capacity;
+    size_t                      value_bytes;
+    __uint64_t                  clock;
+    __uint64_t                  generation;
+    ArchiveCacheStats           stats;
+    pthread_mutex_t             lock;
+} ArchiveCache;
+
+
+/**
+ Initializes an empty cache.
+
+ @param self The cache.
+ @param budget The budget of the cache.
+ */
+void        ArchiveCache_init(ArchiveCache*             self,
+                              const ArchiveCacheBudget* budget);
+
+
+/**
+ Frees the cache's internal structure.
+
+ @param self The cache.
+ */
+void        ArchiveCache_free(ArchiveCache*             self);
+
+
+/**
+ Computes the priority of an entry used now.
+
+ @param self The cache.
+ @param cost The cost of the entry, in ns per KB.
+ @return The priority.
+ */
+static inline __uint64_t    ArchiveCache_priority(const ArchiveCache*   self,
+                                                  __uint64_t            cost)
+{
+    return __atomic_load_n(&self->clock, __ATOMIC_RELAXED) + cost;
+}
+
+
+/**
+ Computes the cost of an entry from its load time.
+
+ @param ns The time it took to load, in ns.
+ @param size The size of the entry.
+ @return The cost, in ns per KB.
+ */
+static inline __uint64_t    ArchiveCache_cost(__uint64_t    ns,
+                                              size_t        size)
+{
+    return ns * 1024 / (size > 0 ? size : 1);
+}
+
+
+/**
+ Moves the clock of the cache to the priority of an evicted page index.
+
+ @param self The cache.
+ @param priority The priority of the page.
+ */
+void        ArchiveCache_age(ArchiveCache*              self,
+                             __uint64_t                 priority);
+
+
+/**
+ Gets the generation of the cache, taken by a lookup before it begins, to
+ add the value it reads with.
+
+ @param self The cache.
+ @return The generation.
+ */
+static inline __uint64_t    ArchiveCache_generation(const ArchiveCache* self)
+{
+    return __atomic_load_n(&self->generation, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ Gets a copy of a value.
+
+ @param self The cache.
+ @param key The key (20 bytes).
+ @param data_max_size The maximum size to copy, or 0 for the whole value.
+ @param _data A pointer in which the copy is returned, which should be
+              free'ed by the caller.
+ @param _data_size A pointer in which the size of the value is returned.
+ @return true if the value is in the cache.
+ */
+bool        ArchiveCache_get(ArchiveCache*              self,
+                             const char*                key,
+                             size_t                     data_max_size,
+                             char**                     _data,
+                             size_t*                    _data_size);
+
+
+/**
+ Adds a copy of a value read by a lookup, evicting others to make room.
+ Values larger than the budget aren't added.
+
+ @param self The cache.
+ @param key The key (20 bytes).
+ @param data The value.
+ @param size The size of the value.
+ @param ns The time it took to read, in ns.
+ @param generation The generation of the cache when the lookup began.
+ */
+void        ArchiveCache_add(ArchiveCache*              self,
+                             const char*                key,
+                             const char*                data,
+                             size_t                     size,
+                             __uint64_t                 ns,
+                             __uint64_t                 generation);
+
+
+/**
+ Removes the value of a key, once it's set or deleted.
+
+ @param self The cache.
+ @param key The key (20 bytes).
+ */
+void        ArchiveCache_remove(ArchiveCache*           self,
+                                const char*             key);
+
+
+/**
+ Removes all the values, once pages with existing keys are added.
+
+ @param self The cache.
+ */
+void        ArchiveCache_clear(ArchiveCache*            self);
+
+
+/**
+ Lists the keys of the values of highest priority.
+
+ @param self The cache.
+ @param keys The keys (20 bytes each).
+ @param max_keys The maximum number of keys.
+ @return The number of keys.
+ */
+size_t      ArchiveCache_hot_keys(ArchiveCache*         self,
+                                  char*                 keys,
+                                  size_t                max_keys);
+
+
+/**
+ Gets the metrics of the cache, those of the indexes as counted by the
+ archive.
+
+ @param self The cache.
+ @param stats A pointer in which the metrics are written.
+ */
+void        ArchiveCache_stats(ArchiveCache*            self,
+                               ArchiveCacheStats*       stats);
+
+
+#endif /* ARCHIVECACHE_H */
@@ -0,0 +1,562 @@
+//
+//  ArchiveCompactor.c
+//  ArchiveLib
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ArchiveCompactor.h"
+
+
+// the number of pages whose dead bytes are computed each time the next
+// compaction is planned, as it reads their whole index
+#define ArchiveCompactorPagesPerPlan    8
+
+// the shortest wait between checks, so an idle compactor doesn't spin
+#define ArchiveCompactorMinIntervalMs   10
+
+
+#pragma mark - ArchiveCompactionPolicy
+
+
+void        ArchiveCompactionPolicy_init(ArchiveCompactionPolicy*   self)
+{
+    self->strategy = ArchiveCompactionSizeTiered;
+    self->max_pages = 64;
+    self->min_merge_pages = 2;
+    self->max_merge_pages = 16;
+    self->max_dead_ratio = 0.5;
+    self->level0_pages = 4;
+    self->level_ratio = 10;
+}
+
+
+#pragma mark - ArchiveCompactor (Private)
+
+
+/**
+ Gets the number of items and the data size of a page, from its manifest
+ entry if it isn't opened.
+
+ @param page The page.
+ @param _n_items A pointer in which the number of items is written.
+ @param _data_size A pointer in which the data size is written.
+ */
+static inline void  _ArchiveCompactor_page_size(const ArchivePage*  page,
+                                                size_t*             _n_items,
+                                                size_t*             _data_size)
+{
+    const ArchiveManifestPage* entry = __atomic_load_n(&page->unopened, __ATOMIC_ACQUIRE);
+    if (entry != NULL) {
+        *_n_items = entry->n_items;
+        *_data_size = entry->data_size;
+    } else {
+        *_n_items = page->index->n_items;
+        *_data_size = page->data_size + page->blob_size;
+    }
+}
+
+
+/**
+ Computes the dead bytes of the next pages, in turn, and tracks the pages
+ added to the archive since the last time.
+
+ @param self The compactor.
+ @param n_pages The number of pages that can be compacted.
+ @return An error code.
+ */
+static Errors       _ArchiveCompactor_refresh(ArchiveCompactor* self,
+                                              size_t            n_pages)
+{
+    if (n_pages != self->n_pages) {
+        self->pages = (ArchiveCompactorPage*)realloc(self->pages, sizeof(ArchiveCompactorPage) * (n_pages + 1));
+        if (n_pages > self->n_pages) {
+            memset(self->pages + self->n_pages, 0, sizeof(ArchiveCompactorPage) * (n_pages - self->n_pages));
+        }
+        self->n_pages = n_pages;
+    }
+
+    ArchivePageStats page_stats;
+    size_t page;
+    size_t i;
+    for (i = 0; i < ArchiveCompactorPagesPerPlan && i < n_pages; i++) {
+        page = self->next_page++ % n_pages;
+        Errors error = Archive_page_stats(self->archive, page, &page_stats);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+        self->pages[page].known = true;
+        self->pages[page].data_size = page_stats.live_size + page_stats.dead_size;
+        self->pages[page].dead_size = page_stats.dead_size;
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Finds the run of consecutive pages whose items fit in the fewest pages,
+ when there are too many pages.
+
+ @param self The compactor.
+ @param n_pages The number of pages that can be compacted.
+ @param _first_page A pointer in which the first page of the run is written.
+ @param _n_pages A pointer in which the number of pages of the run is written.
+ @return false if no run would reduce the number of pages.
+ */
+static bool         _ArchiveCompactor_plan_size_tiered(ArchiveCompactor*    self,
+                                                       size_t               n_pages,
+                                                       size_t*              _first_page,
+                                                       size_t*              _n_pages)
+{
+    const ArchivePage* pages = __atomic_load_n(&self->archive->pages, __ATOMIC_ACQUIRE);
+    size_t* n_items = (size_t*)malloc(sizeof(size_t) * (n_pages + 1));
+    size_t data_size;
+    size_t i, length;
+    for (i = 0; i < n_pages; i++) {
+        _ArchiveCompactor_page_size(pages + i, n_items + i, &data_size);
+    }
+
+    // the most pages saved, the shortest run to get there, the oldest run
+    size_t best_gain = 0;
+    size_t total, needed, gain;
+    for (length = self->policy.min_merge_pages; length <= self->policy.max_merge_pages && length <= n_pages; length++) {
+        total = 0;
+        for (i = 0; i < n_pages; i++) {
+            total += n_items[i];
+            if (i >= length) {
+                total -= n_items[i - length];
+            }
+            if (i + 1 < length) {
+                continue;
+            }
+            // compaction writes at least one page
+            needed = (total + MAX_ITEMS_PER_INDEX - 1) / MAX_ITEMS_PER_INDEX;
+            gain = length - (needed > 0 ? needed : 1);
+            if (gain > best_gain) {
+                best_gain = gain;
+                *_first_page = i + 1 - length;
+                *_n_pages = length;
+            }
+        }
+    }
+    free(n_items);
+    return best_gain > 0;
+}
+
+
+/**
+ Gets the number of pages a level can have before it's merged down.
+
+ @param self The compactor.
+ @param level The level.
+ @return The number of pages.
+ */
+static inline size_t _ArchiveCompactor_level_size(const ArchiveCompactor*   self,
+                                                  size_t                    level)
+{
+    size_t size = self->policy.level0_pages;
+    size_t i;
+    for (i = 1; i < level; i++) {
+        size *= self->policy.level_ratio;
+    }
+    return size;
+}
+
+
+/**
+ Counts the pages of each level, among the pages that can be compacted.
+
+ @param self The compactor.
+ @param n_pages The number of pages that can be compacted.
+ @param _n_levels A pointer in which the number of levels is written.
+ @return The number of pages of each level, which should be free'ed by the
+         caller.
+ */
+static size_t*      _ArchiveCompactor_count_levels(ArchiveCompactor*    self,
+                                                   size_t               n_pages,
+                                                   size_t*              _n_levels)
+{
+    const ArchivePage* pages = __atomic_load_n(&self->archive->pages, __ATOMIC_ACQUIRE);
+    size_t n_levels = 1;
+    size_t i;
+    for (i = 0; i < n_pages; i++) {
+        if (pages[i].level + 1 > n_levels) {
+            n_levels = pages[i].level + 1;
+        }
+    }
+    size_t* counts = (size_t*)calloc(n_levels, sizeof(size_t));
+    for (i = 0; i < n_pages; i++) {
+        counts[pages[i].level]++;
+    }
+    *_n_levels = n_levels;
+    return counts;
+}
+
+
+/**
+ Counts the pages of a level that overlap a key range, by binary search in
+ the level's pages.
+
+ @param pages The pages of the level, in key order.
+ @param n_pages The number of pages of the level.
+ @param min_key The smallest key of the range.
+ @param max_key The largest key of the range.
+ @return The number of pages.
+ */
+static size_t       _ArchiveCompactor_overlap(const ArchivePage*    pages,
+                                              size_t                n_pages,
+                                              const char*           min_key,
+                                              const char*           max_key)
+{
+    size_t low = 0, high = n_pages, middle, first;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (memcmp(pages[middle].max_key, min_key, 20) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    first = low;
+    high = n_pages;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (memcmp(pages[middle].min_key, max_key, 20) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low - first;
+}
+
+
+/**
+ Finds the pages to merge down to the next level: the oldest pages of level
+ 0, or the page of the first level over its size overlapping the fewest
+ pages of the next level.
+
+ @param self The compactor.
+ @param n_pages The number of pages that can be compacted.
+ @param _first_page A pointer in which the first page to merge is written.
+ @param _n_pages A pointer in which the number of pages to merge is written.
+ @return false if no level is over its size.
+ */
+static bool         _ArchiveCompactor_plan_leveled(ArchiveCompactor*   self,
+                                                   size_t              n_pages,
+                                                   size_t*             _first_page,
+                                                   size_t*             _n_pages)
+{
+    const ArchivePage* pages = __atomic_load_n(&self->archive->pages, __ATOMIC_ACQUIRE);
+    size_t n_levels;
+    size_t* counts = _ArchiveCompactor_count_levels(self, n_pages, &n_levels);
+    bool found = false;
+
+    // the pages of level 0 follow the others
+    if (counts[0] > _ArchiveCompactor_level_size(self, 0)) {
+        *_first_page = n_pages - counts[0];
+        *_n_pages = counts[0] < self->policy.max_merge_pages ? counts[0] : self->policy.max_merge_pages;
+        found = true;
+    }
+
+    // the levels are sorted runs, deeper ones first
+    size_t level, first, next_first, best, overlap, i;
+    for (level = 1; !found && level < n_levels; level++) {
+        if (counts[level] <= _ArchiveCompactor_level_size(self, level)) {
+            continue;
+        }
+        for (first = 0; first < n_pages && pages[first].level != level; first++);
+        for (next_first = 0; next_first < n_pages && pages[next_first].level != level + 1; next_first++);
+        best = (size_t)-1;
+        for (i = first; i < first + counts[level]; i++) {
+            overlap = level + 1 < n_levels ?
+                _ArchiveCompactor_overlap(pages + next_first, counts[level + 1], pages[i].min_key, pages[i].max_key) : 0;
+            if (overlap < best) {
+                best = overlap;
+                *_first_page = i;
+                *_n_pages = 1;
+            }
+        }
+        found = true;
+    }
+    free(counts);
+    return found;
+}
+
+
+/**
+ Pays for the bytes copied by compaction from the token bucket, waiting for
+ the bucket to refill if it's empty.
+
+ @param context The compactor.
+ @param n_bytes The number of bytes copied.
+ @return E_CANCELLED if the compactor is stopping, or E_SUCCESS.
+ */
+static Errors       _ArchiveCompactor_throttle(void*    context,
+                                               size_t   n_bytes)
+{
+    ArchiveCompactor* self = (ArchiveCompactor*)context;
+    pthread_mutex_lock(&self->lock);
+    self->stats.n_bytes_compacted += n_bytes;
+    Errors error = self->stopping ? E_CANCELLED : E_SUCCESS;
+    if (self->io_rate == 0 || error != E_SUCCESS) {
+        pthread_mutex_unlock(&self->lock);
+        return error;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double)(now.tv_sec - self->refilled_at.tv_sec) +
+                     (double)(now.tv_nsec - self->refilled_at.tv_nsec) / 1e9;
+    self->refilled_at = now;
+    self->tokens += elapsed * (double)self->io_rate;
+    if (self->tokens > (double)self->io_rate) {
+        self->tokens = (double)self->io_rate;
+    }
+    self->tokens -= (double)n_bytes;
+
+    // wait for the bucket to be refilled, unless stopped meanwhile
+    if (self->tokens < 0) {
+        double wait = -self->tokens / (double)self->io_rate;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)wait;
+        deadline.tv_nsec += (long)((wait - (double)(time_t)wait) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!self->stopping &&
+               pthread_cond_timedwait(&self->wake, &self->lock, &deadline) != ETIMEDOUT) {
+        }
+        self->throttled += wait;
+        if (self->stopping) {
+            error = E_CANCELLED;
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+    return error;
+}
+
+
+/**
+ Compacts in the background until stopped, waiting between checks when
+ there's nothing to compact.
+
+ @param arg The compactor.
+ @return NULL.
+ */
+static void*        _ArchiveCompactor_thread(void*      arg)
+{
+    ArchiveCompactor* self = (ArchiveCompactor*)arg;
+    Errors error;
+    struct timespec deadline;
+    pthread_mutex_lock(&self->lock);
+    while (!self->stopping) {
+        pthread_mutex_unlock(&self->lock);
+        error = ArchiveCompactor_run(self);
+
+        // nothing left to compact, the indexes can be closed without a
+        // compaction reading them
+        if (error != E_SUCCESS) {
+            Archive_trim_cache(self->archive);
+            Archive_snapshot_hot_keys(self->archive);
+        }
+        pthread_mutex_lock(&self->lock);
+        if (error == E_SUCCESS) {
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += self->interval_ms / 1000;
+        deadline.tv_nsec += (long)(self->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!self->stopping) {
+            pthread_cond_timedwait(&self->wake, &self->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+
+#pragma mark - ArchiveCompactor (Public API)
+
+
+void        ArchiveCompactor_init(ArchiveCompactor*                 self,
+                                  Archive*                          archive,
+                                  const ArchiveCompactionPolicy*    policy,
+                                  size_t                            io_rate)
+{
+    self->archive = archive;
+    if (policy != NULL) {
+        self->policy = *policy;
+    } else {
+        ArchiveCompactionPolicy_init(&self->policy);
+    }
+    self->io_rate = io_rate;
+    self->tokens = (double)io_rate;
+    clock_gettime(CLOCK_MONOTONIC, &self->refilled_at);
+    self->pages = NULL;
+    self->n_pages = 0;
+    self->next_page = 0;
+    memset(&self->stats, 0, sizeof(ArchiveCompactionStats));
+    self->throttled = 0;
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wake, NULL);
+    self->interval_ms = 0;
+    self->running = false;
+    self->stopping = false;
+    Archive_set_compaction_throttle(archive, _ArchiveCompactor_throttle, self);
+}
+
+
+void        ArchiveCompactor_free(ArchiveCompactor*     self)
+{
+    ArchiveCompactor_stop(self);
+    Archive_set_compaction_throttle(self->archive, NULL, NULL);
+    free(self->pages);
+    self->pages = NULL;
+    self->n_pages = 0;
+    pthread_cond_destroy(&self->wake);
+    pthread_mutex_destroy(&self->lock);
+}
+
+
+Errors      ArchiveCompactor_start(ArchiveCompactor*    self,
+                                   unsigned int         interval_ms)
+{
+    if (self->running) {
+        return E_SUCCESS;
+    }
+    self->interval_ms = interval_ms > ArchiveCompactorMinIntervalMs ? interval_ms : ArchiveCompactorMinIntervalMs;
+    self->stopping = false;
+    if (pthread_create(&self->thread, NULL, _ArchiveCompactor_thread, self) != 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    self->running = true;
+    return E_SUCCESS;
+}
+
+
+void        ArchiveCompactor_stop(ArchiveCompactor*     self)
+{
+    if (!self->running) {
+        return;
+    }
+    pthread_mutex_lock(&self->lock);
+    self->stopping = true;
+    pthread_cond_broadcast(&self->wake);
+    pthread_mutex_unlock(&self->lock);
+    pthread_join(self->thread, NULL);
+    self->running = false;
+    self->stopping = false;
+}
+
+
+Errors      ArchiveCompactor_plan(ArchiveCompactor*     self,
+                                  size_t*               _first_page,
+                                  size_t*               _n_pages)
+{
+    // the last page is being written to
+    size_t n_pages = __atomic_load_n(&self->archive->n_pages, __ATOMIC_ACQUIRE);
+    size_t n_sealed = n_pages > 0 ? n_pages - 1 : 0;
+    Errors error = _ArchiveCompactor_refresh(self, n_sealed);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    bool leveled = self->policy.strategy == ArchiveCompactionLeveled;
+    const ArchivePage* pages = __atomic_load_n(&self->archive->pages, __ATOMIC_ACQUIRE);
+    size_t debt_bytes = 0;
+    size_t debt_pages = n_pages > self->policy.max_pages ? n_pages - self->policy.max_pages : 0;
+    size_t i;
+    for (i = 0; i < n_sealed; i++) {
+        debt_bytes += self->pages[i].known ? self->pages[i].dead_size : 0;
+    }
+    if (leveled) {
+        size_t n_levels;
+        size_t* counts = _ArchiveCompactor_count_levels(self, n_sealed, &n_levels);
+        debt_pages = 0;
+        for (i = 0; i < n_levels; i++) {
+            if (counts[i] > _ArchiveCompactor_level_size(self, i)) {
+                debt_pages += counts[i] - _ArchiveCompactor_level_size(self, i);
+            }
+        }
+        free(counts);
+    }
+    pthread_mutex_lock(&self->lock);
+    self->stats.n_pages = n_pages;
+    self->stats.debt_pages = debt_pages;
+    self->stats.debt_bytes = debt_bytes;
+    pthread_mutex_unlock(&self->lock);
+
+    // pages mostly dead first, as they hold disk space (rewritten alone, or
+    // merged down if they're in a level, pages of level 0 being merged soon)
+    for (i = 0; i < n_sealed; i++) {
+        if (self->pages[i].known && self->pages[i].dead_size > 0 &&
+            (double)self->pages[i].dead_size > self->policy.max_dead_ratio * (double)self->pages[i].data_size &&
+            (!leveled || pages[i].level > 0)) {
+            *_first_page = i;
+            *_n_pages = 1;
+            return E_SUCCESS;
+        }
+    }
+
+    // then too many pages to look keys up in
+    if (leveled ? _ArchiveCompactor_plan_leveled(self, n_sealed, _first_page, _n_pages) :
+        n_pages > self->policy.max_pages &&
+        _ArchiveCompactor_plan_size_tiered(self, n_sealed, _first_page, _n_pages)) {
+        return E_SUCCESS;
+    }
+    return E_NOT_FOUND;
+}
+
+
+Errors      ArchiveCompactor_run(ArchiveCompactor*      self)
+{
+    size_t first_page, n_pages;
+    Errors error = ArchiveCompactor_plan(self, &first_page, &n_pages);
+    if (error != E_SUCCESS) {
+        pthread_mutex_lock(&self->lock);
+        self->stats.last_error = error == E_NOT_FOUND ? E_SUCCESS : error;
+        pthread_mutex_unlock(&self->lock);
+        return error;
+    }
+    error = self->policy.strategy == ArchiveCompactionLeveled ?
+        Archive_compact_level(self->archive, first_page, n_pages) :
+        Archive_compact(self->archive, first_page, n_pages);
+
+    // the pages moved, what's known about them has to be computed again
+    if (error == E_SUCCESS) {
+        free(self->pages);
+        self->pages = NULL;
+        self->n_pages = 0;
+        self->next_page = 0;
+    }
+    pthread_mutex_lock(&self->lock);
+    self->stats.last_error = error;
+    if (error == E_SUCCESS) {
+        self->stats.n_compactions++;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return error;
+}
+
+
+void        ArchiveCompactor_stats(ArchiveCompactor*        self,
+                                   ArchiveCompactionStats*  stats)
+{
+    pthread_mutex_lock(&self->lock);
+    *stats = self->stats;
+    // (waits are often much shorter than a millisecond)
+    stats->throttled_ms = (size_t)(self->throttled * 1000);
+    pthread_mutex_unlock(&self->lock);
+    stats->n_bytes_set = __atomic_load_n(&self->archive->n_bytes_set, __ATOMIC_RELAXED);
+    stats->write_amplification = stats->n_bytes_set > 0 ?
+        (double)(stats->n_bytes_set + stats->n_bytes_compacted) / (double)stats->n_bytes_set : 0;
+}
@@ -0,0 +1,219 @@
+#ifndef ARCHIVECOMPACTOR_H
+#define ARCHIVECOMPACTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "Errors.h"
+#include "Archive.h"
+
+
+#pragma mark - ArchiveCompactionPolicy
+
+
+/**
+ * How the pages to merge are picked.
+ *
+ * - ArchiveCompactionSizeTiered: the run of consecutive pages whose items
+ *   fit in the fewest pages, so small pages (from frequent saves, or with
+ *   many deleted items) are merged into full ones.
+ * - ArchiveCompactionLeveled: pages are merged down into levels (see
+ *   Archive_compact_level), the oldest pages of level 0 first, then the page
+ *   of the first level over its size overlapping the fewest pages of the
+ *   next one. A lookup probes the pages of level 0 and one page per level.
+ */
+typedef enum ArchiveCompactionStrategy
+{
+    ArchiveCompactionSizeTiered     = 0,
+    ArchiveCompactionLeveled        = 1,
+} ArchiveCompactionStrategy;
+
+
+/**
+ * When and what the compactor merges. Pages are merged while the archive
+ * has more than `max_pages` pages (the number of pages a missing key is
+ * looked up in), by runs of `min_merge_pages` to `max_merge_pages` pages.
+ * A page with more than `max_dead_ratio` of its data shadowed or deleted is
+ * rewritten regardless.
+ *
+ * Leveled, level 0 is merged down once it has more than `level0_pages`
+ * sealed pages (up to `max_merge_pages` at once), level 1 once it has more
+ * than `level0_pages` pages too, and each level after it once it has more
+ * than `level_ratio` times the pages of the previous one. Pages with too
+ * much dead data are merged down regardless, and `max_pages` isn't used.
+ */
+typedef struct ArchiveCompactionPolicy
+{
+    ArchiveCompactionStrategy   strategy;
+    size_t                      max_pages;
+    size_t                      min_merge_pages;
+    size_t                      max_merge_pages;
+    double                      max_dead_ratio;
+    size_t                      level0_pages;
+    size_t                      level_ratio;
+} ArchiveCompactionPolicy;
+
+
+/**
+ Initializes a policy with the default values: size-tiered, 64 pages at
+ most, merged by 2 to 16, and pages rewritten past half dead data. Leveled,
+ 4 pages in level 0 and 1, and 10 times more in each level after.
+
+ @param self The policy.
+ */
+void            ArchiveCompactionPolicy_init(ArchiveCompactionPolicy*   self);
+
+
+#pragma mark - ArchiveCompactionStats
+
+
+/**
+ * Metrics of a compactor. Write amplification is the number of bytes
+ * written by the application and by compaction, for each byte written by
+ * the application. The debt is what's left to compact: the pages beyond
+ * the policy's maximum (or the levels' sizes), and the dead bytes known in
+ * the pages (pages are checked a few at a time).
+ */
+typedef struct ArchiveCompactionStats
+{
+    size_t                      n_compactions;
+    size_t                      n_bytes_set;
+    size_t                      n_bytes_compacted;
+    double                      write_amplification;
+    size_t                      n_pages;
+    size_t                      debt_pages;
+    size_t                      debt_bytes;
+    size_t                      throttled_ms;
+    Errors                      last_error;
+} ArchiveCompactionStats;
+
+
+#pragma mark - ArchiveCompactor
+
+
+/**
+ * The dead bytes known for a page of the archive.
+ */
+typedef struct ArchiveCompactorPage
+{
+    bool                        known;
+    size_t                      data_size;
+    size_t                      dead_size;
+} ArchiveCompactorPage;
+
+
+/**
+ * Compacts an archive in the background, while it's written to and read
+ * from, following a policy. The items copied are paid for from a token
+ * bucket of `io_rate` bytes per second (up to a second worth of bytes can
+ * be spent at once), so compaction doesn't take the disk from the lookups.
+ * Once there's nothing to compact, it trims the cache of the archive (see
+ * Archive_trim_cache) and saves its hot keys (see
+ * Archive_snapshot_hot_keys).
+ *
+ * Compactions and trims by hand mustn't be done while a compactor runs, and
+ * the compactor must be stopped before the archive is freed.
+ */
+typedef struct ArchiveCompactor
+{
+    Archive*                    archive;
+    ArchiveCompactionPolicy     policy;
+    size_t                      io_rate;
+    double                      tokens;
+    struct timespec             refilled_at;
+    double                      throttled;
+    ArchiveCompactorPage*       pages;
+    size_t                      n_pages;
+    size_t                      next_page;
+    ArchiveCompactionStats      stats;
+    pthread_mutex_t             lock;
+    pthread_cond_t              wake;
+    pthread_t                   thread;
+    unsigned int                interval_ms;
+    bool                        running;
+    bool                        stopping;
+} ArchiveCompactor;
+
+
+/**
+ Initializes a compactor, and sets it as the compaction throttle of the
+ archive.
+
+ @param self The compactor.
+ @param archive The archive to compact.
+ @param policy The policy, copied, or NULL for the default one.
+ @param io_rate The bytes compaction may copy per second, or 0 for no
+                limit.
+ */
+void            ArchiveCompactor_init(ArchiveCompactor*                 self,
+                                      Archive*                          archive,
+                                      const ArchiveCompactionPolicy*    policy,
+                                      size_t                            io_rate);
+
+
+/**
+ Stops and frees the compactor.
+
+ @param self The compactor.
+ */
+void            ArchiveCompactor_free(ArchiveCompactor*     self);
+
+
+/**
+ Starts compacting in the background, on a thread of its own.
+
+ @param self The compactor.
+ @param interval_ms How long to wait between checks when there's nothing
+                    to compact, at least 10 ms.
+ @return An error code.
+ */
+Errors          ArchiveCompactor_start(ArchiveCompactor*    self,
+                                       unsigned int         interval_ms);
+
+
+/**
+ Stops compacting in the background. A compaction in progress is given up,
+ the archive being left as it was.
+
+ @param self The compactor.
+ */
+void            ArchiveCompactor_stop(ArchiveCompactor*     self);
+
+
+/**
+ Picks the next pages to merge.
+
+ @param self The compactor.
+ @param _first_page A pointer in which the index of the first page is
+                    written.
+ @param _n_pages A pointer in which the number of pages is written.
+ @return E_NOT_FOUND if there's nothing to compact, or an error code.
+ */
+Errors          ArchiveCompactor_plan(ArchiveCompactor*     self,
+                                      size_t*               _first_page,
+                                      size_t*               _n_pages);
+
+
+/**
+ Compacts the next pages to merge, in the calling thread. It mustn't be
+ called while the compactor runs in the background.
+
+ @param self The compactor.
+ @return E_NOT_FOUND if there was nothing to compact, or an error code.
+ */
+Errors          ArchiveCompactor_run(ArchiveCompactor*      self);
+
+
+/**
+ Gets the metrics of the compactor.
+
+ @param self The compactor.
+ @param stats A pointer in which the metrics are written.
+ */
+void            ArchiveCompactor_stats(ArchiveCompactor*        self,
+                                       ArchiveCompactionStats*  stats);
+
+
+#endif /* ARCHIVECOMPACTOR_H */
@@ -0,0 +1,336 @@
+//
+//  ArchiveExecutor.c
+//  ArchiveLib
+//
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ArchiveExecutor.h"
+
+
+#pragma mark - ArchiveExecutor (Private)
+
+
+/**
+ * The tasks left to a worker, from `next` to `end`. The worker takes them
+ * from the front, thieves from the back.
+ */
+typedef struct ArchiveExecutorQueue
+{
+    pthread_mutex_t             lock;
+    size_t                      next;
+    size_t                      end;
+} ArchiveExecutorQueue;
+
+
+/**
+ * The state shared by the workers of an operation.
+ */
+typedef struct ArchiveExecutorJob
+{
+    ArchiveExecutor*            executor;
+    struct ArchiveExecutorJob*  next;
+    ArchiveTask                 task;
+    void*                       context;
+    size_t                      n_tasks;
+    ArchiveExecutorQueue*       queues;
+    size_t                      n_queues;
+    size_t                      n_workers;
+    size_t                      n_done;
+    pthread_mutex_t             progress_lock;
+    Errors                      error;
+} ArchiveExecutorJob;
+
+
+/**
+ Takes the next task of a queue.
+
+ @param queue The queue.
+ @param _index A pointer in which the index of the task is written.
+ @return false if the queue is empty.
+ */
+static inline bool      _ArchiveExecutorQueue_pop(ArchiveExecutorQueue*    queue,
+                                                  size_t*                  _index)
+{
+    pthread_mutex_lock(&queue->lock);
+    bool found = queue->next < queue->end;
+    if (found) {
+        *_index = queue->next++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+
+/**
+ Moves half of the tasks left to another worker to a worker's queue, from
+ the one with the most tasks left.
+
+ @param job The job.
+ @param queue The queue of the thief.
+ @return false if there are no tasks left to steal.
+ */
+static bool             _ArchiveExecutor_steal(ArchiveExecutorJob*      job,
+                                               ArchiveExecutorQueue*    queue)
+{
+    while (true) {
+        // the counts are only hints, they're checked again under the lock
+        ArchiveExecutorQueue* victim = NULL;
+        size_t most = 0;
+        size_t left, i;
+        for (i = 0; i < job->n_queues; i++) {
+            pthread_mutex_lock(&job->queues[i].lock);
+            left = job->queues[i].end - job->queues[i].next;
+            pthread_mutex_unlock(&job->queues[i].lock);
+            if (left > most) {
+                most = left;
+                victim = job->queues + i;
+            }
+        }
+        if (victim == NULL) {
+            return false;
+        }
+
+        size_t first, end;
+        pthread_mutex_lock(&victim->lock);
+        left = victim->end - victim->next;
+        end = victim->end;
+        first = end - (left + 1) / 2;
+        victim->end = first;
+        pthread_mutex_unlock(&victim->lock);
+        if (left == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->next = first;
+        queue->end = end;
+        pthread_mutex_unlock(&queue->lock);
+        return true;
+    }
+}
+
+
+/**
+ Stops the tasks not started yet of a job.
+
+ @param job The job.
+ @param error The reason.
+ */
+static inline void      _ArchiveExecutor_stop(ArchiveExecutorJob*   job,
+                                              Errors                error)
+{
+    Errors expected = E_SUCCESS;
+    __atomic_compare_exchange_n(&job->error, &expected, error, false,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+
+/**
+ Runs tasks of a job, from its own queue then from the others', until
+ there are none left or the job is stopped.
+
+ @param arg The job.
+ */
+static void             _ArchiveExecutor_worker(void*       arg)
+{
+    ArchiveExecutorJob* job = (ArchiveExecutorJob*)arg;
+    size_t worker = __atomic_fetch_add(&job->n_workers, 1, __ATOMIC_RELAXED);
+    ArchiveExecutorQueue* queue = job->queues + worker % job->n_queues;
+    ArchiveProgress progress = job->executor->progress;
+    size_t index, n_done;
+    Errors error;
+    while (__atomic_load_n(&job->error, __ATOMIC_RELAXED) == E_SUCCESS) {
+        if (!_ArchiveExecutorQueue_pop(queue, &index) &&
+            !(_ArchiveExecutor_steal(job, queue) && _ArchiveExecutorQueue_pop(queue, &index))) {
+            break;
+        }
+        error = job->task(job->context, index);
+        if (error != E_SUCCESS) {
+            _ArchiveExecutor_stop(job, error);
+        }
+        n_done = __atomic_add_fetch(&job->n_done, 1, __ATOMIC_RELAXED);
+        if (progress != NULL) {
+            pthread_mutex_lock(&job->progress_lock);
+            if (!progress(job->executor->progress_context, n_done, job->n_tasks)) {
+                _ArchiveExecutor_stop(job, E_CANCELLED);
+            }
+            pthread_mutex_unlock(&job->progress_lock);
+        }
+    }
+}
+
+
+static void*            _ArchiveExecutor_thread(void*       arg)
+{
+    _ArchiveExecutor_worker(arg);
+    return NULL;
+}
+
+
+/**
+ Runs workers on threads created for them, the calling thread being one of
+ them.
+
+ @param context Unused.
+ @param worker The worker.
+ @param arg The argument of the worker.
+ @param n_workers The number of workers to run.
+ */
+static void             _ArchiveExecutor_dispatch(void*     context,
+                                                  void      (*worker)(void* arg),
+                                                  void*     arg,
+                                                  size_t    n_workers)
+{
+    (void)context;
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * n_workers);
+    size_t n_started = 0;
+    size_t i;
+    for (i = 1; i < n_workers; i++) {
+        if (pthread_create(threads + n_started, NULL, _ArchiveExecutor_thread, arg) != 0) {
+            break;
+        }
+        n_started++;
+    }
+    // the workers that couldn't be started steal nothing, their tasks are
+    // taken by the others
+    worker(arg);
+    for (i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+
+#pragma mark - ArchiveExecutor (Public API)
+
+
+void        ArchiveExecutor_init(ArchiveExecutor*       self,
+                                 size_t                 max_threads)
+{
+    ArchiveExecutor_set_max_threads(self, max_threads);
+    self->dispatch = NULL;
+    self->dispatch_context = NULL;
+    self->progress = NULL;
+    self->progress_context = NULL;
+    self->jobs = NULL;
+    self->n_busy_threads = 0;
+    pthread_mutex_init(&self->lock, NULL);
+}
+
+
+void        ArchiveExecutor_free(ArchiveExecutor*       self)
+{
+    pthread_mutex_destroy(&self->lock);
+}
+
+
+void        ArchiveExecutor_set_max_threads(ArchiveExecutor*    self,
+                                            size_t              max_threads)
+{
+    if (max_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_threads = n_cpus > 0 ? (size_t)n_cpus : 1;
+    }
+    self->max_threads = max_threads;
+}
+
+
+void        ArchiveExecutor_set_dispatch(ArchiveExecutor*       self,
+                                         ArchiveDispatch        dispatch,
+                                         void*                  context)
+{
+    self->dispatch = dispatch;
+    self->dispatch_context = context;
+}
+
+
+void        ArchiveExecutor_set_progress(ArchiveExecutor*       self,
+                                         ArchiveProgress        progress,
+                                         void*                  context)
+{
+    self->progress = progress;
+    self->progress_context = context;
+}
+
+
+void        ArchiveExecutor_cancel(ArchiveExecutor*     self)
+{
+    pthread_mutex_lock(&self->lock);
+    ArchiveExecutorJob* job;
+    for (job = self->jobs; job != NULL; job = job->next) {
+        _ArchiveExecutor_stop(job, E_CANCELLED);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+Errors      ArchiveExecutor_run(ArchiveExecutor*        self,
+                                size_t                  n_tasks,
+                                size_t                  n_threads,
+                                ArchiveTask             task,
+                                void*                   context)
+{
+    if (n_threads == 0 || n_threads > self->max_threads) {
+        n_threads = self->max_threads;
+    }
+    if (n_threads > n_tasks) {
+        n_threads = n_tasks > 0 ? n_tasks : 1;
+    }
+
+    ArchiveExecutorJob job;
+    job.executor = self;
+    job.task = task;
+    job.context = context;
+    job.n_tasks = n_tasks;
+    job.n_workers = 0;
+    job.n_done = 0;
+    job.error = E_SUCCESS;
+    pthread_mutex_init(&job.progress_lock, NULL);
+
+    // the threads are shared by the operations running at the same time,
+    // each one gets at least the calling thread
+    pthread_mutex_lock(&self->lock);
+    size_t n_free = self->n_busy_threads < self->max_threads ? self->max_threads - self->n_busy_threads : 0;
+    if (n_threads > n_free) {
+        n_threads = n_free > 0 ? n_free : 1;
+    }
+    self->n_busy_threads += n_threads;
+    job.next = self->jobs;
+    self->jobs = &job;
+    pthread_mutex_unlock(&self->lock);
+    job.n_queues = n_threads;
+
+    // consecutive tasks to each worker, as they often read neighbouring data
+    job.queues = (ArchiveExecutorQueue*)malloc(sizeof(ArchiveExecutorQueue) * n_threads);
+    size_t i;
+    for (i = 0; i < n_threads; i++) {
+        pthread_mutex_init(&job.queues[i].lock, NULL);
+        job.queues[i].next = n_tasks * i / n_threads;
+        job.queues[i].end = n_tasks * (i + 1) / n_threads;
+    }
+
+    if (self->dispatch != NULL) {
+        self->dispatch(self->dispatch_context, _ArchiveExecutor_worker, &job, n_threads);
+    } else {
+        _ArchiveExecutor_dispatch(NULL, _ArchiveExecutor_worker, &job, n_threads);
+    }
+
+    for (i = 0; i < n_threads; i++) {
+        pthread_mutex_destroy(&job.queues[i].lock);
+    }
+    free(job.queues);
+    pthread_mutex_destroy(&job.progress_lock);
+
+    pthread_mutex_lock(&self->lock);
+    ArchiveExecutorJob** link = &self->jobs;
+    while (*link != &job) {
+        link = &(*link)->next;
+    }
+    *link = job.next;
+    self->n_busy_threads -= n_threads;
+    pthread_mutex_unlock(&self->lock);
+    return job.error;
+}
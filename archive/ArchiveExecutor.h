@@ -0,0 +1,167 @@
+#ifndef ARCHIVEEXECUTOR_H
+#define ARCHIVEEXECUTOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "Errors.h"
+
+
+#pragma mark - ArchiveExecutor
+
+
+/**
+ * A task of a parallel operation, run once for each index from 0 to the
+ * number of tasks. Tasks of the same operation may run at the same time on
+ * different threads.
+ *
+ * @param context The context of the operation.
+ * @param index The index of the task.
+ * @return An error code. An error stops the tasks not started yet.
+ */
+typedef Errors (*ArchiveTask)(void*                     context,
+                              size_t                    index);
+
+
+/**
+ * A progress callback, called after each task of an operation. The calls
+ * are never concurrent, but they may come from any of the threads.
+ *
+ * @param context The context given with the callback.
+ * @param n_done The number of tasks done.
+ * @param n_tasks The number of tasks of the operation.
+ * @return false to cancel the operation.
+ */
+typedef bool (*ArchiveProgress)(void*                   context,
+                                size_t                  n_done,
+                                size_t                  n_tasks);
+
+
+/**
+ * Runs the workers of an operation on the threads of the host application.
+ * It must call `worker(arg)` `n_workers` times, each call on its own thread
+ * or some of them one after the other, and return once all of them returned.
+ * Workers steal tasks from each other, so they all finish even if they don't
+ * run at the same time.
+ *
+ * @param context The context given with the dispatch function.
+ * @param worker The worker.
+ * @param arg The argument of the worker.
+ * @param n_workers The number of workers to run.
+ */
+typedef void (*ArchiveDispatch)(void*                   context,
+                                void                    (*worker)(void* arg),
+                                void*                   arg,
+                                size_t                  n_workers);
+
+
+/**
+ * Runs the tasks of the long operations of an archive (save, compaction,
+ * verification, bulk load) on a bounded number of threads. Tasks are split
+ * between the workers in ranges of consecutive indexes, and a worker done
+ * with its range steals half of what's left of another's.
+ *
+ * The workers run on threads created for each operation (the calling thread
+ * being one of them), or on the host's through a dispatch function. The
+ * operations running at the same time share the maximum number of threads.
+ */
+typedef struct ArchiveExecutor
+{
+    size_t                      max_threads;
+    ArchiveDispatch             dispatch;
+    void*                       dispatch_context;
+    ArchiveProgress             progress;
+    void*                       progress_context;
+    pthread_mutex_t             lock;
+    struct ArchiveExecutorJob*  jobs;
+    size_t                      n_busy_threads;
+} ArchiveExecutor;
+
+
+/**
+ Initializes an executor.
+
+ @param self The executor.
+ @param max_threads The maximum number of threads of the operations, 0 for
+                    the number of CPUs.
+ */
+void            ArchiveExecutor_init(ArchiveExecutor*       self,
+                                     size_t                 max_threads);
+
+
+/**
+ Frees the executor. No operation may be running.
+
+ @param self The executor.
+ */
+void            ArchiveExecutor_free(ArchiveExecutor*       self);
+
+
+/**
+ Sets the maximum number of threads of the operations.
+
+ @param self The executor.
+ @param max_threads The maximum number of threads, 0 for the number of CPUs.
+ */
+void            ArchiveExecutor_set_max_threads(ArchiveExecutor*    self,
+                                                size_t              max_threads);
+
+
+/**
+ Runs the workers of the operations on the host's threads.
+
+ @param self The executor.
+ @param dispatch The dispatch function, or NULL to create threads.
+ @param context The context given to the dispatch function.
+ */
+void            ArchiveExecutor_set_dispatch(ArchiveExecutor*       self,
+                                             ArchiveDispatch        dispatch,
+                                             void*                  context);
+
+
+/**
+ Reports the progress of the operations.
+
+ @param self The executor.
+ @param progress The progress callback, or NULL.
+ @param context The context given to the callback.
+ */
+void            ArchiveExecutor_set_progress(ArchiveExecutor*       self,
+                                             ArchiveProgress        progress,
+                                             void*                  context);
+
+
+/**
+ Cancels the running operations. Tasks already started finish, the others
+ don't start. It does nothing if no operation is running, and can be called
+ from any thread. A progress callback returning false only cancels its
+ operation.
+
+ @param self The executor.
+ */
+void            ArchiveExecutor_cancel(ArchiveExecutor*     self);
+
+
+/**
+ Runs the tasks of an operation, and waits for them.
+
+ @param self The executor.
+ @param n_tasks The number of tasks.
+ @param n_threads The number of threads to use, 0 for as many as allowed.
+                  It's capped by the threads of the executor's maximum
+                  not used by other operations, but the calling thread
+                  always runs the tasks.
+ @param task The task function.
+ @param context The context given to the tasks.
+ @return The first error of the tasks, E_CANCELLED if the operation was
+         cancelled, or E_SUCCESS.
+ */
+Errors          ArchiveExecutor_run(ArchiveExecutor*        self,
+                                    size_t                  n_tasks,
+                                    size_t                  n_threads,
+                                    ArchiveTask             task,
+                                    void*                   context);
+
+
+#endif /* ARCHIVEEXECUTOR_H */
@@ -0,0 +1,296 @@
+//
+//  ArchiveHotSet.c
+//  ArchiveLib
+//
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for asprintf
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "Endian.h"
+#include "Checksum.h"
+#include "FileIO.h"
+#include "ArchiveHotSet.h"
+
+
+#define ArchiveHotSetMagic      0x41484b31 // "AHK1"
+#define ArchiveHotSetVersion    1
+
+
+/**
+ * The header of a hot set file. It's followed by the keys, by the number of
+ * ranges and a record per range and its file name, and by the checksum of
+ * everything before it.
+ */
+typedef struct __attribute__((__packed__)) ArchiveHotSetHeader
+{
+    __uint32_t              magic;
+    __uint32_t              version;
+    __uint32_t              n_keys;
+} ArchiveHotSetHeader;
+
+
+typedef struct __attribute__((__packed__)) ArchiveHotRangeRecord
+{
+    __uint32_t              offset_high;
+    __uint32_t              offset_low;
+    __uint32_t              size_high;
+    __uint32_t              size_low;
+    __uint32_t              filename_size;
+} ArchiveHotRangeRecord;
+
+
+#pragma mark - ArchiveHotSet (Private)
+
+
+static int          _ArchiveHotSet_range_compare(const void*    a,
+                                                 const void*    b)
+{
+    const ArchiveHotRange* range_a = (const ArchiveHotRange*)a;
+    const ArchiveHotRange* range_b = (const ArchiveHotRange*)b;
+    int compare = strcmp(range_a->filename, range_b->filename);
+    if (compare != 0) {
+        return compare;
+    }
+    return range_a->offset < range_b->offset ? -1 : (range_a->offset > range_b->offset ? 1 : 0);
+}
+
+
+/**
+ Reads the ranges of a hot set file.
+
+ @param self The hot set.
+ @param buffer The content of the file.
+ @param end The end of the records (the checksum's offset).
+ @param position The offset of the ranges, moved past them.
+ @return An error code.
+ */
+static Errors       _ArchiveHotSet_read_ranges(ArchiveHotSet*   self,
+                                               const char*      buffer,
+                                               size_t           end,
+                                               size_t*          position)
+{
+    __uint32_t n_ranges;
+    if (*position + sizeof(__uint32_t) > end) {
+        return E_INVALID_HOT_KEYS;
+    }
+    memcpy(&n_ranges, buffer + *position, sizeof(__uint32_t));
+    *position += sizeof(__uint32_t);
+    ArchiveHotRangeRecord record;
+    size_t filename_size;
+    char* filename;
+    size_t i;
+    for (i = 0; i < be32toh(n_ranges); i++) {
+        if (*position + sizeof(ArchiveHotRangeRecord) > end) {
+            return E_INVALID_HOT_KEYS;
+        }
+        memcpy(&record, buffer + *position, sizeof(ArchiveHotRangeRecord));
+        *position += sizeof(ArchiveHotRangeRecord);
+        filename_size = be32toh(record.filename_size);
+        if (*position + filename_size > end) {
+            return E_INVALID_HOT_KEYS;
+        }
+        filename = strndup(buffer + *position, filename_size);
+        *position += filename_size;
+        ArchiveHotSet_add_range(self, filename,
+                                ((__uint64_t)be32toh(record.offset_high) << 32) | be32toh(record.offset_low),
+                                ((__uint64_t)be32toh(record.size_high) << 32) | be32toh(record.size_low));
+        free(filename);
+    }
+    return E_SUCCESS;
+}
+
+
+#pragma mark - ArchiveHotSet
+
+
+void        ArchiveHotSet_init(ArchiveHotSet*           self)
+{
+    self->keys = NULL;
+    self->n_keys = 0;
+    self->ranges = NULL;
+    self->n_ranges = 0;
+}
+
+
+void        ArchiveHotSet_free(ArchiveHotSet*           self)
+{
+    size_t i;
+    for (i = 0; i < self->n_ranges; i++) {
+        free(self->ranges[i].filename);
+    }
+    free(self->ranges);
+    free(self->keys);
+    ArchiveHotSet_init(self);
+}
+
+
+void        ArchiveHotSet_add_key(ArchiveHotSet*        self,
+                                  const char*           key)
+{
+    self->keys = (char*)realloc(self->keys, 20 * (self->n_keys + 1));
+    memcpy(self->keys + 20 * self->n_keys, key, 20);
+    self->n_keys += 1;
+}
+
+
+void        ArchiveHotSet_add_range(ArchiveHotSet*      self,
+                                    const char*         filename,
+                                    __uint64_t          offset,
+                                    __uint64_t          size)
+{
+    self->ranges = (ArchiveHotRange*)realloc(self->ranges, sizeof(ArchiveHotRange) * (self->n_ranges + 1));
+    self->ranges[self->n_ranges].filename = strdup(filename);
+    self->ranges[self->n_ranges].offset = offset;
+    self->ranges[self->n_ranges].size = size;
+    self->n_ranges += 1;
+}
+
+
+void        ArchiveHotSet_merge_ranges(ArchiveHotSet*   self)
+{
+    if (self->n_ranges == 0) {
+        return;
+    }
+    qsort(self->ranges, self->n_ranges, sizeof(ArchiveHotRange), _ArchiveHotSet_range_compare);
+    ArchiveHotRange* last = self->ranges;
+    ArchiveHotRange* range;
+    size_t i;
+    for (i = 1; i < self->n_ranges; i++) {
+        range = self->ranges + i;
+        if (strcmp(range->filename, last->filename) == 0 && range->offset <= last->offset + last->size) {
+            if (range->offset + range->size > last->offset + last->size) {
+                last->size = range->offset + range->size - last->offset;
+            }
+            free(range->filename);
+        } else {
+            *(++last) = *range;
+        }
+    }
+    self->n_ranges = (size_t)(last - self->ranges) + 1;
+}
+
+
+Errors      ArchiveHotSet_write(const ArchiveHotSet*    self,
+                                const char*             path)
+{
+    // serialize the whole hot set
+    size_t size = sizeof(ArchiveHotSetHeader) + 20 * self->n_keys + 2 * sizeof(__uint32_t);
+    size_t i;
+    for (i = 0; i < self->n_ranges; i++) {
+        size += sizeof(ArchiveHotRangeRecord) + strlen(self->ranges[i].filename);
+    }
+    char* buffer = (char*)malloc(size);
+    ArchiveHotSetHeader header;
+    header.magic    = htobe32(ArchiveHotSetMagic);
+    header.version  = htobe32(ArchiveHotSetVersion);
+    header.n_keys   = htobe32((__uint32_t)self->n_keys);
+    memcpy(buffer, &header, sizeof(ArchiveHotSetHeader));
+    size_t position = sizeof(ArchiveHotSetHeader);
+    memcpy(buffer + position, self->keys, 20 * self->n_keys);
+    position += 20 * self->n_keys;
+    __uint32_t n_ranges = htobe32((__uint32_t)self->n_ranges);
+    memcpy(buffer + position, &n_ranges, sizeof(__uint32_t));
+    position += sizeof(__uint32_t);
+    ArchiveHotRangeRecord record;
+    size_t filename_size;
+    for (i = 0; i < self->n_ranges; i++) {
+        filename_size = strlen(self->ranges[i].filename);
+        record.offset_high      = htobe32((__uint32_t)(self->ranges[i].offset >> 32));
+        record.offset_low       = htobe32((__uint32_t)self->ranges[i].offset);
+        record.size_high        = htobe32((__uint32_t)(self->ranges[i].size >> 32));
+        record.size_low         = htobe32((__uint32_t)self->ranges[i].size);
+        record.filename_size    = htobe32((__uint32_t)filename_size);
+        memcpy(buffer + position, &record, sizeof(ArchiveHotRangeRecord));
+        position += sizeof(ArchiveHotRangeRecord);
+        memcpy(buffer + position, self->ranges[i].filename, filename_size);
+        position += filename_size;
+    }
+    __uint32_t checksum = htobe32(Checksum_fnv1a(Checksum_fnv1a_init, buffer, position));
+    memcpy(buffer + position, &checksum, sizeof(__uint32_t));
+
+    // like the manifest, written next to the current one
+    char* tmp_path;
+    asprintf(&tmp_path, "%s.tmp", path);
+    file_descriptor fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        free(tmp_path);
+        free(buffer);
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    Errors error = write_to_file(fd, buffer, size, 0);
+    free(buffer);
+    if (error == E_SUCCESS && fsync(fd) < 0) {
+        error = E_SYSTEM_ERROR_ERRNO;
+    }
+    close(fd);
+    if (error == E_SUCCESS && rename(tmp_path, path) < 0) {
+        error = E_SYSTEM_ERROR_ERRNO;
+    }
+    if (error != E_SUCCESS) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return error;
+}
+
+
+Errors      ArchiveHotSet_read(ArchiveHotSet*           self,
+                               const char*              path)
+{
+    off_t file_size = fsize(path);
+    if (file_size < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    size_t size = (size_t)file_size;
+    if (size < sizeof(ArchiveHotSetHeader) + sizeof(__uint32_t)) {
+        return E_INVALID_HOT_KEYS;
+    }
+    file_descriptor fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    char* buffer = (char*)malloc(size);
+    Errors error = read_from_file(fd, buffer, size, 0);
+    close(fd);
+    if (error != E_SUCCESS) {
+        free(buffer);
+        return error;
+    }
+
+    // check the checksum before trusting anything
+    size_t end = size - sizeof(__uint32_t);
+    __uint32_t checksum;
+    memcpy(&checksum, buffer + end, sizeof(__uint32_t));
+    ArchiveHotSetHeader header;
+    memcpy(&header, buffer, sizeof(ArchiveHotSetHeader));
+    __uint32_t version = be32toh(header.version);
+    size_t n_keys = be32toh(header.n_keys);
+    size_t position = sizeof(ArchiveHotSetHeader) + 20 * n_keys;
+    if (be32toh(checksum) != Checksum_fnv1a(Checksum_fnv1a_init, buffer, end) ||
+        be32toh(header.magic) != ArchiveHotSetMagic ||
+        version != ArchiveHotSetVersion ||
+        position > end) {
+        free(buffer);
+        return E_INVALID_HOT_KEYS;
+    }
+    size_t i;
+    for (i = 0; i < n_keys; i++) {
+        ArchiveHotSet_add_key(self, buffer + sizeof(ArchiveHotSetHeader) + 20 * i);
+    }
+    error = _ArchiveHotSet_read_ranges(self, buffer, end, &position);
+    free(buffer);
+    if (error == E_SUCCESS && position != end) {
+        error = E_INVALID_HOT_KEYS;
+    }
+    if (error != E_SUCCESS) {
+        ArchiveHotSet_free(self);
+    }
+    return error;
+}
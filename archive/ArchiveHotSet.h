@@ -0,0 +1,112 @@
+#ifndef ARCHIVEHOTSET_H
+#define ARCHIVEHOTSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "Errors.h"
+
+
+/**
+ * A range of a file of an archive read by its hot keys: the header and
+ * index of a page file, or the data of an item in a page file or its blob
+ * file. The file name is relative to the base path of the archive.
+ */
+typedef struct ArchiveHotRange
+{
+    char*                       filename;
+    __uint64_t                  offset;
+    __uint64_t                  size;
+} ArchiveHotRange;
+
+
+/**
+ * The hottest keys of an archive, hottest first, and the ranges of its files
+ * they're read from, saved to a side file (see Archive_save_hot_keys) so the
+ * archive opened again can prefetch them before they're looked up.
+ *
+ * Like the manifest, the file is written to a temporary file, synced and
+ * renamed over the previous one.
+ */
+typedef struct ArchiveHotSet
+{
+    char*                       keys;
+    size_t                      n_keys;
+    ArchiveHotRange*            ranges;
+    size_t                      n_ranges;
+} ArchiveHotSet;
+
+
+/**
+ Initializes an empty hot set.
+
+ @param self The hot set.
+ */
+void        ArchiveHotSet_init(ArchiveHotSet*           self);
+
+
+/**
+ Frees the hot set's internal structure.
+
+ @param self The hot set.
+ */
+void        ArchiveHotSet_free(ArchiveHotSet*           self);
+
+
+/**
+ Appends a key to the hot set.
+
+ @param self The hot set.
+ @param key The key (20 bytes).
+ */
+void        ArchiveHotSet_add_key(ArchiveHotSet*        self,
+                                  const char*           key);
+
+
+/**
+ Appends a range to the hot set.
+
+ @param self The hot set.
+ @param filename The file name, which is copied.
+ @param offset The start of the range.
+ @param size The size of the range.
+ */
+void        ArchiveHotSet_add_range(ArchiveHotSet*      self,
+                                    const char*         filename,
+                                    __uint64_t          offset,
+                                    __uint64_t          size);
+
+
+/**
+ Sorts the ranges by file and offset, and merges the ones overlapping or
+ following each other, so each is prefetched once.
+
+ @param self The hot set.
+ */
+void        ArchiveHotSet_merge_ranges(ArchiveHotSet*   self);
+
+
+/**
+ Writes the hot set atomically.
+
+ @param self The hot set.
+ @param path The path of the file.
+ @return An error code.
+ */
+Errors      ArchiveHotSet_write(const ArchiveHotSet*    self,
+                                const char*             path);
+
+
+/**
+ Reads a hot set file, into an initialized hot set.
+
+ @param self The hot set.
+ @param path The path of the file.
+ @return An error code. E_INVALID_HOT_KEYS if the file is corrupted.
+ */
+Errors      ArchiveHotSet_read(ArchiveHotSet*           self,
+                               const char*              path);
+
+
+#endif /* ARCHIVEHOTSET_H */
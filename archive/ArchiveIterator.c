@@ -0,0 +1,231 @@
+//
+//  ArchiveIterator.c
+//  ArchiveLib
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ArchiveIterator.h"
+
+
+#pragma mark - ArchiveIterator (Private)
+
+
+/**
+ Checks if a key matches the iterator's prefix.
+
+ @param self The iterator.
+ @param key The key (20 bytes).
+ @return A boolean representing wheather the key matches.
+ */
+static inline bool  _ArchiveIterator_matches(const ArchiveIterator* self,
+                                             const char*            key)
+{
+    return memcmp(key, self->prefix, self->prefix_len) == 0;
+}
+
+
+/**
+ Gets a page of the iterator's archive (the writer may move the list of
+ pages while adding some).
+
+ @param self The iterator.
+ @param page The index of the page.
+ @return The page.
+ */
+static inline const ArchivePage*    _ArchiveIterator_page(const ArchiveIterator*    self,
+                                                          size_t                    page)
+{
+    return __atomic_load_n(&self->archive->pages, __ATOMIC_ACQUIRE) + page;
+}
+
+
+#pragma mark - ArchiveIterator (Public API)
+
+
+Errors      ArchiveIterator_init(ArchiveIterator*       self,
+                                 const Archive*         archive,
+                                 const char*            prefix,
+                                 size_t                 prefix_len)
+{
+    if (prefix_len > 20 || (prefix == NULL && prefix_len > 0)) {
+        return E_INVALID_PARTIAL_KEY_LENGTH;
+    }
+
+    self->archive = archive;
+    self->prefix_len = prefix_len;
+    if (prefix_len > 0) {
+        memcpy(self->prefix, prefix, prefix_len);
+    }
+
+    // a prefix restricts the scan to the bucket of its first byte
+    if (prefix_len > 0) {
+        self->bucket = _HashIndex_key(prefix);
+        self->bucket_end = self->bucket + 1;
+    } else {
+        self->bucket = 0;
+        self->bucket_end = HashIndexPageCount;
+    }
+
+    // pages are walked newest to oldest within each bucket, as long as no
+    // compaction swaps them
+    Archive_lock_pages(archive);
+    self->page = __atomic_load_n(&archive->n_pages, __ATOMIC_ACQUIRE) - 1;
+    self->n_swaps = __atomic_load_n(&archive->n_swaps, __ATOMIC_ACQUIRE);
+    Archive_unlock_pages(archive);
+    self->item = 0;
+    self->error = E_SUCCESS;
+
+    return E_SUCCESS;
+}
+
+
+bool        ArchiveIterator_next(ArchiveIterator*       self,
+                                 ArchiveEntry*          entry)
+{
+    const Archive* archive = self->archive;
+    const HashPage* bucket;
+    const HashItem* item;
+    size_t n_pages;
+
+    if (self->error != E_SUCCESS) {
+        return false;
+    }
+
+    // the pages are locked for a step only, the iteration stops if some were
+    // swapped in between
+    Archive_lock_pages(archive);
+    if (__atomic_load_n(&archive->n_swaps, __ATOMIC_ACQUIRE) != self->n_swaps) {
+        Archive_unlock_pages(archive);
+        self->error = E_STALE_PAGE;
+        return false;
+    }
+    n_pages = __atomic_load_n(&archive->n_pages, __ATOMIC_ACQUIRE);
+    while (self->bucket < self->bucket_end) {
+        // `page` wraps around past the oldest page, which ends the bucket
+        while (self->page < n_pages) {
+            // skip the pages without keys in the bucket, without opening
+            // them; a page being walked is opened again if its index was
+            // closed in between (its buckets keep their order)
+            if ((self->item == 0 &&
+                 !ArchivePage_may_have(_ArchiveIterator_page(self, self->page), self->bucket)) ||
+                Archive_open_page(archive, self->page) != E_SUCCESS) {
+                self->page--;
+                self->item = 0;
+                continue;
+            }
+            bucket = &(_ArchiveIterator_page(self, self->page)->index->pages[self->bucket]);
+            while (self->item < bucket->n_items) {
+                item = bucket->items + self->item;
+                self->item++;
+                if (HashItem_is_tombstone(item) ||
+                    !_ArchiveIterator_matches(self, item->key) ||
+                    !Archive_is_newest(archive, self->page, item)) {
+                    continue;
+                }
+                memcpy(entry->key, item->key, 20);
+                entry->data_offset = item->data_offset;
+                entry->data_size = item->data_size;
+                entry->page = self->page;
+                Archive_unlock_pages(archive);
+                return true;
+            }
+            self->page--;
+            self->item = 0;
+        }
+        self->bucket++;
+        self->page = n_pages - 1;
+    }
+    Archive_unlock_pages(archive);
+
+    return false;
+}
+
+
+#pragma mark - ArchivePageIterator (Private)
+
+
+static int          _ArchivePageIterator_compare(const void*        a,
+                                                 const void*        b)
+{
+    size_t offset_a = ((const HashItem*)a)->data_offset;
+    size_t offset_b = ((const HashItem*)b)->data_offset;
+    if (offset_a < offset_b) {
+        return -1;
+    }
+    return offset_a > offset_b;
+}
+
+
+#pragma mark - ArchivePageIterator (Public API)
+
+
+Errors      ArchivePageIterator_init(ArchivePageIterator*   self,
+                                     const Archive*         archive,
+                                     size_t                 page)
+{
+    // the items are copied while the page can't be swapped nor closed
+    Archive_lock_pages(archive);
+    if (page >= __atomic_load_n(&archive->n_pages, __ATOMIC_ACQUIRE)) {
+        Archive_unlock_pages(archive);
+        return E_INDEX_OUT_OF_BOUNDS;
+    }
+    Errors error = Archive_open_page(archive, page);
+    if (error != E_SUCCESS) {
+        Archive_unlock_pages(archive);
+        return error;
+    }
+
+    const HashIndex* index = __atomic_load_n(&archive->pages, __ATOMIC_ACQUIRE)[page].index;
+    self->page = page;
+    self->position = 0;
+    self->n_items = 0;
+    self->items = (HashItem*)malloc(
+        sizeof(HashItem) * (index->n_items > 0 ? index->n_items : 1));
+
+    // collect the items of all buckets
+    const HashPage* bucket;
+    size_t i, j;
+    for (i = 0; i < HashIndexPageCount; i++) {
+        bucket = &(index->pages[i]);
+        for (j = 0; j < bucket->n_items; j++) {
+            if (!HashItem_is_tombstone(bucket->items + j)) {
+                self->items[self->n_items++] = bucket->items[j];
+            }
+        }
+    }
+    Archive_unlock_pages(archive);
+
+    // sort them by data offset
+    if (self->n_items > 0) {
+        qsort(self->items, self->n_items, sizeof(HashItem),
+              _ArchivePageIterator_compare);
+    }
+
+    return E_SUCCESS;
+}
+
+
+bool        ArchivePageIterator_next(ArchivePageIterator*   self,
+                                     ArchiveEntry*          entry)
+{
+    if (self->position >= self->n_items) {
+        return false;
+    }
+    const HashItem* item = self->items + self->position++;
+    memcpy(entry->key, item->key, 20);
+    entry->data_offset = item->data_offset;
+    entry->data_size = item->data_size;
+    entry->page = self->page;
+    return true;
+}
+
+
+void        ArchivePageIterator_free(ArchivePageIterator*   self)
+{
+    free(self->items);
+    self->items = NULL;
+    self->n_items = 0;
+    self->position = 0;
+}
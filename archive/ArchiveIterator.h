@@ -0,0 +1,134 @@
+#ifndef ARCHIVEITERATOR_H
+#define ARCHIVEITERATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Errors.h"
+#include "Archive.h"
+
+
+#pragma mark - ArchiveEntry
+
+
+/**
+ * An entry yielded by the archive iterators.
+ */
+typedef struct ArchiveEntry
+{
+    char                        key[20];
+    size_t                      data_offset;
+    size_t                      data_size;
+    size_t                      page;
+} ArchiveEntry;
+
+
+#pragma mark - ArchiveIterator
+
+
+/**
+ * Iterates over the live keys of an archive (newest page wins), optionally
+ * restricted to a key prefix. Keys are yielded bucket by bucket, so a
+ * non-empty prefix only walks the bucket of its first byte.
+ *
+ * The archive may be written while iterating, though the keys set meanwhile
+ * may be missed. The pages are locked for each step only (see
+ * Archive_lock_pages), so a compactor may swap some in between: the
+ * iteration stops then, with `error` set to E_STALE_PAGE, and is started
+ * again if needed.
+ */
+typedef struct ArchiveIterator
+{
+    const Archive*              archive;
+    char                        prefix[20];
+    size_t                      prefix_len;
+    size_t                      bucket;
+    size_t                      bucket_end;
+    size_t                      page;
+    size_t                      item;
+    size_t                      n_swaps;
+    Errors                      error;
+} ArchiveIterator;
+
+
+/**
+ Initializes an iterator over the live keys of the archive.
+
+ @param self The iterator.
+ @param archive The archive to iterate.
+ @param prefix The key prefix to match. Or NULL to iterate all keys.
+ @param prefix_len The length of the prefix (between 0 and 20 bytes).
+ @return An error code.
+ */
+Errors      ArchiveIterator_init(ArchiveIterator*       self,
+                                 const Archive*         archive,
+                                 const char*            prefix,
+                                 size_t                 prefix_len);
+
+
+/**
+ Yields the next live entry.
+
+ @param self The iterator.
+ @param entry A pointer in which the entry will be written.
+ @return false when the iteration is over, or was stopped by a compaction
+         (see `error`).
+ */
+bool        ArchiveIterator_next(ArchiveIterator*       self,
+                                 ArchiveEntry*          entry);
+
+
+#pragma mark - ArchivePageIterator
+
+
+/**
+ * Iterates over all the items of a single page in data offset order
+ * (which is the order in which they were written to the file), including
+ * the shadowed ones. Tombstones have no data and are skipped.
+ *
+ * The items are copied when the iterator is initialized, so a compaction
+ * may swap the page afterwards; the entries are then those of the file the
+ * page had.
+ */
+typedef struct ArchivePageIterator
+{
+    HashItem*                   items;
+    size_t                      n_items;
+    size_t                      position;
+    size_t                      page;
+} ArchivePageIterator;
+
+
+/**
+ Initializes an iterator over the items of a page.
+
+ @param self The iterator.
+ @param archive The archive.
+ @param page The index of the page in the archive.
+ @return An error code.
+ */
+Errors      ArchivePageIterator_init(ArchivePageIterator*   self,
+                                     const Archive*         archive,
+                                     size_t                 page);
+
+
+/**
+ Yields the next item of the page.
+
+ @param self The iterator.
+ @param entry A pointer in which the entry will be written.
+ @return false when the iteration is over.
+ */
+bool        ArchivePageIterator_next(ArchivePageIterator*   self,
+                                     ArchiveEntry*          entry);
+
+
+/**
+ Frees the iterator's internal structure.
+
+ @param self The iterator.
+ */
+void        ArchivePageIterator_free(ArchivePageIterator*   self);
+
+
+#endif /* ARCHIVEITERATOR_H */
@@ -0,0 +1,320 @@
+//
+//  ArchiveManifest.c
+//  ArchiveLib
+//
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for asprintf
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "Endian.h"
+#include "Checksum.h"
+#include "FileIO.h"
+#include "ArchiveManifest.h"
+
+
+#define ArchiveManifestMagic    0x414d4631 // "AMF1"
+#define ArchiveManifestVersion1 1
+#define ArchiveManifestVersion2 2
+#define ArchiveManifestVersion3 3
+#define ArchiveManifestVersion  ArchiveManifestVersion3
+
+
+/**
+ * The header of a manifest file. It's followed by a record per page and its
+ * file name, and by the checksum of everything before it.
+ */
+typedef struct __attribute__((__packed__)) ArchiveManifestHeader
+{
+    __uint32_t              magic;
+    __uint32_t              version;
+    __uint32_t              n_pages;
+} ArchiveManifestHeader;
+
+
+typedef struct __attribute__((__packed__)) ArchiveManifestRecordV1
+{
+    __uint32_t              generation;
+    __uint32_t              filename_size;
+} ArchiveManifestRecordV1;
+
+
+typedef struct __attribute__((__packed__)) ArchiveManifestRecordV2
+{
+    __uint32_t              generation;
+    __uint32_t              n_items;
+    __uint32_t              data_size;
+    __uint8_t               filter[HashIndexPageCount / 8];
+    __uint32_t              filename_size;
+} ArchiveManifestRecordV2;
+
+
+typedef struct __attribute__((__packed__)) ArchiveManifestRecord
+{
+    __uint32_t              generation;
+    __uint32_t              n_items;
+    __uint32_t              data_size;
+    __uint8_t               filter[HashIndexPageCount / 8];
+    __uint32_t              level;
+    char                    min_key[20];
+    char                    max_key[20];
+    __uint32_t              filename_size;
+} ArchiveManifestRecord;
+
+
+#pragma mark ArchiveManifest Private Helpers
+
+
+/**
+ Reads the record of a page.
+
+ @param version The version of the manifest.
+ @param buffer The manifest content.
+ @param end The end of the records in the buffer.
+ @param _position A pointer to the position of the record, moved past it.
+ @param page A pointer in which the page is written, the file name points
+             to the buffer and isn't null-terminated.
+ @param _filename_size A pointer to the size of the file name.
+ @return An error code.
+ */
+static Errors       _ArchiveManifest_read_record(__uint32_t             version,
+                                                 const char*            buffer,
+                                                 size_t                 end,
+                                                 size_t*                _position,
+                                                 ArchiveManifestPage*   page,
+                                                 size_t*                _filename_size)
+{
+    size_t position = *_position;
+    if (version == ArchiveManifestVersion1) {
+        // no summary, the pages may have any key
+        ArchiveManifestRecordV1 record;
+        if (position + sizeof(ArchiveManifestRecordV1) > end) {
+            return E_INVALID_MANIFEST;
+        }
+        memcpy(&record, buffer + position, sizeof(ArchiveManifestRecordV1));
+        position += sizeof(ArchiveManifestRecordV1);
+        page->generation = be32toh(record.generation);
+        page->n_items = 0;
+        page->data_size = 0;
+        memset(page->filter, 0xff, sizeof(page->filter));
+        page->level = 0;
+        *_filename_size = be32toh(record.filename_size);
+    } else if (version == ArchiveManifestVersion2) {
+        // no levels, the pages are all of level 0
+        ArchiveManifestRecordV2 record;
+        if (position + sizeof(ArchiveManifestRecordV2) > end) {
+            return E_INVALID_MANIFEST;
+        }
+        memcpy(&record, buffer + position, sizeof(ArchiveManifestRecordV2));
+        position += sizeof(ArchiveManifestRecordV2);
+        page->generation = be32toh(record.generation);
+        page->n_items = be32toh(record.n_items);
+        page->data_size = be32toh(record.data_size);
+        memcpy(page->filter, record.filter, sizeof(page->filter));
+        page->level = 0;
+        *_filename_size = be32toh(record.filename_size);
+    } else {
+        ArchiveManifestRecord record;
+        if (position + sizeof(ArchiveManifestRecord) > end) {
+            return E_INVALID_MANIFEST;
+        }
+        memcpy(&record, buffer + position, sizeof(ArchiveManifestRecord));
+        position += sizeof(ArchiveManifestRecord);
+        page->generation = be32toh(record.generation);
+        page->n_items = be32toh(record.n_items);
+        page->data_size = be32toh(record.data_size);
+        memcpy(page->filter, record.filter, sizeof(page->filter));
+        page->level = be32toh(record.level);
+        memcpy(page->min_key, record.min_key, 20);
+        memcpy(page->max_key, record.max_key, 20);
+        *_filename_size = be32toh(record.filename_size);
+    }
+    if (version < ArchiveManifestVersion3 ||
+        (page->level == 0 && memcmp(page->min_key, page->max_key, 20) == 0)) {
+        // unknown range, pages of level 0 had none before fences
+        memset(page->min_key, 0, 20);
+        memset(page->max_key, 0xff, 20);
+    }
+    if (*_filename_size == 0 || *_filename_size > end - position) {
+        return E_INVALID_MANIFEST;
+    }
+    page->filename = (char*)(buffer + position);
+    *_position = position + *_filename_size;
+    return E_SUCCESS;
+}
+
+
+#pragma mark ArchiveManifest Public Functions
+
+
+void        ArchiveManifest_init(ArchiveManifest*           self)
+{
+    self->pages = NULL;
+    self->n_pages = 0;
+    self->capacity = 0;
+}
+
+
+void        ArchiveManifest_free(ArchiveManifest*           self)
+{
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        free(self->pages[i].filename);
+    }
+    free(self->pages);
+    self->pages = NULL;
+    self->n_pages = 0;
+    self->capacity = 0;
+}
+
+
+void        ArchiveManifest_add_page(ArchiveManifest*           self,
+                                     const ArchiveManifestPage*  page)
+{
+    if (self->n_pages >= self->capacity) {
+        self->capacity = self->capacity > 0 ? self->capacity * 2 : 10;
+        self->pages = (ArchiveManifestPage*)realloc(self->pages, sizeof(ArchiveManifestPage) * self->capacity);
+    }
+    self->pages[self->n_pages] = *page;
+    self->pages[self->n_pages].filename = strdup(page->filename);
+    self->n_pages += 1;
+}
+
+
+Errors      ArchiveManifest_write(const ArchiveManifest*    self,
+                                  const char*               path)
+{
+    // serialize the whole manifest
+    size_t size = sizeof(ArchiveManifestHeader) + sizeof(__uint32_t);
+    size_t i;
+    for (i = 0; i < self->n_pages; i++) {
+        size += sizeof(ArchiveManifestRecord) + strlen(self->pages[i].filename);
+    }
+    char* buffer = (char*)malloc(size);
+    ArchiveManifestHeader header;
+    header.magic    = htobe32(ArchiveManifestMagic);
+    header.version  = htobe32(ArchiveManifestVersion);
+    header.n_pages  = htobe32((__uint32_t)self->n_pages);
+    memcpy(buffer, &header, sizeof(ArchiveManifestHeader));
+    size_t position = sizeof(ArchiveManifestHeader);
+    ArchiveManifestRecord record;
+    size_t filename_size;
+    for (i = 0; i < self->n_pages; i++) {
+        filename_size = strlen(self->pages[i].filename);
+        record.generation       = htobe32(self->pages[i].generation);
+        record.n_items          = htobe32(self->pages[i].n_items);
+        record.data_size        = htobe32(self->pages[i].data_size);
+        record.level            = htobe32(self->pages[i].level);
+        record.filename_size    = htobe32((__uint32_t)filename_size);
+        memcpy(record.filter, self->pages[i].filter, sizeof(record.filter));
+        memcpy(record.min_key, self->pages[i].min_key, 20);
+        memcpy(record.max_key, self->pages[i].max_key, 20);
+        memcpy(buffer + position, &record, sizeof(ArchiveManifestRecord));
+        position += sizeof(ArchiveManifestRecord);
+        memcpy(buffer + position, self->pages[i].filename, filename_size);
+        position += filename_size;
+    }
+    __uint32_t checksum = htobe32(Checksum_fnv1a(Checksum_fnv1a_init, buffer, position));
+    memcpy(buffer + position, &checksum, sizeof(__uint32_t));
+
+    // write it next to the current one, and replace it once it's durable
+    char* tmp_path;
+    asprintf(&tmp_path, "%s.tmp", path);
+    file_descriptor fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        free(tmp_path);
+        free(buffer);
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    Errors error = write_to_file(fd, buffer, size, 0);
+    free(buffer);
+    if (error == E_SUCCESS && fsync(fd) < 0) {
+        error = E_SYSTEM_ERROR_ERRNO;
+    }
+    close(fd);
+    if (error == E_SUCCESS && rename(tmp_path, path) < 0) {
+        error = E_SYSTEM_ERROR_ERRNO;
+    }
+    if (error != E_SUCCESS) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return error;
+    }
+    free(tmp_path);
+
+    // make the rename durable
+    return sync_directory(path);
+}
+
+
+Errors      ArchiveManifest_read(ArchiveManifest*           self,
+                                 const char*                path)
+{
+    off_t file_size = fsize(path);
+    if (file_size < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    size_t size = (size_t)file_size;
+    if (size < sizeof(ArchiveManifestHeader) + sizeof(__uint32_t)) {
+        return E_INVALID_MANIFEST;
+    }
+
+    file_descriptor fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    char* buffer = (char*)malloc(size);
+    Errors error = read_from_file(fd, buffer, size, 0);
+    close(fd);
+    if (error != E_SUCCESS) {
+        free(buffer);
+        return error;
+    }
+
+    // check the checksum before trusting anything
+    size_t end = size - sizeof(__uint32_t);
+    __uint32_t checksum;
+    memcpy(&checksum, buffer + end, sizeof(__uint32_t));
+    ArchiveManifestHeader header;
+    memcpy(&header, buffer, sizeof(ArchiveManifestHeader));
+    __uint32_t version = be32toh(header.version);
+    if (be32toh(checksum) != Checksum_fnv1a(Checksum_fnv1a_init, buffer, end) ||
+        be32toh(header.magic) != ArchiveManifestMagic ||
+        version < ArchiveManifestVersion1 || version > ArchiveManifestVersion3) {
+        free(buffer);
+        return E_INVALID_MANIFEST;
+    }
+
+    // read the pages
+    size_t n_pages = be32toh(header.n_pages);
+    size_t position = sizeof(ArchiveManifestHeader);
+    ArchiveManifestPage page;
+    size_t filename_size;
+    char* filename;
+    size_t i;
+    for (i = 0; i < n_pages; i++) {
+        error = _ArchiveManifest_read_record(version, buffer, end, &position, &page, &filename_size);
+        if (error != E_SUCCESS) {
+            break;
+        }
+        filename = strndup(page.filename, filename_size);
+        page.filename = filename;
+        ArchiveManifest_add_page(self, &page);
+        free(filename);
+    }
+    free(buffer);
+    if (error == E_SUCCESS && position != end) {
+        error = E_INVALID_MANIFEST;
+    }
+    if (error != E_SUCCESS) {
+        ArchiveManifest_free(self);
+    }
+    return error;
+}
@@ -0,0 +1,113 @@
+#ifndef ARCHIVEMANIFEST_H
+#define ARCHIVEMANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "Errors.h"
+#include "HashIndex.h"
+
+
+/**
+ * A page listed in an archive manifest, with a summary of its saved content
+ * so it can be used before its file is opened: the number of index items,
+ * the size of the data, and a filter with a bit set for each non-empty
+ * bucket of the index (keys starting with the byte of an unset bit are not
+ * in the page), the smallest and largest keys of the page (see
+ * ArchivePage_fence_may_have), and its level (see Archive_compact_level).
+ */
+typedef struct ArchiveManifestPage
+{
+    char*                       filename;
+    __uint32_t                  generation;
+    __uint32_t                  n_items;
+    __uint32_t                  data_size;
+    __uint8_t                   filter[HashIndexPageCount / 8];
+    __uint32_t                  level;
+    char                        min_key[20];
+    char                        max_key[20];
+} ArchiveManifestPage;
+
+
+/**
+ Checks if a page may have keys starting with the given byte.
+
+ @param self The manifest page.
+ @param bucket The first byte of the key.
+ @return false if the page has no such key.
+ */
+static inline bool  ArchiveManifestPage_may_have(const ArchiveManifestPage*  self,
+                                                 size_t                      bucket)
+{
+    return (self->filter[bucket / 8] >> (bucket % 8)) & 1;
+}
+
+
+/**
+ * The manifest of an archive lists its page files, oldest first, with the
+ * generation each page had when the archive was saved and a summary of its
+ * content. Page files keep a stable name, so a save only rewrites this file
+ * instead of renaming every changed page, and an archive can be reopened
+ * from it alone.
+ *
+ * The manifest is written to a temporary file, synced and renamed over the
+ * previous one, so it's replaced atomically.
+ */
+typedef struct ArchiveManifest
+{
+    ArchiveManifestPage*        pages;
+    size_t                      n_pages;
+    size_t                      capacity;
+} ArchiveManifest;
+
+
+/**
+ Initializes an empty manifest.
+
+ @param self The manifest.
+ */
+void        ArchiveManifest_init(ArchiveManifest*           self);
+
+
+/**
+ Frees the manifest's internal structure.
+
+ @param self The manifest.
+ */
+void        ArchiveManifest_free(ArchiveManifest*           self);
+
+
+/**
+ Appends a page to the manifest.
+
+ @param self The manifest.
+ @param page The page, its file name is copied.
+ */
+void        ArchiveManifest_add_page(ArchiveManifest*           self,
+                                     const ArchiveManifestPage*  page);
+
+
+/**
+ Writes the manifest atomically.
+
+ @param self The manifest.
+ @param path The path of the manifest file.
+ @return An error code.
+ */
+Errors      ArchiveManifest_write(const ArchiveManifest*    self,
+                                  const char*               path);
+
+
+/**
+ Reads a manifest file, into an initialized manifest.
+
+ @param self The manifest.
+ @param path The path of the manifest file.
+ @return An error code. E_INVALID_MANIFEST if the file is corrupted.
+ */
+Errors      ArchiveManifest_read(ArchiveManifest*           self,
+                                 const char*                path);
+
+
+#endif /* ARCHIVEMANIFEST_H */
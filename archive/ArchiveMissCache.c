@@ -0,0 +1,193 @@
+//
+//  ArchiveMissCache.c
+//  ArchiveLib
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "Checksum.h"
+#include "ArchiveMissCache.h"
+
+
+#define ArchiveMissCacheUsed    ((__uint64_t)1 << 32)
+
+
+#pragma mark - ArchiveMissCache (Private)
+
+
+/**
+ Gets the slot of a key.
+
+ @param self The miss cache.
+ @param key The key (20 bytes).
+ @return The slot.
+ */
+static inline ArchiveMissCacheSlot*     _ArchiveMissCache_slot(const ArchiveMissCache*  self,
+                                                               const char*              key)
+{
+    return self->slots + Checksum_fnv1a(Checksum_fnv1a_init, key, 20) % self->n_slots;
+}
+
+
+/**
+ Packs a key in the words of a used slot.
+
+ @param key The key (20 bytes).
+ @param words The words.
+ */
+static inline void      _ArchiveMissCache_pack(const char*      key,
+                                               __uint64_t*      words)
+{
+    __uint32_t last;
+    memcpy(words, key, 16);
+    memcpy(&last, key + 16, 4);
+    words[2] = ArchiveMissCacheUsed | last;
+}
+
+
+/**
+ Locks a slot to write it, waiting for the lookups writing it.
+
+ @param slot The slot.
+ @return The sequence of the slot before it was locked.
+ */
+static inline __uint64_t    _ArchiveMissCache_lock(ArchiveMissCacheSlot*  slot)
+{
+    __uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    while ((sequence & 1) ||
+           !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        if (sequence & 1) {
+            sched_yield();
+            sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+        }
+    }
+    return sequence;
+}
+
+
+/**
+ Empties a slot, so lookups adding its keys until now don't.
+
+ @param self The miss cache.
+ @param slot The slot.
+ @param key The key to remove, or NULL for any.
+ */
+static void             _ArchiveMissCache_invalidate(ArchiveMissCache*      self,
+                                                     ArchiveMissCacheSlot*  slot,
+                                                     const char*            key)
+{
+    __uint64_t words[3];
+    __uint64_t sequence = _ArchiveMissCache_lock(slot);
+    if (key != NULL) {
+        _ArchiveMissCache_pack(key, words);
+    }
+    if (__atomic_load_n(&slot->key[2], __ATOMIC_RELAXED) & ArchiveMissCacheUsed &&
+        (key == NULL || (__atomic_load_n(&slot->key[0], __ATOMIC_RELAXED) == words[0] &&
+                         __atomic_load_n(&slot->key[1], __ATOMIC_RELAXED) == words[1] &&
+                         __atomic_load_n(&slot->key[2], __ATOMIC_RELAXED) == words[2]))) {
+        __atomic_store_n(&slot->key[2], 0, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&self->stats.n_invalidations, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+
+#pragma mark - ArchiveMissCache
+
+
+void        ArchiveMissCache_init(ArchiveMissCache*     self,
+                                  size_t                n_slots)
+{
+    self->slots = (ArchiveMissCacheSlot*)calloc(n_slots, sizeof(ArchiveMissCacheSlot));
+    self->n_slots = n_slots;
+    memset(&self->stats, 0, sizeof(ArchiveMissCacheStats));
+}
+
+
+void        ArchiveMissCache_free(ArchiveMissCache*     self)
+{
+    free(self->slots);
+    self->slots = NULL;
+    self->n_slots = 0;
+}
+
+
+bool        ArchiveMissCache_has(ArchiveMissCache*      self,
+                                 const char*            key,
+                                 __uint64_t*            sequence)
+{
+    ArchiveMissCacheSlot* slot = _ArchiveMissCache_slot(self, key);
+    __uint64_t words[3];
+    __uint64_t slot_words[3];
+    _ArchiveMissCache_pack(key, words);
+
+    // the words are read again if the slot was written meanwhile
+    __uint64_t before, after;
+    do {
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        slot_words[0] = __atomic_load_n(&slot->key[0], __ATOMIC_RELAXED);
+        slot_words[1] = __atomic_load_n(&slot->key[1], __ATOMIC_RELAXED);
+        slot_words[2] = __atomic_load_n(&slot->key[2], __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    } while (before != after && !(after & 1));
+    *sequence = after;
+
+    bool has = !(after & 1) && memcmp(words, slot_words, sizeof(words)) == 0;
+    __atomic_fetch_add(has ? &self->stats.n_hits : &self->stats.n_misses, 1, __ATOMIC_RELAXED);
+    return has;
+}
+
+
+void        ArchiveMissCache_add(ArchiveMissCache*      self,
+                                 const char*            key,
+                                 __uint64_t             sequence)
+{
+    // a slot being written, or written since, may have been invalidated
+    ArchiveMissCacheSlot* slot = _ArchiveMissCache_slot(self, key);
+    if ((sequence & 1) ||
+        !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __uint64_t words[3];
+    _ArchiveMissCache_pack(key, words);
+    if (__atomic_load_n(&slot->key[2], __ATOMIC_RELAXED) & ArchiveMissCacheUsed) {
+        __atomic_fetch_add(&self->stats.n_evictions, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->key[0], words[0], __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->key[1], words[1], __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->key[2], words[2], __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&self->stats.n_inserts, 1, __ATOMIC_RELAXED);
+}
+
+
+void        ArchiveMissCache_remove(ArchiveMissCache*   self,
+                                    const char*         key)
+{
+    _ArchiveMissCache_invalidate(self, _ArchiveMissCache_slot(self, key), key);
+}
+
+
+void        ArchiveMissCache_clear(ArchiveMissCache*    self)
+{
+    size_t i;
+    for (i = 0; i < self->n_slots; i++) {
+        _ArchiveMissCache_invalidate(self, self->slots + i, NULL);
+    }
+}
+
+
+void        ArchiveMissCache_stats(const ArchiveMissCache*  self,
+                                   ArchiveMissCacheStats*   stats)
+{
+    stats->n_hits           = __atomic_load_n(&self->stats.n_hits, __ATOMIC_RELAXED);
+    stats->n_misses         = __atomic_load_n(&self->stats.n_misses, __ATOMIC_RELAXED);
+    stats->n_inserts        = __atomic_load_n(&self->stats.n_inserts, __ATOMIC_RELAXED);
+    stats->n_evictions      = __atomic_load_n(&self->stats.n_evictions, __ATOMIC_RELAXED);
+    stats->n_invalidations  = __atomic_load_n(&self->stats.n_invalidations, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,136 @@
+#ifndef ARCHIVEMISSCACHE_H
+#define ARCHIVEMISSCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#pragma mark - ArchiveMissCacheStats
+
+
+/**
+ * Metrics of a miss cache. The hit rate is `n_hits / (n_hits + n_misses)`,
+ * misses being the lookups the cache couldn't answer. Keys are evicted by
+ * newer ones falling in their slot.
+ */
+typedef struct ArchiveMissCacheStats
+{
+    size_t                      n_hits;
+    size_t                      n_misses;
+    size_t                      n_inserts;
+    size_t                      n_evictions;
+    size_t                      n_invalidations;
+} ArchiveMissCacheStats;
+
+
+#pragma mark - ArchiveMissCache
+
+
+/**
+ * A slot of the miss cache. Its sequence is odd while it's written, and
+ * moves on with each write, so a key is only added if nothing changed the
+ * slot since the lookup that missed it began. The key is stored in 64 bits
+ * words, the upper half of the last one being 1 if the slot is used.
+ */
+typedef struct ArchiveMissCacheSlot
+{
+    __uint64_t                  sequence;
+    __uint64_t                  key[3];
+} ArchiveMissCacheSlot;
+
+
+/**
+ * A bounded cache of the keys recently looked up and not found in an
+ * archive, so repeated misses are answered without walking the pages. It's
+ * direct-mapped, each key having a single slot.
+ *
+ * Lookups read it without locks (a slot is read again if it changed while
+ * read). A key is removed from it when set, and it's cleared when pages with
+ * existing keys are added to the archive, both after the keys are visible to
+ * the lookups: a lookup adding a key checks that its slot wasn't written
+ * since the lookup began.
+ */
+typedef struct ArchiveMissCache
+{
+    ArchiveMissCacheSlot*       slots;
+    size_t                      n_slots;
+    ArchiveMissCacheStats       stats;
+} ArchiveMissCache;
+
+
+/**
+ Initializes an empty miss cache.
+
+ @param self The miss cache.
+ @param n_slots The number of keys it can hold.
+ */
+void        ArchiveMissCache_init(ArchiveMissCache*     self,
+                                  size_t                n_slots);
+
+
+/**
+ Frees the miss cache's internal structure.
+
+ @param self The miss cache.
+ */
+void        ArchiveMissCache_free(ArchiveMissCache*     self);
+
+
+/**
+ Checks if a key is known to be missing.
+
+ @param self The miss cache.
+ @param key The key (20 bytes).
+ @param sequence A pointer in which the sequence of the key's slot is
+                 written, to add the key with if the lookup misses it.
+ @return true if the key is missing.
+ */
+bool        ArchiveMissCache_has(ArchiveMissCache*      self,
+                                 const char*            key,
+                                 __uint64_t*            sequence);
+
+
+/**
+ Adds a key missed by a lookup, unless its slot changed since the lookup
+ began.
+
+ @param self The miss cache.
+ @param key The key (20 bytes).
+ @param sequence The sequence of the key's slot from ArchiveMissCache_has.
+ */
+void        ArchiveMissCache_add(ArchiveMissCache*      self,
+                                 const char*            key,
+                                 __uint64_t             sequence);
+
+
+/**
+ Removes a key, once it's set and visible to the lookups.
+
+ @param self The miss cache.
+ @param key The key (20 bytes).
+ */
+void        ArchiveMissCache_remove(ArchiveMissCache*   self,
+                                    const char*         key);
+
+
+/**
+ Removes all the keys, once keys were added to the archive and are visible
+ to the lookups.
+
+ @param self The miss cache.
+ */
+void        ArchiveMissCache_clear(ArchiveMissCache*    self);
+
+
+/**
+ Gets the metrics of the miss cache.
+
+ @param self The miss cache.
+ @param stats A pointer in which the metrics are written.
+ */
+void        ArchiveMissCache_stats(const ArchiveMissCache*  self,
+                                   ArchiveMissCacheStats*   stats);
+
+
+#endif /* ARCHIVEMISSCACHE_H */
@@ -1,6 +1,11 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // for O_DIRECT
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <stddef.h>
 
 #include <stdbool.h>
 #include <unistd.h>
@@ -9,7 +14,10 @@
 #include <sys/stat.h>
 
 #include "Endian.h"
+#include "FileIO.h"
+#include "Checksum.h"
 #include "ArchivePage.h"
+#include "ArchiveWal.h"
 #include "HashIndexPack.h"
 
 #include <fcntl.h>
@@ -31,70 +39,270 @@ typedef struct __attribute__((__packed__)) ArchiveFileHeader
 } ArchiveFileHeader;
 
 
+/**
+ * The file header of version 2, which adds the generation of the page: the
+ * number of times it was saved. Pages keep their file name across saves, and
+ * the generation tells which save a file is at.
+ */
+typedef struct __attribute__((__packed__)) ArchiveFileHeaderV2
+{
+    ArchiveFileHeader       header;
+    __uint32_t              generation;
+} ArchiveFileHeaderV2;
+
+
+/**
+ * The file header of version 3, which ends with a checksum (CRC32C) of the
+ * fields before it. The data of each item of these pages is followed by the
+ * checksum of its key and data (see ArchivePage_item_checksum).
+ */
+typedef struct __attribute__((__packed__)) ArchiveFileHeaderV3
+{
+    ArchiveFileHeaderV2     header;
+    __uint32_t              checksum;
+} ArchiveFileHeaderV3;
+
+
+/**
+ * The file header of version 5, which adds the fence of the page (see
+ * ArchivePage_fence_may_have) before the checksum, so lookups can skip the
+ * page without reading its index.
+ */
+typedef struct __attribute__((__packed__)) ArchiveFileHeaderV5
+{
+    ArchiveFileHeaderV2     header;
+    __uint8_t               filter[HashIndexPageCount / 8];
+    char                    min_key[20];
+    char                    max_key[20];
+    __uint32_t              checksum;
+} ArchiveFileHeaderV5;
+
+
+/**
+ * Version 4 has the header of version 3, its items may be stored in the blob
+ * file of the page (see HashItem_is_blob), and its page file holds up to
+ * 2 GB of data.
+ */
 typedef enum ArchiveFileVersion {
     ArchiveFileVersion1 = 1,
+    ArchiveFileVersion2 = 2,
+    ArchiveFileVersion3 = 3,
+    ArchiveFileVersion4 = 4,
+    ArchiveFileVersion5 = 5,
 } ArchiveFileVersion;
 
 
-static size_t ArchivePage_index_start = sizeof(ArchiveFileHeader);
-static size_t ArchivePage_data_start = sizeof(ArchiveFileHeader) + (_MAX_ITEMS_PER_INDEX * sizeof(PackedHashItem));
+static const ArchiveFileVersion ArchivePage_version = ArchiveFileVersion5;
 static size_t ArchivePage_capacity = _MAX_ITEMS_PER_INDEX;
 
+// the size of the writes of ArchivePage_build
+#define ArchivePageBuildBufferSize  (4 << 20)
 
-#pragma mark Read / Write
+// the offsets, sizes and buffers of direct reads, and the items of the blob
+// files, are aligned on blocks of this size
+#define ArchivePageBlockSize    4096
 
 
-static inline off_t     fsize(const char*               filename)
+/**
+ The index starts right after the header, whose size depends on the version
+ of the file.
+ */
+static inline size_t    ArchivePage_index_start(const ArchivePage*  self)
 {
-    struct stat st;
-    if (stat(filename, &st) == 0) {
-        return st.st_size;
+    switch (self->version) {
+        case ArchiveFileVersion1:
+            return sizeof(ArchiveFileHeader);
+        case ArchiveFileVersion2:
+            return sizeof(ArchiveFileHeaderV2);
+        case ArchiveFileVersion3:
+        case ArchiveFileVersion4:
+            return sizeof(ArchiveFileHeaderV3);
+        default:
+            return sizeof(ArchiveFileHeaderV5);
     }
-    return (-1);
 }
 
 
-static inline Errors    write_to_file(file_descriptor   fd,
-                                      const void*       buffer,
-                                      size_t            size,
-                                      off_t             offset)
+static inline size_t    ArchivePage_data_start(const ArchivePage*   self)
 {
-    off_t writen = 0;
-    ssize_t r;
-    while (writen < size) {
-        r = pwrite(fd, (char*)buffer + writen, size - writen, offset + writen);
-        if (r < 0) {
-            return E_SYSTEM_ERROR_ERRNO;
-        }
-        writen += r;
+    return ArchivePage_index_start(self) + (ArchivePage_capacity * sizeof(PackedHashItem));
+}
+
+
+/**
+ The size of the checksum following the data of each item, if the version of
+ the file has one.
+ */
+static inline size_t    ArchivePage_trailer_size(const ArchivePage* self)
+{
+    return self->version >= ArchiveFileVersion3 ? sizeof(__uint32_t) : 0;
+}
+
+
+static inline size_t    ArchivePage_round_to_block(size_t size)
+{
+    return (size + ArchivePageBlockSize - 1) & ~(size_t)(ArchivePageBlockSize - 1);
+}
+
+
+/**
+ Checks if an item is stored in the blob file of the page. Older pages have
+ no blob file, the flag is part of their data offsets.
+
+ @param self The archive page.
+ @param item The item.
+ @return true if the item is a blob.
+ */
+static inline bool      ArchivePage_item_is_blob(const ArchivePage* self,
+                                                 const HashItem*    item)
+{
+    return self->version >= ArchiveFileVersion4 && HashItem_is_blob(item);
+}
+
+
+/**
+ Gets the file and the position in it of the data of an item.
+
+ @param self The archive page.
+ @param item The item.
+ @param _fd A pointer to the file descriptor of the file.
+ @param _direct_fd A pointer to the descriptor for direct reads of the file.
+ @return The position of the data in the file.
+ */
+static inline off_t     ArchivePage_item_position(const ArchivePage*    self,
+                                                  const HashItem*       item,
+                                                  file_descriptor*      _fd,
+                                                  file_descriptor*      _direct_fd)
+{
+    if (ArchivePage_item_is_blob(self, item)) {
+        *_fd = self->blob_fd;
+        *_direct_fd = self->blob_direct_fd;
+        return (off_t)((item->data_offset & ~HashItemBlobFlag) * ArchivePageBlockSize);
     }
-    return E_SUCCESS;
+    *_fd = self->fd;
+    *_direct_fd = self->direct_fd;
+    return (off_t)(ArchivePage_data_start(self) + item->data_offset);
 }
 
 
-static inline Errors    read_from_file(file_descriptor  fd,
-                                       void*            buffer,
-                                       size_t           size,
-                                       off_t            offset)
+/**
+ Checks if an item of a given size goes to the blob file of the page.
+ */
+static inline bool      ArchivePage_stores_blob(const ArchivePage*  self,
+                                                size_t              size)
 {
-    off_t read = 0;
-    ssize_t r;
-    while (read < size) {
-        r = pread(fd, (char*)buffer + read, size - read, offset + read);
-        // If `pread` returns 0 or <0, we can consider this an error.
-        // As per the spec:
-        // > On success, pread() returns the number of bytes read (a return of
-        // > zero indicates end of file).
-        // > On error, -1 is returned.
-        if (r == 0) {
-            return E_FILE_READ_ERROR;
+    return self->blob_threshold > 0 && size >= self->blob_threshold &&
+           self->version >= ArchiveFileVersion4;
+}
+
+
+/**
+ Computes the checksum of an item, which covers its key so that an index
+ slot pointing to the data of another item doesn't go unnoticed.
+
+ @param key The key of the item (20 bytes).
+ @param data The data of the item.
+ @param size The size of the data.
+ @return The checksum.
+ */
+static inline __uint32_t ArchivePage_item_checksum(const char*      key,
+                                                   const void*      data,
+                                                   size_t           size)
+{
+    return Checksum_crc32c(Checksum_crc32c(0, key, 20), data, size);
+}
+
+
+/**
+ Computes the fence of a page from its index: a bit per bucket holding keys,
+ and the smallest and largest keys, or an empty range if it has none.
+
+ @param self The archive page.
+ @param filter The filter (HashIndexPageCount bits).
+ @param min_key A pointer in which the smallest key (20 bytes) is written.
+ @param max_key A pointer in which the largest key (20 bytes) is written.
+ */
+static void             ArchivePage_compute_fence(const ArchivePage*    self,
+                                                  __uint8_t*            filter,
+                                                  char*                 min_key,
+                                                  char*                 max_key)
+{
+    const HashPage* bucket;
+    size_t first = HashIndexPageCount;
+    size_t last = 0;
+    size_t i, j;
+    memset(filter, 0, HashIndexPageCount / 8);
+    for (i = 0; i < HashIndexPageCount; i++) {
+        if (self->index->pages[i].n_items > 0) {
+            filter[i / 8] |= 1 << (i % 8);
+            first = first < i ? first : i;
+            last = i;
         }
-        if (r < 0) {
-            return E_SYSTEM_ERROR_ERRNO;
+    }
+    memset(min_key, 0xff, 20);
+    memset(max_key, 0, 20);
+    if (first == HashIndexPageCount) {
+        return;
+    }
+
+    // the keys of a bucket start with its byte, so they're in the first and
+    // last buckets holding keys
+    bucket = self->index->pages + first;
+    memcpy(min_key, bucket->items[0].key, 20);
+    for (j = 1; j < bucket->n_items; j++) {
+        if (memcmp(bucket->items[j].key, min_key, 20) < 0) {
+            memcpy(min_key, bucket->items[j].key, 20);
         }
-        read += r;
     }
-    return E_SUCCESS;
+    bucket = self->index->pages + last;
+    memcpy(max_key, bucket->items[0].key, 20);
+    for (j = 1; j < bucket->n_items; j++) {
+        if (memcmp(bucket->items[j].key, max_key, 20) > 0) {
+            memcpy(max_key, bucket->items[j].key, 20);
+        }
+    }
+}
+
+
+/**
+ Widens the fence of a page to a key set in its index.
+
+ @param self The archive page.
+ @param key The key.
+ */
+static inline void      ArchivePage_widen_fence(ArchivePage*    self,
+                                                const char*     key)
+{
+    size_t bucket = _HashIndex_key(key);
+    self->filter[bucket / 8] |= 1 << (bucket % 8);
+    if (memcmp(key, self->min_key, 20) < 0) {
+        memcpy(self->min_key, key, 20);
+    }
+    if (memcmp(key, self->max_key, 20) > 0) {
+        memcpy(self->max_key, key, 20);
+    }
+}
+
+
+/**
+ Checks the checksum ending the header of a page file, for versions 3 and
+ above.
+
+ @param self The archive page.
+ @param file_header The header.
+ @return E_CHECKSUM_MISMATCH if the header is corrupted, or E_SUCCESS.
+ */
+static inline Errors    ArchivePage_check_file_header(const ArchivePage*  self,
+                                                      const void*         file_header)
+{
+    if (self->version < ArchiveFileVersion3) {
+        return E_SUCCESS;
+    }
+    size_t checksum_offset = ArchivePage_index_start(self) - sizeof(__uint32_t);
+    __uint32_t checksum;
+    memcpy(&checksum, (const char*)file_header + checksum_offset, sizeof(__uint32_t));
+    return be32toh(checksum) == Checksum_crc32c(0, file_header, checksum_offset) ?
+        E_SUCCESS : E_CHECKSUM_MISMATCH;
 }
 
 
@@ -118,7 +326,7 @@ static inline Errors    ArchivePage_read_file_index(ArchivePage*        self,
         self->fd,
         p_items,
         p_items_size,
-        ArchivePage_index_start
+        ArchivePage_index_start(self)
     );
     if (error != E_SUCCESS) {
         free(p_items);
@@ -145,7 +353,7 @@ static inline Errors    ArchivePage_read_file_header(ArchivePage*       self)
     Errors error;
     
     // read ArchiveFileHeader from file
-    ArchiveFileHeader file_header;
+    ArchiveFileHeaderV5 file_header;
 
     char* full_file_path;
     asprintf(&full_file_path, "%s%s", self->base_file_path, self->filename);
@@ -166,20 +374,44 @@ static inline Errors    ArchivePage_read_file_header(ArchivePage*       self)
     }
     
     // check data consistency
-    if (be32toh(file_header.version) != ArchiveFileVersion1) {
+    self->version = be32toh(file_header.header.header.version);
+    if (self->version != ArchiveFileVersion1 &&
+        self->version != ArchiveFileVersion2 &&
+        self->version != ArchiveFileVersion3 &&
+        self->version != ArchiveFileVersion4 &&
+        self->version != ArchiveFileVersion5) {
         return E_UNKNOWN_ARCHIVE_VERSION;
     }
 
+    // read the fields added by newer versions
+    self->generation = 0;
+    if (self->version >= ArchiveFileVersion2) {
+        if (size < ArchivePage_index_start(self)) {
+            return E_FILE_READ_ERROR;
+        }
+        error = read_from_file(self->fd, &file_header, ArchivePage_index_start(self), 0);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+        self->generation = be32toh(file_header.header.generation);
+    }
+
+    // a torn or corrupted header can't be trusted
+    error = ArchivePage_check_file_header(self, &file_header);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
     // enforce the right endianness
-    size_t capacity     = be32toh(file_header.capacity);
-    size_t n_items      = be32toh(file_header.n_items);
-    size_t index_start  = be32toh(file_header.index_start);
-    size_t data_start   = be32toh(file_header.data_start);
-    size_t data_size    = be32toh(file_header.data_size);
+    size_t capacity     = be32toh(file_header.header.header.capacity);
+    size_t n_items      = be32toh(file_header.header.header.n_items);
+    size_t index_start  = be32toh(file_header.header.header.index_start);
+    size_t data_start   = be32toh(file_header.header.header.data_start);
+    size_t data_size    = be32toh(file_header.header.header.data_size);
 
     // check data consistency
-    if (index_start != ArchivePage_index_start ||
-        data_start != ArchivePage_data_start ||
+    if (index_start != ArchivePage_index_start(self) ||
+        data_start != ArchivePage_data_start(self) ||
         capacity != ArchivePage_capacity ||
         n_items > capacity ||
         data_size + data_start > size) {
@@ -193,6 +425,15 @@ static inline Errors    ArchivePage_read_file_header(ArchivePage*       self)
     // read index
     error = ArchivePage_read_file_index(self, n_items);
 
+    // and the fence, computed from it for older versions
+    if (error == E_SUCCESS && self->version >= ArchiveFileVersion5) {
+        memcpy(self->filter, file_header.filter, sizeof(self->filter));
+        memcpy(self->min_key, file_header.min_key, 20);
+        memcpy(self->max_key, file_header.max_key, 20);
+    } else if (error == E_SUCCESS) {
+        ArchivePage_refresh_fence(self);
+    }
+
     return error;
 }
 
@@ -200,56 +441,90 @@ static inline Errors    ArchivePage_read_file_header(ArchivePage*       self)
 #pragma mark ArchivePage Header Serialization
 
 
-static inline void      ArchivePage_dump_file_header(const ArchivePage* self,
+static inline size_t    ArchivePage_dump_file_header(const ArchivePage* self,
                                                      void*              buf)
 {
-    ArchiveFileHeader file_header;
-    file_header.version     = htobe32(ArchiveFileVersion1);
-    file_header.capacity    = htobe32((__uint32_t)ArchivePage_capacity);
-    file_header.n_items     = htobe32((__uint32_t)self->index->n_items);
-    file_header.index_start = htobe32((__uint32_t)ArchivePage_index_start);
-    file_header.data_start  = htobe32((__uint32_t)ArchivePage_data_start);
-    file_header.data_size   = htobe32((__uint32_t)self->data_size);
-    memcpy(buf, &file_header, sizeof(ArchiveFileHeader));
+    ArchiveFileHeaderV5 file_header;
+    file_header.header.header.version     = htobe32(self->version);
+    file_header.header.header.capacity    = htobe32((__uint32_t)ArchivePage_capacity);
+    file_header.header.header.n_items     = htobe32((__uint32_t)self->index->n_items);
+    file_header.header.header.index_start = htobe32((__uint32_t)ArchivePage_index_start(self));
+    file_header.header.header.data_start  = htobe32((__uint32_t)ArchivePage_data_start(self));
+    file_header.header.header.data_size   = htobe32((__uint32_t)self->data_size);
+    file_header.header.generation         = htobe32(self->generation);
+    if (self->version >= ArchiveFileVersion5) {
+        ArchivePage_compute_fence(self, file_header.filter, file_header.min_key, file_header.max_key);
+    }
+
+    // older pages keep their header, the checksum ends it
+    size_t header_size = ArchivePage_index_start(self);
+    if (self->version >= ArchiveFileVersion3) {
+        size_t checksum_offset = header_size - sizeof(__uint32_t);
+        __uint32_t checksum = htobe32(Checksum_crc32c(0, &file_header, checksum_offset));
+        memcpy((char*)&file_header + checksum_offset, &checksum, sizeof(__uint32_t));
+    }
+    memcpy(buf, &file_header, header_size);
+    return header_size;
 }
 
 
 /**
- Write the file header to the archive's file descriptor.
+ Write the file header to the archive's file descriptor. The header fits in
+ a single sector, so the write is atomic.
 
  @param self The archive.
  @return An error code.
  */
 static inline Errors    ArchivePage_write_file_header(const ArchivePage* self)
 {
-    Errors error;
-    
-    // allocate a buffer to write the full header + index
-    // use calloc to make sure we fill up empty space with 0 in the file
-    size_t header_size = sizeof(ArchiveFileHeader) +
-                         (sizeof(PackedHashItem) * ArchivePage_capacity);
-    void* buf = calloc(header_size, 1);
-    
-    // write the header
-    ArchivePage_dump_file_header(self, buf);
-    
-    // write the index
-    size_t n_items;
-    error = HashIndex_pack(self->index, (PackedHashItem*)(buf + ArchivePage_index_start), ArchivePage_capacity, &n_items);
-    if (error != E_SUCCESS) {
-        free(buf);
-        return error;
+    char buf[sizeof(ArchiveFileHeaderV5)];
+    size_t header_size = ArchivePage_dump_file_header(self, buf);
+    return write_to_file(self->fd, buf, header_size, 0);
+}
+
+
+/**
+ Write the index items set since the last save to the archive's file
+ descriptor, after the saved ones. The header isn't updated, so until it is
+ the new items are ignored when reading the file.
+
+ @param self The archive.
+ @return An error code.
+ */
+static inline Errors    ArchivePage_write_file_index(const ArchivePage* self)
+{
+    if (self->n_unsaved_items == 0) {
+        return E_SUCCESS;
     }
-    
-    // write to file
-    error = write_to_file(self->fd, buf, header_size, 0);
-    if (error != E_SUCCESS) {
-        free(buf);
-        return error;
+    size_t n_saved_items = self->index->n_items - self->n_unsaved_items;
+    return write_to_file(
+        self->fd,
+        self->unsaved_items,
+        sizeof(PackedHashItem) * self->n_unsaved_items,
+        (off_t)(ArchivePage_index_start(self) + (sizeof(PackedHashItem) * n_saved_items))
+    );
+}
+
+
+/**
+ Keeps track of the newest item of a key, to write it to the file's index on
+ the next save.
+
+ @param self The archive.
+ @param key The key of the item.
+ */
+static inline void      ArchivePage_add_unsaved_item(ArchivePage*   self,
+                                                     const char*    key)
+{
+    // there can't be more unsaved items than free slots in the file's index
+    if (self->unsaved_items == NULL) {
+        size_t n_saved_items = self->index->n_items - 1;
+        self->unsaved_items = (PackedHashItem*)malloc(
+            sizeof(PackedHashItem) * (ArchivePage_capacity - n_saved_items));
     }
-    
-    free(buf);
-    return E_SUCCESS;
+    HashItem_pack(HashIndex_get(self->index, key, 20),
+                  self->unsaved_items + self->n_unsaved_items);
+    self->n_unsaved_items += 1;
 }
 
 
@@ -299,106 +574,531 @@ static inline Errors    ArchivePage_open_file(ArchivePage*      self,
 
 
 /**
- Close the archive's file descriptor.
+ Builds the path of the archive's write-ahead log.
 
  @param self The archive.
+ @return The path, which should be free'ed by the caller.
  */
-static inline void      ArchivePage_close_file(ArchivePage*         self)
+static inline char*     ArchivePage_wal_path(const ArchivePage*     self)
 {
-    flock(self->fd, LOCK_UN);
-    close(self->fd);
-    self->fd = (-1);
+    char* wal_path;
+    asprintf(&wal_path, "%s%s.wal", self->base_file_path, self->filename);
+    return wal_path;
 }
 
 
-static inline Errors    ArchivePage_read_item(const ArchivePage*    self,
-                                              const HashItem*       item,
-                                              size_t                data_max_size,
-                                              char**                _data,
-                                              size_t*               _data_size)
+/**
+ Logs the file header to the page's write-ahead log, before it's written in
+ place.
+
+ @param self The archive.
+ @return An error code.
+ */
+static inline Errors    ArchivePage_log_file_header(ArchivePage*    self)
 {
-    size_t data_size = item->data_size;
-    size_t data_offset = item->data_offset;
+    char buf[sizeof(ArchiveFileHeaderV5)];
+    size_t header_size = ArchivePage_dump_file_header(self, buf);
+    char* wal_path = ArchivePage_wal_path(self);
+    Errors error = ArchiveWal_log_header(self->wal, wal_path, buf, header_size);
+    free(wal_path);
+    return error;
+}
+
+
+/**
+ Replays the items of the archive's write-ahead log, if the page wasn't
+ saved after they were logged.
+
+ @param self The archive.
+ @param items The items recovered from the log.
+ @param n_items The number of items.
+ */
+static inline void      ArchivePage_replay_wal(ArchivePage*         self,
+                                               const PackedHashItem* items,
+                                               size_t               n_items)
+{
+    struct stat st;
+    if (n_items == 0 || fstat(self->fd, &st) < 0) {
+        return;
+    }
     
-    // if a `data_max_size` is specified, and if it's smaller than the actual
-    // file data size, then we read only that `data_max_size` chunk
-    size_t data_read_size = data_size;
-    if (data_max_size > 0 && data_max_size < data_read_size) {
-        data_read_size = data_max_size;
+    struct stat blob_st;
+    blob_st.st_size = 0;
+    if (self->blob_fd >= 0 && fstat(self->blob_fd, &blob_st) < 0) {
+        return;
     }
-   
-    // alloc the data chunk
-    char* data = (char*)malloc(sizeof(char) * data_read_size);
-
-    // read from file
-    Errors error = read_from_file(
-        self->fd,
-        data,
-        data_read_size,
-        (off_t)(ArchivePage_data_start + data_offset)
-    );
 
-    // if error, free data and return
-    if (error != E_SUCCESS) {
-        free(data);
-        return error;
+    HashItem item;
+    file_descriptor fd, direct_fd;
+    size_t end;
+    size_t i;
+    for (i = 0; i < n_items; i++) {
+        HashItem_unpack(&item, items + i);
+        
+        // the data is synced before the log, but never trust it blindly
+        end = (size_t)ArchivePage_item_position(self, &item, &fd, &direct_fd) +
+              item.data_size + ArchivePage_trailer_size(self);
+        if (!HashItem_is_tombstone(&item) &&
+            end > (size_t)(ArchivePage_item_is_blob(self, &item) ? blob_st.st_size : st.st_size)) {
+            break;
+        }
+        if (HashIndex_set(self->index, item.key, item.data_offset, item.data_size) != E_SUCCESS) {
+            break;
+        }
+        ArchivePage_add_unsaved_item(self, item.key);
+        if (ArchivePage_item_is_blob(self, &item)) {
+            if (ArchivePage_round_to_block(end) > self->blob_size) {
+                self->blob_size = ArchivePage_round_to_block(end);
+            }
+        } else if (!HashItem_is_tombstone(&item) &&
+            item.data_offset + item.data_size + ArchivePage_trailer_size(self) > self->data_size) {
+            self->data_size = item.data_offset + item.data_size + ArchivePage_trailer_size(self);
+        }
+        self->has_changes = true;
     }
+}
 
-    // assign return pointers
-    *_data_size = data_size;
-    *_data = data;
 
-    return E_SUCCESS;
+/**
+ Close the archive's file descriptor.
+
+ @param self The archive.
+ */
+static inline void      ArchivePage_close_file(ArchivePage*         self)
+{
+    if (self->direct_fd >= 0) {
+        close(self->direct_fd);
+        self->direct_fd = (-1);
+    }
+    if (self->blob_direct_fd >= 0) {
+        close(self->blob_direct_fd);
+        self->blob_direct_fd = (-1);
+    }
+    if (self->blob_fd >= 0) {
+        close(self->blob_fd);
+        self->blob_fd = (-1);
+    }
+    flock(self->fd, LOCK_UN);
+    close(self->fd);
+    self->fd = (-1);
 }
 
 
-static Errors       ArchivePage_write_item(ArchivePage*     self,
-                                           const char*      data,
-                                           size_t           size,
-                                           size_t*          _data_offset)
+/**
+ Builds the path of the archive's blob file.
+
+ @param self The archive.
+ @return The path, which should be free'ed by the caller.
+ */
+static inline char*     ArchivePage_blob_path(const ArchivePage*    self)
 {
+    char* blob_path;
+    asprintf(&blob_path, "%s%s.blob", self->base_file_path, self->filename);
+    return blob_path;
+}
 
-    // the item is positioned at the end of the files data section
-    size_t offset = self->data_size;
 
-    // write to file
-    Errors error = write_to_file(
-        self->fd,
-        data,
-        size,
-        (off_t)(ArchivePage_data_start + offset)
-    );
+/**
+ Opens a file for direct reads.
 
-    if (error != E_SUCCESS) {
-        return error;
+ @param path The path of the file.
+ @return The file descriptor, or -1 if the file system doesn't support
+         direct I/O.
+ */
+static inline file_descriptor ArchivePage_open_direct(const char*   path)
+{
+#if defined(O_DIRECT)
+    return open(path, O_RDONLY | O_DIRECT);
+#else
+    file_descriptor fd = open(path, O_RDONLY);
+#if defined(F_NOCACHE)
+    if (fd >= 0 && fcntl(fd, F_NOCACHE, 1) < 0) {
+        close(fd);
+        fd = (-1);
     }
-
-    // update the data size
-    self->data_size += size;
-    
-    // set return pointer
-    *_data_offset = offset;
-
-    return E_SUCCESS;
+#endif
+    return fd;
+#endif
 }
 
 
-#pragma mark ArchivePage Public Functions
-
+/**
+ Opens the file descriptors used for direct reads, of the page file and of
+ the blob file. They stay closed if the file system doesn't support direct
+ I/O.
 
-Errors      ArchivePage_init(ArchivePage*           self,
-                             const char*            filename,
-                             const char*            base_file_name,
-                             bool                   new_file)
+ @param self The archive page.
+ */
+static inline void      ArchivePage_open_direct_files(ArchivePage*  self)
 {
-    Errors error;
-    size_t str_size = strlen(filename) + 1;
+    char* path;
+    if (self->direct_fd < 0) {
+        asprintf(&path, "%s%s", self->base_file_path, self->filename);
+        self->direct_fd = ArchivePage_open_direct(path);
+        free(path);
+    }
+    if (self->blob_fd >= 0 && self->blob_direct_fd < 0) {
+        path = ArchivePage_blob_path(self);
+        self->blob_direct_fd = ArchivePage_open_direct(path);
+        free(path);
+    }
+}
 
-    // copy filename to the struct
-    self->filename = (char*)malloc(str_size);
-    memcpy(self->filename, filename, str_size);
 
-    // get new string size
+/**
+ Opens the blob file of the archive page.
+
+ @param self The archive page.
+ @param create Whether to create the file if the page has none yet.
+ @return An error code. A page without blob file isn't an error.
+ */
+static inline Errors    ArchivePage_open_blob_file(ArchivePage*     self,
+                                                   bool             create)
+{
+    char* blob_path = ArchivePage_blob_path(self);
+    file_descriptor fd = open(blob_path, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+    free(blob_path);
+    if (fd < 0) {
+        return (!create && errno == ENOENT) ? E_SUCCESS : E_SYSTEM_ERROR_ERRNO;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    self->blob_fd = fd;
+
+    // new items start after whatever is there, even torn writes
+    self->blob_size = ArchivePage_round_to_block((size_t)st.st_size);
+    if (self->direct_threshold > 0) {
+        ArchivePage_open_direct_files(self);
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Checks if some data can be read directly: it's large enough and aligned in
+ its file.
+
+ @param self The archive page.
+ @param direct_fd The descriptor for direct reads of the file.
+ @param offset The position of the data in the file.
+ @param size The number of bytes to read.
+ @return A boolean representing wheather the data can be read directly.
+ */
+static inline bool      ArchivePage_can_read_direct(const ArchivePage*  self,
+                                                    file_descriptor     direct_fd,
+                                                    off_t               offset,
+                                                    size_t              size)
+{
+    return direct_fd >= 0 &&
+           size >= self->direct_threshold &&
+           offset % ArchivePageBlockSize == 0;
+}
+
+
+/**
+ Reads from a direct file descriptor. The buffer and the offset are
+ aligned, and the size read is rounded up to the alignment, so the buffer
+ must have room for it; the end of the file may cut the last block short.
+
+ @param fd The descriptor for direct reads of the file.
+ @param buffer The buffer (aligned).
+ @param size The number of bytes needed.
+ @param offset The offset in the file (aligned).
+ @return An error code.
+ */
+static inline Errors    ArchivePage_read_direct(file_descriptor     fd,
+                                                void*               buffer,
+                                                size_t              size,
+                                                off_t               offset)
+{
+    size_t aligned_size = ArchivePage_round_to_block(size);
+    size_t read = 0;
+    ssize_t r;
+    while (read < size) {
+        r = pread(fd, (char*)buffer + read, aligned_size - read, offset + (off_t)read);
+        if (r == 0) {
+            return E_FILE_READ_ERROR;
+        }
+        if (r < 0) {
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        read += (size_t)r;
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Checks if a read should be verified, as configured for the page.
+
+ @param self The archive page.
+ @return A boolean representing wheather the read should be verified.
+ */
+static inline bool      ArchivePage_should_verify(const ArchivePage* self)
+{
+    switch (self->verify_mode) {
+        case ArchiveVerifyAlways:
+            return true;
+        case ArchiveVerifySampled:
+            return self->verify_sample_rate <= 1 ||
+                   arc4random_uniform(self->verify_sample_rate) == 0;
+        default:
+            return false;
+    }
+}
+
+
+/**
+ Reads a range of the data of an item.
+
+ @param self The archive page.
+ @param item The item (not a tombstone).
+ @param range_offset The offset in the data of the first byte to read, the
+                     range is empty if it's past the end of the data.
+ @param data_max_size The maximum number of bytes to read, 0 to read up to
+                      the end of the data.
+ @param _data A pointer to the char* that will be returned.
+ @param _data_size A pointer to the number of bytes read.
+ @return An error code.
+ */
+static inline Errors    ArchivePage_read_item(const ArchivePage*    self,
+                                              const HashItem*       item,
+                                              size_t                range_offset,
+                                              size_t                data_max_size,
+                                              char**                _data,
+                                              size_t*               _data_size)
+{
+    size_t data_size = item->data_size;
+    size_t start = range_offset < data_size ? range_offset : data_size;
+    
+    // if a `data_max_size` is specified, and if it's smaller than the rest of
+    // the data, then we read only that `data_max_size` chunk
+    size_t data_read_size = data_size - start;
+    if (data_max_size > 0 && data_max_size < data_read_size) {
+        data_read_size = data_max_size;
+    }
+
+    // full reads are verified with the checksum that follows the data
+    size_t trailer_size = 0;
+    if (data_read_size == data_size && ArchivePage_should_verify(self)) {
+        trailer_size = ArchivePage_trailer_size(self);
+    }
+   
+    // read from file, bypassing the page cache for large items, the buffer of
+    // a direct read is aligned and can be free'ed as any other
+    char* data = NULL;
+    Errors error = E_SYSTEM_ERROR_ERRNO;
+    file_descriptor fd, direct_fd;
+    off_t offset = ArchivePage_item_position(self, item, &fd, &direct_fd) + (off_t)start;
+    if (ArchivePage_can_read_direct(self, direct_fd, offset, data_read_size)) {
+        size_t aligned_size = ArchivePage_round_to_block(data_read_size + trailer_size);
+        if (posix_memalign((void**)&data, ArchivePageBlockSize, aligned_size) == 0) {
+            error = ArchivePage_read_direct(direct_fd, data, data_read_size + trailer_size, offset);
+            if (error != E_SUCCESS) {
+                free(data);
+                data = NULL;
+            }
+        }
+    }
+    if (data == NULL) {
+        data = (char*)malloc(sizeof(char) * (data_read_size + trailer_size));
+        error = read_from_file(fd, data, data_read_size + trailer_size, offset);
+    }
+
+    // check the data
+    __uint32_t checksum;
+    if (error == E_SUCCESS && trailer_size > 0) {
+        memcpy(&checksum, data + data_size, sizeof(__uint32_t));
+        if (be32toh(checksum) != ArchivePage_item_checksum(item->key, data, data_size)) {
+            error = E_CHECKSUM_MISMATCH;
+        }
+    }
+
+    // if error, free data and return
+    if (error != E_SUCCESS) {
+        free(data);
+        return error;
+    }
+
+    // assign return pointers
+    *_data_size = data_read_size;
+    *_data = data;
+
+    return E_SUCCESS;
+}
+
+
+/**
+ Writes the data of an item, followed by its checksum, at the end of the blob
+ file of the page.
+
+ @param self The archive page.
+ @param key The key of the item.
+ @param data The data of the item.
+ @param size The size of the data.
+ @param _data_offset A pointer in which the data offset of the item, flagged
+                     as a blob, is written.
+ @return An error code. E_INDEX_MAX_SIZE_EXCEEDED if the blob file is full.
+ */
+static Errors       ArchivePage_write_blob(ArchivePage*     self,
+                                           const char*      key,
+                                           const char*      data,
+                                           size_t           size,
+                                           size_t*          _data_offset)
+{
+    Errors error;
+    if (self->blob_fd < 0) {
+        error = ArchivePage_open_blob_file(self, true);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+    }
+
+    // the offset in blocks must stay below the tombstone's
+    size_t block = self->blob_size / ArchivePageBlockSize;
+    if (block >= HashItemBlobFlag - 1) {
+        return E_INDEX_MAX_SIZE_EXCEEDED;
+    }
+
+    error = write_to_file(self->blob_fd, data, size, (off_t)self->blob_size);
+    size_t trailer_size = ArchivePage_trailer_size(self);
+    __uint32_t checksum = htobe32(ArchivePage_item_checksum(key, data, size));
+    if (error == E_SUCCESS) {
+        error = write_to_file(self->blob_fd, &checksum, trailer_size, (off_t)(self->blob_size + size));
+    }
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    self->blob_size = ArchivePage_round_to_block(self->blob_size + size + trailer_size);
+    *_data_offset = HashItemBlobFlag | block;
+    return E_SUCCESS;
+}
+
+
+/**
+ Computes the data offset of the next item written to the page file: the end
+ of the file's data section, aligned if the item is to be read directly.
+
+ @param self The archive page.
+ @param data_size The size of the file's data section.
+ @param size The size of the item's data.
+ @return The data offset.
+ */
+static inline size_t    ArchivePage_next_offset(const ArchivePage*  self,
+                                                size_t              data_size,
+                                                size_t              size)
+{
+    size_t offset = data_size;
+    if (self->direct_threshold > 0 && size >= self->direct_threshold) {
+        size_t start = ArchivePage_data_start(self);
+        offset = ArchivePage_round_to_block(start + offset) - start;
+    }
+    return offset;
+}
+
+
+/**
+ Checks if an item fits in the data section of the page file at a given
+ offset: the data offsets must stay below the offset marking tombstones,
+ and below the flag of blobs from version 4.
+
+ @param self The archive page.
+ @param offset The data offset of the item.
+ @param size The size of the item's data.
+ @return false if the item must go to another page.
+ */
+static inline bool      ArchivePage_fits(const ArchivePage* self,
+                                         size_t             offset,
+                                         size_t             size)
+{
+    size_t limit = self->version >= ArchiveFileVersion4 ? HashItemBlobFlag : HashItemTombstoneOffset;
+    return offset + size + ArchivePage_trailer_size(self) < limit;
+}
+
+
+static Errors       ArchivePage_write_item(ArchivePage*     self,
+                                           const char*      key,
+                                           const char*      data,
+                                           size_t           size,
+                                           size_t*          _data_offset)
+{
+    // huge items go to the blob file
+    if (ArchivePage_stores_blob(self, size)) {
+        return ArchivePage_write_blob(self, key, data, size, _data_offset);
+    }
+
+    // the item is positioned at the end of the files data section
+    size_t offset = ArchivePage_next_offset(self, self->data_size, size);
+    if (!ArchivePage_fits(self, offset, size)) {
+        return E_INDEX_MAX_SIZE_EXCEEDED;
+    }
+
+    // write to file
+    Errors error = write_to_file(
+        self->fd,
+        data,
+        size,
+        (off_t)(ArchivePage_data_start(self) + offset)
+    );
+
+    // followed by its checksum
+    size_t trailer_size = ArchivePage_trailer_size(self);
+    if (error == E_SUCCESS && trailer_size > 0) {
+        __uint32_t checksum = htobe32(ArchivePage_item_checksum(key, data, size));
+        error = write_to_file(
+            self->fd,
+            &checksum,
+            trailer_size,
+            (off_t)(ArchivePage_data_start(self) + offset + size)
+        );
+    }
+
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // update the data size
+    self->data_size = offset + size + trailer_size;
+    
+    // set return pointer
+    *_data_offset = offset;
+
+    return E_SUCCESS;
+}
+
+
+#pragma mark ArchivePage Public Functions
+
+
+Errors      ArchivePage_init(ArchivePage*           self,
+                             const char*            filename,
+                             const char*            base_file_name,
+                             bool                   new_file)
+{
+    Errors error;
+    size_t str_size = strlen(filename) + 1;
+    self->unopened = NULL;
+    self->opened_entry = NULL;
+    self->level = 0;
+    self->cache_priority = 0;
+    self->cache_cost = 0;
+    self->pinned = false;
+    self->direct_fd = (-1);
+    self->direct_threshold = 0;
+    self->blob_fd = (-1);
+    self->blob_direct_fd = (-1);
+    self->blob_size = 0;
+    self->blob_threshold = 0;
+
+    // copy filename to the struct
+    self->filename = (char*)malloc(str_size);
+    memcpy(self->filename, filename, str_size);
+
+    // get new string size
     str_size = strlen(base_file_name) + 1;
     self->base_file_path = (char*)malloc(str_size);
     memcpy(self->base_file_path, base_file_name, str_size);
@@ -417,42 +1117,303 @@ Errors      ArchivePage_init(ArchivePage*           self,
     // allocates and inits the index
     self->index = (HashIndex*)malloc(sizeof(HashIndex));
     HashIndex_init(self->index);
+    self->verify_mode = ArchiveVerifyAlways;
+    self->verify_sample_rate = 0;
+    self->wal = NULL;
+    self->unsaved_items = NULL;
+    self->n_unsaved_items = 0;
+    self->version = ArchivePage_version;
+    self->generation = 0;
 
     // loads file header and index
+    PackedHashItem* wal_items = NULL;
+    size_t n_wal_items = 0;
     if (new_file) {
+        // write an empty header right away, so the page can be opened
+        // (and its log replayed) even if it's never saved, the index slots
+        // are left as a hole in the file
         self->data_size = 0;
         self->has_changes = true;
+        ArchivePage_refresh_fence(self);
+        if (ftruncate(self->fd, (off_t)ArchivePage_data_start(self)) < 0) {
+            error = E_SYSTEM_ERROR_ERRNO;
+        } else {
+            error = ArchivePage_write_file_header(self);
+        }
     } else {
-        error = ArchivePage_read_file_header(self);
-        if (error != E_SUCCESS) {
-            ArchivePage_close_file(self);
-            free(self->index);
-            free(self->filename);
-            free(self->base_file_path);
-            self->index = NULL;
-            self->filename = NULL;
-            self->base_file_path = NULL;
-            return error;
+        // a log left by a page that wasn't saved, redo its last header write
+        // before reading the header
+        char* wal_path = ArchivePage_wal_path(self);
+        error = ArchiveWal_recover(wal_path, self->fd, &wal_items, &n_wal_items);
+        free(wal_path);
+        if (error == E_SUCCESS) {
+            error = ArchivePage_read_file_header(self);
+        }
+        if (error == E_SUCCESS && self->version >= ArchiveFileVersion4) {
+            error = ArchivePage_open_blob_file(self, false);
         }
     }
+    if (error != E_SUCCESS) {
+        free(wal_items);
+        free(self->unsaved_items);
+        ArchivePage_close_file(self);
+        HashIndex_free(self->index);
+        free(self->index);
+        free(self->filename);
+        free(self->base_file_path);
+        self->index = NULL;
+        self->filename = NULL;
+        self->base_file_path = NULL;
+        return error;
+    }
+
+    // and the items logged after it
+    if (n_wal_items > 0) {
+        ArchivePage_replay_wal(self, wal_items, n_wal_items);
+        ArchivePage_refresh_fence(self);
+    }
+    free(wal_items);
         
     return E_SUCCESS;
 }
 
 
-void        ArchivePage_free(ArchivePage*           self)
+void        ArchivePage_init_unopened(ArchivePage*               self,
+                                      const ArchiveManifestPage* entry,
+                                      const char*                base_file_name)
 {
+    self->index = NULL;
+    self->fd = (-1);
+    self->direct_fd = (-1);
+    self->direct_threshold = 0;
+    self->blob_fd = (-1);
+    self->blob_direct_fd = (-1);
+    self->blob_size = 0;
+    self->blob_threshold = 0;
+    self->verify_mode = ArchiveVerifyAlways;
+    self->verify_sample_rate = 0;
+    self->filename = strdup(entry->filename);
+    self->base_file_path = strdup(base_file_name);
+    self->wal = NULL;
+    self->unsaved_items = NULL;
+    self->n_unsaved_items = 0;
+    self->version = ArchivePage_version;
+    self->generation = entry->generation;
+    self->data_size = entry->data_size;
+    self->has_changes = false;
+
+    // keep the entry, the file name is the page's
+    self->opened_entry = NULL;
+    self->cache_priority = 0;
+    self->cache_cost = 0;
+    self->pinned = false;
+    self->level = entry->level;
+    memcpy(self->filter, entry->filter, sizeof(self->filter));
+    memcpy(self->min_key, entry->min_key, 20);
+    memcpy(self->max_key, entry->max_key, 20);
+    self->unopened = (ArchiveManifestPage*)malloc(sizeof(ArchiveManifestPage));
+    *(self->unopened) = *entry;
+    self->unopened->filename = self->filename;
+}
+
+
+Errors      ArchivePage_open(ArchivePage*           self)
+{
+    ArchiveManifestPage* entry = self->unopened;
+    if (entry == NULL) {
+        return E_SUCCESS;
+    }
+
+    // opened aside with the page's settings, the page stays unopened on
+    // failure
+    ArchivePage page;
+    Errors error = ArchivePage_init(&page, self->filename, self->base_file_path, false);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    page.verify_mode = self->verify_mode;
+    page.verify_sample_rate = self->verify_sample_rate;
+    page.blob_threshold = self->blob_threshold;
+    ArchivePage_set_direct_io(&page, self->direct_threshold);
+
+    // a page older than its entry lost a save the manifest relies on, and
+    // one of the same generation must have the same saved items
+    if (page.generation < entry->generation ||
+        (page.generation == entry->generation && entry->n_items > 0 &&
+         page.index->n_items - page.n_unsaved_items != entry->n_items)) {
+        ArchivePage_free(&page);
+        return E_STALE_PAGE;
+    }
+
+    // published once complete, lookups may still read the entry, the level
+    // and the fence meanwhile, so everything but them is copied first
+    free(self->filename);
+    free(self->base_file_path);
+    page.opened_entry = entry;
+    memcpy(self, &page, offsetof(ArchivePage, unopened));
+    memcpy((char*)self + offsetof(ArchivePage, opened_entry),
+           (char*)&page + offsetof(ArchivePage, opened_entry),
+           sizeof(ArchivePage) - offsetof(ArchivePage, opened_entry));
+    __atomic_store_n(&self->unopened, NULL, __ATOMIC_RELEASE);
+    return E_SUCCESS;
+}
+
+
+bool        ArchivePage_close(ArchivePage*          self)
+{
+    if (self->unopened != NULL) {
+        return true;
+    }
+    if (self->has_changes || self->n_unsaved_items > 0) {
+        return false;
+    }
+
+    // the log of a saved page has nothing to replay
+    ArchiveManifestPage* entry = self->opened_entry;
+    if (entry == NULL) {
+        entry = (ArchiveManifestPage*)malloc(sizeof(ArchiveManifestPage));
+    }
+    ArchivePage_summarize(self, entry);
+    if (self->wal != NULL) {
+        ArchiveWal_free(self->wal);
+        free(self->wal);
+        self->wal = NULL;
+    }
     ArchivePage_close_file(self);
     HashIndex_free(self->index);
     free(self->index);
+    free(self->unsaved_items);
+    self->index = NULL;
+    self->unsaved_items = NULL;
+    self->blob_size = 0;
+    self->opened_entry = NULL;
+    self->unopened = entry;
+    return true;
+}
+
+
+size_t      ArchivePage_index_size(const ArchivePage*   self)
+{
+    size_t size = sizeof(HashIndex);
+    size_t i;
+    for (i = 0; i < HashIndexPageCount; i++) {
+        size += self->index->pages[i].capacity * sizeof(HashItem);
+    }
+    return size;
+}
+
+
+void        ArchivePage_refresh_fence(ArchivePage*  self)
+{
+    if (self->index != NULL) {
+        ArchivePage_compute_fence(self, self->filter, self->min_key, self->max_key);
+    }
+}
+
+
+void        ArchivePage_summarize(const ArchivePage*    self,
+                                  ArchiveManifestPage*  entry)
+{
+    if (self->unopened != NULL) {
+        *entry = *(self->unopened);
+        return;
+    }
+    entry->filename = self->filename;
+    entry->generation = self->generation;
+    entry->n_items = (__uint32_t)(self->index->n_items - self->n_unsaved_items);
+    entry->data_size = (__uint32_t)self->data_size;
+    entry->level = self->level;
+    ArchivePage_compute_fence(self, entry->filter, entry->min_key, entry->max_key);
+}
+
+
+void        ArchivePage_free(ArchivePage*           self)
+{
+    if (self->wal != NULL) {
+        ArchiveWal_free(self->wal);
+        free(self->wal);
+        self->wal = NULL;
+    }
+    if (self->unopened != NULL) {
+        free(self->unopened);
+        self->unopened = NULL;
+    } else {
+        ArchivePage_close_file(self);
+        HashIndex_free(self->index);
+        free(self->index);
+    }
+    free(self->opened_entry);
+    self->opened_entry = NULL;
+    free(self->unsaved_items);
     free(self->filename);
     free(self->base_file_path);
     self->index = NULL;
+    self->unsaved_items = NULL;
+    self->n_unsaved_items = 0;
     self->filename = NULL;
     self->base_file_path = NULL;
 }
 
 
+Errors      ArchivePage_commit(ArchivePage*         self)
+{
+    Errors error;
+    char* wal_path;
+
+    // skip write if there are no changes
+    if (!self->has_changes) {
+        return E_SUCCESS;
+    }
+
+    // the data must be durable before the index pointing to it
+    if (fdatasync(self->fd) < 0 ||
+        (self->blob_fd >= 0 && fdatasync(self->blob_fd) < 0)) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+
+    // write the new index items to free slots, they are committed by the
+    // header write that follows, which is atomic; with a log, the header is
+    // logged first so a torn write is redone
+    self->generation += 1;
+    error = ArchivePage_write_file_index(self);
+    if (error == E_SUCCESS && fdatasync(self->fd) < 0) {
+        error = E_SYSTEM_ERROR_ERRNO;
+    }
+    if (error == E_SUCCESS && self->wal != NULL) {
+        error = ArchivePage_log_file_header(self);
+    }
+    if (error == E_SUCCESS) {
+        error = ArchivePage_write_file_header(self);
+    }
+    if (error == E_SUCCESS && fdatasync(self->fd) < 0) {
+        error = E_SYSTEM_ERROR_ERRNO;
+    }
+
+    // the log is not needed anymore, the pending items are saved (there may
+    // be a log replayed when opening the page even if it isn't enabled)
+    if (error == E_SUCCESS) {
+        wal_path = ArchivePage_wal_path(self);
+        if (self->wal != NULL) {
+            error = ArchiveWal_remove(self->wal, wal_path);
+            self->wal->n_pending = 0;
+        } else if (unlink(wal_path) < 0 && errno != ENOENT) {
+            error = E_SYSTEM_ERROR_ERRNO;
+        }
+        free(wal_path);
+    }
+    if (error != E_SUCCESS) {
+        self->generation -= 1;
+        return error;
+    }
+    free(self->unsaved_items);
+    self->unsaved_items = NULL;
+    self->n_unsaved_items = 0;
+
+    self->has_changes = false;
+    return E_SUCCESS;
+}
+
+
 Errors      ArchivePage_save(ArchivePage*           self)
 {
     Errors error;
@@ -466,6 +1427,11 @@ Errors      ArchivePage_save(ArchivePage*           self)
         return E_SUCCESS;
     }
 
+    error = ArchivePage_commit(self);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
     // Build old file path
     asprintf(&full_old_path, "%s%s", self->base_file_path, self->filename);
 
@@ -479,31 +1445,261 @@ Errors      ArchivePage_save(ArchivePage*           self)
     // Combine file path to full path
     asprintf(&full_new_path, "%s%s", self->base_file_path, new_filename);
 
-    // Rename the current file
+    // the blob file is linked under the new name first, so that the page can
+    // be read under either name until the rename
+    char* old_blob_path = NULL;
+    char* new_blob_path = NULL;
+    if (self->blob_fd >= 0) {
+        old_blob_path = ArchivePage_blob_path(self);
+        asprintf(&new_blob_path, "%s.blob", full_new_path);
+        if (link(old_blob_path, new_blob_path) < 0) {
+            free(old_blob_path);
+            free(new_blob_path);
+            free(new_filename);
+            free(full_new_path);
+            free(full_old_path);
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+    }
+
+    // Rename the current file, now that its content is complete
     int er = rename(full_old_path, full_new_path);
 
     if (er < 0) {
+        if (new_blob_path != NULL) {
+            unlink(new_blob_path);
+        }
+        free(old_blob_path);
+        free(new_blob_path);
         free(new_filename);
         free(full_new_path);
         free(full_old_path);
         return E_SYSTEM_ERROR_ERRNO;
     }
+    if (old_blob_path != NULL) {
+        unlink(old_blob_path);
+    }
+    free(old_blob_path);
+    free(new_blob_path);
 
     char* oldfname = self->filename;
 
     self->filename = new_filename;
 
     free(oldfname);
-    free(full_new_path);
     free(full_old_path);
 
-    // write the file header
-    error = ArchivePage_write_file_header(self);
+    // make the rename durable
+    error = sync_directory(full_new_path);
+    free(full_new_path);
+    return error;
+}
+
+
+void        ArchivePage_enable_wal(ArchivePage*     self,
+                                   size_t           batch_size)
+{
+    if (self->wal != NULL) {
+        self->wal->batch_size = batch_size > 0 ? batch_size : 1;
+        return;
+    }
+    self->wal = (ArchiveWal*)malloc(sizeof(ArchiveWal));
+    ArchiveWal_init(self->wal, batch_size);
+}
+
+
+size_t      ArchivePage_stored_size(const ArchivePage*  self,
+                                    const HashItem*     item)
+{
+    if (HashItem_is_tombstone(item) || ArchivePage_item_is_blob(self, item)) {
+        return 0;
+    }
+    return item->data_size + ArchivePage_trailer_size(self);
+}
+
+
+void        ArchivePage_set_verify(ArchivePage*     self,
+                                   ArchiveVerifyMode mode,
+                                   __uint32_t       sample_rate)
+{
+    self->verify_mode = mode;
+    self->verify_sample_rate = sample_rate;
+}
+
+
+void        ArchivePage_set_direct_io(ArchivePage*  self,
+                                      size_t        threshold)
+{
+    self->direct_threshold = threshold;
+    if (!ArchivePage_is_open(self)) {
+        // opened with the page
+        return;
+    }
+    if (threshold > 0) {
+        ArchivePage_open_direct_files(self);
+        return;
+    }
+    if (self->direct_fd >= 0) {
+        close(self->direct_fd);
+        self->direct_fd = (-1);
+    }
+    if (self->blob_direct_fd >= 0) {
+        close(self->blob_direct_fd);
+        self->blob_direct_fd = (-1);
+    }
+}
+
+
+void        ArchivePage_set_blob_threshold(ArchivePage*     self,
+                                           size_t           threshold)
+{
+    self->blob_threshold = threshold;
+}
+
+
+void        ArchivePage_advise(const ArchivePage*   self,
+                               ArchiveAccess        access)
+{
+    if (!ArchivePage_is_open(self)) {
+        return;
+    }
+    advise_file(self->fd, (off_t)ArchivePage_data_start(self), self->data_size, access);
+    if (self->blob_fd >= 0) {
+        advise_file(self->blob_fd, 0, self->blob_size, access);
+    }
+}
+
+
+void        ArchivePage_prefetch(const ArchivePage* self,
+                                 const HashItem*    item)
+{
+    if (!ArchivePage_is_open(self) || HashItem_is_tombstone(item)) {
+        return;
+    }
+    file_descriptor fd, direct_fd;
+    off_t offset = ArchivePage_item_position(self, item, &fd, &direct_fd);
+    advise_file(fd, offset, item->data_size + ArchivePage_trailer_size(self), ArchiveAccessWillNeed);
+}
+
+
+off_t       ArchivePage_item_range(const ArchivePage*   self,
+                                   const HashItem*      item,
+                                   size_t*              _size,
+                                   bool*                _in_blob)
+{
+    file_descriptor fd, direct_fd;
+    *_size = item->data_size + ArchivePage_trailer_size(self);
+    *_in_blob = ArchivePage_item_is_blob(self, item);
+    return ArchivePage_item_position(self, item, &fd, &direct_fd);
+}
+
+
+size_t      ArchivePage_index_end(const ArchivePage*    self)
+{
+    return ArchivePage_index_start(self) +
+           sizeof(PackedHashItem) * (self->index->n_items - self->n_unsaved_items);
+}
+
+
+Errors      ArchivePage_verify_header(const ArchivePage* self)
+{
+    if (self->version < ArchiveFileVersion3) {
+        return E_SUCCESS;
+    }
+    ArchiveFileHeaderV5 file_header;
+    Errors error = read_from_file(self->fd, &file_header, ArchivePage_index_start(self), 0);
     if (error != E_SUCCESS) {
-        printf("An error when saving page, error = %d\n", error);
         return error;
     }
-    self->has_changes = false;
+    return ArchivePage_check_file_header(self, &file_header);
+}
+
+
+Errors      ArchivePage_verify_item(const ArchivePage*  self,
+                                    const HashItem*     item)
+{
+    size_t trailer_size = ArchivePage_trailer_size(self);
+    if (trailer_size == 0 || HashItem_is_tombstone(item)) {
+        return E_SUCCESS;
+    }
+
+    // read the data by chunks, so large items don't need a large buffer
+    size_t chunk_size = 1 << 20;
+    size_t buffer_size = item->data_size + trailer_size;
+    if (buffer_size > chunk_size) {
+        buffer_size = chunk_size;
+    }
+    char* buffer = (char*)malloc(buffer_size);
+    file_descriptor fd, direct_fd;
+    off_t offset = ArchivePage_item_position(self, item, &fd, &direct_fd);
+    __uint32_t checksum = Checksum_crc32c(0, item->key, 20);
+    size_t remaining = item->data_size;
+    size_t size;
+    Errors error = E_SUCCESS;
+    while (remaining > 0 && error == E_SUCCESS) {
+        size = remaining < buffer_size ? remaining : buffer_size;
+        error = read_from_file(fd, buffer, size, offset);
+        checksum = Checksum_crc32c(checksum, buffer, size);
+        offset += size;
+        remaining -= size;
+    }
+    __uint32_t stored;
+    if (error == E_SUCCESS) {
+        error = read_from_file(fd, &stored, trailer_size, offset);
+    }
+    free(buffer);
+    if (error == E_SUCCESS && be32toh(stored) != checksum) {
+        error = E_CHECKSUM_MISMATCH;
+    }
+    return error;
+}
+
+
+Errors      ArchivePage_sync(ArchivePage*           self)
+{
+    if (self->wal == NULL || self->wal->n_pending == 0) {
+        return E_SUCCESS;
+    }
+
+    // group commit: one data sync, then one log sync for the whole batch
+    if (fdatasync(self->fd) < 0 ||
+        (self->blob_fd >= 0 && fdatasync(self->blob_fd) < 0)) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    char* wal_path = ArchivePage_wal_path(self);
+    Errors error = ArchiveWal_flush(self->wal, wal_path);
+    free(wal_path);
+    return error;
+}
+
+
+/**
+ Logs the newest item of a key to the page's write-ahead log, and syncs the
+ log if a batch is complete.
+
+ @param self The archive page.
+ @param key The key of the item.
+ @return An error code.
+ */
+static inline Errors    ArchivePage_log_item(ArchivePage*       self,
+                                             const char*        key)
+{
+    if (self->wal == NULL) {
+        return E_SUCCESS;
+    }
+
+    // a batch left by a failed flush is flushed again before adding to it
+    Errors error;
+    if (ArchiveWal_should_flush(self->wal)) {
+        error = ArchivePage_sync(self);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+    }
+    ArchiveWal_append(self->wal, HashIndex_get(self->index, key, 20));
+    if (ArchiveWal_should_flush(self->wal)) {
+        return ArchivePage_sync(self);
+    }
     return E_SUCCESS;
 }
 
@@ -517,7 +1713,7 @@ bool        ArchivePage_has(const ArchivePage*      self,
         return false;
     }
     const HashItem* item = HashIndex_get(self->index, partial_key, partial_key_len);
-    if (item == NULL) {
+    if (item == NULL || HashItem_is_tombstone(item)) {
         return false;
     }
     if (key != NULL) {
@@ -539,13 +1735,85 @@ Errors      ArchivePage_get(const ArchivePage*      self,
         return E_INVALID_PARTIAL_KEY_LENGTH;
     }
     const HashItem* item = HashIndex_get(self->index, partial_key, partial_key_len);
-    if (item == NULL) {
+    if (item == NULL || HashItem_is_tombstone(item)) {
         return E_NOT_FOUND;
     }
     if (key != NULL) {
         memcpy(key, item->key, 20);
     }
-    return ArchivePage_read_item(self, item, data_max_size, _data, _data_size);
+    Errors error = ArchivePage_read_item(self, item, 0, data_max_size, _data, _data_size);
+    if (error == E_SUCCESS) {
+        *_data_size = item->data_size;
+    }
+    return error;
+}
+
+
+Errors      ArchivePage_read(const ArchivePage*     self,
+                             const HashItem*        item,
+                             size_t                 data_max_size,
+                             char**                 _data,
+                             size_t*                _data_size)
+{
+    if (HashItem_is_tombstone(item)) {
+        return E_NOT_FOUND;
+    }
+    Errors error = ArchivePage_read_item(self, item, 0, data_max_size, _data, _data_size);
+    if (error == E_SUCCESS) {
+        *_data_size = item->data_size;
+    }
+    return error;
+}
+
+
+Errors      ArchivePage_read_range(const ArchivePage*   self,
+                                   const HashItem*      item,
+                                   size_t               offset,
+                                   size_t               length,
+                                   char**               _data,
+                                   size_t*              _data_size)
+{
+    if (HashItem_is_tombstone(item)) {
+        return E_NOT_FOUND;
+    }
+    return ArchivePage_read_item(self, item, offset, length, _data, _data_size);
+}
+
+
+Errors      ArchivePage_send(const ArchivePage*     self,
+                             const HashItem*        item,
+                             size_t                 offset,
+                             size_t                 data_max_size,
+                             file_descriptor        out_fd,
+                             size_t*                _data_size)
+{
+    if (HashItem_is_tombstone(item)) {
+        return E_NOT_FOUND;
+    }
+
+    // the range of the data to send, cut at its end
+    size_t start = offset < item->data_size ? offset : item->data_size;
+    size_t size = item->data_size - start;
+    if (data_max_size > 0 && data_max_size < size) {
+        size = data_max_size;
+    }
+
+    Errors error;
+    if (size == item->data_size && ArchivePage_should_verify(self)) {
+        error = ArchivePage_verify_item(self, item);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+    }
+
+    file_descriptor fd, direct_fd;
+    off_t position = ArchivePage_item_position(self, item, &fd, &direct_fd);
+    error = send_file_data(fd, position + (off_t)start, out_fd, size);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    *_data_size = size;
+    return E_SUCCESS;
 }
 
 
@@ -560,7 +1828,7 @@ Errors      ArchivePage_set(ArchivePage*            self,
     }
     
     size_t offset;
-    Errors error = ArchivePage_write_item(self, data, size, &offset);
+    Errors error = ArchivePage_write_item(self, key, data, size, &offset);
     if (error != E_SUCCESS) {
         return error;
     }
@@ -568,6 +1836,167 @@ Errors      ArchivePage_set(ArchivePage*            self,
     if (error != E_SUCCESS) {
         return error;
     }
+    ArchivePage_widen_fence(self, key);
     self->has_changes = true;
-    return E_SUCCESS;
+    ArchivePage_add_unsaved_item(self, key);
+    return ArchivePage_log_item(self, key);
+}
+
+
+Errors      ArchivePage_build(ArchivePage*          self,
+                              const HashItem*       items,
+                              size_t                n_items,
+                              const char*           data)
+{
+    if (self->index->n_items + n_items > MAX_ITEMS_PER_INDEX) {
+        return E_INDEX_MAX_SIZE_EXCEEDED;
+    }
+
+    // nor their data, which must stay below the reserved offsets
+    const char* item_data;
+    size_t size, offset, padding;
+    size_t data_size = self->data_size;
+    size_t i;
+    for (i = 0; i < n_items; i++) {
+        size = items[i].data_size;
+        if (ArchivePage_stores_blob(self, size)) {
+            continue;
+        }
+        offset = ArchivePage_next_offset(self, data_size, size);
+        if (!ArchivePage_fits(self, offset, size)) {
+            return E_INDEX_MAX_SIZE_EXCEEDED;
+        }
+        data_size = offset + size + ArchivePage_trailer_size(self);
+    }
+
+    // the items of the page file are appended to a buffer, written whenever
+    // it's full, and larger items on their own
+    size_t buffer_capacity = ArchivePageBuildBufferSize;
+    char* buffer = (char*)malloc(buffer_capacity);
+    size_t buffered = 0;
+    size_t buffer_offset = self->data_size;
+    size_t trailer_size = ArchivePage_trailer_size(self);
+    __uint32_t checksum;
+    Errors error = E_SUCCESS;
+    for (i = 0; i < n_items && error == E_SUCCESS; i++) {
+        item_data = data + items[i].data_offset;
+        size = items[i].data_size;
+        if (ArchivePage_stores_blob(self, size)) {
+            error = ArchivePage_write_blob(self, items[i].key, item_data, size, &offset);
+        } else {
+            offset = ArchivePage_next_offset(self, self->data_size, size);
+            padding = offset - self->data_size;
+            if (buffered > 0 && buffered + padding + size + trailer_size > buffer_capacity) {
+                error = write_to_file(self->fd, buffer, buffered,
+                                      (off_t)(ArchivePage_data_start(self) + buffer_offset));
+                buffer_offset += buffered;
+                buffered = 0;
+            }
+            if (error == E_SUCCESS && padding + size + trailer_size > buffer_capacity) {
+                // the padding is a hole
+                error = write_to_file(self->fd, item_data, size,
+                                      (off_t)(ArchivePage_data_start(self) + offset));
+                buffer_offset = offset + size;
+            } else if (error == E_SUCCESS) {
+                memset(buffer + buffered, 0, padding);
+                memcpy(buffer + buffered + padding, item_data, size);
+                buffered += padding + size;
+            }
+            if (error == E_SUCCESS && trailer_size > 0) {
+                checksum = htobe32(ArchivePage_item_checksum(items[i].key, item_data, size));
+                memcpy(buffer + buffered, &checksum, trailer_size);
+                buffered += trailer_size;
+            }
+            self->data_size = offset + size + trailer_size;
+        }
+        if (error == E_SUCCESS) {
+            error = HashIndex_set(self->index, items[i].key, offset, size);
+        }
+        if (error == E_SUCCESS) {
+            ArchivePage_widen_fence(self, items[i].key);
+            ArchivePage_add_unsaved_item(self, items[i].key);
+            self->has_changes = true;
+        }
+    }
+    if (error == E_SUCCESS && buffered > 0) {
+        error = write_to_file(self->fd, buffer, buffered,
+                              (off_t)(ArchivePage_data_start(self) + buffer_offset));
+    }
+    free(buffer);
+    return error;
+}
+
+
+Errors      ArchivePage_copy_item(ArchivePage*          self,
+                                  const ArchivePage*    source,
+                                  const HashItem*       item)
+{
+    if (HashItem_is_tombstone(item)) {
+        return ArchivePage_delete(self, item->key);
+    }
+
+    // through memory, unless it stays a blob
+    Errors error;
+    if (!ArchivePage_item_is_blob(source, item) || !ArchivePage_stores_blob(self, item->data_size)) {
+        char* data;
+        size_t data_size;
+        error = ArchivePage_read_item(source, item, 0, 0, &data, &data_size);
+        if (error == E_SUCCESS) {
+            error = ArchivePage_set(self, item->key, data, data_size);
+            free(data);
+        }
+        return error;
+    }
+
+    if (self->index->n_items >= MAX_ITEMS_PER_INDEX) {
+        return E_INDEX_MAX_SIZE_EXCEEDED;
+    }
+    if (self->blob_fd < 0) {
+        error = ArchivePage_open_blob_file(self, true);
+        if (error != E_SUCCESS) {
+            return error;
+        }
+    }
+    size_t block = self->blob_size / ArchivePageBlockSize;
+    if (block >= HashItemBlobFlag - 1) {
+        return E_INDEX_MAX_SIZE_EXCEEDED;
+    }
+
+    // the data and its checksum, which covers the key, are copied as is
+    size_t size = item->data_size + ArchivePage_trailer_size(self);
+    file_descriptor fd, direct_fd;
+    off_t offset = ArchivePage_item_position(source, item, &fd, &direct_fd);
+    error = copy_file_data(fd, offset, self->blob_fd, (off_t)self->blob_size, size);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    self->blob_size = ArchivePage_round_to_block(self->blob_size + size);
+    error = HashIndex_set(self->index, item->key, HashItemBlobFlag | block, item->data_size);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    ArchivePage_widen_fence(self, item->key);
+    self->has_changes = true;
+    ArchivePage_add_unsaved_item(self, item->key);
+    return ArchivePage_log_item(self, item->key);
+}
+
+
+Errors      ArchivePage_delete(ArchivePage*         self,
+                               const char*          key)
+{
+    // if the page is full, return an error
+    if (self->index->n_items >= MAX_ITEMS_PER_INDEX) {
+        return E_INDEX_MAX_SIZE_EXCEEDED;
+    }
+
+    // a tombstone has no data in the file
+    Errors error = HashIndex_set(self->index, key, HashItemTombstoneOffset, 0);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    ArchivePage_widen_fence(self, key);
+    self->has_changes = true;
+    ArchivePage_add_unsaved_item(self, key);
+    return ArchivePage_log_item(self, key);
 }
@@ -2,8 +2,12 @@
 #define ARCHIVELIB_ARCHIVELAYER_H
 
 
+#include <string.h>
+
 #include "Errors.h"
 #include "HashIndex.h"
+#include "HashIndexPack.h"
+#include "ArchiveManifest.h"
 
 
 /**
@@ -16,6 +20,37 @@
 typedef int file_descriptor;
 
 
+/**
+ * The write-ahead log of a page (see ArchiveWal.h).
+ */
+typedef struct ArchiveWal ArchiveWal;
+
+
+/**
+ * How reads check the data of the items against their checksum. Only pages
+ * of version 3 and above have checksums, and only full reads are verified.
+ */
+typedef enum ArchiveVerifyMode {
+    ArchiveVerifyAlways     = 0,
+    ArchiveVerifySampled    = 1,
+    ArchiveVerifyOff        = 2,
+} ArchiveVerifyMode;
+
+
+/**
+ * The expected access pattern of a page file, passed to the kernel as a hint
+ * (see advise_file): scans read the data sequentially, point lookups at
+ * random, and prefetches mark ranges that will be needed soon or not again.
+ */
+typedef enum ArchiveAccess {
+    ArchiveAccessNormal     = 0,
+    ArchiveAccessSequential = 1,
+    ArchiveAccessRandom     = 2,
+    ArchiveAccessWillNeed   = 3,
+    ArchiveAccessDontNeed   = 4,
+} ArchiveAccess;
+
+
 /**
  *
  *  ArchivePage for a given disk file
@@ -23,15 +58,68 @@ typedef int file_descriptor;
  *  from were the data starts in the file,
  *  the size of the file.
  *
+ *  The index is stored in the file in the order items were set, so a save
+ *  only writes the items set since the previous one (`unsaved_items`) after
+ *  the saved ones, and then the header.
+ *
+ *  Items of at least `direct_threshold` bytes are read bypassing the page
+ *  cache (see ArchivePage_set_direct_io), through `direct_fd`, so large items
+ *  don't evict the small ones from it.
+ *
+ *  Items of at least `blob_threshold` bytes are stored in a blob file next to
+ *  the page file (`<filename>.blob`), so huge items don't fill the page, and
+ *  are copied without going through memory by compaction. The blob file is
+ *  made of blocks, each item starting on a block boundary.
+ *
+ *  A page listed in a manifest may not be opened yet: its file is opened and
+ *  its index loaded on first use (see ArchivePage_open), until then only its
+ *  manifest entry (`unopened`) is known. The entry is kept until the page is
+ *  freed (`opened_entry`), as lookups on other threads may be reading it.
+ *
+ *  A page has a fence, widened by each item set: a bit per bucket holding
+ *  keys (`filter`) and the range of its keys, from `min_key` to `max_key`,
+ *  so lookups skip it without touching its index once it stops being
+ *  written (see ArchivePage_fence_may_have). It's stored in the header of
+ *  the page file. Pages written by leveled compaction have a level above 0
+ *  (see Archive_compact_level). The level and the fence are kept by
+ *  ArchivePage_open, which doesn't write them.
+ *
+ *  An opened page can be closed again to free its index (see
+ *  ArchivePage_close), and is then opened again on next use. Its priority in
+ *  the archive's cache (`cache_priority`, `cache_cost`, `pinned`, see
+ *  ArchiveCache) is kept by ArchivePage_open too.
+ *
  */
 typedef struct ArchivePage
 {
     HashIndex*              index;
     size_t                  data_size;
     file_descriptor         fd;
+    file_descriptor         direct_fd;
+    file_descriptor         blob_fd;
+    file_descriptor         blob_direct_fd;
     char*                   filename;
     char*                   base_file_path;
+    ArchiveWal*             wal;
+    PackedHashItem*         unsaved_items;
+    size_t                  n_unsaved_items;
+    __uint32_t              version;
+    __uint32_t              generation;
+    ArchiveVerifyMode       verify_mode;
+    __uint32_t              verify_sample_rate;
     bool                    has_changes;
+    ArchiveManifestPage*    unopened;
+    __uint32_t              level;
+    __uint8_t               filter[HashIndexPageCount / 8];
+    char                    min_key[20];
+    char                    max_key[20];
+    __uint64_t              cache_priority;
+    __uint64_t              cache_cost;
+    bool                    pinned;
+    ArchiveManifestPage*    opened_entry;
+    size_t                  direct_threshold;
+    size_t                  blob_size;
+    size_t                  blob_threshold;
 } ArchivePage;
 
 
@@ -49,6 +137,143 @@ Errors      ArchivePage_init(ArchivePage*           self,
                              bool                   new_file);
 
 
+/**
+ Initializes an archive page listed in a manifest, without opening its file.
+
+ @param self The archive page.
+ @param entry The manifest entry of the page.
+ @param base_file_name The base path of the archive.
+ */
+void        ArchivePage_init_unopened(ArchivePage*               self,
+                                      const ArchiveManifestPage* entry,
+                                      const char*                base_file_name);
+
+
+/**
+ Opens the file and loads the index of a page initialized with
+ ArchivePage_init_unopened. Does nothing if the page is already opened. The
+ page is opened aside and published at once, so lookups on other threads see
+ it either unopened or opened, but calls must not run concurrently.
+
+ @param self The archive page.
+ @return An error code. E_STALE_PAGE if the page file is older than its
+         manifest entry.
+ */
+Errors      ArchivePage_open(ArchivePage*           self);
+
+
+/**
+ Closes the file and frees the index of an opened page, which goes back to
+ the state of a page initialized with ArchivePage_init_unopened, with an
+ entry summarizing it. Pages with changes not saved can't be closed, and
+ the log of a page (see ArchivePage_enable_wal) must be enabled again once
+ it's reopened. The page must not be used by other threads meanwhile.
+
+ @param self The archive page.
+ @return true if the page is closed.
+ */
+bool        ArchivePage_close(ArchivePage*          self);
+
+
+/**
+ Gets the memory taken by the index of an opened page.
+
+ @param self The archive page.
+ @return The size of the index, in bytes.
+ */
+size_t      ArchivePage_index_size(const ArchivePage*   self);
+
+
+/**
+ Checks if the page's file is opened and its index loaded.
+
+ @param self The archive page.
+ @return A boolean representing wheather the page is opened.
+ */
+static inline bool ArchivePage_is_open(const ArchivePage*   self)
+{
+    return __atomic_load_n(&self->unopened, __ATOMIC_ACQUIRE) == NULL;
+}
+
+
+/**
+ Checks if the page may have keys starting with the given byte, without
+ opening it.
+
+ @param self The archive page.
+ @param bucket The first byte of the key.
+ @return false if the page has no such key.
+ */
+static inline bool ArchivePage_may_have(const ArchivePage*  self,
+                                        size_t              bucket)
+{
+    const ArchiveManifestPage* entry = __atomic_load_n(&self->unopened, __ATOMIC_ACQUIRE);
+    if (entry != NULL) {
+        return ArchiveManifestPage_may_have(entry, bucket);
+    }
+    return __atomic_load_n(&self->index->pages[bucket].n_items, __ATOMIC_ACQUIRE) > 0;
+}
+
+
+/**
+ Computes the fence of the page from its index again, for pages whose index
+ was changed directly.
+
+ @param self The archive page, opened.
+ */
+void        ArchivePage_refresh_fence(ArchivePage*  self);
+
+
+/**
+ Checks if the range of keys of a page may have keys starting with a prefix.
+
+ @param self The archive page.
+ @param partial_key The prefix (between 1 and 20 bytes).
+ @param partial_key_len The length of the prefix.
+ @return -1 if the page's keys are all before the prefix, 1 if they're all
+         after it, or 0.
+ */
+static inline int   ArchivePage_compare_range(const ArchivePage*  self,
+                                              const char*         partial_key,
+                                              size_t              partial_key_len)
+{
+    if (memcmp(self->max_key, partial_key, partial_key_len) < 0) {
+        return -1;
+    }
+    return memcmp(self->min_key, partial_key, partial_key_len) > 0 ? 1 : 0;
+}
+
+
+/**
+ Checks the fence of a page for keys starting with a prefix, without touching
+ its index. Only for pages not being written, as the writer updates it.
+
+ @param self The archive page.
+ @param partial_key The prefix (between 1 and 20 bytes).
+ @param partial_key_len The length of the prefix.
+ @return false if the page has no such key.
+ */
+static inline bool  ArchivePage_fence_may_have(const ArchivePage*  self,
+                                               const char*         partial_key,
+                                               size_t              partial_key_len)
+{
+    __uint8_t bucket = (__uint8_t)partial_key[0];
+    return ((self->filter[bucket / 8] >> (bucket % 8)) & 1) &&
+        ArchivePage_compare_range(self, partial_key, partial_key_len) == 0;
+}
+
+
+/**
+ Summarizes the saved content of the page for the archive's manifest.
+
+ @param self The archive page.
+ @param entry A pointer in which the entry is written. Its file name points
+              to the page's.
+ */
+void        ArchivePage_summarize(const ArchivePage*    self,
+                                  ArchiveManifestPage*  entry);
+
+
 /**
  Free the inside structures of the archive page.
 
@@ -58,7 +283,24 @@ void        ArchivePage_free(ArchivePage*           self);
 
 
 /**
- Saves the archive page to the file system.
+ Saves the archive page to the file system, keeping its file name. Each
+ commit increments the generation of the page, which is stored in its header
+ (for pages of version 2 and above).
+
+ Only the index items set since the last save are written, to free slots
+ after the saved ones, and are then committed by writing the header (a
+ single sector), so a crash at any point leaves a page that can be opened
+ again.
+
+ @param self The archive page.
+ @return An error code.
+ */
+Errors      ArchivePage_commit(ArchivePage*         self);
+
+
+/**
+ Saves the archive page to the file system, and renames its file to a new
+ unique name (see ArchivePage_commit).
 
  @param self The archive page.
  @return An error code.
@@ -67,7 +309,188 @@ Errors      ArchivePage_save(ArchivePage*           self);
 
 
 /**
- Checks if a given partial key is inside the archive page.
+ Enables the write-ahead log of the archive page: the items set on the page
+ are logged and synced in batches, and replayed when the page is opened again
+ without having been saved.
+
+ @param self The archive page.
+ @param batch_size The number of items to group in a single sync.
+ */
+void        ArchivePage_enable_wal(ArchivePage*     self,
+                                   size_t           batch_size);
+
+
+/**
+ Gets the size taken by an item in the data section of the page file, which
+ includes its checksum. Items stored in the blob file take no space there.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ @return The size in bytes.
+ */
+size_t      ArchivePage_stored_size(const ArchivePage*  self,
+                                    const HashItem*     item);
+
+
+/**
+ Sets how reads from the archive page are verified.
+
+ @param self The archive page.
+ @param mode The verification mode.
+ @param sample_rate With ArchiveVerifySampled, one read out of `sample_rate`
+                    is verified (on average).
+ */
+void        ArchivePage_set_verify(ArchivePage*     self,
+                                   ArchiveVerifyMode mode,
+                                   __uint32_t       sample_rate);
+
+
+/**
+ Reads the items of at least `threshold` bytes with direct I/O, bypassing the
+ page cache, and aligns the items of that size written to the page so they
+ can be. Smaller items, and the items of pages which weren't written in this
+ mode, are read through the page cache. If the file system doesn't support
+ direct I/O, all the reads go through the page cache.
+
+ @param self The archive page.
+ @param threshold The size of the items to read directly, or 0 to read all
+                  the items through the page cache.
+ */
+void        ArchivePage_set_direct_io(ArchivePage*  self,
+                                      size_t        threshold);
+
+
+/**
+ Stores the items of at least `threshold` bytes set from now on in the blob
+ file of the archive page instead of the page file. Only pages created by
+ this version of the library can have a blob file, for older ones this does
+ nothing.
+
+ @param self The archive page.
+ @param threshold The size of the items to store in the blob file, or 0 to
+                  store all the items in the page file.
+ */
+void        ArchivePage_set_blob_threshold(ArchivePage*     self,
+                                           size_t           threshold);
+
+
+/**
+ Sets a batch of new items to the archive page at once, writing their data
+ in order with large sequential writes. The items aren't logged to the
+ write-ahead log, the page should be saved once built.
+
+ @param self The archive page.
+ @param items The items (their keys should be distinct), whose data offsets
+              are the positions of their data in `data`.
+ @param n_items The number of items.
+ @param data The data of the items.
+ @return An error code. E_INDEX_MAX_SIZE_EXCEEDED if the items don't fit in
+         the page, in which case none is set.
+ */
+Errors      ArchivePage_build(ArchivePage*          self,
+                              const HashItem*       items,
+                              size_t                n_items,
+                              const char*           data);
+
+
+/**
+ Copies an item of another archive page to this page. The items stored in a
+ blob file are copied from file to file, without reading them in memory.
+
+ @param self The archive page.
+ @param source The archive page of the item.
+ @param item The item, as found in the source page's index.
+ @return An error code.
+ */
+Errors      ArchivePage_copy_item(ArchivePage*          self,
+                                  const ArchivePage*    source,
+                                  const HashItem*       item);
+
+
+/**
+ Hints the kernel about how the data section of the archive page will be
+ accessed. Does nothing if the page isn't opened.
+
+ @param self The archive page.
+ @param access The access pattern.
+ */
+void        ArchivePage_advise(const ArchivePage*   self,
+                               ArchiveAccess        access);
+
+
+/**
+ Starts reading the data of an item in the background, so a following read
+ doesn't wait for the disk.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ */
+void        ArchivePage_prefetch(const ArchivePage* self,
+                                 const HashItem*    item);
+
+
+/**
+ Gets the range of the page's files read to get an item, its data and
+ checksum, so it can be prefetched without the page being opened.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ @param _size A pointer in which the size of the range is written.
+ @param _in_blob A pointer in which is written whether the range is in the
+                 blob file of the page.
+ @return The start of the range.
+ */
+off_t       ArchivePage_item_range(const ArchivePage*   self,
+                                   const HashItem*      item,
+                                   size_t*              _size,
+                                   bool*                _in_blob);
+
+
+/**
+ Gets the end of the header and saved index of the page file, which are
+ read to open the page.
+
+ @param self The archive page.
+ @return The size of the start of the page file read by ArchivePage_open.
+ */
+size_t      ArchivePage_index_end(const ArchivePage*    self);
+
+
+/**
+ Checks the header of the archive page file against its checksum.
+
+ @param self The archive page.
+ @return An error code. E_CHECKSUM_MISMATCH if the header is corrupted.
+ */
+Errors      ArchivePage_verify_header(const ArchivePage* self);
+
+
+/**
+ Checks the data of an item of the archive page against its checksum,
+ regardless of the verification mode. Tombstones and the items of pages
+ without checksums are always valid.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ @return An error code. E_CHECKSUM_MISMATCH if the data is corrupted.
+ */
+Errors      ArchivePage_verify_item(const ArchivePage*  self,
+                                    const HashItem*     item);
+
+
+/**
+ Syncs the data and the logged items of the archive page that are not yet
+ durable. Does nothing if the write-ahead log isn't enabled.
+
+ @param self The archive page.
+ @return An error code.
+ */
+Errors      ArchivePage_sync(ArchivePage*           self);
+
+
+/**
+ Checks if a given partial key is inside the archive page. A key whose
+ newest item in the page is a tombstone is not considered to be inside.
 
  @param page The archive page.
  @param partial_key The partial key to lookup (between 3 and 20 bytes).
@@ -108,6 +531,70 @@ Errors      ArchivePage_get(const ArchivePage*      self,
                             size_t*                 _data_size);
 
 
+/**
+ Reads the data of an item of the archive page.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ @param data_max_size The maximum number of bytes to read from the file.
+                      Pass 0 to read the full file.
+ @param _data A pointer to the char* that will be returned.
+              The returned char* should be free'ed by the caller.
+ @param _data_size A pointer to the size of the item's data.
+ @return An error code.
+ */
+Errors      ArchivePage_read(const ArchivePage*     self,
+                             const HashItem*        item,
+                             size_t                 data_max_size,
+                             char**                 _data,
+                             size_t*                _data_size);
+
+
+/**
+ Reads a range of the data of an item of the archive page. Like partial
+ reads, ranges are verified only if they cover the whole data.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ @param offset The offset in the data of the first byte to read. The range is
+               empty if it's past the end of the data.
+ @param length The maximum number of bytes to read.
+               Pass 0 to read up to the end of the data.
+ @param _data A pointer to the char* that will be returned.
+              The returned char* should be free'ed by the caller.
+ @param _data_size A pointer to the number of bytes read.
+ @return An error code.
+ */
+Errors      ArchivePage_read_range(const ArchivePage*   self,
+                                   const HashItem*      item,
+                                   size_t               offset,
+                                   size_t               length,
+                                   char**               _data,
+                                   size_t*              _data_size);
+/**
+ Sends the data of an item of the archive page to a file descriptor (a file,
+ a pipe or a socket), from file to descriptor in the kernel where it can.
+ Like reads, only whole items are verified, when the verification mode says
+ so, and their verification reads them in memory: set the mode to sampled or
+ never to keep them out of user space.
+
+ @param self The archive page.
+ @param item The item, as found in the page's index.
+ @param offset The offset in the data of the first byte to send.
+ @param data_max_size The maximum number of bytes to send.
+                      Pass 0 to send up to the end of the data.
+ @param out_fd The file descriptor to write the data to, at its position.
+ @param _data_size A pointer to the number of bytes sent.
+ @return An error code.
+ */
+Errors      ArchivePage_send(const ArchivePage*     self,
+                             const HashItem*        item,
+                             size_t                 offset,
+                             size_t                 data_max_size,
+                             file_descriptor        out_fd,
+                             size_t*                _data_size);
+
+
 /**
  Sets a new item to the archive page.
 
@@ -123,4 +610,16 @@ Errors      ArchivePage_set(ArchivePage*            self,
                             size_t                  size);
 
 
+/**
+ Adds a tombstone for a key to the archive page, which shadows the older
+ items with that key.
+
+ @param self The archive page.
+ @param key The key to delete (a 20 bytes binary string).
+ @return An error code.
+ */
+Errors      ArchivePage_delete(ArchivePage*         self,
+                               const char*          key);
+
+
 #endif //ARCHIVELIB_ARCHIVELAYER_H
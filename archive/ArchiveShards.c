@@ -0,0 +1,208 @@
+//
+//  ArchiveShards.c
+//  ArchiveLib
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ArchiveShards.h"
+#include "ArchiveSaveResult.h"
+
+
+#pragma mark - ArchiveShards (Private)
+
+
+/**
+ Computes how much the first byte of a key is shifted to get its shard.
+
+ @param n_shards The number of shards.
+ @param _shift A pointer in which the shift is written.
+ @return E_INDEX_OUT_OF_BOUNDS if the number of shards isn't a power of two
+         from 1 to 256.
+ */
+static inline Errors    _ArchiveShards_shift(size_t         n_shards,
+                                             size_t*        _shift)
+{
+    if (n_shards == 0 || n_shards > HashIndexPageCount || (n_shards & (n_shards - 1)) != 0) {
+        return E_INDEX_OUT_OF_BOUNDS;
+    }
+    size_t shift = 8;
+    while (((size_t)1 << (8 - shift)) < n_shards) {
+        shift--;
+    }
+    *_shift = shift;
+    return E_SUCCESS;
+}
+
+
+/**
+ Initializes the shards, with the manifests they're saved to.
+
+ @param self The sharded archive.
+ @param base_file_path The directory of the archive files.
+ @param n_shards The number of shards.
+ @return An error code.
+ */
+static Errors           _ArchiveShards_init(ArchiveShards*  self,
+                                            const char*     base_file_path,
+                                            size_t          n_shards)
+{
+    Errors error = _ArchiveShards_shift(n_shards, &self->shift);
+    if (error != E_SUCCESS) {
+        self->shards = NULL;
+        self->n_shards = 0;
+        return error;
+    }
+    self->n_shards = n_shards;
+    self->shards = (ArchiveShard*)malloc(sizeof(ArchiveShard) * n_shards);
+    char manifest_filename[32];
+    size_t i;
+    for (i = 0; i < n_shards; i++) {
+        Archive_init(&self->shards[i].archive, base_file_path);
+        snprintf(manifest_filename, sizeof(manifest_filename), "shard-%zu.manifest", i);
+        Archive_use_manifest(&self->shards[i].archive, manifest_filename);
+        pthread_mutex_init(&self->shards[i].lock, NULL);
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Locks the shard owning a key.
+
+ @param self The sharded archive.
+ @param key The key, or a partial key.
+ @return The shard, to unlock once done.
+ */
+static inline ArchiveShard* _ArchiveShards_lock(ArchiveShards*  self,
+                                                const char*     key)
+{
+    ArchiveShard* shard = self->shards + ArchiveShards_shard_of(self, key);
+    pthread_mutex_lock(&shard->lock);
+    return shard;
+}
+
+
+#pragma mark - ArchiveShards (Public API)
+
+
+Errors          ArchiveShards_init(ArchiveShards*           self,
+                                   const char*              base_file_path,
+                                   size_t                   n_shards)
+{
+    Errors error = _ArchiveShards_init(self, base_file_path, n_shards);
+    size_t i;
+    for (i = 0; i < self->n_shards && error == E_SUCCESS; i++) {
+        error = Archive_add_empty_page(&self->shards[i].archive);
+    }
+    return error;
+}
+
+
+Errors          ArchiveShards_open(ArchiveShards*           self,
+                                   const char*              base_file_path,
+                                   size_t                   n_shards)
+{
+    Errors error = _ArchiveShards_init(self, base_file_path, n_shards);
+    Archive* archive;
+    size_t i;
+    for (i = 0; i < self->n_shards && error == E_SUCCESS; i++) {
+        archive = &self->shards[i].archive;
+        error = Archive_load_manifest(archive);
+        if (error == E_SUCCESS && archive->n_pages == 0) {
+            error = Archive_add_empty_page(archive);
+        }
+    }
+    return error;
+}
+
+
+void            ArchiveShards_free(ArchiveShards*           self)
+{
+    size_t i;
+    for (i = 0; i < self->n_shards; i++) {
+        Archive_free(&self->shards[i].archive);
+        pthread_mutex_destroy(&self->shards[i].lock);
+    }
+    free(self->shards);
+    self->shards = NULL;
+    self->n_shards = 0;
+}
+
+
+Errors          ArchiveShards_get_partial(ArchiveShards*    self,
+                                          const char*       partial_key,
+                                          size_t            partial_key_len,
+                                          char*             key,
+                                          size_t            data_max_size,
+                                          char**            _data,
+                                          size_t*           _data_size)
+{
+    if (partial_key_len < 3 || partial_key_len > 20) {
+        return E_INVALID_PARTIAL_KEY_LENGTH;
+    }
+    // lookups run alongside the shard's writer (see Archive_get_partial)
+    ArchiveShard* shard = self->shards + ArchiveShards_shard_of(self, partial_key);
+    return Archive_get_partial(&shard->archive, partial_key, partial_key_len, key,
+                               data_max_size, _data, _data_size);
+}
+
+
+bool            ArchiveShards_has(ArchiveShards*            self,
+                                  const char*               key)
+{
+    return Archive_has(&self->shards[ArchiveShards_shard_of(self, key)].archive, key);
+}
+
+
+Errors          ArchiveShards_set(ArchiveShards*            self,
+                                  const char*               key,
+                                  const char*               data,
+                                  size_t                    size)
+{
+    ArchiveShard* shard = _ArchiveShards_lock(self, key);
+    Errors error = Archive_set(&shard->archive, key, data, size);
+    pthread_mutex_unlock(&shard->lock);
+    return error;
+}
+
+
+Errors          ArchiveShards_delete(ArchiveShards*         self,
+                                     const char*            key)
+{
+    ArchiveShard* shard = _ArchiveShards_lock(self, key);
+    Errors error = Archive_delete(&shard->archive, key);
+    pthread_mutex_unlock(&shard->lock);
+    return error;
+}
+
+
+Errors          ArchiveShards_sync(ArchiveShards*           self)
+{
+    Errors error = E_SUCCESS;
+    size_t i;
+    for (i = 0; i < self->n_shards && error == E_SUCCESS; i++) {
+        pthread_mutex_lock(&self->shards[i].lock);
+        error = Archive_sync(&self->shards[i].archive);
+        pthread_mutex_unlock(&self->shards[i].lock);
+    }
+    return error;
+}
+
+
+Errors          ArchiveShards_save(ArchiveShards*           self)
+{
+    ArchiveSaveResult result;
+    Errors error = E_SUCCESS;
+    size_t i;
+    for (i = 0; i < self->n_shards && error == E_SUCCESS; i++) {
+        pthread_mutex_lock(&self->shards[i].lock);
+        error = Archive_save(&self->shards[i].archive, &result);
+        pthread_mutex_unlock(&self->shards[i].lock);
+        if (error == E_SUCCESS) {
+            ArchiveSaveResult_free(&result);
+        }
+    }
+    return error;
+}
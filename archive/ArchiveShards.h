@@ -0,0 +1,197 @@
+#ifndef ARCHIVESHARDS_H
+#define ARCHIVESHARDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "Errors.h"
+#include "Archive.h"
+#include "HashIndex.h"
+
+
+#pragma mark - ArchiveShard
+
+
+/**
+ * A shard of a sharded archive: an archive of its own, with its own pages and
+ * its own manifest, and the lock of its writers. Readers don't take it.
+ */
+typedef struct ArchiveShard
+{
+    Archive                     archive;
+    pthread_mutex_t             lock;
+} ArchiveShard;
+
+
+#pragma mark - ArchiveShards
+
+
+/**
+ * An archive partitioned in shards by the leading bits of the keys, so
+ * writers of keys of different shards write to different tail pages and don't
+ * contend. Lookups go straight to the shard owning the key.
+ *
+ * Each shard is saved in the manifest "shard-<i>.manifest" of the base file
+ * path, and its pages next to it. The shards can be configured (WAL,
+ * verification, ...) through their `archive` before being used.
+ */
+typedef struct ArchiveShards
+{
+    ArchiveShard*               shards;
+    size_t                      n_shards;
+    size_t                      shift;
+} ArchiveShards;
+
+
+/**
+ Initializes a new sharded archive.
+
+ @param self The sharded archive.
+ @param base_file_path The directory of the archive files (with the trailing
+                       slash).
+ @param n_shards The number of shards, a power of two from 1 to 256.
+ @return An error code. E_INDEX_OUT_OF_BOUNDS if the number of shards isn't
+         valid.
+ */
+Errors          ArchiveShards_init(ArchiveShards*           self,
+                                   const char*              base_file_path,
+                                   size_t                   n_shards);
+
+
+/**
+ Opens a sharded archive from the manifests of its shards.
+
+ @param self The sharded archive.
+ @param base_file_path The directory of the archive files (with the trailing
+                       slash).
+ @param n_shards The number of shards the archive was created with.
+ @return An error code.
+ */
+Errors          ArchiveShards_open(ArchiveShards*           self,
+                                   const char*              base_file_path,
+                                   size_t                   n_shards);
+
+
+/**
+ Frees the sharded archive and closes its files.
+
+ @param self The sharded archive.
+ */
+void            ArchiveShards_free(ArchiveShards*           self);
+
+
+/**
+ Finds the shard owning a key, from its first byte.
+
+ @param self The sharded archive.
+ @param key The key, or a partial key.
+ @return The index of the shard.
+ */
+static inline size_t ArchiveShards_shard_of(const ArchiveShards*    self,
+                                            const char*             key)
+{
+    return _HashIndex_key(key) >> self->shift;
+}
+
+
+/**
+ Retrieves an item from the sharded archive given a partial key (see
+ Archive_get_partial).
+
+ @param self The sharded archive.
+ @param partial_key The partial key to lookup (between 3 and 20 bytes).
+ @param partial_key_len The length of the partial key.
+ @param key A pointer in which the full key (20 bytes) will be written.
+            Or NULL.
+ @param data_max_size The maximum number of bytes to read, 0 to read all.
+ @param _data A pointer to the char* that will be returned.
+              The returned char* should be free'ed by the caller.
+ @param _data_size A pointer to the size of the read data.
+ @return An error code.
+ */
+Errors          ArchiveShards_get_partial(ArchiveShards*    self,
+                                          const char*       partial_key,
+                                          size_t            partial_key_len,
+                                          char*             key,
+                                          size_t            data_max_size,
+                                          char**            _data,
+                                          size_t*           _data_size);
+
+
+/**
+ Retrieves an item from the sharded archive.
+
+ @param self The sharded archive.
+ @param key The key to lookup (a 20 bytes binary string).
+ @param _data A pointer to the char* that will be returned.
+              The returned char* should be free'ed by the caller.
+ @param _data_size A pointer to the size of the read data.
+ @return An error code.
+ */
+static inline Errors ArchiveShards_get(ArchiveShards*       self,
+                                       const char*          key,
+                                       char**               _data,
+                                       size_t*              _data_size)
+{
+    return ArchiveShards_get_partial(self, key, 20, NULL, 0, _data, _data_size);
+}
+
+
+/**
+ Checks if the sharded archive has a key.
+
+ @param self The sharded archive.
+ @param key The key to lookup (a 20 bytes binary string).
+ @return A boolean representing wheather the key is in the archive.
+ */
+bool            ArchiveShards_has(ArchiveShards*            self,
+                                  const char*               key);
+
+
+/**
+ Sets an item to its shard. Writers of different shards don't wait for each
+ other.
+
+ @param self The sharded archive.
+ @param key The key to set for the new item (a 20 bytes binary string).
+ @param data The data to write to the archive.
+ @param size The length of the data to write.
+ @return An error code.
+ */
+Errors          ArchiveShards_set(ArchiveShards*            self,
+                                  const char*               key,
+                                  const char*               data,
+                                  size_t                    size);
+
+
+/**
+ Deletes an item from its shard.
+
+ @param self The sharded archive.
+ @param key The key of the item to delete (a 20 bytes binary string).
+ @return An error code. E_NOT_FOUND if the key isn't in the archive.
+ */
+Errors          ArchiveShards_delete(ArchiveShards*         self,
+                                     const char*            key);
+
+
+/**
+ Makes the items set to the shards durable (see Archive_sync).
+
+ @param self The sharded archive.
+ @return An error code.
+ */
+Errors          ArchiveShards_sync(ArchiveShards*           self);
+
+
+/**
+ Saves the shards and their manifests.
+
+ @param self The sharded archive.
+ @return An error code.
+ */
+Errors          ArchiveShards_save(ArchiveShards*           self);
+
+
+#endif /* ARCHIVESHARDS_H */
@@ -0,0 +1,309 @@
+//
+//  ArchiveWal.c
+//  ArchiveLib
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "Endian.h"
+#include "Checksum.h"
+#include "ArchiveWal.h"
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+
+/**
+ * The header of a log record, followed by `size` bytes of payload.
+ */
+typedef struct __attribute__((__packed__)) ArchiveWalRecordHeader
+{
+    __uint32_t              type;
+    __uint32_t              size;
+    __uint32_t              checksum;
+} ArchiveWalRecordHeader;
+
+
+typedef enum ArchiveWalRecordType {
+    ArchiveWalRecordItems       = 1,
+    ArchiveWalRecordPageHeader  = 3,
+} ArchiveWalRecordType;
+
+
+#pragma mark ArchiveWal Private Helpers
+
+
+/**
+ Computes the checksum of a record's payload, used to detect a record torn by
+ a crash.
+
+ @param type The record type.
+ @param data The payload.
+ @param size The size of the payload.
+ @return The checksum.
+ */
+static inline __uint32_t _ArchiveWal_checksum(__uint32_t     type,
+                                              const void*    data,
+                                              size_t         size)
+{
+    return Checksum_fnv1a(Checksum_fnv1a_init ^ type, data, size);
+}
+
+
+/**
+ Opens the log file for appending, if it isn't already.
+
+ @param self The log.
+ @param path The path of the log file.
+ @return An error code.
+ */
+static Errors       _ArchiveWal_open(ArchiveWal*            self,
+                                     const char*            path)
+{
+    if (self->fd >= 0) {
+        return E_SUCCESS;
+    }
+    self->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+    if (self->fd < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Appends a record to the log file and syncs it.
+
+ @param self The log.
+ @param path The path of the log file.
+ @param type The record type.
+ @param data The payload.
+ @param size The size of the payload.
+ @return An error code.
+ */
+static Errors       _ArchiveWal_write_record(ArchiveWal*    self,
+                                             const char*    path,
+                                             __uint32_t     type,
+                                             const void*    data,
+                                             size_t         size)
+{
+    Errors error = _ArchiveWal_open(self, path);
+    if (error != E_SUCCESS) {
+        return error;
+    }
+
+    // write the header and the payload in one go, so that a record is
+    // either fully written or detected as torn
+    size_t record_size = sizeof(ArchiveWalRecordHeader) + size;
+    char* record = (char*)malloc(record_size);
+    ArchiveWalRecordHeader* header = (ArchiveWalRecordHeader*)record;
+    header->type        = htobe32(type);
+    header->size        = htobe32((__uint32_t)size);
+    header->checksum    = htobe32(_ArchiveWal_checksum(type, data, size));
+    memcpy(record + sizeof(ArchiveWalRecordHeader), data, size);
+
+    size_t written = 0;
+    ssize_t r;
+    while (written < record_size) {
+        r = write(self->fd, record + written, record_size - written);
+        if (r < 0) {
+            free(record);
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        written += r;
+    }
+    free(record);
+
+    if (fdatasync(self->fd) < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    return E_SUCCESS;
+}
+
+
+#pragma mark ArchiveWal Public Functions
+
+
+void        ArchiveWal_init(ArchiveWal*             self,
+                            size_t                  batch_size)
+{
+    self->fd = (-1);
+    self->batch_size = batch_size > 0 ? batch_size : 1;
+    self->pending = (PackedHashItem*)malloc(sizeof(PackedHashItem) * self->batch_size);
+    self->n_pending = 0;
+}
+
+
+void        ArchiveWal_free(ArchiveWal*             self)
+{
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+    free(self->pending);
+    self->fd = (-1);
+    self->pending = NULL;
+    self->n_pending = 0;
+}
+
+
+void        ArchiveWal_append(ArchiveWal*           self,
+                              const HashItem*       item)
+{
+    // the buffer holds a full batch, and is flushed when it's full
+    HashItem_pack(item, self->pending + self->n_pending);
+    self->n_pending += 1;
+}
+
+
+Errors      ArchiveWal_flush(ArchiveWal*            self,
+                             const char*            path)
+{
+    if (self->n_pending == 0) {
+        return E_SUCCESS;
+    }
+    Errors error = _ArchiveWal_write_record(
+        self,
+        path,
+        ArchiveWalRecordItems,
+        self->pending,
+        sizeof(PackedHashItem) * self->n_pending
+    );
+    if (error != E_SUCCESS) {
+        return error;
+    }
+    self->n_pending = 0;
+    return E_SUCCESS;
+}
+
+
+Errors      ArchiveWal_log_header(ArchiveWal*       self,
+                                  const char*       path,
+                                  const void*       header,
+                                  size_t            size)
+{
+    return _ArchiveWal_write_record(self, path, ArchiveWalRecordPageHeader, header, size);
+}
+
+
+Errors      ArchiveWal_remove(ArchiveWal*           self,
+                              const char*           path)
+{
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = (-1);
+    }
+    if (unlink(path) < 0 && errno != ENOENT) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    return E_SUCCESS;
+}
+
+
+Errors      ArchiveWal_recover(const char*          path,
+                               file_descriptor      page_fd,
+                               PackedHashItem**     _items,
+                               size_t*              _n_items)
+{
+    *_items = NULL;
+    *_n_items = 0;
+
+    // no log, nothing to recover
+    file_descriptor fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? E_SUCCESS : E_SYSTEM_ERROR_ERRNO;
+    }
+
+    // read the whole log, it only holds what changed since the last save
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    size_t size = (size_t)st.st_size;
+    char* log = (char*)malloc(size > 0 ? size : 1);
+    size_t read_size = 0;
+    ssize_t r;
+    while (read_size < size) {
+        r = pread(fd, log + read_size, size - read_size, read_size);
+        if (r <= 0) {
+            break;
+        }
+        read_size += r;
+    }
+    close(fd);
+
+    // walk the records, stopping at the first torn one
+    const char* image = NULL;
+    size_t image_size = 0;
+    size_t items_start = 0;
+    size_t items_end = 0;
+    size_t position = 0;
+    ArchiveWalRecordHeader header;
+    __uint32_t type, record_size;
+    while (position + sizeof(ArchiveWalRecordHeader) <= read_size) {
+        memcpy(&header, log + position, sizeof(ArchiveWalRecordHeader));
+        type = be32toh(header.type);
+        record_size = be32toh(header.size);
+        if (record_size > read_size - position - sizeof(ArchiveWalRecordHeader)) {
+            break;
+        }
+        const char* payload = log + position + sizeof(ArchiveWalRecordHeader);
+        if (be32toh(header.checksum) != _ArchiveWal_checksum(type, payload, record_size)) {
+            break;
+        }
+        position += sizeof(ArchiveWalRecordHeader) + record_size;
+
+        if (type == ArchiveWalRecordPageHeader) {
+            // the items before a header are saved in the page
+            image = payload;
+            image_size = record_size;
+            items_start = items_end = position;
+        } else if (type == ArchiveWalRecordItems &&
+                   record_size % sizeof(PackedHashItem) == 0) {
+            items_end = position;
+        } else {
+            break;
+        }
+    }
+
+    // redo the last header write
+    if (image != NULL) {
+        size_t written = 0;
+        while (written < image_size) {
+            r = pwrite(page_fd, image + written, image_size - written, written);
+            if (r < 0) {
+                free(log);
+                return E_SYSTEM_ERROR_ERRNO;
+            }
+            written += r;
+        }
+        if (fdatasync(page_fd) < 0) {
+            free(log);
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+    }
+
+    // collect the item records following it
+    size_t n_items = 0;
+    PackedHashItem* items = (PackedHashItem*)malloc(items_end - items_start + 1);
+    position = items_start;
+    while (position < items_end) {
+        memcpy(&header, log + position, sizeof(ArchiveWalRecordHeader));
+        record_size = be32toh(header.size);
+        memcpy(items + n_items, log + position + sizeof(ArchiveWalRecordHeader), record_size);
+        n_items += record_size / sizeof(PackedHashItem);
+        position += sizeof(ArchiveWalRecordHeader) + record_size;
+    }
+
+    free(log);
+    *_items = items;
+    *_n_items = n_items;
+    return E_SUCCESS;
+}
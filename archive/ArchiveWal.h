@@ -0,0 +1,132 @@
+#ifndef ARCHIVEWAL_H
+#define ARCHIVEWAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "Errors.h"
+#include "ArchivePage.h"
+#include "HashIndexPack.h"
+
+
+/**
+ * Write-ahead log of an archive page, stored next to the page file as
+ * "<filename>.wal".
+ *
+ * Items set on the page since its last save are appended to the log as
+ * index records, in batches: the page data is synced first, then the
+ * records, so a record never points to data that isn't on disk.
+ *
+ * Saving a page writes its new index items to free slots, then logs the new
+ * page header, a few hundred bytes, before writing it in place: if the
+ * header write is torn, it's written again when the page is opened. The log
+ * is removed once the page is saved.
+ */
+struct ArchiveWal
+{
+    file_descriptor             fd;
+    size_t                      batch_size;
+    PackedHashItem*             pending;
+    size_t                      n_pending;
+};
+
+
+/**
+ Initializes a write-ahead log. The log file is only created on the first
+ flush.
+
+ @param self The log.
+ @param batch_size The number of records to buffer before syncing them.
+ */
+void        ArchiveWal_init(ArchiveWal*             self,
+                            size_t                  batch_size);
+
+
+/**
+ Closes the log file and frees the pending records, without flushing them.
+
+ @param self The log.
+ */
+void        ArchiveWal_free(ArchiveWal*             self);
+
+
+/**
+ Buffers a record for an index item. The log must not hold a full batch
+ already (see ArchiveWal_should_flush), the batch size is fixed.
+
+ @param self The log.
+ @param item The item set in the page's index.
+ */
+void        ArchiveWal_append(ArchiveWal*           self,
+                              const HashItem*       item);
+
+
+/**
+ Checks whether enough records are buffered for a group commit.
+
+ @param self The log.
+ @return A boolean representing wheather the log should be flushed.
+ */
+static inline bool ArchiveWal_should_flush(const ArchiveWal* self)
+{
+    return self->n_pending >= self->batch_size;
+}
+
+
+/**
+ Writes the buffered records to the log file and syncs it. The caller must
+ have synced the page data first.
+
+ @param self The log.
+ @param path The path of the log file.
+ @return An error code.
+ */
+Errors      ArchiveWal_flush(ArchiveWal*            self,
+                             const char*            path);
+
+
+/**
+ Writes a record holding the page's new header to the log file and syncs
+ it. The index items it commits must be synced in the page file first.
+
+ @param self The log.
+ @param path The path of the log file.
+ @param header The header image.
+ @param size The size of the image.
+ @return An error code.
+ */
+Errors      ArchiveWal_log_header(ArchiveWal*       self,
+                                  const char*       path,
+                                  const void*       header,
+                                  size_t            size);
+
+
+/**
+ Closes and removes the log file, once its content is saved in the page.
+
+ @param self The log.
+ @param path The path of the log file.
+ @return An error code.
+ */
+Errors      ArchiveWal_remove(ArchiveWal*           self,
+                              const char*           path);
+
+
+/**
+ Recovers a page from its log file, if any. The last header is written
+ again to the page file, and the item records that follow it are returned.
+
+ @param path The path of the log file.
+ @param page_fd The file descriptor of the page file.
+ @param _items A pointer in which the recovered items are returned. It
+               should be free'ed by the caller.
+ @param _n_items A pointer to the number of recovered items.
+ @return An error code.
+ */
+Errors      ArchiveWal_recover(const char*          path,
+                               file_descriptor      page_fd,
+                               PackedHashItem**     _items,
+                               size_t*              _n_items);
+
+
+#endif /* ARCHIVEWAL_H */
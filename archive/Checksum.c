@@ -0,0 +1,170 @@
+//
+//  Checksum.c
+//  ArchiveLib
+//
+
+#include <string.h>
+#include <pthread.h>
+
+#include "Checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CHECKSUM_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CHECKSUM_CRC32C_ARMV8
+#endif
+
+
+#define Checksum_crc32c_polynomial  0x82f63b78 // reflected 0x1edc6f41
+
+
+#pragma mark Table-driven CRC32C
+
+
+static __uint32_t       Checksum_crc32c_table[8][256];
+static pthread_once_t   Checksum_crc32c_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ Builds the tables for the slicing-by-8 implementation.
+ */
+static void         _Checksum_crc32c_init_table(void)
+{
+    __uint32_t crc;
+    size_t i, j;
+    for (i = 0; i < 256; i++) {
+        crc = (__uint32_t)i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ (Checksum_crc32c_polynomial & (0 - (crc & 1)));
+        }
+        Checksum_crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        crc = Checksum_crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = (crc >> 8) ^ Checksum_crc32c_table[0][crc & 0xff];
+            Checksum_crc32c_table[j][i] = crc;
+        }
+    }
+}
+
+
+static __uint32_t   _Checksum_crc32c_table(__uint32_t           crc,
+                                           const unsigned char* bytes,
+                                           size_t               size)
+{
+    // process 8 bytes at a time, the tables are little endian
+    __uint64_t word;
+    while (size >= 8) {
+        memcpy(&word, bytes, 8);
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = Checksum_crc32c_table[7][word & 0xff] ^
+              Checksum_crc32c_table[6][(word >> 8) & 0xff] ^
+              Checksum_crc32c_table[5][(word >> 16) & 0xff] ^
+              Checksum_crc32c_table[4][(word >> 24) & 0xff] ^
+              Checksum_crc32c_table[3][(word >> 32) & 0xff] ^
+              Checksum_crc32c_table[2][(word >> 40) & 0xff] ^
+              Checksum_crc32c_table[1][(word >> 48) & 0xff] ^
+              Checksum_crc32c_table[0][word >> 56];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = (crc >> 8) ^ Checksum_crc32c_table[0][(crc ^ *bytes) & 0xff];
+        bytes++;
+        size--;
+    }
+    return crc;
+}
+
+
+#pragma mark Hardware CRC32C
+
+
+#if defined(CHECKSUM_CRC32C_SSE42)
+
+__attribute__((target("sse4.2")))
+static __uint32_t   _Checksum_crc32c_hardware(__uint32_t            crc,
+                                              const unsigned char*  bytes,
+                                              size_t                size)
+{
+#if defined(__x86_64__)
+    __uint64_t word;
+    __uint64_t crc64 = crc;
+    while (size >= 8) {
+        memcpy(&word, bytes, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        bytes += 8;
+        size -= 8;
+    }
+    crc = (__uint32_t)crc64;
+#endif
+    while (size > 0) {
+        crc = _mm_crc32_u8(crc, *bytes);
+        bytes++;
+        size--;
+    }
+    return crc;
+}
+
+#elif defined(CHECKSUM_CRC32C_ARMV8)
+
+static __uint32_t   _Checksum_crc32c_hardware(__uint32_t            crc,
+                                              const unsigned char*  bytes,
+                                              size_t                size)
+{
+    __uint64_t word;
+    while (size >= 8) {
+        memcpy(&word, bytes, 8);
+        crc = __crc32cd(crc, word);
+        bytes += 8;
+        size -= 8;
+    }
+    while (size > 0) {
+        crc = __crc32cb(crc, *bytes);
+        bytes++;
+        size--;
+    }
+    return crc;
+}
+
+#endif
+
+
+#pragma mark Checksum Public Functions
+
+
+static __uint32_t   (*Checksum_crc32c_impl)(__uint32_t, const unsigned char*, size_t);
+
+
+/**
+ Picks the implementation for the running CPU.
+ */
+static void         _Checksum_crc32c_init(void)
+{
+#if defined(CHECKSUM_CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        Checksum_crc32c_impl = _Checksum_crc32c_hardware;
+        return;
+    }
+#elif defined(CHECKSUM_CRC32C_ARMV8)
+    Checksum_crc32c_impl = _Checksum_crc32c_hardware;
+    return;
+#endif
+    _Checksum_crc32c_init_table();
+    Checksum_crc32c_impl = _Checksum_crc32c_table;
+}
+
+
+__uint32_t          Checksum_crc32c(__uint32_t              crc,
+                                    const void*             data,
+                                    size_t                  size)
+{
+    pthread_once(&Checksum_crc32c_once, _Checksum_crc32c_init);
+    return ~Checksum_crc32c_impl(~crc, (const unsigned char*)data, size);
+}
@@ -0,0 +1,50 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#define Checksum_fnv1a_init     2166136261u
+
+
+/**
+ Computes a 32 bits FNV-1a checksum, used to detect torn or corrupted
+ records in the archive's metadata files.
+
+ @param hash The checksum of the preceding bytes, or Checksum_fnv1a_init.
+ @param data The data.
+ @param size The size of the data.
+ @return The checksum.
+ */
+static inline __uint32_t    Checksum_fnv1a(__uint32_t           hash,
+                                           const void*          data,
+                                           size_t               size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/**
+ Computes a CRC32C (Castagnoli) checksum, used to detect corrupted items and
+ headers in the page files. It uses the CRC32 instructions of SSE 4.2 (when
+ the CPU supports them) or ARMv8, and a table-driven implementation
+ otherwise.
+
+ @param crc The checksum of the preceding bytes, or 0.
+ @param data The data.
+ @param size The size of the data.
+ @return The checksum.
+ */
+__uint32_t                  Checksum_crc32c(__uint32_t           crc,
+                                            const void*          data,
+                                            size_t               size);
+
+
+#endif /* CHECKSUM_H */
@@ -13,6 +13,14 @@ typedef enum Errors
     E_UNKNOWN_ARCHIVE_VERSION       = -6,
     E_INVALID_ARCHIVE_HEADER        = -7,
     E_INVALID_PARTIAL_KEY_LENGTH    = -8,
+    E_AMBIGUOUS                     = -9,
+    E_INVALID_MANIFEST              = -10,
+    E_STALE_PAGE                    = -11,
+    E_CHECKSUM_MISMATCH             = -12,
+    E_DIGEST_MISMATCH               = -13,
+    E_CANCELLED                     = -14,
+    E_INVALID_HOT_KEYS              = -15,
+    E_NOT_CONTENT_ADDRESSED         = -16,
 } Errors;
 
 
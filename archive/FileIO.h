@@ -0,0 +1,326 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <errno.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#include "Errors.h"
+#include "ArchivePage.h"
+
+#ifdef __APPLE__
+#define fdatasync fsync
+#endif
+
+
+#pragma mark Read / Write
+
+
+static inline off_t     fsize(const char*               filename)
+{
+    struct stat st;
+    if (stat(filename, &st) == 0) {
+        return st.st_size;
+    }
+    return (-1);
+}
+
+
+static inline Errors    write_to_file(file_descriptor   fd,
+                                      const void*       buffer,
+                                      size_t            size,
+                                      off_t             offset)
+{
+    off_t writen = 0;
+    ssize_t r;
+    while (writen < size) {
+        r = pwrite(fd, (char*)buffer + writen, size - writen, offset + writen);
+        if (r < 0) {
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        writen += r;
+    }
+    return E_SUCCESS;
+}
+
+
+static inline Errors    read_from_file(file_descriptor  fd,
+                                       void*            buffer,
+                                       size_t           size,
+                                       off_t            offset)
+{
+    off_t read = 0;
+    ssize_t r;
+    while (read < size) {
+        r = pread(fd, (char*)buffer + read, size - read, offset + read);
+        // If `pread` returns 0 or <0, we can consider this an error.
+        // As per the spec:
+        // > On success, pread() returns the number of bytes read (a return of
+        // > zero indicates end of file).
+        // > On error, -1 is returned.
+        if (r == 0) {
+            return E_FILE_READ_ERROR;
+        }
+        if (r < 0) {
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        read += r;
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Copies a range of a file to another file. The copy is done by the kernel
+ where it can (with copy_file_range on Linux, which may even share the
+ blocks on file systems supporting it), and through a buffer otherwise.
+
+ @param in_fd The file to copy from.
+ @param in_offset The offset of the range in that file.
+ @param out_fd The file to copy to.
+ @param out_offset The offset to copy the range to.
+ @param size The size of the range.
+ @return An error code.
+ */
+static inline Errors    copy_file_data(file_descriptor  in_fd,
+                                       off_t            in_offset,
+                                       file_descriptor  out_fd,
+                                       off_t            out_offset,
+                                       size_t           size)
+{
+    size_t copied = 0;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    long long in_position = in_offset;
+    long long out_position = out_offset;
+    long r;
+    while (copied < size) {
+        r = syscall(SYS_copy_file_range, in_fd, &in_position, out_fd, &out_position, size - copied, 0);
+        if (r <= 0) {
+            break;
+        }
+        copied += (size_t)r;
+    }
+    if (copied == size) {
+        return E_SUCCESS;
+    }
+#endif
+
+    // what the kernel couldn't copy (not supported, or across file systems)
+    size_t buffer_size = size - copied < (1 << 20) ? size - copied : (1 << 20);
+    char* buffer = (char*)malloc(buffer_size > 0 ? buffer_size : 1);
+    size_t chunk;
+    Errors error = E_SUCCESS;
+    while (copied < size && error == E_SUCCESS) {
+        chunk = size - copied < buffer_size ? size - copied : buffer_size;
+        error = read_from_file(in_fd, buffer, chunk, in_offset + (off_t)copied);
+        if (error == E_SUCCESS) {
+            error = write_to_file(out_fd, buffer, chunk, out_offset + (off_t)copied);
+        }
+        copied += chunk;
+    }
+    free(buffer);
+    return error;
+}
+
+
+/**
+ Writes a buffer at the current position of a file, a pipe or a socket.
+
+ @param fd The file descriptor to write to.
+ @param buffer The data.
+ @param size The size of the data.
+ @return An error code.
+ */
+static inline Errors    write_to_stream(file_descriptor fd,
+                                        const void*     buffer,
+                                        size_t          size)
+{
+    size_t writen = 0;
+    ssize_t r;
+    while (writen < size) {
+        r = write(fd, (const char*)buffer + writen, size - writen);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0) {
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        writen += (size_t)r;
+    }
+    return E_SUCCESS;
+}
+
+
+/**
+ Sends a range of a file to the current position of a file, a pipe or a
+ socket. The data is sent by the kernel where it can (with sendfile), so it
+ never enters user space, and through a buffer otherwise.
+
+ @param in_fd The file to send from.
+ @param in_offset The offset of the range in that file.
+ @param out_fd The file descriptor to send to.
+ @param size The size of the range.
+ @return An error code.
+ */
+static inline Errors    send_file_data(file_descriptor  in_fd,
+                                       off_t            in_offset,
+                                       file_descriptor  out_fd,
+                                       size_t           size)
+{
+    size_t sent = 0;
+#if defined(__linux__)
+    off_t position = in_offset;
+    ssize_t r;
+    while (sent < size) {
+        r = sendfile(out_fd, in_fd, &position, size - sent);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r < 0 && sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        if (r < 0) {
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        if (r == 0) {
+            return E_FILE_READ_ERROR;
+        }
+        sent += (size_t)r;
+    }
+#elif defined(__APPLE__)
+    // only to sockets
+    off_t length;
+    int r;
+    while (sent < size) {
+        length = (off_t)(size - sent);
+        r = sendfile(in_fd, out_fd, in_offset + (off_t)sent, &length, NULL, 0);
+        sent += (size_t)length;
+        if (r < 0 && errno != EINTR && errno != EAGAIN) {
+            if (sent == 0 && (errno == ENOTSOCK || errno == EOPNOTSUPP)) {
+                break;
+            }
+            return E_SYSTEM_ERROR_ERRNO;
+        }
+        if (r == 0 && length == 0) {
+            return E_FILE_READ_ERROR;
+        }
+    }
+#endif
+    if (sent == size) {
+        return E_SUCCESS;
+    }
+
+    // the kernel can't send to that descriptor
+    size_t buffer_size = size - sent < (1 << 20) ? size - sent : (1 << 20);
+    char* buffer = (char*)malloc(buffer_size);
+    size_t chunk;
+    Errors error = E_SUCCESS;
+    while (sent < size && error == E_SUCCESS) {
+        chunk = size - sent < buffer_size ? size - sent : buffer_size;
+        error = read_from_file(in_fd, buffer, chunk, in_offset + (off_t)sent);
+        if (error == E_SUCCESS) {
+            error = write_to_stream(out_fd, buffer, chunk);
+        }
+        sent += chunk;
+    }
+    free(buffer);
+    return error;
+}
+
+
+/**
+ Syncs the directory containing a file, making a rename durable.
+
+ @param file_path The path of the file.
+ @return An error code.
+ */
+static inline Errors    sync_directory(const char*          file_path)
+{
+    char* path = strdup(file_path);
+    file_descriptor fd = open(dirname(path), O_RDONLY);
+    free(path);
+    if (fd < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    int r = fsync(fd);
+    close(fd);
+    if (r < 0) {
+        return E_SYSTEM_ERROR_ERRNO;
+    }
+    return E_SUCCESS;
+}
+
+
+#pragma mark Access Hints
+
+
+/**
+ Hints the kernel about how a range of a file will be accessed, so it can
+ adjust its read-ahead and its page cache. Hints are best effort: they're
+ ignored where the system has no equivalent, and their errors too.
+
+ @param fd The file.
+ @param offset The start of the range.
+ @param size The size of the range, or 0 for the rest of the file.
+ @param access The access pattern.
+ */
+static inline void      advise_file(file_descriptor     fd,
+                                    off_t               offset,
+                                    size_t              size,
+                                    ArchiveAccess       access)
+{
+#if defined(POSIX_FADV_NORMAL)
+    int advice;
+    switch (access) {
+        case ArchiveAccessSequential:
+            advice = POSIX_FADV_SEQUENTIAL;
+            break;
+        case ArchiveAccessRandom:
+            advice = POSIX_FADV_RANDOM;
+            break;
+        case ArchiveAccessWillNeed:
+            advice = POSIX_FADV_WILLNEED;
+            break;
+        case ArchiveAccessDontNeed:
+            advice = POSIX_FADV_DONTNEED;
+            break;
+        default:
+            advice = POSIX_FADV_NORMAL;
+            break;
+    }
+    posix_fadvise(fd, offset, (off_t)size, advice);
+#elif defined(__APPLE__)
+    struct radvisory radvisory;
+    switch (access) {
+        case ArchiveAccessNormal:
+        case ArchiveAccessSequential:
+            fcntl(fd, F_RDAHEAD, 1);
+            break;
+        case ArchiveAccessRandom:
+            fcntl(fd, F_RDAHEAD, 0);
+            break;
+        case ArchiveAccessWillNeed:
+            radvisory.ra_offset = offset;
+            radvisory.ra_count = size > INT_MAX ? INT_MAX : (int)size;
+            fcntl(fd, F_RDADVISE, &radvisory);
+            break;
+        default:
+            break;
+    }
+#endif
+}
+
+
+#endif /* FILEIO_H */
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "HashIndex.h"
 
@@ -29,6 +31,39 @@ static inline void  _HashItem_init_with_key(HashItem*       self,
 }
 
 
+#pragma mark - HashItemBlock
+
+
+/**
+ * The storage of the items of a hash page. When it's full, the items are
+ * copied to a larger block, but the block stays allocated until the page is
+ * freed: a reader may still be walking it, and the items it has are never
+ * modified.
+ */
+typedef struct HashItemBlock
+{
+    struct HashItemBlock*   previous;
+    size_t                  capacity;
+    HashItem                items[];
+} HashItemBlock;
+
+
+static inline HashItemBlock* _HashItemBlock_new(size_t              capacity,
+                                                HashItemBlock*      previous)
+{
+    HashItemBlock* block = (HashItemBlock*)malloc(sizeof(HashItemBlock) + sizeof(HashItem) * capacity);
+    block->previous = previous;
+    block->capacity = capacity;
+    return block;
+}
+
+
+static inline HashItemBlock* _HashItemBlock_of(const HashItem*      items)
+{
+    return (HashItemBlock*)((char*)items - offsetof(HashItemBlock, items));
+}
+
+
 #pragma mark - HashPage
 
 
@@ -39,41 +74,50 @@ static inline void  _HashItem_init_with_key(HashItem*       self,
  */
 static inline void  _HashPage_init(HashPage*                self)
 {
-    self->items = (HashItem*)malloc(
-        sizeof(HashItem) * HASH_PAGE_INITIAL_CAPACITY);
     self->capacity = HASH_PAGE_INITIAL_CAPACITY;
-    self->n_items = 0;
+    __atomic_store_n(&self->n_items, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&self->items, _HashItemBlock_new(self->capacity, NULL)->items, __ATOMIC_RELEASE);
 }
 
 
 /**
- Frees the hash page. This won't free the page structure itself.
+ Frees the hash page, and the blocks its items were in. This won't free the
+ page structure itself.
 
  @param self The hash page to free.
  */
 static inline void  _HashPage_free(HashPage*                self)
 {
-    free(self->items);
+    HashItemBlock* block = _HashItemBlock_of(self->items);
+    HashItemBlock* previous;
+    while (block != NULL) {
+        previous = block->previous;
+        free(block);
+        block = previous;
+    }
 }
 
 
 /**
- Retrieves an item from the hash page.
+ Retrieves an item from some items of a hash page, walking them from the
+ newest to the oldest so that a key set again (or deleted) in the same page
+ resolves to its latest item.
 
- @param self The hash page.
+ @param items The items.
  @param partial_key The partial key to lookup (between 3 and 20 bytes).
  @param partial_key_len The length of the partial key.
+ @param end The number of items to look at, starting from the oldest.
  @return The hash item. It's not a copy, the item is still in the page.
  */
-static inline const HashItem* _HashPage_get(HashPage*       self,
+static inline const HashItem* _HashPage_get(const HashItem* items,
                                             const char*     partial_key,
-                                            size_t          partial_key_len)
+                                            size_t          partial_key_len,
+                                            size_t          end)
 {
-    size_t n_items = self->n_items;
-    HashItem *item = self->items;
-    int i;
-    for (i = 0; i < n_items; ++i) {
-        char* item_key = item->key;
+    const HashItem *item = items + end;
+    while (item > items) {
+        item--;
+        const char* item_key = item->key;
         // the first byte doesn't need to be compared as it's in the hash key
         // the two first bytes are compared inline here to reduce the use of
         // memcmp (which is more expensive)
@@ -82,41 +126,51 @@ static inline const HashItem* _HashPage_get(HashPage*       self,
             memcmp(item_key + 3, partial_key + 3, partial_key_len - 3) == 0) {
             return item;
         }
-        item++;
     }
     return NULL;
 }
 
 
 /**
- Adds a HashItem to the page.
+ Makes room for one more item in the page. When the block of its items is
+ full, they are moved to a larger block, published before any item is added
+ to it.
 
  @param self The hash page.
- @param key The key to insert (a 20 bytes binary string).
- @param size Data size in the file.
- @param offset Data offset in the file.
+ @return The slot of the next item.
  */
-static inline void        _HashPage_set(HashPage*           self,
-                                        const char*         key,
-                                        size_t              offset,
-                                        size_t              size)
+static inline HashItem*   _HashPage_reserve(HashPage*       self)
 {
-    // if needed, increase the capacity
     if (self->n_items >= self->capacity) {
         size_t new_capacity = self->capacity * 2;
         if (new_capacity <= HASH_PAGE_INITIAL_CAPACITY) {
             new_capacity = HASH_PAGE_INITIAL_CAPACITY;
         }
-        self->items = (HashItem*)realloc(self->items,
-                                         sizeof(HashItem) * new_capacity);
+        HashItemBlock* block = _HashItemBlock_new(new_capacity, _HashItemBlock_of(self->items));
+        memcpy(block->items, self->items, sizeof(HashItem) * self->n_items);
+        __atomic_store_n(&self->items, block->items, __ATOMIC_RELEASE);
         self->capacity = new_capacity;
     }
+    return self->items + self->n_items;
+}
 
-    // set the hash item
-    _HashItem_init_with_key(self->items + self->n_items, key, offset, size);
 
-    // increase the number of items
-    self->n_items += 1;
+/**
+ Adds a HashItem to the page. The item is published once it's complete, so
+ readers on other threads see either all of it or nothing.
+
+ @param self The hash page.
+ @param key The key to insert (a 20 bytes binary string).
+ @param size Data size in the file.
+ @param offset Data offset in the file.
+ */
+static inline void        _HashPage_set(HashPage*           self,
+                                        const char*         key,
+                                        size_t              offset,
+                                        size_t              size)
+{
+    _HashItem_init_with_key(_HashPage_reserve(self), key, offset, size);
+    __atomic_store_n(&self->n_items, self->n_items + 1, __ATOMIC_RELEASE);
 }
 
 
@@ -171,12 +225,45 @@ HashPage* HashIndex_get_or_create_page(HashIndex*     self,
 }
 
 
+void      HashPage_append(HashPage*                   self,
+                          const HashItem*             item)
+{
+    *_HashPage_reserve(self) = *item;
+    __atomic_store_n(&self->n_items, self->n_items + 1, __ATOMIC_RELEASE);
+}
+
+
 const HashItem* HashIndex_get(HashIndex*              self,
                               const char*             partial_key,
                               size_t                  partial_key_len)
 {
+    return HashIndex_get_next(self, partial_key, partial_key_len, NULL);
+}
+
+
+const HashItem* HashIndex_get_next(HashIndex*         self,
+                                   const char*        partial_key,
+                                   size_t             partial_key_len,
+                                   const HashItem*    after)
+{
+    // the number of items first, the items they're in have at least as many
     HashPage* page = _HashIndex_get_page(self, partial_key);
-    return _HashPage_get(page, partial_key, partial_key_len);
+    size_t end = __atomic_load_n(&page->n_items, __ATOMIC_ACQUIRE);
+    if (end == 0) {
+        return NULL;
+    }
+    const HashItem* items = __atomic_load_n(&page->items, __ATOMIC_ACQUIRE);
+    if (after == NULL) {
+        return _HashPage_get(items, partial_key, partial_key_len, end);
+    }
+
+    // the previous item may be in a block the items have been moved from
+    HashItemBlock* block = _HashItemBlock_of(items);
+    while ((uintptr_t)after < (uintptr_t)block->items ||
+           (uintptr_t)after >= (uintptr_t)(block->items + block->capacity)) {
+        block = block->previous;
+    }
+    return _HashPage_get(block->items, partial_key, partial_key_len, (size_t)(after - block->items));
 }
 
 
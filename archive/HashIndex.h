@@ -31,6 +31,33 @@ typedef struct HashItem
 } HashItem;
 
 
+/**
+ * Data offset marking an item as a tombstone: its key has been deleted, and
+ * the item shadows the older versions of the key. It's reserved, pages don't
+ * store data up to it.
+ */
+#define HashItemTombstoneOffset ((size_t)0xFFFFFFFF)
+
+static inline bool HashItem_is_tombstone(const HashItem* item)
+{
+    return item->data_offset == HashItemTombstoneOffset;
+}
+
+
+/**
+ * Flag of the data offset of an item stored in the blob file of its page
+ * rather than in the page file. The rest of the offset is the position of the
+ * data in the blob file, in blocks (see ArchivePage). It's only a flag in
+ * pages of version 4 and above, whose data offsets stay below it.
+ */
+#define HashItemBlobFlag ((size_t)0x80000000)
+
+static inline bool HashItem_is_blob(const HashItem* item)
+{
+    return !HashItem_is_tombstone(item) && (item->data_offset & HashItemBlobFlag) != 0;
+}
+
+
 /**
  * Page of the Hash Map
  * there is 1 page for each of the first chars.
@@ -84,7 +111,20 @@ HashPage* HashIndex_get_or_create_page(HashIndex*     self,
 
 
 /**
- Retrieves an hash item from the index by its key.
+ Appends an item to a page of an index, without counting it in the index
+ (see HashIndex_set). The item is published to readers on other threads
+ once it's complete.
+
+ @param self The page.
+ @param item The item, copied.
+ */
+void      HashPage_append(HashPage*                   self,
+                          const HashItem*             item);
+
+
+/**
+ Retrieves an hash item from the index by its key. If the key was set more
+ than once, the newest item is returned.
 
  @param self The index.
  @param partial_key The partial key to lookup (between 3 and 20 bytes).
@@ -97,7 +137,24 @@ const HashItem* HashIndex_get(HashIndex*              self,
 
 
 /**
- Sets an item in the index.
+ Retrieves the next (older) hash item matching a key, walking the items of
+ the key's bucket from the newest to the oldest.
+
+ @param self The index.
+ @param partial_key The partial key to lookup (between 3 and 20 bytes).
+ @param partial_key_len The length of the partial key.
+ @param after The previously returned item, or NULL to get the newest one.
+ @return The hash item, or NULL if there are no more matches.
+ */
+const HashItem* HashIndex_get_next(HashIndex*         self,
+                                   const char*        partial_key,
+                                   size_t             partial_key_len,
+                                   const HashItem*    after);
+
+
+/**
+ Sets an item in the index. Setting a key that is already in the index adds
+ a newer item that shadows the previous one.
 
  @param self The index.
  @param key The key to insert (a 20 bytes binary string).
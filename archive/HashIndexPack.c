@@ -11,8 +11,8 @@
 
 #pragma mark HashItem Pack
 
-static inline void      HashItem_pack(const HashItem*               self,
-                                      PackedHashItem*               packed)
+void      HashItem_pack(const HashItem*                 self,
+                        PackedHashItem*                 packed)
 {
     memcpy(packed->key, self->key, 20);
     packed->data_offset = htobe32((__uint32_t)self->data_offset);
@@ -20,8 +20,8 @@ static inline void      HashItem_pack(const HashItem*               self,
 }
 
 
-static inline void      HashItem_unpack(HashItem*                   self,
-                                        const PackedHashItem*       packed)
+void      HashItem_unpack(HashItem*                     self,
+                          const PackedHashItem*         packed)
 {
     memcpy(self->key, packed->key, 20);
     self->data_offset   = be32toh(packed->data_offset);
@@ -32,15 +32,9 @@ static inline void      HashItem_unpack(HashItem*                   self,
 static inline void      HashPage_set_packed(HashPage*               self,
                                             const PackedHashItem*   item)
 {
-    // if needed, increase the capacity
-    if (self->n_items >= self->capacity) {
-        unsigned short new_capacity = self->capacity * 2;
-        self->items = realloc(self->items, (sizeof(HashItem) * new_capacity));
-        self->capacity = new_capacity;
-    }
-
-    HashItem_unpack(&(self->items[self->n_items]), item);
-    self->n_items += 1;
+    HashItem unpacked;
+    HashItem_unpack(&unpacked, item);
+    HashPage_append(self, &unpacked);
 }
 
 
@@ -23,6 +23,26 @@ typedef struct __attribute__((__packed__)) PackedHashItem
 } PackedHashItem;
 
 
+/**
+ Pack a HashItem into a PackedHashItem.
+
+ @param self The HashItem.
+ @param packed The PackedHashItem to populate.
+ */
+void      HashItem_pack(const HashItem*         self,
+                        PackedHashItem*         packed);
+
+
+/**
+ Unpack a PackedHashItem into a HashItem.
+
+ @param self The HashItem to populate.
+ @param packed The PackedHashItem to read from.
+ */
+void      HashItem_unpack(HashItem*             self,
+                          const PackedHashItem* packed);
+
+
 /**
  Pack the HashIndex into an array of PackedHashItem
 
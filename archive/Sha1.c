@@ -0,0 +1,241 @@
+//
+//  Sha1.c
+//  ArchiveLib
+//
+
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "Sha1.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_SHANI
+#endif
+
+
+#define Sha1BlockSize   64
+
+
+#pragma mark Portable SHA-1
+
+
+static inline __uint32_t    _Sha1_rol(__uint32_t    value,
+                                      int           bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+
+static void         _Sha1_compress_portable(__uint32_t*             state,
+                                            const unsigned char*    data,
+                                            size_t                  n_blocks)
+{
+    __uint32_t w[80];
+    __uint32_t a, b, c, d, e, f, k, t;
+    size_t i;
+    while (n_blocks-- > 0) {
+        for (i = 0; i < 16; i++) {
+            w[i] = ((__uint32_t)data[4 * i] << 24) |
+                   ((__uint32_t)data[4 * i + 1] << 16) |
+                   ((__uint32_t)data[4 * i + 2] << 8) |
+                   ((__uint32_t)data[4 * i + 3]);
+        }
+        for (i = 16; i < 80; i++) {
+            w[i] = _Sha1_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            t = _Sha1_rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = _Sha1_rol(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+
+        data += Sha1BlockSize;
+    }
+}
+
+
+#pragma mark SHA-1 with the x86 SHA extensions
+
+
+#if defined(SHA1_SHANI)
+
+/**
+ Four rounds of SHA-1 (`g` is the index of the group of rounds, 0 to 19):
+ `e` holds the next E value plus the message words, and the previous state is
+ saved to `e_next` for the following group. The message schedule is computed
+ four words at a time, as the rounds consume them.
+ */
+#define _SHA1_SHANI_ROUNDS(g, e, e_next)                                            \
+    if ((g) < 4) {                                                                  \
+        msg[(g)] = _mm_shuffle_epi8(                                                \
+            _mm_loadu_si128((const __m128i*)(data + 16 * (g))), mask);             \
+    }                                                                               \
+    if ((g) == 0) {                                                                 \
+        e = _mm_add_epi32(e, msg[0]);                                               \
+    } else {                                                                        \
+        e = _mm_sha1nexte_epu32(e, msg[(g) % 4]);                                   \
+    }                                                                               \
+    e_next = abcd;                                                                  \
+    if ((g) >= 3 && (g) <= 18) {                                                    \
+        msg[((g) + 1) % 4] = _mm_sha1msg2_epu32(msg[((g) + 1) % 4], msg[(g) % 4]); \
+    }                                                                               \
+    abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5);                                   \
+    if ((g) >= 1 && (g) <= 16) {                                                    \
+        msg[((g) + 3) % 4] = _mm_sha1msg1_epu32(msg[((g) + 3) % 4], msg[(g) % 4]); \
+    }                                                                               \
+    if ((g) >= 2 && (g) <= 17) {                                                    \
+        msg[((g) + 2) % 4] = _mm_xor_si128(msg[((g) + 2) % 4], msg[(g) % 4]);      \
+    }
+
+
+__attribute__((target("sha,ssse3,sse4.1")))
+static void         _Sha1_compress_shani(__uint32_t*                state,
+                                         const unsigned char*       data,
+                                         size_t                     n_blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i msg[4];
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    while (n_blocks-- > 0) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        _SHA1_SHANI_ROUNDS(0, e0, e1)
+        _SHA1_SHANI_ROUNDS(1, e1, e0)
+        _SHA1_SHANI_ROUNDS(2, e0, e1)
+        _SHA1_SHANI_ROUNDS(3, e1, e0)
+        _SHA1_SHANI_ROUNDS(4, e0, e1)
+        _SHA1_SHANI_ROUNDS(5, e1, e0)
+        _SHA1_SHANI_ROUNDS(6, e0, e1)
+        _SHA1_SHANI_ROUNDS(7, e1, e0)
+        _SHA1_SHANI_ROUNDS(8, e0, e1)
+        _SHA1_SHANI_ROUNDS(9, e1, e0)
+        _SHA1_SHANI_ROUNDS(10, e0, e1)
+        _SHA1_SHANI_ROUNDS(11, e1, e0)
+        _SHA1_SHANI_ROUNDS(12, e0, e1)
+        _SHA1_SHANI_ROUNDS(13, e1, e0)
+        _SHA1_SHANI_ROUNDS(14, e0, e1)
+        _SHA1_SHANI_ROUNDS(15, e1, e0)
+        _SHA1_SHANI_ROUNDS(16, e0, e1)
+        _SHA1_SHANI_ROUNDS(17, e1, e0)
+        _SHA1_SHANI_ROUNDS(18, e0, e1)
+        _SHA1_SHANI_ROUNDS(19, e1, e0)
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+
+        data += Sha1BlockSize;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (__uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+
+/**
+ Checks if the CPU has the SHA extensions (and SSE 4.1, which they need).
+ */
+static int          _Sha1_has_shani(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx >> 29) & 1;
+}
+
+#endif
+
+
+#pragma mark Sha1 Public Functions
+
+
+static void         (*Sha1_compress)(__uint32_t*, const unsigned char*, size_t);
+static pthread_once_t Sha1_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ Picks the implementation for the running CPU.
+ */
+static void         _Sha1_init(void)
+{
+#if defined(SHA1_SHANI)
+    if (_Sha1_has_shani()) {
+        Sha1_compress = _Sha1_compress_shani;
+        return;
+    }
+#endif
+    Sha1_compress = _Sha1_compress_portable;
+}
+
+
+void                Sha1_digest(const void*         data,
+                                size_t              size,
+                                char*               digest)
+{
+    pthread_once(&Sha1_once, _Sha1_init);
+
+    __uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+    // the full blocks are hashed in place
+    size_t n_blocks = size / Sha1BlockSize;
+    Sha1_compress(state, (const unsigned char*)data, n_blocks);
+
+    // the rest is padded with a 1 bit, zeros, and the size in bits
+    unsigned char tail[2 * Sha1BlockSize];
+    size_t rest = size - n_blocks * Sha1BlockSize;
+    size_t tail_size = rest + 9 <= Sha1BlockSize ? Sha1BlockSize : 2 * Sha1BlockSize;
+    memset(tail, 0, tail_size);
+    memcpy(tail, (const unsigned char*)data + n_blocks * Sha1BlockSize, rest);
+    tail[rest] = 0x80;
+    __uint64_t bits = (__uint64_t)size * 8;
+    size_t i;
+    for (i = 0; i < 8; i++) {
+        tail[tail_size - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    Sha1_compress(state, tail, tail_size / Sha1BlockSize);
+
+    for (i = 0; i < 5; i++) {
+        digest[4 * i]     = (char)(state[i] >> 24);
+        digest[4 * i + 1] = (char)(state[i] >> 16);
+        digest[4 * i + 2] = (char)(state[i] >> 8);
+        digest[4 * i + 3] = (char)(state[i]);
+    }
+}
@@ -0,0 +1,24 @@
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <stddef.h>
+
+
+#define Sha1DigestSize  20
+
+
+/**
+ Computes the SHA-1 digest of some data, used as the key of the items in
+ content-addressed archives. It uses the SHA extensions of x86 CPUs when the
+ CPU supports them, and a portable implementation otherwise.
+
+ @param data The data.
+ @param size The size of the data.
+ @param digest A pointer in which the digest (20 bytes) will be written.
+ */
+void            Sha1_digest(const void*         data,
+                            size_t              size,
+                            char*               digest);
+
+
+#endif /* SHA1_H */
@@ -0,0 +1,209 @@
+//
+//  bench_direct_io.c
+//  ArchiveLib
+//
+//  Compares how much of the page cache small and large items take under a
+//  mixed workload, with large items read through the page cache or with
+//  direct I/O (Archive_set_direct_io).
+//
+//  The small items are set to their own pages and the large ones to others,
+//  so the share of these page files resident in the page cache (as told by
+//  mincore) is the cache hit rate of the next read of their items. Run it
+//  under a memory limit (e.g. in a cgroup) to see the large items evict the
+//  small ones when they go through the page cache.
+//
+//  Usage: ArchiveDirectIOBench [n_small_items] [n_large_items] [n_rounds]
+//
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "Archive.h"
+#include "FileIO.h"
+
+#ifdef __APPLE__
+typedef char mincore_vec_t;
+#else
+typedef unsigned char mincore_vec_t;
+#endif
+
+
+#define SmallItemSize   1024
+#define LargeItemSize   (4 << 20)
+#define DirectThreshold (1 << 20)
+
+
+static inline void _make_key(char* key, size_t i, bool large)
+{
+    memset(key, 0, 20);
+    key[0] = large ? 'L' : 'S';
+    memcpy(key + 1, &i, sizeof(size_t));
+}
+
+
+static inline double _now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ Counts the pages of a file which are in the page cache.
+ */
+static void _count_resident(const char* path, size_t* n_resident, size_t* n_pages)
+{
+    off_t size = fsize(path);
+    file_descriptor fd = open(path, O_RDONLY);
+    if (size <= 0 || fd < 0) {
+        return;
+    }
+    void* map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t n = ((size_t)size + page_size - 1) / page_size;
+    mincore_vec_t* vec = (mincore_vec_t*)malloc(n);
+    size_t i;
+    if (mincore(map, (size_t)size, vec) == 0) {
+        for (i = 0; i < n; i++) {
+            *n_resident += vec[i] & 1;
+        }
+    }
+    *n_pages += n;
+    free(vec);
+    munmap(map, (size_t)size);
+}
+
+
+/**
+ Computes the share of a range of saved pages which is in the page cache.
+ */
+static double _resident_ratio(const ArchiveSaveResult* result, size_t first, size_t end)
+{
+    size_t n_resident = 0;
+    size_t n_pages = 0;
+    size_t i;
+    for (i = first; i < end; i++) {
+        _count_resident(result->files[i].filename, &n_resident, &n_pages);
+    }
+    return n_pages > 0 ? (double)n_resident / n_pages : 0;
+}
+
+
+static Errors _read_item(Archive* archive, size_t i, bool large)
+{
+    char key[20];
+    char* data;
+    size_t data_size;
+    _make_key(key, i, large);
+    Errors error = Archive_get(archive, key, &data, &data_size);
+    if (error == E_SUCCESS) {
+        free(data);
+    }
+    return error;
+}
+
+
+static Errors _run(size_t threshold, size_t n_small, size_t n_large, size_t n_rounds)
+{
+    Errors error;
+    Archive archive;
+    ArchiveSaveResult result;
+    char key[20];
+    char* data = (char*)malloc(LargeItemSize);
+    size_t i, j;
+
+    printf("== %s ==\n", threshold > 0 ? "Direct I/O for large items" : "Page cache for all items");
+    Archive_init(&archive, "./");
+    Archive_set_direct_io(&archive, threshold);
+
+    // small items in their pages, large ones in the following ones
+    error = Archive_add_empty_page(&archive);
+    for (i = 0; error == E_SUCCESS && i < n_small; i++) {
+        memset(data, (int)i, SmallItemSize);
+        _make_key(key, i, false);
+        error = Archive_set(&archive, key, data, SmallItemSize);
+    }
+    size_t n_small_pages = archive.n_pages;
+    if (error == E_SUCCESS) {
+        error = Archive_add_empty_page(&archive);
+    }
+    for (i = 0; error == E_SUCCESS && i < n_large; i++) {
+        memset(data, (int)i, LargeItemSize);
+        _make_key(key, i, true);
+        error = Archive_set(&archive, key, data, LargeItemSize);
+    }
+    free(data);
+    if (error != E_SUCCESS) {
+        printf("Failed to set the items, error = %d\n", error);
+        Archive_free(&archive);
+        return error;
+    }
+    error = Archive_save(&archive, &result);
+    if (error != E_SUCCESS) {
+        printf("Failed to save the archive, error = %d\n", error);
+        Archive_free(&archive);
+        return error;
+    }
+
+    // start cold, then warm the small items up
+    Archive_set_access(&archive, ArchiveAccessDontNeed);
+    Archive_set_access(&archive, ArchiveAccessNormal);
+    for (i = 0; error == E_SUCCESS && i < n_small; i++) {
+        error = _read_item(&archive, i, false);
+    }
+
+    // mixed workload: a large item for every 100 small ones
+    double start = _now();
+    size_t n_reads = 0;
+    for (j = 0; error == E_SUCCESS && j < n_rounds; j++) {
+        for (i = 0; error == E_SUCCESS && i < n_small; i++) {
+            error = _read_item(&archive, arc4random_uniform((__uint32_t)n_small), false);
+            if (error == E_SUCCESS && i % 100 == 0) {
+                error = _read_item(&archive, arc4random_uniform((__uint32_t)n_large), true);
+            }
+            n_reads++;
+        }
+    }
+    double elapsed = _now() - start;
+    if (error != E_SUCCESS) {
+        printf("Failed to read the items, error = %d\n", error);
+    } else {
+        printf("Reads: %zu small in %.3fs\n", n_reads, elapsed);
+        printf("Small items in the page cache: %5.1f%%\n",
+               100 * _resident_ratio(&result, 0, n_small_pages));
+        printf("Large items in the page cache: %5.1f%%\n",
+               100 * _resident_ratio(&result, n_small_pages, result.count));
+    }
+
+    Archive_free(&archive);
+    for (i = 0; i < result.count; i++) {
+        unlink(result.files[i].filename);
+    }
+    ArchiveSaveResult_free(&result);
+    return error;
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t n_small = argc > 1 ? (size_t)atol(argv[1]) : 20000;
+    size_t n_large = argc > 2 ? (size_t)atol(argv[2]) : 64;
+    size_t n_rounds = argc > 3 ? (size_t)atol(argv[3]) : 5;
+    if (n_small == 0 || n_large == 0) {
+        printf("Usage: %s [n_small_items] [n_large_items] [n_rounds]\n", argv[0]);
+        return 1;
+    }
+
+    if (_run(0, n_small, n_large, n_rounds) != E_SUCCESS ||
+        _run(DirectThreshold, n_small, n_large, n_rounds) != E_SUCCESS) {
+        return 1;
+    }
+    return 0;
+}
@@ -8,14 +8,22 @@
 
 #include <ArchivePage.h>
 #include <Archive.h>
+#include <ArchiveIterator.h>
+#include <ArchiveShards.h>
+#include <ArchiveExecutor.h>
+#include <ArchiveCompactor.h>
+#include <Checksum.h>
+#include <Sha1.h>
 #include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include <cmocka.h>
 #include <malloc/malloc.h>
 #include <uuid/uuid.h>
 
 static void test_ArchivePage(void **state) {
-    assert_int_equal(sizeof(ArchivePage), 0x30);
+    assert_int_equal(sizeof(ArchivePage), 0xf0);
 }
 
 
@@ -120,6 +128,7 @@ static void test_Archive_has(void **state) {
 
     HashIndex* index = (&(archive.pages[0]))->index;
     HashIndex_set(index, key, 0, 0);
+    ArchivePage_refresh_fence(archive.pages + 0);
 
     assert_true(Archive_has(&archive, key));
 
@@ -137,6 +146,7 @@ static void test_Archive_has(void **state) {
     };
     assert_false(Archive_has(&archive, key2));
     HashIndex_set(index, key2, 1, 1);
+    ArchivePage_refresh_fence(archive.pages + 0);
     assert_true(Archive_has(&archive, key2));
 
     char key3[20] = {
@@ -151,6 +161,7 @@ static void test_Archive_has(void **state) {
             (&(archive.pages[1]))->index,
             key3, 1, 1
     );
+    ArchivePage_refresh_fence(archive.pages + 1);
 
     assert_true(Archive_has(&archive, key3));
 
@@ -165,6 +176,7 @@ static void test_Archive_has(void **state) {
             (&(archive.pages[1]))->index,
             key4, 1, 1
     );
+    ArchivePage_refresh_fence(archive.pages + 1);
     assert_true(Archive_has(&archive, key4));
 
     /// Add new page on 255
@@ -179,6 +191,7 @@ static void test_Archive_has(void **state) {
             (&(archive.pages[1]))->index,
             key5, 1, 1
     );
+    ArchivePage_refresh_fence(archive.pages + 1);
     assert_true(Archive_has(&archive, key5));
 }
 
@@ -370,9 +383,9 @@ static void test_Archive_set__index_inserts(void **state) {
     assert_int_equal(archive.pages[1].index->pages[0xff].n_items, 2);
     assert_memory_not_equal(archive.pages[1].index->pages[0xff].items[0].key, key, 20);
     assert_memory_equal(archive.pages[1].index->pages[0xff].items[1].key, key, 20);
-    // Assert offset is correct
+    // Assert offset is correct (after the data and checksum of the first item)
     assert_int_equal(archive.pages[1].index->pages[0xff].items[1].data_offset,
-                     archive.pages[1].index->pages[0xff].items[0].data_size);
+                     archive.pages[1].index->pages[0xff].items[0].data_size + 4);
     key[1] = (char) 0xf2;
     assert_false(Archive_has(&archive, key));
     Archive_set(&archive, key, "lots_andLots of data", 21);
@@ -606,6 +619,2015 @@ static void test_HashIndex_init(void **state) {
 
 
 
+/**
+ *
+ * Test iterating live keys, prefixes and page items
+ */
+static void test_ArchiveIterator(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    char key[20] = {
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100
+    };
+    Archive_set(&archive, key, "data", 5);
+    key[19] = 101;
+    Archive_set(&archive, key, "more data", 10);
+    key[0] = 1;
+    Archive_set(&archive, key, "other", 6);
+
+    // the same key in a newer page shadows the older one
+    Archive_add_empty_page(&archive);
+    key[0] = 100;
+    HashIndex_set(archive.pages[1].index, key, 0, 3);
+
+    ArchiveIterator it;
+    ArchiveEntry entry;
+    size_t count = 0;
+    assert_int_equal(ArchiveIterator_init(&it, &archive, NULL, 0), E_SUCCESS);
+    while (ArchiveIterator_next(&it, &entry)) {
+        if (entry.key[0] == 100 && entry.key[19] == 101) {
+            assert_int_equal(entry.page, 1);
+            assert_int_equal(entry.data_size, 3);
+        }
+        count++;
+    }
+    assert_int_equal(count, 3);
+
+    // prefix only matches the keys starting with it
+    count = 0;
+    assert_int_equal(ArchiveIterator_init(&it, &archive, key, 3), E_SUCCESS);
+    while (ArchiveIterator_next(&it, &entry)) {
+        assert_memory_equal(entry.key, key, 3);
+        count++;
+    }
+    assert_int_equal(count, 2);
+
+    count = 0;
+    ArchiveIterator_init(&it, &archive, key, 20);
+    while (ArchiveIterator_next(&it, &entry)) {
+        assert_memory_equal(entry.key, key, 20);
+        count++;
+    }
+    assert_int_equal(count, 1);
+
+    assert_int_equal(ArchiveIterator_init(&it, &archive, key, 21),
+                     E_INVALID_PARTIAL_KEY_LENGTH);
+
+    // page items come in offset order, each followed by its checksum
+    ArchivePageIterator pit;
+    size_t offset = 0;
+    count = 0;
+    assert_int_equal(ArchivePageIterator_init(&pit, &archive, 0), E_SUCCESS);
+    while (ArchivePageIterator_next(&pit, &entry)) {
+        assert_int_equal(entry.data_offset, offset);
+        assert_int_equal(entry.page, 0);
+        offset += entry.data_size + 4;
+        count++;
+    }
+    assert_int_equal(count, 3);
+    ArchivePageIterator_free(&pit);
+
+    assert_int_equal(ArchivePageIterator_init(&pit, &archive, 2),
+                     E_INDEX_OUT_OF_BOUNDS);
+
+    // a compaction in between two steps stops the iteration
+    assert_int_equal(ArchiveIterator_init(&it, &archive, NULL, 0), E_SUCCESS);
+    assert_true(ArchiveIterator_next(&it, &entry));
+    assert_int_equal(Archive_compact(&archive, 0, 1), E_SUCCESS);
+    assert_false(ArchiveIterator_next(&it, &entry));
+    assert_int_equal(it.error, E_STALE_PAGE);
+
+    Archive_free(&archive);
+}
+
+
+/**
+ *
+ * Test ambiguous partial keys and unique prefix lengths
+ */
+static void test_Archive_resolve_partial(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    char key[20] = {
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100
+    };
+    char key2[20];
+    memcpy(key2, key, 20);
+    key2[10] = 101;
+
+    Archive_set(&archive, key, "data", 5);
+    Archive_add_empty_page(&archive);
+    Archive_set(&archive, key2, "other", 6);
+
+    char full_key[20];
+    size_t n_candidates;
+    assert_int_equal(Archive_resolve_partial(&archive, key, 10, full_key, &n_candidates),
+                     E_AMBIGUOUS);
+    assert_int_equal(n_candidates, 2);
+    assert_int_equal(Archive_resolve_partial(&archive, key, 11, full_key, &n_candidates),
+                     E_SUCCESS);
+    assert_int_equal(n_candidates, 1);
+    assert_memory_equal(full_key, key, 20);
+    assert_int_equal(Archive_resolve_partial(&archive, key, 2, full_key, &n_candidates),
+                     E_INVALID_PARTIAL_KEY_LENGTH);
+
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get_partial_unique(&archive, key2, 5, NULL, 0, &data, &data_size, &n_candidates),
+                     E_AMBIGUOUS);
+    assert_int_equal(Archive_get_partial_unique(&archive, key2, 11, full_key, 0, &data, &data_size, NULL),
+                     E_SUCCESS);
+    assert_memory_equal(full_key, key2, 20);
+    assert_int_equal(data_size, 6);
+    free(data);
+
+    size_t length;
+    assert_int_equal(Archive_unique_prefix_length(&archive, key, &length), E_SUCCESS);
+    assert_int_equal(length, 11);
+    key[0] = 1;
+    assert_int_equal(Archive_unique_prefix_length(&archive, key, &length), E_NOT_FOUND);
+    Archive_set(&archive, key, "data", 5);
+    assert_int_equal(Archive_unique_prefix_length(&archive, key, &length), E_SUCCESS);
+    assert_int_equal(length, 3);
+
+    // a key deleted in a newer page doesn't count anymore
+    key[0] = 100;
+    Archive_add_empty_page(&archive);
+    Archive_delete(&archive, key2);
+    assert_int_equal(Archive_resolve_partial(&archive, key, 10, full_key, &n_candidates),
+                     E_SUCCESS);
+    assert_int_equal(Archive_unique_prefix_length(&archive, key, &length), E_SUCCESS);
+    assert_int_equal(length, 3);
+
+    // without a count, the keys are only counted up to the ambiguity
+    key2[10] = 102;
+    Archive_set(&archive, key2, "more", 5);
+    key2[10] = 103;
+    Archive_set(&archive, key2, "more", 5);
+    assert_int_equal(Archive_resolve_partial(&archive, key, 10, full_key, &n_candidates),
+                     E_AMBIGUOUS);
+    assert_int_equal(n_candidates, 3);
+    assert_int_equal(Archive_resolve_partial(&archive, key, 10, NULL, NULL), E_AMBIGUOUS);
+
+    Archive_free(&archive);
+}
+
+
+/**
+ *
+ * Test deleting items, page stats and compaction
+ */
+static void test_Archive_delete(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    char key[20] = {
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100
+    };
+    char key2[20];
+    memcpy(key2, key, 20);
+    key2[19] = 101;
+
+    assert_int_equal(Archive_delete(&archive, key), E_NOT_FOUND);
+    Archive_set(&archive, key, "data", 5);
+    Archive_set(&archive, key2, "other", 6);
+    Archive_add_empty_page(&archive);
+
+    // the tombstone hides the key, but not the other keys with its prefix
+    assert_int_equal(Archive_delete(&archive, key), E_SUCCESS);
+    assert_false(Archive_has(&archive, key));
+    char full_key[20];
+    assert_true(Archive_has_partial(&archive, key, 10, full_key));
+    assert_memory_equal(full_key, key2, 20);
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_NOT_FOUND);
+
+    // setting the key again after deleting it writes a new item
+    assert_int_equal(Archive_set(&archive, key, "new", 4), E_SUCCESS);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "new");
+    free(data);
+    assert_int_equal(Archive_delete(&archive, key), E_SUCCESS);
+    assert_false(Archive_has(&archive, key));
+
+    ArchivePageStats stats;
+    assert_int_equal(Archive_page_stats(&archive, 0, &stats), E_SUCCESS);
+    assert_int_equal(stats.n_live_items, 1);
+    assert_int_equal(stats.n_dead_items, 1);
+    assert_int_equal(stats.live_size, 6 + 4);
+    assert_int_equal(stats.dead_size, 5 + 4);
+    assert_int_equal(Archive_page_stats(&archive, 1, &stats), E_SUCCESS);
+    assert_int_equal(stats.n_tombstones, 2);
+    assert_int_equal(stats.n_dead_items, 1);
+    assert_int_equal(stats.dead_size, 4 + 4);
+
+    // compacting keeps only the live data, but not the page being written
+    assert_int_equal(Archive_compact(&archive, 0, 2), E_INDEX_OUT_OF_BOUNDS);
+    Archive_add_empty_page(&archive);
+    assert_int_equal(Archive_compact(&archive, 0, 2), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 2);
+    assert_int_equal(archive.pages[0].index->n_items, 1);
+    assert_int_equal(archive.pages[0].data_size, 6 + 4);
+    assert_false(Archive_has(&archive, key));
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "other");
+    free(data);
+
+    // tombstones are kept while an older page has their key
+    Archive_add_empty_page(&archive);
+    Archive_delete(&archive, key2);
+    Archive_add_empty_page(&archive);
+    assert_int_equal(Archive_compact(&archive, 1, 2), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 3);
+    assert_false(Archive_has(&archive, key2));
+    assert_int_equal(Archive_compact(&archive, 1, 2), E_INDEX_OUT_OF_BOUNDS);
+
+    Archive_free(&archive);
+}
+
+
+/**
+ *
+ * Test overwriting items with put
+ */
+static void test_Archive_put(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    char key[20] = {
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100, 100,
+            100, 100, 100, 100, 100, 100
+    };
+    char* data;
+    size_t data_size;
+
+    // set doesn't overwrite, put does, even in the same page
+    Archive_set(&archive, key, "data", 5);
+    Archive_set(&archive, key, "ignored", 8);
+    assert_int_equal(archive.pages[0].index->n_items, 1);
+    assert_int_equal(Archive_put(&archive, key, "new data", 9), E_SUCCESS);
+    assert_int_equal(archive.pages[0].index->n_items, 2);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "new data");
+    free(data);
+
+    // the newest item survives a save and reload
+    ArchiveSaveResult saves;
+    Archive_save(&archive, &saves);
+    Archive_free(&archive);
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "new data");
+    free(data);
+
+    // and is shadowed by a put in a newer page
+    Archive_add_empty_page(&archive);
+    Archive_put(&archive, key, "newest", 7);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "newest");
+    free(data);
+
+    ArchiveIterator it;
+    ArchiveEntry entry;
+    size_t count = 0;
+    ArchiveIterator_init(&it, &archive, NULL, 0);
+    while (ArchiveIterator_next(&it, &entry)) {
+        assert_int_equal(entry.page, 1);
+        count++;
+    }
+    assert_int_equal(count, 1);
+
+    ArchivePageStats stats;
+    Archive_page_stats(&archive, 0, &stats);
+    assert_int_equal(stats.n_live_items, 0);
+    assert_int_equal(stats.n_dead_items, 2);
+    assert_int_equal(stats.dead_size, 14 + 2 * 4);
+
+    Archive_free(&archive);
+}
+
+
+/**
+ *
+ * Test replaying the write-ahead log of pages that weren't saved
+ */
+static void test_Archive_wal(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_enable_wal(&archive, 2);
+    Archive_add_empty_page(&archive);
+    char filename[37];
+    strcpy(filename, archive.pages[0].filename);
+
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key3[20] = {3, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+
+    // the first two items make a batch, the third one is never synced
+    Archive_set(&archive, key1, "one", 4);
+    Archive_set(&archive, key2, "two", 4);
+    Archive_set(&archive, key3, "three", 6);
+    Archive_free(&archive);
+
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, filename), E_SUCCESS);
+    assert_true(Archive_has(&archive, key1));
+    assert_true(Archive_has(&archive, key2));
+    assert_false(Archive_has(&archive, key3));
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "two");
+    free(data);
+
+    // an explicit sync makes the pending items durable
+    Archive_enable_wal(&archive, 10);
+    Archive_set(&archive, key3, "three", 6);
+    Archive_delete(&archive, key1);
+    assert_int_equal(Archive_sync(&archive), E_SUCCESS);
+    Archive_free(&archive);
+
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, filename), E_SUCCESS);
+    assert_false(Archive_has(&archive, key1));
+    assert_true(Archive_has(&archive, key3));
+
+    // saving writes the index and removes the log
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    char wal_path[64];
+    sprintf(wal_path, "%s.wal", filename);
+    assert_int_equal(access(wal_path, F_OK), -1);
+    Archive_free(&archive);
+
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_SUCCESS);
+    assert_int_equal(archive.pages[0].index->n_items, 4);
+    assert_false(Archive_has(&archive, key1));
+    assert_true(Archive_has(&archive, key2));
+    assert_true(Archive_has(&archive, key3));
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+}
+
+
+/**
+ *
+ * Test that saves only write the index items set since the last save
+ */
+static void test_ArchivePage_save_incremental(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    ArchiveSaveResult saves;
+    Archive_set(&archive, key1, "one", 4);
+    Archive_save(&archive, &saves);
+    ArchiveSaveResult_free(&saves);
+    assert_int_equal(archive.pages[0].n_unsaved_items, 0);
+
+    // tamper with the size of the saved item (header is 104 bytes, and the
+    // size is the last field of the 28 bytes packed item)
+    __uint32_t size = htonl(3);
+    assert_int_equal(pwrite(archive.pages[0].fd, &size, 4, 104 + 24), 4);
+
+    // the next save leaves the saved slot as is
+    Archive_set(&archive, key2, "two", 4);
+    assert_int_equal(archive.pages[0].n_unsaved_items, 1);
+    Archive_save(&archive, &saves);
+    Archive_free(&archive);
+
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_SUCCESS);
+    assert_int_equal(archive.pages[0].index->n_items, 2);
+    char* data;
+    size_t data_size;
+    // the tampered slot is still there, and no longer matches its checksum
+    assert_int_equal(Archive_get(&archive, key1, &data, &data_size), E_CHECKSUM_MISMATCH);
+    assert_int_equal(Archive_get_partial(&archive, key1, 20, NULL, 2, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 3);
+    free(data);
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "two");
+    free(data);
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+}
+
+/**
+ * Archive
+ *
+ * Test that pages keep their file name in manifest mode, and that the
+ * archive can be reopened from its manifest
+ */
+static void test_Archive_manifest(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "manifest");
+    Archive_add_empty_page(&archive);
+    char filename[37];
+    strcpy(filename, archive.pages[0].filename);
+
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    ArchiveSaveResult saves;
+
+    // each save commits a new generation under the same name
+    Archive_set(&archive, key1, "one", 4);
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    assert_string_equal(saves.files[0].filename, filename);
+    ArchiveSaveResult_free(&saves);
+    Archive_set(&archive, key2, "two", 4);
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    assert_string_equal(saves.files[0].filename, filename);
+    ArchiveSaveResult_free(&saves);
+    assert_int_equal(archive.pages[0].generation, 2);
+
+    // a save without changes keeps the generation
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    assert_int_equal(archive.pages[0].generation, 2);
+    Archive_free(&archive);
+
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "manifest");
+    assert_int_equal(Archive_load_manifest(&archive), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 1);
+    assert_string_equal(archive.pages[0].filename, filename);
+    assert_int_equal(archive.pages[0].generation, 2);
+    assert_true(Archive_has(&archive, key1));
+    assert_true(Archive_has(&archive, key2));
+    Archive_free(&archive);
+
+    // a corrupted manifest is detected
+    file_descriptor fd = open("./manifest", O_WRONLY);
+    assert_int_equal(pwrite(fd, "X", 1, 0), 1);
+    close(fd);
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "manifest");
+    assert_int_equal(Archive_load_manifest(&archive), E_INVALID_MANIFEST);
+    Archive_free(&archive);
+}
+
+/**
+ * Archive
+ *
+ * Test that Archive_open restores the pages from the manifest, and only
+ * opens them when needed
+ */
+static void test_Archive_open(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "manifest");
+
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key3[20] = {3, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    Archive_add_empty_page(&archive);
+    Archive_set(&archive, key1, "one", 4);
+    Archive_add_empty_page(&archive);
+    Archive_set(&archive, key2, "two", 4);
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+
+    // only the last page is opened
+    assert_int_equal(Archive_open(&archive, "./", "manifest"), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 2);
+    assert_false(ArchivePage_is_open(archive.pages + 0));
+    assert_true(ArchivePage_is_open(archive.pages + 1));
+    assert_int_equal(archive.pages[0].generation, 1);
+    assert_int_equal(archive.pages[0].data_size, 4 + 4);
+
+    // the filter of the first page excludes the keys starting with 3
+    assert_false(Archive_has(&archive, key3));
+    assert_true(Archive_has(&archive, key2));
+    assert_false(ArchivePage_is_open(archive.pages + 0));
+
+    // reading from it opens it
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, key1, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "one");
+    free(data);
+    assert_true(ArchivePage_is_open(archive.pages + 0));
+
+    // saving again keeps the summary of the pages
+    Archive_set(&archive, key3, "three", 6);
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+
+    assert_int_equal(Archive_open(&archive, "./", "manifest"), E_SUCCESS);
+    assert_int_equal(archive.pages[1].generation, 2);
+    assert_true(Archive_has(&archive, key1));
+    assert_true(Archive_has(&archive, key3));
+    Archive_free(&archive);
+}
+
+/**
+ * Archive
+ *
+ * Test that corrupted items and headers are detected by their checksums
+ */
+static void test_Archive_verify(void **state) {
+    assert_int_equal(Checksum_crc32c(0, "123456789", 9), 0xe3069283);
+    assert_int_equal(Checksum_crc32c(Checksum_crc32c(0, "1234", 4), "56789", 5), 0xe3069283);
+
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+    Archive_add_empty_page(&archive);
+    char filename[37];
+    strcpy(filename, archive.pages[0].filename);
+
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    Archive_set(&archive, key2, "two", 4);
+    assert_int_equal(ArchivePage_set(archive.pages + 0, key1, "one", 4), E_SUCCESS);
+    size_t n_corrupted = 1;
+    assert_int_equal(Archive_verify(&archive, 2, &n_corrupted), E_SUCCESS);
+    assert_int_equal(n_corrupted, 0);
+
+    // flip a byte of the first item's data (index of 2000 items after the
+    // 104 bytes header)
+    assert_int_equal(pwrite(archive.pages[0].fd, "O", 1, 104 + 2000 * 28), 1);
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, key1, &data, &data_size), E_CHECKSUM_MISMATCH);
+    assert_int_equal(Archive_verify(&archive, 0, &n_corrupted), E_CHECKSUM_MISMATCH);
+    assert_int_equal(n_corrupted, 1);
+
+    // unless reads aren't verified
+    Archive_set_verify(&archive, ArchiveVerifyOff, 0);
+    assert_int_equal(Archive_get(&archive, key1, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "One");
+    free(data);
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    free(data);
+
+    // a corrupted header prevents opening the page
+    ArchiveSaveResult saves;
+    Archive_save(&archive, &saves);
+    Archive_free(&archive);
+    file_descriptor fd = open(saves.files[0].filename, O_WRONLY);
+    assert_int_equal(pwrite(fd, "\xff", 1, 8), 1);
+    close(fd);
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_CHECKSUM_MISMATCH);
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+}
+
+
+
+static void test_Archive_content_addressed(void **state) {
+    char digest[20];
+    Sha1_digest("abc", 3, digest);
+    assert_memory_equal(digest, "\xa9\x99\x3e\x36\x47\x06\x81\x6a\xba\x3e"
+                                "\x25\x71\x78\x50\xc2\x6c\x9c\xd0\xd8\x9d", 20);
+    Sha1_digest("", 0, digest);
+    assert_memory_equal(digest, "\xda\x39\xa3\xee\x5e\x6b\x4b\x0d\x32\x55"
+                                "\xbf\xef\x95\x60\x18\x90\xaf\xd8\x07\x09", 20);
+    const char* two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    Sha1_digest(two_blocks, strlen(two_blocks), digest);
+    assert_memory_equal(digest, "\x84\x98\x3e\x44\x1c\x3b\xd2\x6e\xba\xae"
+                                "\x4a\xa1\xf9\x51\x29\xe5\xe5\x46\x70\xf1", 20);
+
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    // keys must be the digest of the data
+    char key[20];
+    assert_int_equal(Archive_set_content(&archive, "abc", 3, key), E_NOT_CONTENT_ADDRESSED);
+    Archive_use_digest(&archive, Sha1_digest, true);
+    char wrong_key[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                          100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    assert_int_equal(Archive_set(&archive, wrong_key, "abc", 3), E_DIGEST_MISMATCH);
+    assert_int_equal(Archive_put(&archive, wrong_key, "abc", 3), E_DIGEST_MISMATCH);
+    assert_false(Archive_has(&archive, wrong_key));
+    assert_int_equal(Archive_set_content(&archive, "abc", 3, key), E_SUCCESS);
+    Sha1_digest("abc", 3, digest);
+    assert_memory_equal(key, digest, 20);
+    assert_int_equal(Archive_set(&archive, digest, "abc", 3), E_SUCCESS);
+    assert_int_equal(archive.pages[0].index->n_items, 1);
+    Sha1_digest(two_blocks, strlen(two_blocks), digest);
+    assert_int_equal(Archive_put(&archive, digest, two_blocks, strlen(two_blocks)), E_SUCCESS);
+
+    size_t n_corrupted = 1;
+    assert_int_equal(Archive_verify(&archive, 1, &n_corrupted), E_SUCCESS);
+    assert_int_equal(n_corrupted, 0);
+
+    // an item written under another key, bypassing the archive, is caught on
+    // full reads and by verify
+    assert_int_equal(ArchivePage_set(archive.pages + 0, wrong_key, "abc", 3), E_SUCCESS);
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, wrong_key, &data, &data_size), E_DIGEST_MISMATCH);
+    assert_int_equal(Archive_get_partial(&archive, wrong_key, 20, NULL, 2, &data, &data_size), E_SUCCESS);
+    free(data);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 3);
+    free(data);
+    assert_int_equal(Archive_verify(&archive, 1, &n_corrupted), E_CHECKSUM_MISMATCH);
+    assert_int_equal(n_corrupted, 1);
+
+    // unless the reads aren't checked
+    Archive_use_digest(&archive, Sha1_digest, false);
+    assert_int_equal(Archive_get(&archive, wrong_key, &data, &data_size), E_SUCCESS);
+    free(data);
+    Archive_free(&archive);
+}
+
+
+
+static void test_Archive_prefetch(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "prefetch_manifest");
+
+    char keys[3 * 20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                         100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                         2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                         100, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                         3, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                         100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    Archive_add_empty_page(&archive);
+    Archive_set(&archive, keys, "one", 4);
+    Archive_add_empty_page(&archive);
+    Archive_set(&archive, keys + 20, "two", 4);
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+
+    // hints don't open the pages
+    assert_int_equal(Archive_open(&archive, "./", "prefetch_manifest"), E_SUCCESS);
+    Archive_set_access(&archive, ArchiveAccessRandom);
+    assert_false(ArchivePage_is_open(archive.pages + 0));
+
+    // but prefetching looks the keys up, missing ones are ignored
+    assert_int_equal(Archive_prefetch(&archive, keys, 3), E_SUCCESS);
+    assert_true(ArchivePage_is_open(archive.pages + 0));
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, keys, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "one");
+    free(data);
+
+    // compaction scans the pages and drops them from the cache
+    Archive_set_compaction_drops_cache(&archive, true);
+    Archive_add_empty_page(&archive);
+    assert_int_equal(Archive_compact(&archive, 0, 2), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 2);
+    assert_int_equal(Archive_get(&archive, keys + 20, &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "two");
+    free(data);
+    Archive_free(&archive);
+}
+
+
+
+static void test_Archive_direct_io(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+    Archive_set_direct_io(&archive, 8192);
+
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    size_t large_size = 20000;
+    char* large = (char*)malloc(large_size);
+    size_t i;
+    for (i = 0; i < large_size; i++) {
+        large[i] = (char)(i * 7);
+    }
+    assert_int_equal(Archive_set(&archive, key1, "small", 5), E_SUCCESS);
+    assert_int_equal(Archive_set(&archive, key2, large, large_size), E_SUCCESS);
+
+    // the large item is aligned in the file (after the 104 bytes header and the
+    // index of 2000 items), the small one isn't
+    const HashItem* item = HashIndex_get(archive.pages[0].index, key2, 20);
+    assert_int_equal((104 + 2000 * 28 + item->data_offset) % 4096, 0);
+    assert_int_equal(HashIndex_get(archive.pages[0].index, key1, 20)->data_offset, 0);
+    assert_int_equal(archive.pages[0].data_size, item->data_offset + large_size + 4);
+
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, large_size);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+    assert_int_equal(Archive_get_partial(&archive, key2, 20, NULL, 10000, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, large, 10000);
+    free(data);
+    assert_int_equal(Archive_get(&archive, key1, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, "small", 5);
+    free(data);
+    assert_int_equal(Archive_verify(&archive, 1, NULL), E_SUCCESS);
+
+    // and stays readable once saved, reopened, and compacted
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    Archive_free(&archive);
+    Archive_init(&archive, "./");
+    Archive_set_direct_io(&archive, 8192);
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    Archive_add_empty_page(&archive);
+    assert_int_equal(Archive_compact(&archive, 0, 1), E_SUCCESS);
+    item = HashIndex_get(archive.pages[0].index, key2, 20);
+    assert_int_equal((104 + 2000 * 28 + item->data_offset) % 4096, 0);
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+
+    // reads through the page cache see the same data
+    Archive_set_direct_io(&archive, 0);
+    assert_int_equal(archive.pages[0].direct_fd, -1);
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+    free(large);
+    Archive_free(&archive);
+}
+
+
+
+static void test_Archive_blobs(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+    Archive_set_blob_threshold(&archive, 8192);
+
+    char key1[20] = {1, 101, 101, 101, 101, 101, 101, 101, 101, 101,
+                     101, 101, 101, 101, 101, 101, 101, 101, 101, 101};
+    char key2[20] = {2, 101, 101, 101, 101, 101, 101, 101, 101, 101,
+                     101, 101, 101, 101, 101, 101, 101, 101, 101, 101};
+    char key3[20] = {3, 101, 101, 101, 101, 101, 101, 101, 101, 101,
+                     101, 101, 101, 101, 101, 101, 101, 101, 101, 101};
+    size_t large_size = 20000;
+    char* large = (char*)malloc(large_size);
+    size_t i;
+    for (i = 0; i < large_size; i++) {
+        large[i] = (char)(i * 11);
+    }
+    assert_int_equal(Archive_set(&archive, key1, "small", 5), E_SUCCESS);
+    assert_int_equal(Archive_set(&archive, key2, large, large_size), E_SUCCESS);
+    assert_int_equal(Archive_set(&archive, key3, large, large_size), E_SUCCESS);
+
+    // the large items are in the blob file, in their own blocks, and take no
+    // space in the page file
+    const HashItem* item = HashIndex_get(archive.pages[0].index, key2, 20);
+    assert_true(HashItem_is_blob(item));
+    assert_int_equal(item->data_offset, HashItemBlobFlag | 0);
+    item = HashIndex_get(archive.pages[0].index, key3, 20);
+    assert_int_equal(item->data_offset, HashItemBlobFlag | 5);
+    assert_false(HashItem_is_blob(HashIndex_get(archive.pages[0].index, key1, 20)));
+    assert_int_equal(archive.pages[0].data_size, 5 + 4);
+    assert_int_equal(archive.pages[0].blob_size, 10 * 4096);
+
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, key3, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, large_size);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+    assert_int_equal(Archive_verify(&archive, 1, NULL), E_SUCCESS);
+
+    // the blob file follows the page file when it's renamed
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    Archive_free(&archive);
+    char* blob_path;
+    asprintf(&blob_path, "%s.blob", saves.files[0].filename);
+    struct stat st;
+    assert_int_equal(stat(blob_path, &st), 0);
+    assert_int_equal(st.st_size, 5 * 4096 + large_size + 4);
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    assert_int_equal(Archive_get(&archive, key2, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+
+    // compaction copies the live blobs to the new blob file, and removes the
+    // old one
+    Archive_set_blob_threshold(&archive, 8192);
+    Archive_add_empty_page(&archive);
+    assert_int_equal(Archive_delete(&archive, key2), E_SUCCESS);
+    assert_int_equal(Archive_compact(&archive, 0, 1), E_SUCCESS);
+    assert_int_equal(access(blob_path, F_OK), -1);
+    free(blob_path);
+    item = HashIndex_get(archive.pages[0].index, key3, 20);
+    assert_int_equal(item->data_offset, HashItemBlobFlag | 0);
+    assert_int_equal(Archive_get(&archive, key3, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+    assert_int_equal(Archive_get(&archive, key1, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, "small", 5);
+    free(data);
+    assert_int_equal(Archive_has(&archive, key2), false);
+    assert_int_equal(Archive_verify(&archive, 1, NULL), E_SUCCESS);
+    free(large);
+    Archive_free(&archive);
+}
+
+
+
+static void test_Archive_get_to_fd(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+
+    char key1[20] = {1, 102, 102, 102, 102, 102, 102, 102, 102, 102,
+                     102, 102, 102, 102, 102, 102, 102, 102, 102, 102};
+    char key2[20] = {2, 102, 102, 102, 102, 102, 102, 102, 102, 102,
+                     102, 102, 102, 102, 102, 102, 102, 102, 102, 102};
+    size_t size = 5000;
+    char* data = (char*)malloc(size);
+    char* buffer = (char*)malloc(size);
+    size_t i;
+    for (i = 0; i < size; i++) {
+        data[i] = (char)(i * 13);
+    }
+    assert_int_equal(Archive_set(&archive, key1, data, size), E_SUCCESS);
+    size_t sent;
+
+    // to a pipe
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(Archive_get_to_fd(&archive, key1, fds[1], &sent), E_SUCCESS);
+    assert_int_equal(sent, size);
+    assert_int_equal(read(fds[0], buffer, size), size);
+    assert_memory_equal(buffer, data, size);
+    close(fds[0]);
+    close(fds[1]);
+
+    // to a socket, a range of the data, cut at its end
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    assert_int_equal(Archive_get_range_to_fd(&archive, key1, 1000, 100, fds[1], &sent), E_SUCCESS);
+    assert_int_equal(sent, 100);
+    assert_int_equal(Archive_get_range_to_fd(&archive, key1, 4950, 100, fds[1], &sent), E_SUCCESS);
+    assert_int_equal(sent, 50);
+    assert_int_equal(Archive_get_range_to_fd(&archive, key1, 6000, 0, fds[1], &sent), E_SUCCESS);
+    assert_int_equal(sent, 0);
+    assert_int_equal(recv(fds[0], buffer, 150, MSG_WAITALL), 150);
+    assert_memory_equal(buffer, data + 1000, 100);
+    assert_memory_equal(buffer + 100, data + 4950, 50);
+    close(fds[0]);
+    close(fds[1]);
+
+    // to a file, at its position
+    char filename[] = "./get_to_fd_XXXXXX";
+    int fd = mkstemp(filename);
+    assert_true(fd >= 0);
+    assert_int_equal(write(fd, "head", 4), 4);
+    assert_int_equal(Archive_get_to_fd(&archive, key1, fd, &sent), E_SUCCESS);
+    assert_int_equal(pread(fd, buffer, size, 4), size);
+    assert_memory_equal(buffer, data, size);
+    close(fd);
+    unlink(filename);
+
+    // missing and deleted items send nothing
+    assert_int_equal(Archive_get_to_fd(&archive, key2, 1, &sent), E_NOT_FOUND);
+    assert_int_equal(Archive_delete(&archive, key1), E_SUCCESS);
+    assert_int_equal(Archive_get_to_fd(&archive, key1, 1, &sent), E_NOT_FOUND);
+
+    free(data);
+    free(buffer);
+    Archive_free(&archive);
+}
+
+
+
+static void test_Archive_get_range(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_add_empty_page(&archive);
+    Archive_set_direct_io(&archive, 4096);
+    Archive_set_blob_threshold(&archive, 16384);
+
+    char key1[20] = {1, 103, 103, 103, 103, 103, 103, 103, 103, 103,
+                     103, 103, 103, 103, 103, 103, 103, 103, 103, 103};
+    char key2[20] = {2, 103, 103, 103, 103, 103, 103, 103, 103, 103,
+                     103, 103, 103, 103, 103, 103, 103, 103, 103, 103};
+    char key3[20] = {3, 103, 103, 103, 103, 103, 103, 103, 103, 103,
+                     103, 103, 103, 103, 103, 103, 103, 103, 103, 103};
+    size_t large_size = 20000;
+    char* large = (char*)malloc(large_size);
+    size_t i;
+    for (i = 0; i < large_size; i++) {
+        large[i] = (char)(i * 17);
+    }
+    assert_int_equal(Archive_set(&archive, key1, large, 1000), E_SUCCESS);
+    assert_int_equal(Archive_set(&archive, key2, large, 10000), E_SUCCESS);
+    assert_int_equal(Archive_set(&archive, key3, large, large_size), E_SUCCESS);
+
+    // ranges in the middle, at the end and past the end, of an item in the
+    // page file, of one read directly (at an aligned offset or not) and of a
+    // blob
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get_range(&archive, key1, 100, 50, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 50);
+    assert_memory_equal(data, large + 100, 50);
+    free(data);
+    assert_int_equal(Archive_get_range(&archive, key1, 900, 500, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 100);
+    assert_memory_equal(data, large + 900, 100);
+    free(data);
+    assert_int_equal(Archive_get_range(&archive, key1, 2000, 0, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 0);
+    free(data);
+    assert_int_equal(Archive_get_range(&archive, key2, 4096, 5000, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 5000);
+    assert_memory_equal(data, large + 4096, 5000);
+    free(data);
+    assert_int_equal(Archive_get_range(&archive, key2, 3, 0, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 9997);
+    assert_memory_equal(data, large + 3, 9997);
+    free(data);
+    assert_int_equal(Archive_get_range(&archive, key3, 15000, 100, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 100);
+    assert_memory_equal(data, large + 15000, 100);
+    free(data);
+    assert_int_equal(Archive_get_range(&archive, key3, 0, 0, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, large_size);
+    assert_memory_equal(data, large, large_size);
+    free(data);
+
+    // partial reads still tell the full size
+    assert_int_equal(Archive_get_partial(&archive, key2, 20, NULL, 10, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 10000);
+    assert_memory_equal(data, large, 10);
+    free(data);
+
+    // and ranges compose with sending to a descriptor
+    int fds[2];
+    assert_int_equal(pipe(fds), 0);
+    assert_int_equal(Archive_get_range_to_fd(&archive, key3, 19990, 0, fds[1], &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 10);
+    char buffer[10];
+    assert_int_equal(read(fds[0], buffer, 10), 10);
+    assert_memory_equal(buffer, large + 19990, 10);
+    close(fds[0]);
+    close(fds[1]);
+
+    assert_int_equal(Archive_delete(&archive, key1), E_SUCCESS);
+    assert_int_equal(Archive_get_range(&archive, key1, 0, 10, &data, &data_size), E_NOT_FOUND);
+    free(large);
+    Archive_free(&archive);
+}
+
+
+
+typedef struct BulkLoadSource {
+    size_t next;
+    size_t n_items;
+    size_t fail_at;
+    char data[64];
+} BulkLoadSource;
+
+
+static Errors bulk_load_next(void* context, char* key, const char** _data, size_t* _size) {
+    BulkLoadSource* source = (BulkLoadSource*)context;
+    if (source->next == source->fail_at) {
+        return E_FILE_READ_ERROR;
+    }
+    if (source->next == source->n_items) {
+        return E_NOT_FOUND;
+    }
+    // every 10th item sets again the key of the item 1000 before it
+    size_t i = source->next % 10 == 9 && source->next >= 1000 ? source->next - 1000 : source->next;
+    memset(key, 104, 20);
+    memcpy(key, &i, sizeof(size_t));
+    snprintf(source->data, sizeof(source->data), "item %zu", source->next);
+    *_data = source->data;
+    *_size = strlen(source->data);
+    source->next++;
+    return E_SUCCESS;
+}
+
+
+static void test_Archive_bulk_load(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    BulkLoadSource source = {0, 5000, (size_t)-1};
+    assert_int_equal(Archive_bulk_load(&archive, bulk_load_next, &source, 4), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 3);
+
+    // the last item of a key wins, in its page or over an older page
+    char key[20];
+    char expected[64];
+    char* data;
+    size_t data_size;
+    size_t i;
+    for (i = 0; i < 5000; i++) {
+        memset(key, 104, 20);
+        memcpy(key, &i, sizeof(size_t));
+        if (i % 10 == 9 && i >= 1000) {
+            assert_int_equal(Archive_has(&archive, key), i < 4000);
+            continue;
+        }
+        snprintf(expected, sizeof(expected), "item %zu", i % 10 == 9 && i < 4000 ? i + 1000 : i);
+        assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+        assert_int_equal(data_size, strlen(expected));
+        assert_memory_equal(data, expected, data_size);
+        free(data);
+    }
+
+    // the index of a page is sorted by key
+    const HashPage* bucket = &(archive.pages[1].index->pages[0]);
+    for (i = 1; i < bucket->n_items; i++) {
+        assert_true(memcmp(bucket->items[i - 1].key, bucket->items[i].key, 20) < 0);
+    }
+
+    // the pages are saved
+    assert_false(archive.pages[0].has_changes);
+    char* path;
+    asprintf(&path, "./%s", archive.pages[2].filename);
+    Archive reopened;
+    Archive_init(&reopened, "./");
+    assert_int_equal(Archive_add_page_by_name(&reopened, path), E_SUCCESS);
+    free(path);
+    memset(key, 104, 20);
+    i = 4998;
+    memcpy(key, &i, sizeof(size_t));
+    assert_int_equal(Archive_get(&reopened, key, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, "item 4998", data_size);
+    free(data);
+    Archive_free(&reopened);
+    assert_int_equal(Archive_verify(&archive, 2, NULL), E_SUCCESS);
+
+    // an error of the source adds no page
+    BulkLoadSource failing = {0, 5000, 4500};
+    assert_int_equal(Archive_bulk_load(&archive, bulk_load_next, &failing, 4), E_FILE_READ_ERROR);
+    assert_int_equal(archive.n_pages, 3);
+    Archive_free(&archive);
+}
+
+
+
+typedef struct ShardWriter {
+    ArchiveShards* shards;
+    size_t first;
+    size_t n_items;
+    Errors error;
+} ShardWriter;
+
+
+static void shard_key(char* key, size_t i) {
+    // spread over all the shards by the first byte
+    memset(key, 105, 20);
+    key[0] = (char)(i * 37);
+    memcpy(key + 1, &i, sizeof(size_t));
+}
+
+
+static void* shard_writer(void* arg) {
+    ShardWriter* writer = (ShardWriter*)arg;
+    char key[20];
+    size_t i;
+    for (i = writer->first; i < writer->first + writer->n_items && writer->error == E_SUCCESS; i++) {
+        shard_key(key, i);
+        writer->error = ArchiveShards_set(writer->shards, key, key, 20);
+    }
+    return NULL;
+}
+
+
+static void test_ArchiveShards(void **state) {
+    ArchiveShards shards;
+    assert_int_equal(ArchiveShards_init(&shards, "./", 3), E_INDEX_OUT_OF_BOUNDS);
+    assert_int_equal(ArchiveShards_init(&shards, "./", 4), E_SUCCESS);
+    char key[20] = {0x3F, 1, 2};
+    assert_int_equal(ArchiveShards_shard_of(&shards, key), 0);
+    key[0] = (char)0xC0;
+    assert_int_equal(ArchiveShards_shard_of(&shards, key), 3);
+
+    // writers of different shards set in parallel
+    ShardWriter writers[4];
+    pthread_t threads[4];
+    size_t i;
+    for (i = 0; i < 4; i++) {
+        writers[i] = (ShardWriter){&shards, i * 3000, 3000, E_SUCCESS};
+        assert_int_equal(pthread_create(threads + i, NULL, shard_writer, writers + i), 0);
+    }
+    for (i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        assert_int_equal(writers[i].error, E_SUCCESS);
+    }
+
+    // each key is in the shard of its first byte
+    char* data;
+    size_t data_size;
+    for (i = 0; i < 12000; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&shards.shards[ArchiveShards_shard_of(&shards, key)].archive, key));
+        assert_false(Archive_has(&shards.shards[(ArchiveShards_shard_of(&shards, key) + 1) % 4].archive, key));
+    }
+    shard_key(key, 1234);
+    assert_int_equal(ArchiveShards_get(&shards, key, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, key, 20);
+    free(data);
+    assert_int_equal(ArchiveShards_get_partial(&shards, key, 9, NULL, 0, &data, &data_size), E_SUCCESS);
+    free(data);
+    assert_int_equal(ArchiveShards_delete(&shards, key), E_SUCCESS);
+    assert_false(ArchiveShards_has(&shards, key));
+
+    // and the shards are saved to their manifests
+    assert_int_equal(ArchiveShards_save(&shards), E_SUCCESS);
+    ArchiveShards_free(&shards);
+    assert_int_equal(ArchiveShards_open(&shards, "./", 4), E_SUCCESS);
+    shard_key(key, 11999);
+    assert_int_equal(ArchiveShards_get(&shards, key, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, key, 20);
+    free(data);
+    shard_key(key, 1234);
+    assert_false(ArchiveShards_has(&shards, key));
+    ArchiveShards_free(&shards);
+    for (i = 0; i < 4; i++) {
+        char manifest_path[32];
+        snprintf(manifest_path, sizeof(manifest_path), "./shard-%zu.manifest", i);
+        unlink(manifest_path);
+    }
+}
+
+
+typedef struct ConcurrentReader {
+    Archive* archive;
+    size_t n_items;
+    size_t* n_set;
+    size_t window;
+    size_t n_missing;
+} ConcurrentReader;
+
+
+static void* concurrent_reader(void* arg) {
+    ConcurrentReader* reader = (ConcurrentReader*)arg;
+    char key[20];
+    char* data;
+    size_t data_size, n_set, i;
+    do {
+        // every key the writer has set must be found
+        n_set = __atomic_load_n(reader->n_set, __ATOMIC_ACQUIRE);
+        for (i = n_set; i > 0 && i + reader->window > n_set; i--) {
+            shard_key(key, i - 1);
+            if (Archive_get(reader->archive, key, &data, &data_size) != E_SUCCESS) {
+                reader->n_missing++;
+                continue;
+            }
+            if (data_size != 20 || memcmp(data, key, 20) != 0) {
+                reader->n_missing++;
+            }
+            free(data);
+        }
+    } while (n_set < reader->n_items);
+    return NULL;
+}
+
+
+static void test_Archive_concurrent_reads(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+
+    // a writer sets items, filling pages, while readers look them up
+    size_t n_set = 0;
+    ConcurrentReader readers[2];
+    pthread_t threads[2];
+    size_t i;
+    for (i = 0; i < 2; i++) {
+        readers[i] = (ConcurrentReader){&archive, 9000, &n_set, 50, 0};
+        assert_int_equal(pthread_create(threads + i, NULL, concurrent_reader, readers + i), 0);
+    }
+    char key[20];
+    for (i = 0; i < 9000; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+        __atomic_store_n(&n_set, i + 1, __ATOMIC_RELEASE);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        assert_int_equal(readers[i].n_missing, 0);
+    }
+    assert_true(archive.n_pages >= 5);
+
+    // readers opening the pages of a manifest at the same time
+    Archive_use_manifest(&archive, "concurrent.manifest");
+    ArchiveSaveResult result;
+    assert_int_equal(Archive_save(&archive, &result), E_SUCCESS);
+    ArchiveSaveResult_free(&result);
+    Archive_free(&archive);
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "concurrent.manifest");
+    assert_int_equal(Archive_load_manifest(&archive), E_SUCCESS);
+    for (i = 0; i < 2; i++) {
+        readers[i] = (ConcurrentReader){&archive, 9000, &n_set, 9000, 0};
+        assert_int_equal(pthread_create(threads + i, NULL, concurrent_reader, readers + i), 0);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        assert_int_equal(readers[i].n_missing, 0);
+    }
+    Archive_free(&archive);
+    unlink("./concurrent.manifest");
+}
+
+
+typedef struct ExecutorCounts {
+    size_t runs[1000];
+    size_t n_progress;
+    size_t cancel_after;
+    size_t n_dispatched;
+} ExecutorCounts;
+
+
+static Errors executor_task(void* context, size_t index) {
+    ExecutorCounts* counts = (ExecutorCounts*)context;
+    __atomic_add_fetch(counts->runs + index, 1, __ATOMIC_RELAXED);
+    return index == 500 && counts->cancel_after == 1 ? E_FILE_READ_ERROR : E_SUCCESS;
+}
+
+
+static bool executor_progress(void* context, size_t n_done, size_t n_tasks) {
+    ExecutorCounts* counts = (ExecutorCounts*)context;
+    counts->n_progress++;
+    return counts->cancel_after == 0 || n_done < counts->cancel_after;
+}
+
+
+typedef struct NestedExecutor {
+    ArchiveExecutor* executor;
+    ExecutorCounts* counts;
+} NestedExecutor;
+
+
+static Errors executor_nested_task(void* context, size_t index) {
+    // an operation started by a task gets no thread of its own
+    NestedExecutor* nested = (NestedExecutor*)context;
+    if (index > 0) {
+        return E_SUCCESS;
+    }
+    return ArchiveExecutor_run(nested->executor, 1000, 8, executor_task, nested->counts);
+}
+
+
+static Errors executor_cancel_task(void* context, size_t index) {
+    NestedExecutor* nested = (NestedExecutor*)context;
+    nested->counts->runs[index]++;
+    if (index == 10) {
+        ArchiveExecutor_cancel(nested->executor);
+    }
+    return E_SUCCESS;
+}
+
+
+static void executor_dispatch(void* context, void (*worker)(void* arg), void* arg, size_t n_workers) {
+    // the host runs the workers one after the other
+    ExecutorCounts* counts = (ExecutorCounts*)context;
+    size_t i;
+    for (i = 0; i < n_workers; i++) {
+        counts->n_dispatched++;
+        worker(arg);
+    }
+}
+
+
+static void test_ArchiveExecutor(void **state) {
+    ArchiveExecutor executor;
+    ArchiveExecutor_init(&executor, 4);
+    ExecutorCounts* counts = (ExecutorCounts*)calloc(1, sizeof(ExecutorCounts));
+    ArchiveExecutor_set_progress(&executor, executor_progress, counts);
+
+    // each task runs once, whoever runs it
+    assert_int_equal(ArchiveExecutor_run(&executor, 1000, 0, executor_task, counts), E_SUCCESS);
+    size_t i;
+    for (i = 0; i < 1000; i++) {
+        assert_int_equal(counts->runs[i], 1);
+    }
+    assert_int_equal(counts->n_progress, 1000);
+
+    // an error stops the tasks
+    memset(counts, 0, sizeof(ExecutorCounts));
+    counts->cancel_after = 1;
+    ArchiveExecutor_set_progress(&executor, NULL, NULL);
+    assert_int_equal(ArchiveExecutor_run(&executor, 1000, 1, executor_task, counts), E_FILE_READ_ERROR);
+    assert_int_equal(counts->runs[500], 1);
+    assert_int_equal(counts->runs[501], 0);
+
+    // so does a cancellation, from the progress callback or while running
+    memset(counts, 0, sizeof(ExecutorCounts));
+    counts->cancel_after = 10;
+    ArchiveExecutor_set_progress(&executor, executor_progress, counts);
+    assert_int_equal(ArchiveExecutor_run(&executor, 1000, 0, executor_task, counts), E_CANCELLED);
+    assert_true(counts->n_progress < 1000);
+    memset(counts, 0, sizeof(ExecutorCounts));
+    ArchiveExecutor_set_progress(&executor, NULL, NULL);
+    NestedExecutor nested = {&executor, counts};
+    assert_int_equal(ArchiveExecutor_run(&executor, 1000, 1, executor_cancel_task, &nested), E_CANCELLED);
+    assert_int_equal(counts->runs[10], 1);
+    assert_int_equal(counts->runs[11], 0);
+
+    // but not before, the next operation runs
+    ArchiveExecutor_cancel(&executor);
+    assert_int_equal(ArchiveExecutor_run(&executor, 10, 0, executor_task, counts), E_SUCCESS);
+
+    // on the host's threads, workers steal the tasks of those not run yet
+    memset(counts, 0, sizeof(ExecutorCounts));
+    ArchiveExecutor_set_progress(&executor, NULL, NULL);
+    ArchiveExecutor_set_dispatch(&executor, executor_dispatch, counts);
+    assert_int_equal(ArchiveExecutor_run(&executor, 1000, 8, executor_task, counts), E_SUCCESS);
+    assert_int_equal(counts->n_dispatched, 4);
+    for (i = 0; i < 1000; i++) {
+        assert_int_equal(counts->runs[i], 1);
+    }
+
+    // operations running at the same time share the threads
+    memset(counts, 0, sizeof(ExecutorCounts));
+    assert_int_equal(ArchiveExecutor_run(&executor, 4, 4, executor_nested_task, &nested), E_SUCCESS);
+    assert_int_equal(counts->n_dispatched, 5);
+    assert_int_equal(executor.n_busy_threads, 0);
+    ArchiveExecutor_free(&executor);
+
+    // the archive's operations run on its executor
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_set_max_threads(&archive, 2);
+    assert_int_equal(archive.executor.max_threads, 2);
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+    char key[20];
+    for (i = 0; i < 5000; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+    }
+    memset(counts, 0, sizeof(ExecutorCounts));
+    Archive_set_progress(&archive, executor_progress, counts);
+    ArchiveSaveResult result;
+    assert_int_equal(Archive_save(&archive, &result), E_SUCCESS);
+    assert_int_equal(result.count, archive.n_pages);
+    for (i = 0; i < result.count; i++) {
+        assert_non_null(result.files[i].filename);
+    }
+    ArchiveSaveResult_free(&result);
+    assert_int_equal(counts->n_progress, archive.n_pages);
+    Archive_cancel(&archive);
+    assert_int_equal(Archive_verify(&archive, 0, NULL), E_SUCCESS);
+    counts->cancel_after = 1;
+    assert_int_equal(Archive_verify(&archive, 0, NULL), E_CANCELLED);
+    Archive_free(&archive);
+    free(counts);
+}
+
+
+static void* compactor_reader(void* arg) {
+    ConcurrentReader* reader = (ConcurrentReader*)arg;
+    char key[20];
+    char* data;
+    size_t data_size, i;
+    while (!__atomic_load_n(reader->n_set, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < reader->n_items; i++) {
+            shard_key(key, i);
+            if (Archive_get(reader->archive, key, &data, &data_size) != E_SUCCESS) {
+                reader->n_missing++;
+                continue;
+            }
+            free(data);
+        }
+    }
+    return NULL;
+}
+
+
+static void test_ArchiveCompactor(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+    char key[20];
+    size_t i;
+    for (i = 0; i < 2000; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+        if (i % 100 == 99) {
+            assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+        }
+    }
+    assert_int_equal(archive.n_pages, 21);
+
+    // too many pages: small ones are merged, by 2 to 16
+    ArchiveCompactionPolicy policy;
+    ArchiveCompactionPolicy_init(&policy);
+    policy.max_pages = 4;
+    ArchiveCompactor compactor;
+    ArchiveCompactor_init(&compactor, &archive, &policy, 0);
+    size_t first_page, n_pages;
+    assert_int_equal(ArchiveCompactor_plan(&compactor, &first_page, &n_pages), E_SUCCESS);
+    assert_int_equal(first_page, 0);
+    assert_int_equal(n_pages, 16);
+    while (ArchiveCompactor_run(&compactor) == E_SUCCESS) {
+    }
+    assert_true(archive.n_pages <= 4);
+    ArchiveCompactionStats stats;
+    ArchiveCompactor_stats(&compactor, &stats);
+    assert_int_equal(stats.n_compactions, 2);
+    assert_int_equal(stats.debt_pages, 0);
+    assert_int_equal(stats.last_error, E_SUCCESS);
+    assert_int_equal(stats.n_bytes_set, 2000 * 20);
+    assert_true(stats.write_amplification > 1.5);
+    for (i = 0; i < 2000; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+
+    // a page mostly shadowed is rewritten, once its dead bytes are known
+    size_t n_compactions = stats.n_compactions;
+    for (i = 0; i < 1500; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_put(&archive, key, "new", 3), E_SUCCESS);
+    }
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+    for (i = 0; i < 4 && stats.n_compactions == n_compactions; i++) {
+        ArchiveCompactor_run(&compactor);
+        ArchiveCompactor_stats(&compactor, &stats);
+    }
+    assert_int_equal(stats.n_compactions, n_compactions + 1);
+    char* data;
+    size_t data_size;
+    shard_key(key, 10);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_memory_equal(data, "new", 3);
+    free(data);
+    ArchiveCompactor_free(&compactor);
+
+    // in the background, under an IO budget, while the archive is read and
+    // written to
+    ArchiveCompactor_init(&compactor, &archive, &policy, 32 << 10);
+    size_t done = 0;
+    ConcurrentReader reader = {&archive, 2000, &done, 0, 0};
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, compactor_reader, &reader), 0);
+    assert_int_equal(ArchiveCompactor_start(&compactor, 1), E_SUCCESS);
+    for (i = 2000; i < 4000; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+        if (i % 100 == 99) {
+            assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+        }
+    }
+    // until the pages are back under the maximum, or 10 s
+    for (i = 0; i < 1000; i++) {
+        usleep(10000);
+        ArchiveCompactor_stats(&compactor, &stats);
+        if (stats.n_compactions > 0 && stats.n_pages > 0 && stats.debt_pages == 0) {
+            break;
+        }
+    }
+    ArchiveCompactor_stop(&compactor);
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    assert_int_equal(reader.n_missing, 0);
+    ArchiveCompactor_stats(&compactor, &stats);
+    assert_true(stats.n_compactions > 0);
+    assert_int_equal(stats.debt_pages, 0);
+    assert_true(stats.throttled_ms > 0);
+    for (i = 0; i < 4000; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+    ArchiveCompactor_free(&compactor);
+    Archive_free(&archive);
+}
+
+
+static void test_Archive_compact_level(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "levels.manifest");
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+    char key[20];
+    size_t i;
+    for (i = 0; i < 4500; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+        if (i % 500 == 499) {
+            assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+        }
+    }
+    assert_int_equal(archive.n_pages, 10);
+
+    // level 0 into level 1: pages in key order, with ranges that don't
+    // overlap, forming a sorted run
+    assert_int_equal(Archive_compact_level(&archive, 0, 9), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 4);
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(archive.pages[i].level, 1);
+        assert_true(memcmp(archive.pages[i].min_key, archive.pages[i].max_key, 20) < 0);
+    }
+    assert_true(memcmp(archive.pages[0].max_key, archive.pages[1].min_key, 20) < 0);
+    assert_true(memcmp(archive.pages[1].max_key, archive.pages[2].min_key, 20) < 0);
+    assert_int_equal(archive.pages[3].level, 0);
+    assert_int_equal(archive.n_runs, 1);
+    assert_int_equal(archive.runs[0].first_page, 0);
+    assert_int_equal(archive.runs[0].n_pages, 3);
+    for (i = 0; i < 4500; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+
+    // shadowed and deleted items are dropped when merged down, and so are
+    // tombstones, as no deeper level has their key
+    char* data;
+    size_t data_size;
+    shard_key(key, 0);
+    assert_int_equal(Archive_put(&archive, key, "new", 3), E_SUCCESS);
+    shard_key(key, 1);
+    assert_int_equal(Archive_delete(&archive, key), E_SUCCESS);
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+
+    // only the oldest pages of level 0 can be merged
+    assert_int_equal(Archive_compact_level(&archive, 4, 1), E_INDEX_OUT_OF_BOUNDS);
+    assert_int_equal(Archive_compact_level(&archive, 3, 2), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 4);
+    size_t n_items = 0;
+    for (i = 0; i < 3; i++) {
+        assert_int_equal(archive.pages[i].level, 1);
+        n_items += archive.pages[i].index->n_items;
+    }
+    assert_int_equal(n_items, 4499);
+    shard_key(key, 0);
+    assert_int_equal(Archive_get(&archive, key, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, 3);
+    assert_memory_equal(data, "new", 3);
+    free(data);
+    shard_key(key, 1);
+    assert_false(Archive_has(&archive, key));
+
+    // a page of level 1 into level 2, deeper levels coming first
+    assert_int_equal(Archive_compact_level(&archive, 1, 1), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 4);
+    assert_int_equal(archive.pages[0].level, 2);
+    assert_int_equal(archive.pages[1].level, 1);
+    assert_int_equal(archive.pages[2].level, 1);
+    assert_int_equal(archive.n_runs, 2);
+    for (i = 2; i < 4500; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&archive);
+
+    // the levels are kept by the manifest, and a lookup only opens the page
+    // of each level covering its key
+    assert_int_equal(Archive_open(&archive, "./", "levels.manifest"), E_SUCCESS);
+    assert_int_equal(archive.n_pages, 4);
+    assert_int_equal(archive.pages[0].level, 2);
+    assert_int_equal(archive.n_runs, 2);
+    shard_key(key, 4499);
+    assert_true(Archive_has(&archive, key));
+    size_t n_open = 0;
+    for (i = 0; i < 3; i++) {
+        n_open += ArchivePage_is_open(archive.pages + i);
+    }
+    assert_true(n_open >= 1 && n_open <= 2);
+    for (i = 2; i < 4500; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+    Archive_free(&archive);
+
+    // leveled compaction in the background keeps each level to its size
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+    for (i = 0; i < 6000; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+        if (i % 250 == 249) {
+            assert_int_equal(Archive_add_empty_page(&archive), E_SUCCESS);
+        }
+    }
+    ArchiveCompactionPolicy policy;
+    ArchiveCompactionPolicy_init(&policy);
+    policy.strategy = ArchiveCompactionLeveled;
+    policy.level0_pages = 2;
+    policy.level_ratio = 2;
+    ArchiveCompactor compactor;
+    ArchiveCompactor_init(&compactor, &archive, &policy, 0);
+    while (ArchiveCompactor_run(&compactor) == E_SUCCESS) {
+    }
+    ArchiveCompactionStats stats;
+    ArchiveCompactor_stats(&compactor, &stats);
+    assert_int_equal(stats.last_error, E_SUCCESS);
+    assert_int_equal(stats.debt_pages, 0);
+    assert_true(stats.n_compactions > 1);
+    assert_true(archive.pages[0].level > 1);
+    assert_int_equal(archive.pages[archive.n_pages - 1].level, 0);
+    for (i = 0; i < 6000; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+    ArchiveCompactor_free(&compactor);
+    Archive_free(&archive);
+}
+
+/**
+ * Archive
+ *
+ * Test that pages keep a fence in their header and the manifest, and that
+ * lookups outside of it don't open them
+ */
+static void test_ArchivePage_fence(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "fence.manifest");
+    char key[20];
+    size_t i;
+    Archive_add_empty_page(&archive);
+    for (i = 0; i < 64; i++) {
+        memset(key, 100, 20);
+        key[0] = (char)(0x10 + i % 16);
+        key[1] = (char)i;
+        assert_int_equal(Archive_set(&archive, key, "low", 4), E_SUCCESS);
+    }
+    Archive_add_empty_page(&archive);
+    for (i = 0; i < 64; i++) {
+        memset(key, 100, 20);
+        key[0] = (char)(0x80 + i % 16);
+        key[1] = (char)i;
+        assert_int_equal(Archive_set(&archive, key, "high", 5), E_SUCCESS);
+    }
+    Archive_add_empty_page(&archive);
+
+    // the fence of a page has the buckets and the range of its keys
+    assert_true(archive.pages[0].filter[0x10 / 8] & (1 << (0x10 % 8)));
+    assert_false(archive.pages[0].filter[0x80 / 8] & (1 << (0x80 % 8)));
+    assert_int_equal((unsigned char)archive.pages[0].min_key[0], 0x10);
+    assert_int_equal((unsigned char)archive.pages[0].min_key[1], 0);
+    assert_int_equal((unsigned char)archive.pages[0].max_key[0], 0x1f);
+    assert_int_equal((unsigned char)archive.pages[0].max_key[1], 63);
+    assert_int_equal((unsigned char)archive.pages[1].min_key[0], 0x80);
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    char filename[256];
+    strcpy(filename, archive.pages[0].filename);
+    Archive_free(&archive);
+
+    // the manifest keeps them, lookups out of the range or the buckets of a
+    // page don't open it
+    assert_int_equal(Archive_open(&archive, "./", "fence.manifest"), E_SUCCESS);
+    memset(key, 100, 20);
+    key[0] = 0x1f;
+    key[1] = (char)200;
+    assert_false(Archive_has(&archive, key));
+    key[0] = 0x40;
+    assert_false(Archive_has(&archive, key));
+    assert_false(ArchivePage_is_open(archive.pages + 0));
+    assert_false(ArchivePage_is_open(archive.pages + 1));
+    key[0] = (char)0x81;
+    key[1] = 1;
+    assert_true(Archive_has(&archive, key));
+    assert_false(ArchivePage_is_open(archive.pages + 0));
+    assert_true(ArchivePage_is_open(archive.pages + 1));
+    Archive_free(&archive);
+
+    // and so does the header of the page file
+    Archive_init(&archive, "./");
+    assert_int_equal(Archive_add_page_by_name(&archive, filename), E_SUCCESS);
+    Archive_add_empty_page(&archive);
+    assert_int_equal((unsigned char)archive.pages[0].max_key[0], 0x1f);
+    assert_int_equal((unsigned char)archive.pages[0].max_key[1], 63);
+    key[0] = 0x10;
+    key[1] = 0;
+    assert_true(Archive_has(&archive, key));
+    key[1] = (char)200;
+    assert_false(Archive_has(&archive, key));
+    Archive_free(&archive);
+}
+
+
+static void* miss_reader(void* arg) {
+    ConcurrentReader* reader = (ConcurrentReader*)arg;
+    char key[20];
+    size_t n_set, i;
+    do {
+        // miss the keys the writer is about to set, they must be found once
+        // set
+        n_set = __atomic_load_n(reader->n_set, __ATOMIC_ACQUIRE);
+        for (i = n_set; i < n_set + reader->window && i < reader->n_items; i++) {
+            shard_key(key, i);
+            Archive_has(reader->archive, key);
+        }
+        for (i = n_set; i > 0 && i + reader->window > n_set; i--) {
+            shard_key(key, i - 1);
+            reader->n_missing += !Archive_has(reader->archive, key);
+        }
+    } while (n_set < reader->n_items);
+    return NULL;
+}
+
+/**
+ * Archive
+ *
+ * Test that missed keys are cached until they're set or pages are added
+ */
+static void test_Archive_miss_cache(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_set_miss_cache(&archive, 64);
+    Archive_add_empty_page(&archive);
+    char key1[20] = {1, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    char key2[20] = {2, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    assert_int_equal(Archive_set(&archive, key1, "one", 4), E_SUCCESS);
+
+    // a repeated miss is answered by the cache, a hit never is
+    ArchiveMissCacheStats stats;
+    assert_false(Archive_has(&archive, key2));
+    assert_false(Archive_has(&archive, key2));
+    assert_true(Archive_has(&archive, key1));
+    Archive_miss_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_hits, 1);
+    assert_int_equal(stats.n_inserts, 1);
+
+    // setting the key removes it
+    assert_int_equal(Archive_set(&archive, key2, "two", 4), E_SUCCESS);
+    assert_true(Archive_has(&archive, key2));
+    Archive_miss_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_invalidations, 1);
+
+    // and adding a page with it clears the cache
+    Archive other;
+    Archive_init(&other, "./");
+    Archive_add_empty_page(&other);
+    char key3[20] = {3, 100, 100, 100, 100, 100, 100, 100, 100, 100,
+                     100, 100, 100, 100, 100, 100, 100, 100, 100, 100};
+    assert_int_equal(Archive_set(&other, key3, "three", 6), E_SUCCESS);
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&other, &saves), E_SUCCESS);
+    assert_false(Archive_has(&archive, key3));
+    assert_int_equal(Archive_add_page_by_name(&archive, saves.files[0].filename), E_SUCCESS);
+    assert_true(Archive_has(&archive, key3));
+    ArchiveSaveResult_free(&saves);
+    Archive_free(&other);
+    Archive_free(&archive);
+
+    // readers missing keys while the writer sets them find them once set
+    Archive_init(&archive, "./");
+    Archive_set_miss_cache(&archive, 256);
+    Archive_add_empty_page(&archive);
+    size_t n_set = 0;
+    ConcurrentReader readers[2];
+    pthread_t threads[2];
+    size_t i;
+    for (i = 0; i < 2; i++) {
+        readers[i] = (ConcurrentReader){&archive, 3000, &n_set, 20, 0};
+        assert_int_equal(pthread_create(threads + i, NULL, miss_reader, readers + i), 0);
+    }
+    // (once the readers missed the first keys twice)
+    do {
+        Archive_miss_cache_stats(&archive, &stats);
+    } while (stats.n_hits == 0);
+    char key[20];
+    for (i = 0; i < 3000; i++) {
+        shard_key(key, i);
+        assert_int_equal(Archive_set(&archive, key, key, 20), E_SUCCESS);
+        __atomic_store_n(&n_set, i + 1, __ATOMIC_RELEASE);
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+        assert_int_equal(readers[i].n_missing, 0);
+    }
+    for (i = 0; i < 3000; i++) {
+        shard_key(key, i);
+        assert_true(Archive_has(&archive, key));
+    }
+    Archive_miss_cache_stats(&archive, &stats);
+    assert_true(stats.n_hits > 0);
+    Archive_free(&archive);
+}
+
+
+/**
+ * Test that the cache keeps values within its budget, closes the indexes of
+ * the pages used the least, and is warmed from the keys it saved
+ */
+static void test_ArchiveCache(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "cache.manifest");
+    ArchiveCacheBudget budget = {1, 64};
+    Archive_set_cache_budget(&archive, &budget);
+    char keys[3][20];
+    size_t i;
+    for (i = 0; i < 3; i++) {
+        memset(keys[i], 100, 20);
+        keys[i][0] = (char)(0x10 * (i + 1));
+        Archive_add_empty_page(&archive);
+        assert_int_equal(Archive_put(&archive, keys[i], "a value", 8), E_SUCCESS);
+    }
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+
+    // a value read twice is read from the cache the second time
+    ArchiveCacheStats stats;
+    char* data;
+    size_t data_size;
+    assert_int_equal(Archive_get(&archive, keys[0], &data, &data_size), E_SUCCESS);
+    free(data);
+    assert_int_equal(Archive_get(&archive, keys[0], &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "a value");
+    free(data);
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_value_misses, 1);
+    assert_int_equal(stats.n_value_hits, 1);
+    assert_int_equal(stats.value_bytes, 8);
+
+    // put replaces it, and values over the budget evict the others
+    assert_int_equal(Archive_put(&archive, keys[0], "another", 8), E_SUCCESS);
+    assert_int_equal(Archive_get(&archive, keys[0], &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "another");
+    free(data);
+    char large[60];
+    memset(large, 'x', sizeof(large));
+    assert_int_equal(Archive_put(&archive, large, large, sizeof(large)), E_SUCCESS);
+    assert_int_equal(Archive_get(&archive, large, &data, &data_size), E_SUCCESS);
+    assert_int_equal(data_size, sizeof(large));
+    free(data);
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_values, 1);
+    assert_int_equal(stats.n_value_evictions, 1);
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+
+    // the indexes over the budget are closed, but the pinned ones and the
+    // last one, and opened again on next use
+    assert_int_equal(Archive_pin_page(&archive, 0, true), E_SUCCESS);
+    assert_int_equal(Archive_pin_page(&archive, 3, true), E_INDEX_OUT_OF_BOUNDS);
+    Archive_trim_cache(&archive);
+    assert_true(ArchivePage_is_open(archive.pages + 0));
+    assert_false(ArchivePage_is_open(archive.pages + 1));
+    assert_true(ArchivePage_is_open(archive.pages + 2));
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_indexes, 2);
+    assert_int_equal(stats.n_pinned_indexes, 1);
+    assert_int_equal(stats.n_index_evictions, 1);
+    assert_int_equal(stats.filter_bytes, 3 * (HashIndexPageCount / 8 + 40));
+    assert_true(Archive_has(&archive, keys[1]));
+    assert_true(ArchivePage_is_open(archive.pages + 1));
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_index_loads, 1);
+
+    // the hot keys are saved, and warm the cache of the archive once opened
+    assert_int_equal(Archive_get(&archive, keys[2], &data, &data_size), E_SUCCESS);
+    free(data);
+    assert_int_equal(Archive_save_hot_keys(&archive, "./cache.hot", 10), E_SUCCESS);
+    Archive_free(&archive);
+    assert_int_equal(Archive_open(&archive, "./", "cache.manifest"), E_SUCCESS);
+    Archive_set_cache_budget(&archive, &budget);
+    ExecutorCounts cancel = {.cancel_after = 1};
+    Archive_set_progress(&archive, executor_progress, &cancel);
+    assert_int_equal(Archive_warm_cache(&archive, "./cache.hot"), E_CANCELLED);
+    assert_false(archive.pages[2].pinned);
+    Archive_set_progress(&archive, NULL, NULL);
+    assert_int_equal(Archive_warm_cache(&archive, "./cache.hot"), E_SUCCESS);
+    assert_false(archive.pages[2].pinned);
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_values, 1);
+
+    // the pages are only pinned within half the budget of the indexes
+    ArchiveCacheBudget pin_budget = {2 * ArchivePage_index_size(archive.pages + 2), 64};
+    Archive_set_cache_budget(&archive, &pin_budget);
+    assert_int_equal(Archive_warm_cache(&archive, "./cache.hot"), E_SUCCESS);
+    assert_true(archive.pages[2].pinned);
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_values, 1);
+    assert_int_equal(Archive_get(&archive, keys[2], &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "a value");
+    free(data);
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_value_hits, 1);
+    Archive_free(&archive);
+    unlink("./cache.hot");
+}
+
+
+/**
+ * Test that the hot keys are saved with the ranges they're read from, at
+ * most every interval, and warm the archive as its manifest is loaded
+ */
+static void test_Archive_hot_keys(void **state) {
+    Archive archive;
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "hot.manifest");
+    Archive_use_hot_keys(&archive, "hot.keys", 10, 3600000);
+    ArchiveCacheBudget budget = {0, 1024};
+    Archive_set_cache_budget(&archive, &budget);
+    char keys[3][20];
+    size_t i;
+    Archive_add_empty_page(&archive);
+    for (i = 0; i < 3; i++) {
+        memset(keys[i], 100, 20);
+        keys[i][0] = (char)(0x10 * (i + 1));
+        assert_int_equal(Archive_put(&archive, keys[i], "a value", 8), E_SUCCESS);
+    }
+    Archive_add_empty_page(&archive);
+    ArchiveSaveResult saves;
+    assert_int_equal(Archive_save(&archive, &saves), E_SUCCESS);
+    ArchiveSaveResult_free(&saves);
+    char* data;
+    size_t data_size;
+    for (i = 0; i < 2; i++) {
+        assert_int_equal(Archive_get(&archive, keys[i], &data, &data_size), E_SUCCESS);
+        free(data);
+    }
+
+    // the data of the keys follow each other, and are merged in a range
+    assert_int_equal(Archive_snapshot_hot_keys(&archive), E_SUCCESS);
+    ArchiveHotSet hot_set;
+    ArchiveHotSet_init(&hot_set);
+    assert_int_equal(ArchiveHotSet_read(&hot_set, "./hot.keys"), E_SUCCESS);
+    assert_int_equal(hot_set.n_keys, 2);
+    assert_int_equal(hot_set.n_ranges, 2);
+    assert_string_equal(hot_set.ranges[0].filename, archive.pages[0].filename);
+    assert_int_equal(hot_set.ranges[0].offset, 0);
+    assert_int_equal(hot_set.ranges[1].size, 2 * (8 + 4));
+    ArchiveHotSet_free(&hot_set);
+
+    // a snapshot within the interval doesn't save them again
+    unlink("./hot.keys");
+    assert_int_equal(Archive_snapshot_hot_keys(&archive), E_SUCCESS);
+    assert_int_equal(access("./hot.keys", F_OK), -1);
+    archive.hot_keys_saved_at = 0;
+    assert_int_equal(Archive_snapshot_hot_keys(&archive), E_SUCCESS);
+    Archive_free(&archive);
+
+    // loading the manifest reads them back into the value cache
+    Archive_init(&archive, "./");
+    Archive_use_manifest(&archive, "hot.manifest");
+    Archive_use_hot_keys(&archive, "hot.keys", 10, 3600000);
+    Archive_set_cache_budget(&archive, &budget);
+    assert_int_equal(Archive_load_manifest(&archive), E_SUCCESS);
+    assert_true(archive.pages[0].pinned);
+    ArchiveCacheStats stats;
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_values, 2);
+    assert_int_equal(Archive_get(&archive, keys[1], &data, &data_size), E_SUCCESS);
+    assert_string_equal(data, "a value");
+    free(data);
+    Archive_cache_stats(&archive, &stats);
+    assert_int_equal(stats.n_value_hits, 1);
+    Archive_free(&archive);
+
+    // and a corrupted file is rejected
+    FILE* file = fopen("./hot.keys", "r+");
+    fseek(file, 12, SEEK_SET);
+    fputc('x', file);
+    fclose(file);
+    ArchiveHotSet_init(&hot_set);
+    assert_int_equal(ArchiveHotSet_read(&hot_set, "./hot.keys"), E_INVALID_HOT_KEYS);
+    unlink("./hot.keys");
+}
+
 
 
 int main(void) {
@@ -622,7 +2644,32 @@ int main(void) {
             cmocka_unit_test(test_Archive_set),
             cmocka_unit_test(test_Archive_set__index_inserts),
             cmocka_unit_test(test_Archive_add_page_by_name),
-            cmocka_unit_test(test_Archive_save_rename)
+            cmocka_unit_test(test_Archive_save_rename),
+            cmocka_unit_test(test_ArchiveIterator),
+            cmocka_unit_test(test_Archive_resolve_partial),
+            cmocka_unit_test(test_Archive_delete),
+            cmocka_unit_test(test_Archive_put),
+            cmocka_unit_test(test_Archive_wal),
+            cmocka_unit_test(test_ArchivePage_save_incremental),
+            cmocka_unit_test(test_Archive_manifest),
+            cmocka_unit_test(test_Archive_open),
+            cmocka_unit_test(test_Archive_verify),
+            cmocka_unit_test(test_Archive_content_addressed),
+            cmocka_unit_test(test_Archive_prefetch),
+            cmocka_unit_test(test_Archive_direct_io),
+            cmocka_unit_test(test_Archive_blobs),
+            cmocka_unit_test(test_Archive_get_to_fd),
+            cmocka_unit_test(test_Archive_get_range),
+            cmocka_unit_test(test_Archive_bulk_load),
+            cmocka_unit_test(test_ArchiveShards),
+            cmocka_unit_test(test_Archive_concurrent_reads),
+            cmocka_unit_test(test_ArchiveExecutor),
+            cmocka_unit_test(test_ArchiveCompactor),
+            cmocka_unit_test(test_Archive_compact_level),
+            cmocka_unit_test(test_ArchivePage_fence),
+            cmocka_unit_test(test_Archive_miss_cache),
+            cmocka_unit_test(test_ArchiveCache),
+            cmocka_unit_test(test_Archive_hot_keys)
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);